@@ -20,33 +20,45 @@ class get_pybind_include(object):
         import pybind11
         return pybind11.get_include(self.user)
 
+# TUXEDO_STUB=1 builds against the in-process ATMI/FML32 stand-in in stub/
+# for benchmarks without a Tuxedo installation
+stub = bool(os.getenv('TUXEDO_STUB'))
+if stub:
+    sources = ['src/tuxedo.cpp', 'stub/tuxstub.cpp']
+    tuxinclude = 'stub/include'
+    tuxlib = []
+else:
+    sources = ['src/tuxedo.cpp']
+    tuxinclude = os.path.join(os.environ['TUXDIR'], 'include')
+    tuxlib = [os.path.join(os.environ['TUXDIR'], 'lib')]
+
 ext_modules = [
     Extension(
         'tuxedo',
-        ['src/tuxedo.cpp'],
+        sources,
         define_macros=[('TUXEDO_WSC', 0)],
         include_dirs=[
-            os.path.join(os.environ['TUXDIR'], 'include'),
+            tuxinclude,
             # Path to pybind11 headers
             get_pybind_include(),
             get_pybind_include(user=True),
         ],
-        library_dirs=[os.path.join(os.environ['TUXDIR'], 'lib')],
-        libraries=['tux', 'fml32', 'tmib', 'engine'],
+        library_dirs=tuxlib,
+        libraries=[] if stub else ['tux', 'fml32', 'tmib', 'engine'],
         language='c++'
     ),
     Extension(
         'tuxedowsc',
-        ['src/tuxedo.cpp'],
+        sources,
         define_macros=[('TUXEDO_WSC', 1)],
         include_dirs=[
-            os.path.join(os.environ['TUXDIR'], 'include'),
+            tuxinclude,
             # Path to pybind11 headers
             get_pybind_include(),
             get_pybind_include(user=True),
         ],
-        library_dirs=[os.path.join(os.environ['TUXDIR'], 'lib')],
-        libraries=['wsc', 'fml32', 'tmib', 'engine'],
+        library_dirs=tuxlib,
+        libraries=[] if stub else ['wsc', 'fml32', 'tmib', 'engine'],
         language='c++'
     ),
 ]
@@ -66,6 +78,20 @@ def has_flag(compiler, flagname):
             return False
     return True
 
+def has_header(compiler, header):
+    """Return a boolean indicating whether a header can be included with
+    the specified compiler.
+    """
+    import tempfile
+    with tempfile.NamedTemporaryFile('w', suffix='.cpp') as f:
+        f.write('#include <%s>\nint main (int argc, char **argv) { return 0; }' % header)
+        f.flush()
+        try:
+            compiler.compile([f.name])
+        except setuptools.distutils.errors.CompileError:
+            return False
+    return True
+
 def cpp_flag(compiler):
     """Return the -std=c++[11/14/17] compiler flag.
     The newer version is prefered over c++11 (when it is available).
@@ -92,9 +118,17 @@ class BuildExt(build_ext):
             opts.append(cpp_flag(self.compiler))
             if has_flag(self.compiler, '-fvisibility=hidden'):
                 opts.append('-fvisibility=hidden')
+            # zlib for compress() when installed, TUXEDO_ZLIB=0 leaves it out
+            if os.getenv('TUXEDO_ZLIB', '1') != '0' and has_header(self.compiler, 'zlib.h'):
+                opts.append('-DTUXEDO_ZLIB=1')
+                link_opts.append('-lz')
+            if sys.platform.startswith('linux'):
+                # shm_open() for SharedStore on older glibc
+                link_opts.append('-lrt')
         elif ct == 'msvc':
             opts.append('/EHsc')
             opts.append('/DVERSION_INFO=\\"%s\\"' % self.distribution.get_version())
+        if ct == 'msvc' and not stub:
             tuxdir = os.environ['TUXDIR']
             #cl /MD  -I"%TUXDIR%"\include -Fea BS-23b8.c a.c  "%TUXDIR%"\lib\libtux.lib  "%TUXDIR%"\lib\libbuft.lib   "%TUXDIR%"\lib\libfml.lib "%TUXDIR%"\lib\libfml32.lib "%TUXDIR%"\lib\libengine.lib  wsock32.lib kernel32.lib advapi32.lib user32.lib gdi32.lib comdlg32.lib winspool.lib  -link /MANIFEST -implib:BS-23b8.lib
             link_opts = [
@@ -1,10 +1,18 @@
 #if defined(_WIN32) || defined(_WIN64)
 #define _CRT_SECURE_NO_WARNINGS
 //#ifdef _MSC_VER
+#include <process.h>
 #include <windows.h>
 #define strcasecmp _stricmp
+#define getpid _getpid
 #else
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #pragma GCC diagnostic push
@@ -26,12 +34,54 @@
 #undef _
 #pragma GCC diagnostic pop
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#if defined(__linux__)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#endif
+
+#if !defined(TUXEDO_ZLIB)
+#define TUXEDO_ZLIB 0
+#endif
+#if TUXEDO_ZLIB
+#include <zlib.h>
+#endif
+
 #include <pybind11/functional.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <clocale>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
 #include <functional>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 
 namespace py = pybind11;
 
@@ -158,10 +208,66 @@ struct context {
   context &operator=(context &&) = delete;
 };
 
+// Buffer allocation counters for each call site
+struct alloc_counters {
+  explicit alloc_counters(const char *site_)
+      : site(site_),
+        tpalloc(0),
+        tprealloc(0),
+        tpfree(0),
+        doublings(0),
+        grown(0),
+        bytes(0) {
+    registry().push_back(this);
+  }
+
+  static std::vector<alloc_counters *> &registry() {
+    static std::vector<alloc_counters *> sites;
+    return sites;
+  }
+
+  const char *site;
+  std::atomic<long long> tpalloc;
+  std::atomic<long long> tprealloc;
+  std::atomic<long long> tpfree;
+  std::atomic<long long> doublings;
+  std::atomic<long long> grown;
+  std::atomic<long long> bytes;
+};
+
+static alloc_counters alloc_other("other");
+static alloc_counters alloc_tpcall("tpcall");
+static alloc_counters alloc_tpacall("tpacall");
+static alloc_counters alloc_tpgetrply("tpgetrply");
+static alloc_counters alloc_tppost("tppost");
+static alloc_counters alloc_tpenqueue("tpenqueue");
+static alloc_counters alloc_tpdequeue("tpdequeue");
+static alloc_counters alloc_tpreturn("tpreturn");
+static alloc_counters alloc_prepare("prepare");
+static alloc_counters alloc_consumer("QueueConsumer");
+static alloc_counters alloc_http("serve_http");
+static alloc_counters alloc_bulk("bulk");
+static alloc_counters alloc_loadgen("loadgen");
+static thread_local alloc_counters *alloc_site = &alloc_other;
+
+struct alloc_scope {
+  explicit alloc_scope(alloc_counters &site) : prev(alloc_site) {
+    alloc_site = &site;
+  }
+  ~alloc_scope() { alloc_site = prev; }
+  alloc_scope(const alloc_scope &) = delete;
+  alloc_scope &operator=(const alloc_scope &) = delete;
+
+ private:
+  alloc_counters *prev;
+};
+
 struct xatmibuf {
   xatmibuf() : pp(&p), len(0), p(nullptr) {}
   xatmibuf(TPSVCINFO *svcinfo)
       : pp(&svcinfo->data), len(svcinfo->len), p(nullptr) {}
+  // Borrows a buffer owned by someone else
+  xatmibuf(char **pp_, long len_) : pp(pp_), len(len_), p(nullptr) {}
   xatmibuf(const char *type, long len) : pp(&p), len(len), p(nullptr) {
     reinit(type, len);
   }
@@ -172,6 +278,8 @@ struct xatmibuf {
       if (*pp == nullptr) {
         throw std::bad_alloc();
       }
+      alloc_site->tpalloc++;
+      alloc_site->bytes += len;
     } else {
       FBFR32 *fbfr = reinterpret_cast<FBFR32 *>(*pp);
       Finit32(fbfr, Fsizeof32(fbfr));
@@ -185,6 +293,7 @@ struct xatmibuf {
   ~xatmibuf() {
     if (p != nullptr) {
       tpfree(p);
+      alloc_site->tpfree++;
     }
   }
 
@@ -208,7 +317,14 @@ struct xatmibuf {
       if (rc == -1) {
         if (Ferror32 == FNOSPACE) {
           len *= 2;
-          *pp = tprealloc(*pp, len);
+          char *np = tprealloc(*pp, len);
+          if (np == nullptr) {
+            throw std::bad_alloc();
+          }
+          *pp = np;
+          alloc_site->tprealloc++;
+          alloc_site->doublings++;
+          alloc_site->bytes += len / 2;
         } else {
           throw fml32_exception(Ferror32);
         }
@@ -222,6 +338,11 @@ struct xatmibuf {
 
  private:
   void swap(xatmibuf &other) noexcept {
+    // Borrowed buffers keep pointing to the owner's storage
+    char **mine = pp == &p ? &other.p : pp;
+    char **theirs = other.pp == &other.p ? &p : other.pp;
+    pp = theirs;
+    other.pp = mine;
     std::swap(p, other.p);
     std::swap(len, other.len);
   }
@@ -236,12 +357,178 @@ static void with_context() {
   }
 }
 
-static py::object to_py(FBFR32 *fbfr, FLDLEN32 buflen = 0) {
+// Encoding of FLD_STRING fields, the locale is used by default
+enum string_codec_t { CODEC_LOCALE, CODEC_UTF8, CODEC_LATIN1, CODEC_BYTES };
+static string_codec_t string_codec = CODEC_LOCALE;
+
+static bool is_ascii(const char *s, size_t n) {
+  size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+    if (_mm_movemask_epi8(v) != 0) {
+      return false;
+    }
+  }
+#elif defined(__aarch64__)
+  for (; i + 16 <= n; i += 16) {
+    if (vmaxvq_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(s + i))) &
+        0x80) {
+      return false;
+    }
+  }
+#endif
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, s + i, sizeof(w));
+    if (w & 0x8080808080808080ULL) {
+      return false;
+    }
+  }
+  for (; i < n; i++) {
+    if (s[i] & 0x80) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static py::object decode_string(const char *s, size_t n) {
+#if PY_MAJOR_VERSION >= 3
+  PyObject *o;
+  switch (string_codec) {
+    case CODEC_BYTES:
+      return py::bytes(s, n);
+    case CODEC_UTF8:
+    case CODEC_LATIN1:
+      if (is_ascii(s, n)) {
+        o = PyUnicode_New(n, 127);
+        if (o != nullptr) {
+          memcpy(PyUnicode_1BYTE_DATA(o), s, n);
+        }
+      } else if (string_codec == CODEC_UTF8) {
+        o = PyUnicode_DecodeUTF8(s, n, "surrogateescape");
+      } else {
+        o = PyUnicode_DecodeLatin1(s, n, nullptr);
+      }
+      break;
+    default:
+      o = PyUnicode_DecodeLocaleAndSize(s, n, "surrogateescape");
+  }
+  if (o == nullptr) {
+    throw py::error_already_set();
+  }
+  return py::reinterpret_steal<py::str>(o);
+#else
+  return py::bytes(s, n);
+#endif
+}
+
+#if PY_MAJOR_VERSION >= 3
+// Points to the encoded string without copying when possible, otherwise
+// keeps the encoded copy in holder
+static void encode_string(py::handle obj, const char **data, Py_ssize_t *size,
+                          py::object &holder) {
+  PyObject *b;
+  switch (string_codec) {
+    case CODEC_UTF8:
+    case CODEC_BYTES:
+      *data = PyUnicode_AsUTF8AndSize(obj.ptr(), size);
+      if (*data != nullptr) {
+        return;
+      }
+      // Lone surrogates from decoding with surrogateescape
+      PyErr_Clear();
+      b = PyUnicode_AsEncodedString(obj.ptr(), "utf-8", "surrogateescape");
+      break;
+    case CODEC_LATIN1:
+#if PY_VERSION_HEX < 0x030C0000
+      // Strings are always ready since 3.12
+      if (PyUnicode_READY(obj.ptr()) == -1) {
+        throw py::error_already_set();
+      }
+#endif
+      if (PyUnicode_KIND(obj.ptr()) == PyUnicode_1BYTE_KIND) {
+        *data = reinterpret_cast<const char *>(PyUnicode_1BYTE_DATA(obj.ptr()));
+        *size = PyUnicode_GET_LENGTH(obj.ptr());
+        return;
+      }
+      b = PyUnicode_AsEncodedString(obj.ptr(), "latin-1", "surrogateescape");
+      break;
+    default:
+      b = PyUnicode_EncodeLocale(obj.ptr(), "surrogateescape");
+  }
+  if (b == nullptr) {
+    throw py::error_already_set();
+  }
+  holder = py::reinterpret_steal<py::bytes>(b);
+  *data = PyBytes_AsString(b);
+  *size = PyBytes_Size(b);
+}
+#endif
+
+// How FML32 is decoded into a dict: DECODE_FLAT returns a field that occurs
+// once as the value itself and repeated fields as tuples instead of lists,
+// DECODE_FIELD_IDS uses field identifiers as keys without Fname32()
+enum { DECODE_FLAT = 1, DECODE_FIELD_IDS = 2 };
+
+static py::object to_py(FBFR32 *fbfr, FLDLEN32 buflen = 0, int mode = 0);
+
+static py::object field_to_py(FLDID32 fieldid, char *value, FLDLEN32 len,
+                              FLDLEN32 buflen = 0, int mode = 0) {
+  switch (Fldtype32(fieldid)) {
+    case FLD_CHAR:
+      return py::cast(value[0]);
+    case FLD_SHORT:
+      return py::cast(*reinterpret_cast<short *>(value));
+    case FLD_LONG:
+      return py::cast(*reinterpret_cast<long *>(value));
+    case FLD_FLOAT:
+      return py::cast(*reinterpret_cast<float *>(value));
+    case FLD_DOUBLE:
+      return py::cast(*reinterpret_cast<double *>(value));
+    case FLD_STRING:
+      return decode_string(value, len > 0 ? len - 1 : 0);
+    case FLD_CARRAY:
+      return py::bytes(value, len);
+    case FLD_FML32:
+      return to_py(reinterpret_cast<FBFR32 *>(value), buflen, mode);
+    default:
+      throw std::invalid_argument("Unsupported field " +
+                                  std::to_string(fieldid));
+  }
+}
+
+static py::object to_py(FBFR32 *fbfr, FLDLEN32 buflen, int mode) {
   FLDID32 fieldid = FIRSTFLDID;
   FLDOCC32 oc = 0;
 
   py::dict result;
   py::list val;
+  // Occurrences of the current field with DECODE_FLAT, they come in a row
+  std::vector<py::object> occs;
+  FLDID32 current = BADFLDID;
+
+  auto set = [&](FLDID32 id, py::object v) {
+    char *name = (mode & DECODE_FIELD_IDS) ? nullptr : Fname32(id);
+    if (name != nullptr) {
+      result[name] = v;
+    } else {
+      result[py::int_(id)] = v;
+    }
+  };
+  auto flush = [&]() {
+    if (occs.size() == 1) {
+      set(current, occs[0]);
+    } else if (!occs.empty()) {
+      py::tuple t(occs.size());
+      for (size_t i = 0; i < occs.size(); i++) {
+        PyTuple_SET_ITEM(t.ptr(), i, occs[i].release().ptr());
+      }
+      set(current, t);
+    }
+    occs.clear();
+  };
 
   if (buflen == 0) {
     buflen = Fsizeof32(fbfr);
@@ -258,58 +545,27 @@ static py::object to_py(FBFR32 *fbfr, FLDLEN32 buflen = 0) {
       break;
     }
 
-    if (oc == 0) {
-      val = py::list();
-
-      char *name = Fname32(fieldid);
-      if (name != nullptr) {
-        result[name] = val;
-      } else {
-        result[py::int_(fieldid)] = val;
+    if (mode & DECODE_FLAT) {
+      if (oc == 0) {
+        flush();
+        current = fieldid;
       }
+      occs.push_back(field_to_py(fieldid, value.get(), len, buflen, mode));
+      continue;
     }
 
-    switch (Fldtype32(fieldid)) {
-      case FLD_CHAR:
-        val.append(py::cast(value.get()[0]));
-        break;
-      case FLD_SHORT:
-        val.append(py::cast(*reinterpret_cast<short *>(value.get())));
-        break;
-      case FLD_LONG:
-        val.append(py::cast(*reinterpret_cast<long *>(value.get())));
-        break;
-      case FLD_FLOAT:
-        val.append(py::cast(*reinterpret_cast<float *>(value.get())));
-        break;
-      case FLD_DOUBLE:
-        val.append(py::cast(*reinterpret_cast<double *>(value.get())));
-        break;
-      case FLD_STRING:
-        val.append(
-#if PY_MAJOR_VERSION >= 3
-            py::reinterpret_steal<py::str>(
-                PyUnicode_DecodeLocale(value.get(), "surrogateescape"))
-#else
-            py::bytes(value.get(), len - 1)
-#endif
-        );
-        break;
-      case FLD_CARRAY:
-        val.append(py::bytes(value.get(), len));
-        break;
-      case FLD_FML32:
-        val.append(to_py(reinterpret_cast<FBFR32 *>(value.get()), buflen));
-        break;
-      default:
-        throw std::invalid_argument("Unsupported field " +
-                                    std::to_string(fieldid));
+    if (oc == 0) {
+      val = py::list();
+      set(fieldid, val);
     }
+
+    val.append(field_to_py(fieldid, value.get(), len, buflen, mode));
   }
+  flush();
   return result;
 }
 
-static py::object to_py(xatmibuf &buf) {
+static py::object to_py(xatmibuf &buf, int mode = 0) {
   char type[8];
   char subtype[16];
   if (tptypes(*buf.pp, type, subtype) == -1) {
@@ -320,22 +576,34 @@ static py::object to_py(xatmibuf &buf) {
   } else if (strcmp(type, "CARRAY") == 0 || strcmp(type, "X_OCTET") == 0) {
     return py::bytes(*buf.pp, buf.len);
   } else if (strcmp(type, "FML32") == 0) {
-    return to_py(*buf.fbfr());
+    return to_py(*buf.fbfr(), 0, mode);
   } else {
     throw std::invalid_argument("Unsupported buffer type");
   }
 }
 
+static void require_fml32(xatmibuf &buf) {
+  char type[8];
+  char subtype[16];
+  if (tptypes(*buf.pp, type, subtype) == -1 || strcmp(type, "FML32") != 0) {
+    throw std::invalid_argument("Not a FML32 buffer");
+  }
+}
+
 struct pytpreply {
   int rval;
   long rcode;
   py::object data;
   int cd;
+  // Cached or shared reply, decoded when the TpReply is built
+  std::shared_ptr<xatmibuf> raw;
 
   pytpreply(int rval_, long rcode_, xatmibuf &out_, int cd_ = -1)
       : rval(rval_), rcode(rcode_), cd(cd_) {
     data = to_py(out_);
   }
+  pytpreply(int rval_, long rcode_, py::object data_, int cd_ = -1)
+      : rval(rval_), rcode(rcode_), data(data_), cd(cd_) {}
 };
 
 static void from_py(py::dict obj, xatmibuf &b);
@@ -344,26 +612,28 @@ static void from_py1(xatmibuf &buf, FLDID32 fieldid, FLDOCC32 oc,
   if (obj.is_none()) {
     // pass
   } else if (py::isinstance<py::bytes>(obj)) {
-    std::string val(PyBytes_AsString(obj.ptr()), PyBytes_Size(obj.ptr()));
+    char *data = PyBytes_AsString(obj.ptr());
+    Py_ssize_t size = PyBytes_Size(obj.ptr());
 
     buf.mutate([&](FBFR32 *fbfr) {
-      return CFchg32(fbfr, fieldid, oc, const_cast<char *>(val.data()),
-                     val.size(), FLD_CARRAY);
+      return CFchg32(fbfr, fieldid, oc, data, size, FLD_CARRAY);
     });
   } else if (py::isinstance<py::str>(obj)) {
 #if PY_MAJOR_VERSION >= 3
-    py::bytes b = py::reinterpret_steal<py::bytes>(
-        PyUnicode_EncodeLocale(obj.ptr(), "surrogateescape"));
-    std::string val(PyBytes_AsString(b.ptr()), PyBytes_Size(b.ptr()));
+    const char *data;
+    Py_ssize_t size;
+    py::object holder;
+    encode_string(obj, &data, &size, holder);
 #else
     if (PyUnicode_Check(obj.ptr())) {
       obj = PyUnicode_AsEncodedString(obj.ptr(), "utf-8", "surrogateescape");
     }
-    std::string val(PyString_AsString(obj.ptr()), PyString_Size(obj.ptr()));
+    const char *data = PyString_AsString(obj.ptr());
+    Py_ssize_t size = PyString_Size(obj.ptr());
 #endif
     buf.mutate([&](FBFR32 *fbfr) {
-      return CFchg32(fbfr, fieldid, oc, const_cast<char *>(val.data()),
-                     val.size(), FLD_CARRAY);
+      return CFchg32(fbfr, fieldid, oc, const_cast<char *>(data), size,
+                     FLD_CARRAY);
     });
   } else if (py::isinstance<py::int_>(obj)) {
     long val = obj.cast<py::int_>();
@@ -388,33 +658,174 @@ static void from_py1(xatmibuf &buf, FLDID32 fieldid, FLDOCC32 oc,
   }
 }
 
+static FLDID32 to_fieldid(py::handle key) {
+  if (py::isinstance<py::int_>(key)) {
+    return key.cast<py::int_>();
+  }
+  return Fldid32(const_cast<char *>(std::string(py::str(key)).c_str()));
+}
+
+// A list or tuple (as decoded with FLAT) holds all occurrences, anything
+// else is a single one for convenience
+static void from_py_occurrences(xatmibuf &buf, FLDID32 fieldid, py::handle o,
+                                xatmibuf &f) {
+  if (py::isinstance<py::list>(o) || py::isinstance<py::tuple>(o)) {
+    FLDOCC32 oc = 0;
+    for (auto e : o) {
+      from_py1(buf, fieldid, oc++, e, f);
+    }
+  } else {
+    from_py1(buf, fieldid, 0, o, f);
+  }
+}
+
 static void from_py(py::dict obj, xatmibuf &b) {
   b.reinit("FML32", 1024);
   xatmibuf f;
 
   for (auto it : obj) {
-    FLDID32 fieldid;
-    if (py::isinstance<py::int_>(it.first)) {
-      fieldid = it.first.cast<py::int_>();
-    } else {
-      fieldid =
-          Fldid32(const_cast<char *>(std::string(py::str(it.first)).c_str()));
+    from_py_occurrences(b, to_fieldid(it.first), it.second, f);
+  }
+}
+
+// Replaces all occurrences of a field
+static void set_field(xatmibuf &buf, FLDID32 fieldid, py::handle o) {
+  if (Fdelall32(*buf.fbfr(), fieldid) == -1 && Ferror32 != FNOTPRES) {
+    throw fml32_exception(Ferror32);
+  }
+  xatmibuf f;
+  from_py_occurrences(buf, fieldid, o, f);
+}
+
+// Typed buffer passed to and from Python without conversion. It either owns
+// the buffer or is a view of the service request valid until the service
+// returns. FML32 fields are read and changed in place.
+struct pybuffer {
+  explicit pybuffer(TPSVCINFO *svcinfo) : buf(svcinfo), valid(true) {
+    init_type();
+  }
+  explicit pybuffer(xatmibuf &&buf_) : buf(std::move(buf_)), valid(true) {
+    init_type();
+  }
+
+  xatmibuf &get() {
+    if (!valid || *buf.pp == nullptr) {
+      throw std::runtime_error("Buffer is no longer valid");
+    }
+    return buf;
+  }
+
+  xatmibuf &fml32() {
+    auto &b = get();
+    if (type != "FML32") {
+      throw std::invalid_argument("Not a FML32 buffer");
+    }
+    return b;
+  }
+
+  // For passing as input, the buffer stays here
+  xatmibuf alias() {
+    auto &b = get();
+    return xatmibuf(b.pp, b.len);
+  }
+
+  // For tpreturn() and tpforward() that take the buffer
+  char *take(long *len) {
+    auto &b = get();
+    *len = b.len;
+    if (b.p == nullptr) {
+      return *b.pp;
     }
+    valid = false;
+    return b.release();
+  }
 
-    py::handle o = it.second;
-    if (py::isinstance<py::list>(o)) {
-      FLDOCC32 oc = 0;
-      for (auto e : o.cast<py::list>()) {
-        from_py1(b, fieldid, oc++, e, f);
+  xatmibuf copy() {
+    auto &b = get();
+    if (type == "FML32") {
+      xatmibuf c("FML32", Fsizeof32(*b.fbfr()));
+      if (Fcpy32(*c.fbfr(), *b.fbfr()) == -1) {
+        throw fml32_exception(Ferror32);
       }
-    } else {
-      // Handle single elements instead of lists for convenience
-      from_py1(b, fieldid, 0, o, f);
+      return c;
+    }
+    xatmibuf c(type.c_str(), b.len);
+    memcpy(*c.pp, *b.pp, b.len);
+    return c;
+  }
+
+  py::object getitem(py::handle key) {
+    FBFR32 *fbfr = *fml32().fbfr();
+    FLDID32 fieldid = to_fieldid(key);
+    FLDOCC32 n = Foccur32(fbfr, fieldid);
+    if (n == -1) {
+      throw fml32_exception(Ferror32);
+    } else if (n == 0) {
+      throw py::key_error(std::string(py::str(key)));
+    }
+    py::list val;
+    for (FLDOCC32 oc = 0; oc < n; oc++) {
+      FLDLEN32 len;
+      char *value = Ffind32(fbfr, fieldid, oc, &len);
+      if (value == nullptr) {
+        throw fml32_exception(Ferror32);
+      }
+      val.append(field_to_py(fieldid, value, len));
+    }
+    return val;
+  }
+
+  void setitem(py::handle key, py::handle o) {
+    set_field(fml32(), to_fieldid(key), o);
+  }
+
+  void delitem(py::handle key) {
+    if (Fdelall32(*fml32().fbfr(), to_fieldid(key)) == -1) {
+      if (Ferror32 == FNOTPRES) {
+        throw py::key_error(std::string(py::str(key)));
+      }
+      throw fml32_exception(Ferror32);
+    }
+  }
+
+  bool contains(py::handle key) {
+    return Fpres32(*fml32().fbfr(), to_fieldid(key), 0) == 1;
+  }
+
+  xatmibuf buf;
+  std::string type;
+  bool valid;
+
+ private:
+  void init_type() {
+    char type_[8];
+    char subtype[16];
+    if (tptypes(*buf.pp, type_, subtype) == -1) {
+      throw std::invalid_argument("Invalid buffer type");
     }
+    type = type_;
+  }
+};
+
+// Calls add fields to their own copy of a Buffer passed by the caller
+static void unshare(xatmibuf &in) {
+  char type[8];
+  char subtype[16];
+  if (in.pp == &in.p || *in.pp == nullptr ||
+      tptypes(*in.pp, type, subtype) == -1 || strcmp(type, "FML32") != 0) {
+    return;
   }
+  xatmibuf c("FML32", Fsizeof32(*in.fbfr()));
+  if (Fcpy32(*c.fbfr(), *in.fbfr()) == -1) {
+    throw fml32_exception(Ferror32);
+  }
+  in = std::move(c);
 }
 
 static xatmibuf from_py(py::object obj) {
+  if (py::isinstance<pybuffer>(obj)) {
+    return obj.cast<pybuffer &>().alias();
+  }
   if (py::isinstance<py::bytes>(obj)) {
     xatmibuf buf("CARRAY", PyBytes_Size(obj.ptr()));
     memcpy(*buf.pp, PyBytes_AsString(obj.ptr()), PyBytes_Size(obj.ptr()));
@@ -435,130 +846,5599 @@ static xatmibuf from_py(py::object obj) {
   }
 }
 
-static py::object pytpexport(py::object idata, long flags) {
-  auto in = from_py(idata);
-  std::vector<char> ostr;
-  ostr.resize(512 + in.len * 2);
+#if PY_MAJOR_VERSION >= 3
+// Message shape declared once: field ids, types and occurrences are resolved
+// when the schema is created and checked while encoding and decoding
+struct schema {
+  enum kind_t { KIND_INT, KIND_FLOAT, KIND_STR, KIND_BYTES, KIND_SCHEMA };
 
-  long olen = ostr.capacity();
-  int rc = tpexport(in.p, in.len, &ostr[0], &olen, flags);
-  if (rc == -1) {
-    throw xatmi_exception(tperrno);
+  struct field {
+    py::str name;
+    FLDID32 fieldid;
+    int fldtype;
+    kind_t kind;
+    py::object nested;
+    FLDOCC32 min, max;  // max is -1 for unlimited
+    bool many;
+  };
+
+  schema(py::object spec, py::object name) : size_hint(1024) {
+    if (py::isinstance<py::dict>(spec)) {
+      py::list names;
+      for (auto it : spec.cast<py::dict>()) {
+        py::handle decl = it.second;
+        if (py::isinstance<py::tuple>(decl)) {
+          py::tuple t = decl.cast<py::tuple>();
+          if (t.size() != 2) {
+            throw std::invalid_argument("Expected (type, cardinality) for " +
+                                        std::string(py::str(it.first)));
+          }
+          add(py::str(it.first), t[0], t[1]);
+        } else {
+          add(py::str(it.first), py::reinterpret_borrow<py::object>(decl),
+              py::int_(1));
+        }
+        names.append(it.first);
+      }
+      py::dict attrs;
+      attrs["__slots__"] = py::tuple(names);
+      type = py::module::import("builtins").attr("type")(
+          name.is_none() ? py::str("Message") : name, py::tuple(), attrs);
+    } else if (py::bool_(py::module::import("dataclasses")
+                              .attr("is_dataclass")(spec))) {
+      auto typing = py::module::import("typing");
+      py::dict hints = typing.attr("get_type_hints")(spec);
+      for (auto f : py::module::import("dataclasses").attr("fields")(spec)) {
+        py::str fname = f.attr("name");
+        py::object t = hints[fname];
+        py::object card = py::int_(1);
+        py::object origin = typing.attr("get_origin")(t);
+        py::tuple args = typing.attr("get_args")(t);
+        if (origin.is(py::module::import("builtins").attr("list"))) {
+          t = args[0];
+          card = py::str("*");
+        } else if (is_union(origin) && args.size() == 2) {
+          // Optional[T], Union[None, T] and T | None
+          auto none = reinterpret_cast<PyObject *>(Py_TYPE(Py_None));
+          if (args[1].ptr() == none) {
+            t = args[0];
+            card = py::str("?");
+          } else if (args[0].ptr() == none) {
+            t = args[1];
+            card = py::str("?");
+          }
+        }
+        add(fname, t, card);
+      }
+      type = spec;
+    } else {
+      throw std::invalid_argument("Expected a dataclass or a dict");
+    }
   }
 
-  if (flags == 0) {
-    return py::bytes(&ostr[0], olen);
+  // typing.Union or types.UnionType of X | Y since Python 3.10
+  static bool is_union(py::handle origin) {
+    if (origin.is(py::module::import("typing").attr("Union"))) {
+      return true;
+    }
+    auto types = py::module::import("types");
+    return py::hasattr(types, "UnionType") &&
+           origin.is(types.attr("UnionType"));
   }
-  return py::str(&ostr[0]);
-}
-
-static py::object pytpimport(const std::string istr, long flags) {
-  xatmibuf obuf("FML32", istr.size());
 
-  long olen = 0;
-  int rc = tpimport(const_cast<char *>(istr.c_str()), istr.size(), obuf.pp,
-                    &olen, flags);
-  if (rc == -1) {
-    throw xatmi_exception(tperrno);
+  // Returns a FML32 buffer or throws on the first field that does not
+  // match the schema
+  xatmibuf encode(py::handle obj) {
+    xatmibuf buf("FML32", size_hint);
+    encode(obj, buf);
+    size_hint = std::max(size_hint, Fused32(*buf.fbfr()));
+    return buf;
   }
 
-  return to_py(obuf);
-}
+  void encode(py::handle obj, xatmibuf &buf) {
+    bool is_dict = py::isinstance<py::dict>(obj);
+    for (auto &f : fields) {
+      py::object value;
+      if (is_dict) {
+        PyObject *v = PyDict_GetItem(obj.ptr(), f.name.ptr());
+        if (v != nullptr) {
+          value = py::reinterpret_borrow<py::object>(v);
+        }
+      } else {
+        PyObject *v = PyObject_GetAttr(obj.ptr(), f.name.ptr());
+        if (v != nullptr) {
+          value = py::reinterpret_steal<py::object>(v);
+        } else if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+          PyErr_Clear();
+        } else {
+          throw py::error_already_set();
+        }
+      }
 
-static void pytppost(const std::string eventname, py::object data, long flags) {
-  auto in = from_py(data);
+      if (!value || value.is_none()) {
+        if (f.min > 0) {
+          throw std::invalid_argument("Field " + std::string(f.name) +
+                                      " is required");
+        }
+        continue;
+      }
 
-  {
-    py::gil_scoped_release release;
-    int rc =
-        tppost(const_cast<char *>(eventname.c_str()), *in.pp, in.len, flags);
-    if (rc == -1) {
-      throw xatmi_exception(tperrno);
+      if (!f.many) {
+        encode1(buf, f, 0, value);
+        continue;
+      }
+      if (!py::isinstance<py::list>(value) &&
+          !py::isinstance<py::tuple>(value)) {
+        throw std::invalid_argument("Field " + std::string(f.name) +
+                                    " must be a list");
+      }
+      py::sequence seq = value.cast<py::sequence>();
+      FLDOCC32 n = seq.size();
+      if (n < f.min || (f.max != -1 && n > f.max)) {
+        throw std::invalid_argument("Field " + std::string(f.name) + " has " +
+                                    std::to_string(n) + " occurrences");
+      }
+      for (FLDOCC32 oc = 0; oc < n; oc++) {
+        encode1(buf, f, oc, seq[oc]);
+      }
     }
   }
-}
 
-static pytpreply pytpcall(const char *svc, py::object idata, long flags) {
-  with_context();
-  auto in = from_py(idata);
-  xatmibuf out("FML32", 1024);
-  {
-    py::gil_scoped_release release;
-    int rc = tpcall(const_cast<char *>(svc), *in.pp, in.len, out.pp, &out.len,
-                    flags);
-    if (rc == -1) {
-      if (tperrno != TPESVCFAIL) {
-        throw xatmi_exception(tperrno);
-      }
+  py::object decode(FBFR32 *fbfr) {
+    PyObject *obj = PyBaseObject_Type.tp_new(
+        reinterpret_cast<PyTypeObject *>(type.ptr()), empty_args.ptr(),
+        nullptr);
+    if (obj == nullptr) {
+      throw py::error_already_set();
     }
-  }
-  return pytpreply(tperrno, tpurcode, out);
-}
+    auto result = py::reinterpret_steal<py::object>(obj);
 
-static TPQCTL pytpenqueue(const char *qspace, const char *qname, TPQCTL *ctl,
-                          py::object data, long flags) {
-  with_context();
-  auto in = from_py(data);
-  {
-    py::gil_scoped_release release;
-    int rc = tpenqueue(const_cast<char *>(qspace), const_cast<char *>(qname),
-                       ctl, *in.pp, in.len, flags);
-    if (rc == -1) {
-      if (tperrno == TPEDIAGNOSTIC) {
-        throw qm_exception(ctl->diagnostic);
+    for (auto &f : fields) {
+      FLDOCC32 n = Foccur32(fbfr, f.fieldid);
+      if (n == -1) {
+        throw fml32_exception(Ferror32);
+      }
+      if (n < f.min || (f.max != -1 && n > f.max)) {
+        throw std::invalid_argument("Field " + std::string(f.name) + " has " +
+                                    std::to_string(n) + " occurrences");
       }
-      throw xatmi_exception(tperrno);
-    }
-  }
-  return *ctl;
-}
 
-static std::pair<TPQCTL, py::object> pytpdequeue(const char *qspace,
-                                                 const char *qname, TPQCTL *ctl,
-                                                 long flags) {
-  with_context();
-  xatmibuf out("FML32", 1024);
-  {
-    py::gil_scoped_release release;
-    int rc = tpdequeue(const_cast<char *>(qspace), const_cast<char *>(qname),
-                       ctl, out.pp, &out.len, flags);
-    if (rc == -1) {
-      if (tperrno == TPEDIAGNOSTIC) {
-        throw qm_exception(ctl->diagnostic);
+      py::object value;
+      if (f.many) {
+        py::list val(n);
+        for (FLDOCC32 oc = 0; oc < n; oc++) {
+          PyList_SET_ITEM(val.ptr(), oc, decode1(fbfr, f, oc).release().ptr());
+        }
+        value = val;
+      } else if (n == 0) {
+        value = py::none();
+      } else {
+        value = decode1(fbfr, f, 0);
+      }
+      // Bypasses __setattr__ of frozen dataclasses
+      if (PyObject_GenericSetAttr(result.ptr(), f.name.ptr(), value.ptr()) ==
+          -1) {
+        throw py::error_already_set();
       }
-      throw xatmi_exception(tperrno);
     }
+    return result;
   }
-  return std::make_pair(*ctl, to_py(out));
-}
 
-static int pytpacall(const char *svc, py::object idata, long flags) {
-  with_context();
+  std::vector<field> fields;
+  py::object type;
+  long size_hint;
+  py::tuple empty_args;
+
+ private:
+  void add(py::str name, py::object t, py::object card) {
+    field f;
+    f.name = name;
+    f.fieldid = Fldid32(const_cast<char *>(std::string(name).c_str()));
+    if (f.fieldid == BADFLDID) {
+      throw fml32_exception(Ferror32);
+    }
+    f.fldtype = Fldtype32(f.fieldid);
+
+    auto builtins = py::module::import("builtins");
+    bool ok;
+    if (t.is(builtins.attr("int"))) {
+      f.kind = KIND_INT;
+      ok = f.fldtype == FLD_SHORT || f.fldtype == FLD_LONG;
+    } else if (t.is(builtins.attr("float"))) {
+      f.kind = KIND_FLOAT;
+      ok = f.fldtype == FLD_FLOAT || f.fldtype == FLD_DOUBLE;
+    } else if (t.is(builtins.attr("str"))) {
+      f.kind = KIND_STR;
+      ok = f.fldtype == FLD_STRING || f.fldtype == FLD_CARRAY ||
+           f.fldtype == FLD_CHAR;
+    } else if (t.is(builtins.attr("bytes"))) {
+      f.kind = KIND_BYTES;
+      ok = f.fldtype == FLD_CARRAY || f.fldtype == FLD_STRING;
+    } else {
+      f.kind = KIND_SCHEMA;
+      f.nested = py::isinstance<schema>(t)
+                     ? t
+                     : py::cast(new schema(t, py::none()),
+                                py::return_value_policy::take_ownership);
+      ok = f.fldtype == FLD_FML32;
+    }
+    if (!ok) {
+      throw std::invalid_argument("Field " + std::string(name) +
+                                  " type does not match field table");
+    }
+
+    if (py::isinstance<py::tuple>(card)) {
+      py::tuple mm = card.cast<py::tuple>();
+      f.min = mm[0].cast<FLDOCC32>();
+      f.max = mm[1].is_none() ? -1 : mm[1].cast<FLDOCC32>();
+      f.many = true;
+    } else if (py::isinstance<py::str>(card)) {
+      std::string c = py::str(card);
+      if (c == "?") {
+        f.min = 0, f.max = 1, f.many = false;
+      } else if (c == "*") {
+        f.min = 0, f.max = -1, f.many = true;
+      } else if (c == "+") {
+        f.min = 1, f.max = -1, f.many = true;
+      } else {
+        throw std::invalid_argument("Unsupported cardinality " + c);
+      }
+    } else {
+      f.min = f.max = card.cast<FLDOCC32>();
+      f.many = f.max != 1;
+    }
+    fields.push_back(f);
+  }
+
+  void encode1(xatmibuf &buf, field &f, FLDOCC32 oc, py::handle value) {
+    switch (f.kind) {
+      case KIND_INT: {
+        if (!py::isinstance<py::int_>(value)) {
+          break;
+        }
+        long val = PyLong_AsLong(value.ptr());
+        if (val == -1 && PyErr_Occurred()) {
+          throw py::error_already_set();
+        }
+        if (f.fldtype == FLD_SHORT) {
+          if (val < SHRT_MIN || val > SHRT_MAX) {
+            throw std::invalid_argument("Field " + std::string(f.name) +
+                                        " value out of range");
+          }
+          short s = val;
+          buf.mutate([&](FBFR32 *fbfr) {
+            return Fchg32(fbfr, f.fieldid, oc, reinterpret_cast<char *>(&s),
+                          0);
+          });
+        } else {
+          buf.mutate([&](FBFR32 *fbfr) {
+            return Fchg32(fbfr, f.fieldid, oc, reinterpret_cast<char *>(&val),
+                          0);
+          });
+        }
+        return;
+      }
+      case KIND_FLOAT: {
+        if (!py::isinstance<py::float_>(value) &&
+            !py::isinstance<py::int_>(value)) {
+          break;
+        }
+        double val = PyFloat_AsDouble(value.ptr());
+        if (val == -1.0 && PyErr_Occurred()) {
+          throw py::error_already_set();
+        }
+        if (f.fldtype == FLD_FLOAT) {
+          float v = val;
+          buf.mutate([&](FBFR32 *fbfr) {
+            return Fchg32(fbfr, f.fieldid, oc, reinterpret_cast<char *>(&v),
+                          0);
+          });
+        } else {
+          buf.mutate([&](FBFR32 *fbfr) {
+            return Fchg32(fbfr, f.fieldid, oc, reinterpret_cast<char *>(&val),
+                          0);
+          });
+        }
+        return;
+      }
+      case KIND_STR:
+      case KIND_BYTES: {
+        if (!py::isinstance<py::str>(value) &&
+            !py::isinstance<py::bytes>(value)) {
+          break;
+        }
+        if (py::isinstance<py::str>(value) != (f.kind == KIND_STR)) {
+          break;
+        }
+        xatmibuf unused;
+        from_py1(buf, f.fieldid, oc, value, unused);
+        return;
+      }
+      case KIND_SCHEMA: {
+        auto &nested = f.nested.cast<schema &>();
+        xatmibuf b = nested.encode(value);
+        buf.mutate([&](FBFR32 *fbfr) {
+          return Fchg32(fbfr, f.fieldid, oc, reinterpret_cast<char *>(*b.fbfr()),
+                        0);
+        });
+        return;
+      }
+    }
+    throw std::invalid_argument("Field " + std::string(f.name) +
+                                " has unexpected type " +
+                                std::string(Py_TYPE(value.ptr())->tp_name));
+  }
+
+  py::object decode1(FBFR32 *fbfr, field &f, FLDOCC32 oc) {
+    FLDLEN32 len;
+    char *value = Ffind32(fbfr, f.fieldid, oc, &len);
+    if (value == nullptr) {
+      throw fml32_exception(Ferror32);
+    }
+    switch (f.kind) {
+      case KIND_SCHEMA:
+        return f.nested.cast<schema &>().decode(
+            reinterpret_cast<FBFR32 *>(value));
+      case KIND_BYTES:
+        if (f.fldtype == FLD_STRING) {
+          return py::bytes(value, len > 0 ? len - 1 : 0);
+        }
+        return py::bytes(value, len);
+      case KIND_STR:
+        if (f.fldtype == FLD_CARRAY) {
+          return decode_string(value, len);
+        } else if (f.fldtype == FLD_CHAR) {
+          return decode_string(value, 1);
+        }
+        return decode_string(value, len > 0 ? len - 1 : 0);
+      default:
+        return field_to_py(f.fieldid, value, len);
+    }
+  }
+};
+#endif
+
+// Numbers in JSON and metrics use '.' whatever LC_NUMERIC the application
+// set with locale.setlocale()
+#if defined(_WIN32) || defined(_WIN64)
+static _locale_t c_locale() {
+  static _locale_t c = _create_locale(LC_NUMERIC, "C");
+  return c;
+}
+
+static double c_strtod(const char *s) {
+  return _strtod_l(s, nullptr, c_locale());
+}
+
+static void c_format(char *buf, size_t size, int precision, double val) {
+  _snprintf_l(buf, size, "%.*g", c_locale(), precision, val);
+  buf[size - 1] = '\0';
+}
+#else
+static locale_t c_locale() {
+  static locale_t c = newlocale(LC_NUMERIC_MASK, "C", locale_t(0));
+  return c;
+}
+
+static double c_strtod(const char *s) {
+  locale_t prev = uselocale(c_locale());
+  double val = strtod(s, nullptr);
+  uselocale(prev);
+  return val;
+}
+
+static void c_format(char *buf, size_t size, int precision, double val) {
+  locale_t prev = uselocale(c_locale());
+  snprintf(buf, size, "%.*g", precision, val);
+  uselocale(prev);
+}
+#endif
+
+// JSON object <-> FML32 without Python objects in between. Keys are field
+// names, arrays are occurrences and nested objects are FLD_FML32 fields.
+// Field names are looked up once per thread.
+static thread_local std::unordered_map<std::string, FLDID32> json_fieldids;
+static thread_local std::unordered_map<FLDID32, std::string> json_names;
+
+static FLDID32 json_fieldid(const std::string &name) {
+  auto it = json_fieldids.find(name);
+  if (it != json_fieldids.end()) {
+    return it->second;
+  }
+  FLDID32 fieldid;
+  if (!name.empty() &&
+      name.find_first_not_of("0123456789") == std::string::npos) {
+    fieldid = std::stoul(name);
+  } else {
+    fieldid = Fldid32(const_cast<char *>(name.c_str()));
+    if (fieldid == BADFLDID) {
+      throw std::invalid_argument("Unknown field " + name);
+    }
+  }
+  json_fieldids[name] = fieldid;
+  return fieldid;
+}
+
+struct json_parser {
+  json_parser(const char *s, size_t n) : begin(s), p(s), end(s + n) {}
+
+  void parse(xatmibuf &buf) {
+    ws();
+    object(buf, 0);
+    ws();
+    if (p != end) {
+      error("Unexpected data after JSON object");
+    }
+  }
+
+ private:
+  const char *begin;
+  const char *p;
+  const char *end;
+  std::string str;
+
+  [[noreturn]] void error(const char *what) {
+    throw std::invalid_argument(std::string(what) + " at JSON offset " +
+                                std::to_string(p - begin));
+  }
+
+  void ws() {
+    while (p != end &&
+           (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+      p++;
+    }
+  }
+
+  void expect(char c) {
+    ws();
+    if (p == end || *p != c) {
+      error("Malformed JSON");
+    }
+    p++;
+  }
+
+  void object(xatmibuf &buf, int depth) {
+    if (depth > 64) {
+      error("JSON nested too deep");
+    }
+    expect('{');
+    ws();
+    if (p != end && *p == '}') {
+      p++;
+      return;
+    }
+    for (;;) {
+      expect('"');
+      string();
+      FLDID32 fieldid = json_fieldid(str);
+      expect(':');
+      ws();
+      if (p != end && *p == '[') {
+        p++;
+        ws();
+        if (p != end && *p == ']') {
+          p++;
+        } else {
+          FLDOCC32 oc = 0;
+          for (;;) {
+            value(buf, fieldid, oc++, depth);
+            ws();
+            if (p != end && *p == ',') {
+              p++;
+              continue;
+            }
+            expect(']');
+            break;
+          }
+        }
+      } else {
+        value(buf, fieldid, 0, depth);
+      }
+      ws();
+      if (p != end && *p == ',') {
+        p++;
+        continue;
+      }
+      expect('}');
+      return;
+    }
+  }
+
+  void value(xatmibuf &buf, FLDID32 fieldid, FLDOCC32 oc, int depth) {
+    ws();
+    if (p == end) {
+      error("Unexpected end of JSON");
+    }
+    switch (*p) {
+      case '"':
+        p++;
+        string();
+        buf.mutate([&](FBFR32 *fbfr) {
+          return CFchg32(fbfr, fieldid, oc, const_cast<char *>(str.data()),
+                         str.size(), FLD_CARRAY);
+        });
+        return;
+      case '{': {
+        xatmibuf f("FML32", 256);
+        object(f, depth + 1);
+        buf.mutate([&](FBFR32 *fbfr) {
+          return Fchg32(fbfr, fieldid, oc, reinterpret_cast<char *>(*f.fbfr()),
+                        0);
+        });
+        return;
+      }
+      case 't':
+      case 'f': {
+        long val = *p == 't';
+        literal(val ? "true" : "false");
+        buf.mutate([&](FBFR32 *fbfr) {
+          return CFchg32(fbfr, fieldid, oc, reinterpret_cast<char *>(&val), 0,
+                         FLD_LONG);
+        });
+        return;
+      }
+      case 'n':
+        literal("null");
+        return;
+      case '[':
+        error("Nested JSON arrays are not supported");
+      default:
+        number(buf, fieldid, oc);
+    }
+  }
+
+  void literal(const char *s) {
+    size_t n = strlen(s);
+    if (static_cast<size_t>(end - p) < n || memcmp(p, s, n) != 0) {
+      error("Malformed JSON");
+    }
+    p += n;
+  }
+
+  void number(xatmibuf &buf, FLDID32 fieldid, FLDOCC32 oc) {
+    const char *start = p;
+    bool real = false;
+    if (p != end && *p == '-') {
+      p++;
+    }
+    const char *digits = p;
+    while (p != end && *p >= '0' && *p <= '9') {
+      p++;
+    }
+    if (p == digits) {
+      error("Malformed JSON");
+    }
+    if (p != end && *p == '.') {
+      real = true;
+      p++;
+      while (p != end && *p >= '0' && *p <= '9') {
+        p++;
+      }
+    }
+    if (p != end && (*p == 'e' || *p == 'E')) {
+      real = true;
+      p++;
+      if (p != end && (*p == '+' || *p == '-')) {
+        p++;
+      }
+      while (p != end && *p >= '0' && *p <= '9') {
+        p++;
+      }
+    }
+
+    // Integers that fit in long, others become doubles
+    bool negative = *start == '-';
+    unsigned long max = negative ? 0UL - static_cast<unsigned long>(LONG_MIN)
+                                 : static_cast<unsigned long>(LONG_MAX);
+    unsigned long magnitude = 0;
+    bool fits = !real;
+    for (const char *d = digits; fits && d != p; d++) {
+      unsigned long digit = *d - '0';
+      if (magnitude > (max - digit) / 10) {
+        fits = false;
+      }
+      magnitude = magnitude * 10 + digit;
+    }
+    if (fits) {
+      long val = negative ? static_cast<long>(0UL - magnitude)
+                          : static_cast<long>(magnitude);
+      buf.mutate([&](FBFR32 *fbfr) {
+        return CFchg32(fbfr, fieldid, oc, reinterpret_cast<char *>(&val), 0,
+                       FLD_LONG);
+      });
+      return;
+    }
+    std::string s(start, p);
+    double val = c_strtod(s.c_str());
+    buf.mutate([&](FBFR32 *fbfr) {
+      return CFchg32(fbfr, fieldid, oc, reinterpret_cast<char *>(&val), 0,
+                     FLD_DOUBLE);
+    });
+  }
+
+  // Reads a string after the opening quote into str
+  void string() {
+    str.clear();
+    for (;;) {
+      const char *start = p;
+#if defined(__SSE2__) || defined(_M_X64)
+      const __m128i quote = _mm_set1_epi8('"');
+      const __m128i backslash = _mm_set1_epi8('\\');
+      const __m128i control = _mm_set1_epi8(0x1f);
+      while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                         _mm_cmpeq_epi8(v, backslash)),
+            _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+        int mask = _mm_movemask_epi8(special);
+        if (mask != 0) {
+          while (!(mask & 1)) {
+            mask >>= 1;
+            p++;
+          }
+          break;
+        }
+        p += 16;
+      }
+#endif
+      while (p != end && *p != '"' && *p != '\\' &&
+             static_cast<unsigned char>(*p) >= 0x20) {
+        p++;
+      }
+      str.append(start, p);
+      if (p == end) {
+        error("Unterminated JSON string");
+      }
+      if (*p == '"') {
+        p++;
+        return;
+      }
+      if (*p != '\\') {
+        error("Control character in JSON string");
+      }
+      p++;
+      if (p == end) {
+        error("Unterminated JSON string");
+      }
+      switch (*p++) {
+        case '"':
+          str += '"';
+          break;
+        case '\\':
+          str += '\\';
+          break;
+        case '/':
+          str += '/';
+          break;
+        case 'b':
+          str += '\b';
+          break;
+        case 'f':
+          str += '\f';
+          break;
+        case 'n':
+          str += '\n';
+          break;
+        case 'r':
+          str += '\r';
+          break;
+        case 't':
+          str += '\t';
+          break;
+        case 'u': {
+          unsigned cp = hex4();
+          if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 && p[0] == '\\' &&
+              p[1] == 'u') {
+            p += 2;
+            unsigned lo = hex4();
+            if (lo < 0xdc00 || lo >= 0xe000) {
+              error("Invalid JSON surrogate pair");
+            }
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+          }
+          utf8(cp);
+          break;
+        }
+        default:
+          error("Invalid JSON escape");
+      }
+    }
+  }
+
+  unsigned hex4() {
+    if (end - p < 4) {
+      error("Invalid JSON escape");
+    }
+    unsigned cp = 0;
+    for (int i = 0; i < 4; i++, p++) {
+      cp <<= 4;
+      if (*p >= '0' && *p <= '9') {
+        cp |= *p - '0';
+      } else if (*p >= 'a' && *p <= 'f') {
+        cp |= *p - 'a' + 10;
+      } else if (*p >= 'A' && *p <= 'F') {
+        cp |= *p - 'A' + 10;
+      } else {
+        error("Invalid JSON escape");
+      }
+    }
+    return cp;
+  }
+
+  void utf8(unsigned cp) {
+    if (cp < 0x80) {
+      str += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+      str += static_cast<char>(0xc0 | (cp >> 6));
+      str += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+      str += static_cast<char>(0xe0 | (cp >> 12));
+      str += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+      str += static_cast<char>(0x80 | (cp & 0x3f));
+    } else {
+      str += static_cast<char>(0xf0 | (cp >> 18));
+      str += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+      str += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+      str += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+  }
+};
+
+// Length of a valid UTF-8 sequence or 0
+static size_t utf8_length(const unsigned char *s, size_t n) {
+  size_t len;
+  if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+    len = 2;
+  } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+    len = 3;
+  } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+    len = 4;
+  } else {
+    return 0;
+  }
+  if (len > n) {
+    return 0;
+  }
+  for (size_t i = 1; i < len; i++) {
+    if ((s[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+  }
+  return len;
+}
+
+// Bytes that are not valid UTF-8 are written as \u00XX
+static void json_string(std::string &out, const char *s, size_t n) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  size_t i = 0;
+  while (i < n) {
+    size_t start = i;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    while (i + 16 <= n) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+      // High bit set covers non-ASCII bytes
+      int mask =
+          _mm_movemask_epi8(_mm_or_si128(
+              _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                           _mm_cmpeq_epi8(v, backslash)),
+              _mm_cmpeq_epi8(_mm_min_epu8(v, control), v))) |
+          _mm_movemask_epi8(v);
+      if (mask != 0) {
+        while (!(mask & 1)) {
+          mask >>= 1;
+          i++;
+        }
+        break;
+      }
+      i += 16;
+    }
+#endif
+    while (i < n) {
+      unsigned char c = s[i];
+      if (c == '"' || c == '\\' || c < 0x20 || c >= 0x80) {
+        break;
+      }
+      i++;
+    }
+    out.append(s + start, i - start);
+    if (i == n) {
+      break;
+    }
+
+    unsigned char c = s[i];
+    if (c >= 0x80) {
+      size_t len =
+          utf8_length(reinterpret_cast<const unsigned char *>(s + i), n - i);
+      if (len != 0) {
+        out.append(s + i, len);
+        i += len;
+        continue;
+      }
+    }
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\r':
+        out += "\\r";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        out += "\\u00";
+        out += hex[c >> 4];
+        out += hex[c & 0xf];
+    }
+    i++;
+  }
+  out += '"';
+}
+
+// Shortest of two precisions that reads back as the same value
+template <typename T>
+static void json_number(std::string &out, T val, int shorter, int exact) {
+  if (!std::isfinite(val)) {
+    out += "null";
+    return;
+  }
+  char tmp[32];
+  c_format(tmp, sizeof(tmp), shorter, static_cast<double>(val));
+  if (static_cast<T>(c_strtod(tmp)) != val) {
+    c_format(tmp, sizeof(tmp), exact, static_cast<double>(val));
+  }
+  out += tmp;
+}
+
+static void fml_to_json(std::string &out, FBFR32 *fbfr, bool flat,
+                        int depth = 0) {
+  if (depth > 64) {
+    throw std::invalid_argument("FML32 nested too deep");
+  }
+  FLDID32 fieldid = FIRSTFLDID;
+  FLDOCC32 oc = 0;
+  FLDLEN32 buflen = Fsizeof32(fbfr);
+  std::unique_ptr<char[]> value(new char[buflen]);
+  bool array = false;
+
+  out += '{';
+  for (bool first = true;; first = false) {
+    FLDLEN32 len = buflen;
+    int r = Fnext32(fbfr, &fieldid, &oc, value.get(), &len);
+    if (r == -1) {
+      throw fml32_exception(Ferror32);
+    } else if (r == 0) {
+      break;
+    }
+
+    if (oc == 0) {
+      if (array) {
+        out += ']';
+      }
+      if (!first) {
+        out += ',';
+      }
+      auto it = json_names.find(fieldid);
+      if (it == json_names.end()) {
+        std::string name;
+        char *n = Fname32(fieldid);
+        if (n != nullptr) {
+          json_string(name, n, strlen(n));
+        } else {
+          name = '"' + std::to_string(fieldid) + '"';
+        }
+        name += ':';
+        it = json_names.insert(std::make_pair(fieldid, name)).first;
+      }
+      out += it->second;
+      array = !flat || Foccur32(fbfr, fieldid) > 1;
+      if (array) {
+        out += '[';
+      }
+    } else {
+      out += ',';
+    }
+
+    char *v = value.get();
+    switch (Fldtype32(fieldid)) {
+      case FLD_CHAR:
+        json_string(out, v, 1);
+        break;
+      case FLD_SHORT:
+        out += std::to_string(*reinterpret_cast<short *>(v));
+        break;
+      case FLD_LONG:
+        out += std::to_string(*reinterpret_cast<long *>(v));
+        break;
+      case FLD_FLOAT:
+        json_number(out, *reinterpret_cast<float *>(v), 7, 9);
+        break;
+      case FLD_DOUBLE:
+        json_number(out, *reinterpret_cast<double *>(v), 15, 17);
+        break;
+      case FLD_STRING:
+        json_string(out, v, len > 0 ? len - 1 : 0);
+        break;
+      case FLD_CARRAY:
+        json_string(out, v, len);
+        break;
+      case FLD_FML32:
+        fml_to_json(out, reinterpret_cast<FBFR32 *>(v), flat, depth + 1);
+        break;
+      default:
+        throw std::invalid_argument("Unsupported field " +
+                                    std::to_string(fieldid));
+    }
+  }
+  if (array) {
+    out += ']';
+  }
+  out += '}';
+}
+
+static xatmibuf json_to_fml(const char *s, size_t n) {
+  xatmibuf buf("FML32", std::max<long>(1024, n * 2));
+  json_parser(s, n).parse(buf);
+  return buf;
+}
+
+static py::object pytpexport(py::object idata, long flags) {
   auto in = from_py(idata);
+  std::vector<char> ostr;
+  ostr.resize(512 + in.len * 2);
+
+  long olen = ostr.capacity();
+  int rc = tpexport(in.p, in.len, &ostr[0], &olen, flags);
+  if (rc == -1) {
+    throw xatmi_exception(tperrno);
+  }
+
+  if (flags == 0) {
+    return py::bytes(&ostr[0], olen);
+  }
+  return py::str(&ostr[0]);
+}
+
+static py::object pytpimport(const std::string istr, long flags) {
+  xatmibuf obuf("FML32", istr.size());
+
+  long olen = 0;
+  int rc = tpimport(const_cast<char *>(istr.c_str()), istr.size(), obuf.pp,
+                    &olen, flags);
+  if (rc == -1) {
+    throw xatmi_exception(tperrno);
+  }
+
+  return to_py(obuf);
+}
+
+static void pytppost_buf(const std::string &eventname, xatmibuf &in,
+                         long flags) {
+  {
+    py::gil_scoped_release release;
+    int rc =
+        tppost(const_cast<char *>(eventname.c_str()), *in.pp, in.len, flags);
+    if (rc == -1) {
+      throw xatmi_exception(tperrno);
+    }
+  }
+}
+
+static void pytppost(const std::string eventname, py::object data, long flags) {
+  alloc_scope scope(alloc_tppost);
+  auto in = from_py(data);
+  pytppost_buf(eventname, in, flags);
+}
+
+// Reply buffer type and size seen for each service. Reply buffers are
+// allocated to fit the 95th percentile of recent replies so that large
+// replies are not reallocated and small ones do not waste memory.
+struct reply_sizing {
+  reply_sizing() : ewma(0), samples(0) {
+    strcpy(type, "FML32");
+    memset(buckets, 0, sizeof(buckets));
+  }
+
+  void record(const char *type_, long len) {
+    snprintf(type, sizeof(type), "%s", type_);
+    ewma = samples == 0 ? len : ewma + (len - ewma) / 8;
+    samples++;
+
+    int b = 0;
+    while (b < 30 && (1L << b) < len) {
+      b++;
+    }
+    buckets[b]++;
+    // Older replies count less over time
+    if (++window == 1024) {
+      for (auto &n : buckets) {
+        n /= 2;
+      }
+      window = 512;
+    }
+  }
+
+  long percentile(double p) const {
+    long long total = 0;
+    for (auto n : buckets) {
+      total += n;
+    }
+    long long acc = 0;
+    for (int b = 0; b < 31; b++) {
+      acc += buckets[b];
+      if (acc > 0 && acc >= total * p) {
+        return 1L << b;
+      }
+    }
+    return 0;
+  }
+
+  long size() const {
+    if (samples == 0) {
+      return 1024;
+    }
+    return std::max(64L, std::max(percentile(0.95), static_cast<long>(ewma)));
+  }
+
+  char type[8];
+  double ewma;
+  long long samples;
+  long long buckets[31];
+  int window = 0;
+};
+
+static std::mutex reply_sizes_mutex;
+static std::map<std::string, reply_sizing> reply_sizes;
+static thread_local std::map<int, std::string> pending_replies;
+
+static xatmibuf reply_buffer(const std::string &svc) {
+  std::string type = "FML32";
+  long size = 1024;
+  {
+    std::lock_guard<std::mutex> lock(reply_sizes_mutex);
+    auto it = reply_sizes.find(svc);
+    if (it != reply_sizes.end()) {
+      type = it->second.type;
+      size = it->second.size();
+    }
+  }
+  return xatmibuf(type.c_str(), size);
+}
+
+static void reply_received(const std::string &svc, xatmibuf &out,
+                           char *allocated, long size) {
+  if (*out.pp != allocated || out.len > size) {
+    alloc_site->grown++;
+  }
+  char type[8];
+  char subtype[16];
+  if (tptypes(*out.pp, type, subtype) == -1) {
+    return;
+  }
+  if (strcmp(type, "FML32") != 0 && strcmp(type, "STRING") != 0 &&
+      strcmp(type, "CARRAY") != 0 && strcmp(type, "X_OCTET") != 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(reply_sizes_mutex);
+  reply_sizes[svc].record(type, out.len);
+}
+
+// Trace context is propagated in an FML32 string field as W3C traceparent
+// ("00-<trace-id>-<parent-id>-<flags>"). Finished spans go to a per-thread
+// single-producer ring and a background thread appends them to a file as
+// OTLP/JSON, one export request per line. With tracing off every call only
+// loads one atomic flag.
+enum span_kind_t { SPAN_SERVER = 2, SPAN_CLIENT = 3 };
+
+struct trace_context {
+  trace_context() : valid(false), sampled(false) {}
+  unsigned char trace_id[16];
+  unsigned char span_id[8];
+  bool valid;
+  bool sampled;
+};
+
+struct trace_span {
+  unsigned char trace_id[16];
+  unsigned char span_id[8];
+  unsigned char parent_id[8];
+  bool has_parent;
+  bool error;
+  int kind;
+  char name[XATMI_SERVICE_NAME_LENGTH + 1];
+  long long start;
+  long long end;
+};
+
+struct span_ring {
+  static const size_t N = 256;
+  span_ring() : head(0), tail(0) {}
+
+  bool push(const trace_span &s) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    spans[h % N] = s;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+  bool pop(trace_span &s) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    s = spans[t % N];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+  size_t size() const {
+    return head.load(std::memory_order_acquire) -
+           tail.load(std::memory_order_acquire);
+  }
+
+  trace_span spans[N];
+  std::atomic<size_t> head;
+  std::atomic<size_t> tail;
+};
+
+static std::atomic<bool> trace_enabled(false);
+static std::atomic<FLDID32> trace_field(BADFLDID);
+static std::atomic<double> trace_sample(0.0);
+static std::atomic<long long> trace_exported(0);
+static std::atomic<long long> trace_dropped(0);
+static std::mutex trace_rings_mutex;
+static std::vector<std::shared_ptr<span_ring>> trace_rings;
+static thread_local std::shared_ptr<span_ring> trace_ring;
+static thread_local trace_context trace_current;
+static thread_local std::map<int, trace_span> trace_pending;
+
+static long long trace_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+static std::mt19937_64 &trace_rng() {
+  static thread_local std::mt19937_64 rng(
+      (static_cast<uint64_t>(std::random_device()()) << 32) ^
+      std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+      static_cast<uint64_t>(trace_now()));
+  return rng;
+}
+
+static void trace_random(unsigned char *p, size_t n) {
+  auto &rng = trace_rng();
+  for (size_t i = 0; i < n; i += 8) {
+    uint64_t v;
+    do {
+      v = rng();
+    } while (v == 0);
+    memcpy(p + i, &v, std::min<size_t>(8, n - i));
+  }
+}
+
+static void trace_hex(char *out, const unsigned char *p, size_t n) {
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < n; i++) {
+    out[i * 2] = digits[p[i] >> 4];
+    out[i * 2 + 1] = digits[p[i] & 0xf];
+  }
+}
+
+static bool trace_unhex(unsigned char *out, const char *s, size_t n) {
+  bool zero = true;
+  for (size_t i = 0; i < n * 2; i++) {
+    char c = s[i];
+    int v;
+    if (c >= '0' && c <= '9') {
+      v = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      v = c - 'a' + 10;
+    } else {
+      return false;
+    }
+    if (i % 2 == 0) {
+      out[i / 2] = static_cast<unsigned char>(v << 4);
+    } else {
+      out[i / 2] |= static_cast<unsigned char>(v);
+    }
+    zero = zero && v == 0;
+  }
+  return !zero;
+}
+
+// 00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01
+static const size_t TRACEPARENT_LEN = 55;
+
+static bool trace_parse(const char *s, trace_context &ctx) {
+  if (strlen(s) < TRACEPARENT_LEN || s[0] != '0' || s[1] != '0' ||
+      s[2] != '-' || s[35] != '-' || s[52] != '-') {
+    return false;
+  }
+  unsigned char flags;
+  if (!trace_unhex(ctx.trace_id, s + 3, 16) ||
+      !trace_unhex(ctx.span_id, s + 36, 8)) {
+    return false;
+  }
+  // Only the ids must not be all zeros
+  if (!trace_unhex(&flags, s + 53, 1) && (s[53] != '0' || s[54] != '0')) {
+    return false;
+  }
+  ctx.valid = true;
+  ctx.sampled = (flags & 1) != 0;
+  return true;
+}
+
+static void trace_format(char *out, const trace_context &ctx) {
+  memcpy(out, "00-", 3);
+  trace_hex(out + 3, ctx.trace_id, 16);
+  out[35] = '-';
+  trace_hex(out + 36, ctx.span_id, 8);
+  memcpy(out + 52, ctx.sampled ? "-01" : "-00", 4);
+}
+
+// Starts a span as a child of parent or as a new root when sampled, returns
+// false when it is not recorded
+static bool trace_start(trace_span &s, const char *name, int kind,
+                        const trace_context &parent) {
+  if (parent.valid) {
+    if (!parent.sampled) {
+      return false;
+    }
+    memcpy(s.trace_id, parent.trace_id, sizeof(s.trace_id));
+    memcpy(s.parent_id, parent.span_id, sizeof(s.parent_id));
+    s.has_parent = true;
+  } else {
+    double sample = trace_sample.load(std::memory_order_relaxed);
+    if (sample <= 0 ||
+        std::uniform_real_distribution<double>()(trace_rng()) >= sample) {
+      return false;
+    }
+    trace_random(s.trace_id, sizeof(s.trace_id));
+    s.has_parent = false;
+  }
+  trace_random(s.span_id, sizeof(s.span_id));
+  strncpy(s.name, name, sizeof(s.name) - 1);
+  s.name[sizeof(s.name) - 1] = '\0';
+  s.kind = kind;
+  s.error = false;
+  s.start = trace_now();
+  return true;
+}
+
+static void trace_end(trace_span &s, bool error) {
+  s.end = trace_now();
+  s.error = error;
+  if (!trace_ring) {
+    trace_ring = std::make_shared<span_ring>();
+    std::lock_guard<std::mutex> lock(trace_rings_mutex);
+    trace_rings.push_back(trace_ring);
+  }
+  if (!trace_ring->push(s)) {
+    trace_dropped++;
+  }
+}
+
+static void trace_inject(xatmibuf &buf, const trace_context &ctx) {
+  char type[8];
+  char subtype[16];
+  if (*buf.pp == nullptr || tptypes(*buf.pp, type, subtype) == -1 ||
+      strcmp(type, "FML32") != 0) {
+    return;
+  }
+  if (buf.len <= 0) {
+    buf.len = Fsizeof32(*buf.fbfr());
+  }
+  char value[TRACEPARENT_LEN + 1];
+  trace_format(value, ctx);
+  FLDID32 field = trace_field.load(std::memory_order_relaxed);
+  buf.mutate([&](FBFR32 *fbfr) { return Fchg32(fbfr, field, 0, value, 0); });
+}
+
+static bool trace_client_start(trace_span &s, const char *svc, xatmibuf &in) {
+  if (!trace_start(s, svc, SPAN_CLIENT, trace_current)) {
+    if (trace_current.valid) {
+      // Pass on the decision not to sample
+      unshare(in);
+      trace_inject(in, trace_current);
+    }
+    return false;
+  }
+  unshare(in);
+  trace_context ctx;
+  memcpy(ctx.trace_id, s.trace_id, sizeof(ctx.trace_id));
+  memcpy(ctx.span_id, s.span_id, sizeof(ctx.span_id));
+  ctx.valid = ctx.sampled = true;
+  trace_inject(in, ctx);
+  return true;
+}
+
+// Injects the trace context into a request, the span must be ended with
+// trace_end() once the reply is received
+static inline bool trace_client(trace_span &s, const char *svc,
+                                xatmibuf &in) {
+  if (!trace_enabled.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  return trace_client_start(s, svc, in);
+}
+
+// Drains the rings and appends the spans to a file
+struct trace_exporter {
+  trace_exporter(const std::string &path_, const std::string &service_,
+                 long flush_ms_)
+      : path(path_), service(service_), flush_ms(flush_ms_), stopping(false) {
+    exporter = std::thread(&trace_exporter::run, this);
+  }
+  ~trace_exporter() { stop(); }
+
+  void flush() {
+    std::lock_guard<std::mutex> lock(flush_mutex);
+    std::vector<std::shared_ptr<span_ring>> rings;
+    {
+      std::lock_guard<std::mutex> lock(trace_rings_mutex);
+      rings = trace_rings;
+    }
+    std::string spans;
+    long long n = 0;
+    trace_span s;
+    char hex[33];
+    for (auto &ring : rings) {
+      while (ring->pop(s)) {
+        spans += n++ == 0 ? "{" : ",{";
+        trace_hex(hex, s.trace_id, 16);
+        spans += "\"traceId\":\"" + std::string(hex, 32) + "\"";
+        trace_hex(hex, s.span_id, 8);
+        spans += ",\"spanId\":\"" + std::string(hex, 16) + "\"";
+        if (s.has_parent) {
+          trace_hex(hex, s.parent_id, 8);
+          spans += ",\"parentSpanId\":\"" + std::string(hex, 16) + "\"";
+        }
+        spans += ",\"name\":";
+        json_string(spans, s.name, strlen(s.name));
+        spans += ",\"kind\":" + std::to_string(s.kind);
+        spans += ",\"startTimeUnixNano\":\"" + std::to_string(s.start) + "\"";
+        spans += ",\"endTimeUnixNano\":\"" + std::to_string(s.end) + "\"";
+        if (s.error) {
+          spans += ",\"status\":{\"code\":2}";
+        }
+        spans += "}";
+      }
+    }
+    {
+      // Rings of finished threads
+      std::lock_guard<std::mutex> lock(trace_rings_mutex);
+      trace_rings.erase(
+          std::remove_if(trace_rings.begin(), trace_rings.end(),
+                         [](const std::shared_ptr<span_ring> &r) {
+                           return r.use_count() <= 2 && r->size() == 0;
+                         }),
+          trace_rings.end());
+    }
+    if (n == 0) {
+      return;
+    }
+    std::string line =
+        "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":"
+        "\"service.name\",\"value\":{\"stringValue\":";
+    json_string(line, service.data(), service.size());
+    line += "}}]},\"scopeSpans\":[{\"scope\":{\"name\":\"tuxedo\"},\"spans\":[";
+    line += spans;
+    line += "]}]}]}\n";
+
+    FILE *f = fopen(path.c_str(), "a");
+    if (f == nullptr) {
+      trace_dropped += n;
+      return;
+    }
+    if (fwrite(line.data(), 1, line.size(), f) != line.size()) {
+      trace_dropped += n;
+    } else {
+      trace_exported += n;
+    }
+    fclose(f);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (stopping) {
+        return;
+      }
+      stopping = true;
+    }
+    cv.notify_one();
+    if (exporter.joinable()) {
+      exporter.join();
+    }
+    flush();
+  }
+
+ private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+      cv.wait_for(lock, std::chrono::milliseconds(flush_ms));
+      lock.unlock();
+      flush();
+      lock.lock();
+    }
+  }
+
+  std::string path;
+  std::string service;
+  long flush_ms;
+
+  std::thread exporter;
+  std::mutex mutex;
+  std::mutex flush_mutex;
+  std::condition_variable cv;
+  bool stopping;
+};
+
+static std::shared_ptr<trace_exporter> tracer;
+
+static void stop_tracing() {
+  trace_enabled = false;
+  auto t = tracer;
+  tracer.reset();
+  if (t) {
+    py::gil_scoped_release release;
+    t->stop();
+  }
+}
+
+// Converts a reply with a Schema or passes it as a Buffer to a callable. A
+// failed service replies with something else than the Schema describes, its
+// reply is converted to a dict.
+static py::object decode_reply(xatmibuf &out, py::object decode, int rval) {
+  if (decode.is_none()) {
+    return to_py(out);
+  }
+  if (py::isinstance<py::int_>(decode)) {
+    return to_py(out, decode.cast<int>());
+  }
+#if PY_MAJOR_VERSION >= 3
+  if (py::isinstance<schema>(decode)) {
+    if (rval != 0) {
+      return to_py(out);
+    }
+    require_fml32(out);
+    return decode.cast<schema &>().decode(*out.fbfr());
+  }
+#endif
+  return decode(py::cast(new pybuffer(std::move(out)),
+                         py::return_value_policy::take_ownership));
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+// Hash table in POSIX shared memory shared by processes on the host. Readers
+// do not lock: a sequence counter is odd while a writer changes the table
+// and readers retry when it changed during the lookup. Writers serialize on
+// a robust process-shared mutex. Values are typed buffers stored as raw
+// bytes, FML32 compacted with Fcpy32.
+struct shared_store {
+  static const uint64_t MAGIC = 0x3130545358555450ULL;  // "PTUXST01"
+  static const int CLASSES = 40;
+
+  struct header {
+    std::atomic<uint64_t> magic;
+    uint64_t size;
+    uint64_t nbuckets;
+    uint64_t heap;
+    uint64_t top;
+    uint64_t count;
+    uint64_t used;
+    uint64_t free[CLASSES];
+    std::atomic<uint64_t> seq;
+    pthread_mutex_t mutex;
+  };
+
+  struct entry {
+    uint64_t next;
+    uint64_t hash;
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t cls;
+    char type[8];
+    char data[4];  // key followed by value
+  };
+
+  shared_store(const std::string &name_, size_t size, const char *snapshot_)
+      : name(name_[0] == '/' ? name_ : "/" + name_),
+        snapshot(snapshot_ == nullptr ? "" : snapshot_),
+        hdr(nullptr),
+        mapped(0) {
+    bool created = true;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fd == -1 && errno == EEXIST) {
+      created = false;
+      fd = shm_open(name.c_str(), O_RDWR, 0660);
+    }
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category(), "shm_open");
+    }
+
+    if (created) {
+      if (size < 64 * 1024) {
+        size = 64 * 1024;
+      }
+      if (ftruncate(fd, size) == -1) {
+        int err = errno;
+        ::close(fd);
+        shm_unlink(name.c_str());
+        throw std::system_error(err, std::system_category(), "ftruncate");
+      }
+    } else {
+      // Wait for the creator to size it
+      struct stat st;
+      for (int i = 0; i < 1000; i++) {
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      size = st.st_size;
+    }
+
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      throw std::system_error(err, std::system_category(), "mmap");
+    }
+    hdr = static_cast<header *>(p);
+    mapped = size;
+
+    if (created) {
+      init(size);
+      if (!snapshot.empty()) {
+        load();
+      }
+      hdr->magic.store(MAGIC, std::memory_order_release);
+    } else {
+      for (int i = 0; i < 1000 && hdr->magic.load() != MAGIC; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      if (hdr->magic.load() != MAGIC) {
+        munmap(hdr, mapped);
+        hdr = nullptr;
+        throw std::runtime_error("Shared store " + name + " not initialized");
+      }
+    }
+  }
+
+  ~shared_store() { close(); }
+
+  shared_store(const shared_store &) = delete;
+  shared_store &operator=(const shared_store &) = delete;
+
+  void close() {
+    if (hdr != nullptr) {
+      munmap(hdr, mapped);
+      hdr = nullptr;
+    }
+  }
+
+  header *get() {
+    if (hdr == nullptr) {
+      throw std::runtime_error("Shared store is closed");
+    }
+    return hdr;
+  }
+
+  bool find(const std::string &key, std::string &type, std::string &value) {
+    header *h = get();
+    uint64_t hash = hash_of(key);
+    for (int attempt = 0; attempt < 100; attempt++) {
+      uint64_t seq = h->seq.load(std::memory_order_acquire);
+      if (seq & 1) {
+        std::this_thread::yield();
+        continue;
+      }
+      bool found = lookup(key, hash, &type, &value);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (h->seq.load(std::memory_order_relaxed) == seq) {
+        return found;
+      }
+    }
+    // Too many writers, wait in line without making other readers retry
+    locker l(this);
+    return lookup(key, hash, &type, &value);
+  }
+
+  // The old value is kept when the new one does not fit
+  void put(const std::string &key, const char *type, const char *value,
+           size_t vlen) {
+    uint64_t hash = hash_of(key);
+    writer w(this);
+    size_t need = offsetof(entry, data) + align(key.size()) + vlen;
+    uint32_t cls = size_class(need);
+    uint64_t off = allocate(cls);
+    if (off == 0) {
+      // The block of the old value may be the only one of its size
+      uint64_t *link = locate(key, hash);
+      if (link == nullptr || at(*link)->cls != cls) {
+        throw std::bad_alloc();
+      }
+      remove(key, hash);
+      off = allocate(cls);
+    } else {
+      remove(key, hash);
+    }
+    entry *e = at(off);
+    e->hash = hash;
+    e->klen = key.size();
+    e->vlen = vlen;
+    e->cls = cls;
+    memset(e->type, 0, sizeof(e->type));
+    strncpy(e->type, type, sizeof(e->type) - 1);
+    memcpy(e->data, key.data(), key.size());
+    memcpy(e->data + align(key.size()), value, vlen);
+    uint64_t *bucket = buckets() + (hash & (hdr->nbuckets - 1));
+    e->next = *bucket;
+    *bucket = off;
+    hdr->count++;
+    hdr->used += uint64_t(1) << cls;
+  }
+
+  bool erase(const std::string &key) {
+    writer w(this);
+    return remove(key, hash_of(key));
+  }
+
+  void clear() {
+    writer w(this);
+    init_table();
+  }
+
+  size_t count() { return get()->count; }
+
+  py::dict stats() {
+    header *h = get();
+    py::dict d;
+    d["entries"] = py::int_(h->count);
+    d["used"] = py::int_(h->used);
+    d["size"] = py::int_(h->size);
+    d["free"] = py::int_(h->size - h->top);
+    d["buckets"] = py::int_(h->nbuckets);
+    return d;
+  }
+
+  // Snapshot records: key length, value length, type, key, value. They are
+  // copied under the lock and written after it is released, readers go on
+  // meanwhile
+  void save(const std::string &path) {
+    std::string records(reinterpret_cast<const char *>(&MAGIC), sizeof(MAGIC));
+    {
+      locker l(this);
+      records.reserve(records.size() + hdr->used);
+      for (uint64_t b = 0; b < hdr->nbuckets; b++) {
+        for (uint64_t off = buckets()[b]; off != 0;) {
+          entry *e = at(off);
+          records.append(reinterpret_cast<const char *>(&e->klen),
+                         sizeof(e->klen));
+          records.append(reinterpret_cast<const char *>(&e->vlen),
+                         sizeof(e->vlen));
+          records.append(e->type, sizeof(e->type));
+          records.append(e->data, e->klen);
+          records.append(e->data + align(e->klen), e->vlen);
+          off = e->next;
+        }
+      }
+    }
+
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == nullptr) {
+      throw std::system_error(errno, std::system_category(), tmp);
+    }
+    bool ok = fwrite(records.data(), 1, records.size(), f) == records.size();
+    if (fclose(f) != 0 || !ok || rename(tmp.c_str(), path.c_str()) == -1) {
+      int err = errno;
+      unlink(tmp.c_str());
+      throw std::system_error(err, std::system_category(), path);
+    }
+  }
+
+  std::string name;
+  std::string snapshot;
+
+ private:
+  // Holds the lock that serializes writers, the table stays readable
+  struct locker {
+    explicit locker(shared_store *s_) : s(s_) {
+      header *h = s->get();
+      int rc = pthread_mutex_lock(&h->mutex);
+#ifdef __linux__
+      if (rc == EOWNERDEAD) {
+        // The previous writer died in the middle of a change
+        pthread_mutex_consistent(&h->mutex);
+        s->init_table();
+        h->seq.store((h->seq.load() | 1) + 1);
+        rc = 0;
+      }
+#endif
+      if (rc != 0) {
+        throw std::system_error(rc, std::system_category(),
+                                "pthread_mutex_lock");
+      }
+    }
+    ~locker() { pthread_mutex_unlock(&s->hdr->mutex); }
+    shared_store *s;
+  };
+
+  // Holds the lock with an odd sequence number while the table changes
+  struct writer {
+    explicit writer(shared_store *s_) : l(s_), s(s_) {
+      s->hdr->seq.fetch_add(1, std::memory_order_acq_rel);
+    }
+    ~writer() { s->hdr->seq.fetch_add(1, std::memory_order_release); }
+    locker l;
+    shared_store *s;
+  };
+
+  static uint64_t hash_of(const std::string &key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key) {
+      hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+    return hash;
+  }
+
+  static size_t align(size_t n) { return (n + 7) & ~size_t(7); }
+
+  static uint32_t size_class(size_t n) {
+    uint32_t cls = 6;
+    while ((size_t(1) << cls) < n) {
+      cls++;
+    }
+    return cls;
+  }
+
+  entry *at(uint64_t off) {
+    return reinterpret_cast<entry *>(reinterpret_cast<char *>(hdr) + off);
+  }
+  uint64_t *buckets() {
+    return reinterpret_cast<uint64_t *>(reinterpret_cast<char *>(hdr) +
+                                        align(sizeof(header)));
+  }
+
+  void init(size_t size) {
+    memset(static_cast<void *>(hdr), 0, sizeof(header));
+    new (&hdr->magic) std::atomic<uint64_t>(0);
+    new (&hdr->seq) std::atomic<uint64_t>(0);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(&hdr->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    hdr->size = size;
+    // About one bucket per 256 bytes of data
+    uint64_t nbuckets = 64;
+    while (nbuckets * 2 * 256 <= size) {
+      nbuckets *= 2;
+    }
+    hdr->nbuckets = nbuckets;
+    hdr->heap = align(sizeof(header)) + nbuckets * sizeof(uint64_t);
+    init_table();
+  }
+
+  void init_table() {
+    memset(buckets(), 0, hdr->nbuckets * sizeof(uint64_t));
+    memset(hdr->free, 0, sizeof(hdr->free));
+    hdr->top = hdr->heap;
+    hdr->count = 0;
+    hdr->used = 0;
+  }
+
+  uint64_t allocate(uint32_t cls) {
+    if (cls >= CLASSES) {
+      return 0;
+    }
+    uint64_t off = hdr->free[cls];
+    if (off != 0) {
+      hdr->free[cls] = at(off)->next;
+      return off;
+    }
+    uint64_t size = uint64_t(1) << cls;
+    if (hdr->top + size > hdr->size) {
+      return 0;
+    }
+    off = hdr->top;
+    hdr->top += size;
+    return off;
+  }
+
+  // Returns the link to the entry of key, nullptr when there is none
+  uint64_t *locate(const std::string &key, uint64_t hash) {
+    uint64_t *link = buckets() + (hash & (hdr->nbuckets - 1));
+    while (*link != 0) {
+      entry *e = at(*link);
+      if (e->hash == hash && e->klen == key.size() &&
+          memcmp(e->data, key.data(), key.size()) == 0) {
+        return link;
+      }
+      link = &e->next;
+    }
+    return nullptr;
+  }
+
+  bool remove(const std::string &key, uint64_t hash) {
+    uint64_t *link = locate(key, hash);
+    if (link == nullptr) {
+      return false;
+    }
+    uint64_t off = *link;
+    entry *e = at(off);
+    *link = e->next;
+    e->next = hdr->free[e->cls];
+    hdr->free[e->cls] = off;
+    hdr->count--;
+    hdr->used -= uint64_t(1) << e->cls;
+    return true;
+  }
+
+  // May run concurrently with a writer, every offset and length is checked
+  // against the mapping before it is followed
+  bool lookup(const std::string &key, uint64_t hash, std::string *type,
+              std::string *value) {
+    uint64_t nbuckets = hdr->nbuckets;
+    uint64_t off = buckets()[hash & (nbuckets - 1)];
+    for (int steps = 0; off != 0 && steps < 1000000; steps++) {
+      if (off < hdr->heap || off + sizeof(entry) > mapped) {
+        return false;
+      }
+      entry *e = at(off);
+      uint64_t klen = e->klen;
+      uint64_t vlen = e->vlen;
+      if (off + offsetof(entry, data) + align(klen) + vlen > mapped) {
+        return false;
+      }
+      if (e->hash == hash && klen == key.size() &&
+          memcmp(e->data, key.data(), klen) == 0) {
+        type->assign(e->type, strnlen(e->type, sizeof(e->type)));
+        value->assign(e->data + align(klen), vlen);
+        return true;
+      }
+      off = e->next;
+    }
+    return false;
+  }
+
+  void load() {
+    FILE *f = fopen(snapshot.c_str(), "rb");
+    if (f == nullptr) {
+      return;
+    }
+    uint64_t magic = 0;
+    if (fread(&magic, sizeof(magic), 1, f) == 1 && magic == MAGIC) {
+      uint32_t klen, vlen;
+      char type[8];
+      std::string key, value;
+      while (fread(&klen, sizeof(klen), 1, f) == 1 &&
+             fread(&vlen, sizeof(vlen), 1, f) == 1 &&
+             fread(type, sizeof(type), 1, f) == 1) {
+        key.resize(klen);
+        value.resize(vlen);
+        if (fread(&key[0], 1, klen, f) != klen ||
+            fread(&value[0], 1, vlen, f) != vlen) {
+          break;
+        }
+        type[sizeof(type) - 1] = '\0';
+        try {
+          put(key, type, value.data(), vlen);
+        } catch (const std::bad_alloc &) {
+          break;
+        }
+      }
+    }
+    fclose(f);
+  }
+
+  header *hdr;
+  size_t mapped;
+};
+
+static std::string store_key(py::handle key) {
+  if (py::isinstance<py::bytes>(key)) {
+    return key.cast<std::string>();
+  }
+  return py::str(key);
+}
+#endif
+
+// Compacted copy of a typed buffer for storing elsewhere
+static std::vector<char> buffer_bytes(xatmibuf &buf, std::string &type) {
+  char type_[8];
+  char subtype[16];
+  if (tptypes(*buf.pp, type_, subtype) == -1) {
+    throw std::invalid_argument("Invalid buffer type");
+  }
+  type = type_;
+  if (type == "STRING") {
+    return std::vector<char>(*buf.pp, *buf.pp + strlen(*buf.pp) + 1);
+  } else if (type != "FML32") {
+    return std::vector<char>(*buf.pp, *buf.pp + buf.len);
+  }
+  FBFR32 *src = *buf.fbfr();
+  long n = std::min(Fused32(src), Fsizeof32(src));
+  for (;;) {
+    std::vector<char> bytes(n);
+    FBFR32 *dst = reinterpret_cast<FBFR32 *>(bytes.data());
+    if (Finit32(dst, n) != -1 && Fcpy32(dst, src) != -1) {
+      return bytes;
+    }
+    if (Ferror32 != FNOSPACE || n >= Fsizeof32(src)) {
+      throw fml32_exception(Ferror32);
+    }
+    n = std::min(n * 2, Fsizeof32(src));
+  }
+}
+
+// Replies of idempotent services kept by request content. Entries are
+// evicted by TTL and least recently used first when over the byte limit,
+// and cleared explicitly or when a subscribed event is posted.
+struct cached_service {
+  typedef std::chrono::steady_clock clock;
+  struct entry {
+    std::string key;
+    long rcode;
+    std::shared_ptr<xatmibuf> reply;
+    clock::time_point expires;
+    size_t bytes;
+  };
+
+  cached_service()
+      : ttl(0), max_bytes(0), bytes(0), hits(0), misses(0), expired(0),
+        evicted(0) {}
+
+  void clear() {
+    lru.clear();
+    index.clear();
+    bytes = 0;
+  }
+
+  std::shared_ptr<xatmibuf> get(const std::string &key, long *rcode) {
+    auto it = index.find(key);
+    if (it == index.end()) {
+      misses++;
+      return nullptr;
+    }
+    if (it->second->expires < clock::now()) {
+      expired++;
+      misses++;
+      erase(it->second);
+      return nullptr;
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    *rcode = it->second->rcode;
+    return it->second->reply;
+  }
+
+  void put(const std::string &key, long rcode,
+           std::shared_ptr<xatmibuf> reply) {
+    auto it = index.find(key);
+    if (it != index.end()) {
+      erase(it->second);
+    }
+    entry e;
+    e.key = key;
+    e.rcode = rcode;
+    e.reply = reply;
+    e.expires = clock::now() + std::chrono::duration_cast<clock::duration>(
+                                   std::chrono::duration<double>(ttl));
+    e.bytes = key.size() + reply->len;
+    if (e.bytes > max_bytes) {
+      return;
+    }
+    bytes += e.bytes;
+    lru.push_front(std::move(e));
+    index[key] = lru.begin();
+    while (bytes > max_bytes) {
+      evicted++;
+      erase(std::prev(lru.end()));
+    }
+  }
+
+  void erase(std::list<entry>::iterator it) {
+    bytes -= it->bytes;
+    index.erase(it->key);
+    lru.erase(it);
+  }
+
+  double ttl;
+  size_t max_bytes;
+  size_t bytes;
+  std::list<entry> lru;
+  std::unordered_map<std::string, std::list<entry>::iterator> index;
+  std::vector<long> subscriptions;
+
+  long long hits;
+  long long misses;
+  long long expired;
+  long long evicted;
+};
+
+#if !TUXEDO_WSC
+void PY(TPSVCINFO *svcinfo);
+#endif
+
+static std::mutex reply_cache_mutex;
+static std::map<std::string, cached_service> reply_cache;
+static std::atomic<int> reply_cache_size(0);
+// Event service names of this server process and the services they clear
+static std::map<std::string, std::string> cache_event_services;
+
+// Request content as cache key, field by field for FML32 so that the
+// buffer size and layout do not matter
+static void cache_key(FBFR32 *fbfr, std::string &key) {
+  FLDID32 fieldid = FIRSTFLDID;
+  FLDOCC32 oc = 0;
+  for (;;) {
+    int r = Fnext32(fbfr, &fieldid, &oc, nullptr, nullptr);
+    if (r == -1) {
+      throw fml32_exception(Ferror32);
+    } else if (r == 0) {
+      break;
+    }
+    FLDLEN32 len;
+    char *value = Ffind32(fbfr, fieldid, oc, &len);
+    if (value == nullptr) {
+      throw fml32_exception(Ferror32);
+    }
+    key.append(reinterpret_cast<char *>(&fieldid), sizeof(fieldid));
+    if (Fldtype32(fieldid) == FLD_FML32) {
+      key += '{';
+      cache_key(reinterpret_cast<FBFR32 *>(value), key);
+      key += '}';
+    } else {
+      key.append(reinterpret_cast<char *>(&len), sizeof(len));
+      key.append(value, len);
+    }
+  }
+}
+
+static bool cache_key(xatmibuf &in, std::string &key) {
+  char type[8];
+  char subtype[16];
+  if (tptypes(*in.pp, type, subtype) == -1) {
+    return false;
+  }
+  key = type;
+  key += '\0';
+  if (strcmp(type, "STRING") == 0) {
+    key += *in.pp;
+  } else if (strcmp(type, "CARRAY") == 0 || strcmp(type, "X_OCTET") == 0) {
+    key.append(*in.pp, in.len);
+  } else if (strcmp(type, "FML32") == 0) {
+    cache_key(*in.fbfr(), key);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void cache_invalidate(const std::string &svc) {
+  std::lock_guard<std::mutex> lock(reply_cache_mutex);
+  auto it = reply_cache.find(svc);
+  if (it != reply_cache.end()) {
+    it->second.clear();
+  }
+}
+
+// Called with reply_cache_mutex held
+static void cache_clear_subscribed() {
+  for (auto &it : reply_cache) {
+    if (!it.second.subscriptions.empty()) {
+      it.second.clear();
+    }
+  }
+}
+
+// Handler of unsolicited messages the application had set before
+static decltype(tpsetunsol(nullptr)) cache_prev_unsol = nullptr;
+
+// Clients receive events as unsolicited messages without the event name,
+// all services with event subscriptions are cleared
+static void cache_unsol(char *data, long len, long flags) {
+  {
+    std::lock_guard<std::mutex> lock(reply_cache_mutex);
+    cache_clear_subscribed();
+  }
+  if (cache_prev_unsol != nullptr
+#ifdef TPUNSOLERR
+      && cache_prev_unsol != TPUNSOLERR
+#endif
+  ) {
+    cache_prev_unsol(data, len, flags);
+  }
+}
+
+// Subscriptions are made without holding the lock, Tuxedo may deliver
+// unsolicited messages from within any call
+static long cache_subscribe(const std::string &svc, const std::string &event) {
+  static std::atomic<int> seq(0);
+  long handle;
+#if !TUXEDO_WSC
+  if (server.ptr() != nullptr) {
+    std::string name =
+        ".PYC" + std::to_string(getpid()) + "_" + std::to_string(seq++);
+    {
+      std::lock_guard<std::mutex> lock(reply_cache_mutex);
+      cache_event_services[name] = svc;
+    }
+#if defined(TPSINGLETON) && defined(TPSECONDARYRQ)
+    int rc = tpadvertisex(const_cast<char *>(name.c_str()), PY, TPSECONDARYRQ);
+#else
+    int rc = tpadvertise(const_cast<char *>(name.c_str()), PY);
+#endif
+    if (rc == -1) {
+      throw xatmi_exception(tperrno);
+    }
+    TPEVCTL ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.flags = TPEVSERVICE;
+    strncpy(ctl.name1, name.c_str(), sizeof(ctl.name1) - 1);
+    handle = tpsubscribe(const_cast<char *>(event.c_str()), nullptr, &ctl, 0);
+  } else
+#endif
+  {
+    static std::once_flag unsol;
+    std::call_once(unsol,
+                   []() { cache_prev_unsol = tpsetunsol(cache_unsol); });
+    handle = tpsubscribe(const_cast<char *>(event.c_str()), nullptr, nullptr,
+                         0);
+  }
+  if (handle == -1) {
+    throw xatmi_exception(tperrno);
+  }
+  return handle;
+}
+
+static void cache_configure(const std::string &svc, double ttl,
+                            size_t max_bytes,
+                            const std::vector<std::string> &events) {
+  with_context();
+  std::vector<long> subscriptions;
+  {
+    std::lock_guard<std::mutex> lock(reply_cache_mutex);
+    auto it = reply_cache.find(svc);
+    if (it != reply_cache.end()) {
+      subscriptions.swap(it->second.subscriptions);
+      reply_cache.erase(it);
+      reply_cache_size--;
+    }
+  }
+  for (auto handle : subscriptions) {
+    tpunsubscribe(handle, 0);
+  }
+  if (ttl <= 0) {
+    return;
+  }
+
+  subscriptions.clear();
+  for (auto &event : events) {
+    subscriptions.push_back(cache_subscribe(svc, event));
+  }
+  std::lock_guard<std::mutex> lock(reply_cache_mutex);
+  if (reply_cache.count(svc) == 0) {
+    reply_cache_size++;
+  }
+  auto &c = reply_cache[svc];
+  c.ttl = ttl;
+  c.max_bytes = max_bytes;
+  c.subscriptions = subscriptions;
+}
+
+static pytpreply cached_reply(long rcode, std::shared_ptr<xatmibuf> reply,
+                              py::object decode, int rval = 0) {
+  if (decode.is_none()) {
+    pytpreply r(rval, rcode, py::none());
+    r.raw = reply;
+    return r;
+  }
+  auto copy = pybuffer(xatmibuf(reply->pp, reply->len)).copy();
+  return pytpreply(rval, rcode, decode_reply(copy, decode, rval));
+}
+
+// Buffers of a compressed service over its threshold travel compressed with
+// zlib. The buffer is tpexport()ed first so it survives a change of
+// architecture; FML32 is sent as a single CARRAY field, CARRAY and X_OCTET
+// as data starting with compress_magic. Receivers unpack them once they have
+// called compress() themselves.
+#define TPCOMPRESS 0x40000000
+
+struct compress_config {
+  long threshold;
+  int level;
+};
+
+static const char compress_magic[8] = {'\x89', 'P', 'Y', 'Z',
+                                       '\r',   '\n', '\x1a', '\n'};
+static const long compress_header = sizeof(compress_magic) + 4;
+
+static std::mutex compress_mutex;
+static std::map<std::string, compress_config> compressed;
+static std::atomic<int> compressed_size(0);
+static std::atomic<FLDID32> compress_field(BADFLDID);
+// Largest buffer unpacked, the original size comes from the sender
+static std::atomic<long> compress_max_size(256 * 1024 * 1024);
+static std::atomic<long long> compress_packed(0), compress_skipped(0),
+    compress_unpacked(0), compress_bytes_in(0), compress_bytes_out(0);
+
+static void compress_set_field(const char *name) {
+  FLDID32 fieldid = Fldid32(const_cast<char *>(name));
+  if (fieldid == BADFLDID) {
+    throw fml32_exception(Ferror32);
+  }
+  if (Fldtype32(fieldid) != FLD_CARRAY) {
+    throw std::invalid_argument(std::string(name) +
+                                " must be a carray field");
+  }
+  compress_field = fieldid;
+}
+
+// Returns false when requests to svc are sent as they are
+static bool compress_settings(const char *svc, long flags,
+                              compress_config &c) {
+  c.threshold = 0;
+  c.level = 1;
+  bool found = false;
+  if (compressed_size > 0) {
+    std::lock_guard<std::mutex> lock(compress_mutex);
+    auto it = compressed.find(svc);
+    if (it != compressed.end()) {
+      c = it->second;
+      found = true;
+    }
+  }
+  if (flags & TPCOMPRESS) {
+    c.threshold = 0;
+    return true;
+  }
+  return found;
+}
+
+// Puts the compressed form of buf in out, the GIL should be released. Small
+// buffers, other buffer types and data that does not shrink are left alone
+static bool compress_buffer(xatmibuf &buf, const compress_config &c,
+                            xatmibuf &out) {
+#if TUXEDO_ZLIB
+  char type[8];
+  char subtype[16];
+  if (*buf.pp == nullptr || tptypes(*buf.pp, type, subtype) == -1) {
+    return false;
+  }
+  bool fml32 = strcmp(type, "FML32") == 0;
+  if (!fml32 && strcmp(type, "CARRAY") != 0 && strcmp(type, "X_OCTET") != 0) {
+    return false;
+  }
+  long size = fml32 ? Fused32(*buf.fbfr()) : buf.len;
+  if (size < c.threshold || size <= compress_header) {
+    return false;
+  }
+  if (fml32 && compress_field == BADFLDID) {
+    compress_set_field("PYZ");
+  }
+
+  std::vector<char> exported(size + 512);
+  long elen = exported.size();
+  if (tpexport(*buf.pp, buf.len, &exported[0], &elen, 0) == -1) {
+    if (tperrno != TPELIMIT) {
+      throw xatmi_exception(tperrno);
+    }
+    exported.resize(elen);
+    if (tpexport(*buf.pp, buf.len, &exported[0], &elen, 0) == -1) {
+      throw xatmi_exception(tperrno);
+    }
+  }
+
+  uLongf zlen = compressBound(elen);
+  std::vector<char> packed(compress_header + zlen);
+  memcpy(&packed[0], compress_magic, sizeof(compress_magic));
+  for (int i = 0; i < 4; i++) {
+    packed[sizeof(compress_magic) + i] =
+        static_cast<char>((static_cast<uint32_t>(elen) >> (24 - 8 * i)) & 0xff);
+  }
+  if (compress2(reinterpret_cast<Bytef *>(&packed[compress_header]), &zlen,
+                reinterpret_cast<const Bytef *>(&exported[0]), elen,
+                c.level) != Z_OK) {
+    throw std::runtime_error("Compression failed");
+  }
+  long plen = compress_header + zlen;
+  if (plen >= size) {
+    compress_skipped++;
+    return false;
+  }
+
+  if (fml32) {
+    out = xatmibuf("FML32", plen + 256);
+    FLDID32 field = compress_field;
+    out.mutate([&](FBFR32 *fbfr) {
+      return Fchg32(fbfr, field, 0, &packed[0], plen);
+    });
+  } else {
+    out = xatmibuf(type, plen);
+    memcpy(*out.pp, &packed[0], plen);
+  }
+  compress_packed++;
+  compress_bytes_in += size;
+  compress_bytes_out += plen;
+  return true;
+#else
+  if (c.threshold == 0) {
+    throw std::runtime_error("Built without zlib, compression not available");
+  }
+  return false;
+#endif
+}
+
+// Puts the original of a compressed buffer in out, the GIL should be
+// released
+static bool decompress_buffer(char *data, long len, xatmibuf &out) {
+#if TUXEDO_ZLIB
+  char type[8];
+  char subtype[16];
+  FLDID32 field = compress_field;
+  if (field == BADFLDID || data == nullptr ||
+      tptypes(data, type, subtype) == -1) {
+    return false;
+  }
+  char *packed;
+  FLDLEN32 plen;
+  if (strcmp(type, "FML32") == 0) {
+    packed = Ffind32(reinterpret_cast<FBFR32 *>(data), field, 0, &plen);
+    if (packed == nullptr) {
+      return false;
+    }
+  } else if (strcmp(type, "CARRAY") == 0 || strcmp(type, "X_OCTET") == 0) {
+    packed = data;
+    plen = len;
+  } else {
+    return false;
+  }
+  if (static_cast<long>(plen) <= compress_header ||
+      memcmp(packed, compress_magic, sizeof(compress_magic)) != 0) {
+    return false;
+  }
+
+  uLongf elen = 0;
+  for (int i = 0; i < 4; i++) {
+    elen = (elen << 8) |
+           static_cast<unsigned char>(packed[sizeof(compress_magic) + i]);
+  }
+  // zlib does not shrink data more than 1032 times
+  if (elen > static_cast<uLongf>(compress_max_size.load()) ||
+      elen / 1032 > static_cast<uLongf>(plen)) {
+    throw std::runtime_error("Compressed buffer too large");
+  }
+  std::vector<char> exported(elen);
+  uLongf n = elen;
+  if (uncompress(reinterpret_cast<Bytef *>(&exported[0]), &n,
+                 reinterpret_cast<const Bytef *>(packed + compress_header),
+                 plen - compress_header) != Z_OK ||
+      n != elen) {
+    throw std::runtime_error("Corrupt compressed buffer");
+  }
+  out = xatmibuf("FML32", elen);
+  long olen = 0;
+  if (tpimport(&exported[0], elen, out.pp, &olen, 0) == -1) {
+    throw xatmi_exception(tperrno);
+  }
+  out.len = olen;
+  compress_unpacked++;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Without the GIL
+static void compress_request(const char *svc, xatmibuf &in, long flags) {
+  compress_config c;
+  xatmibuf packed;
+  if (compress_settings(svc, flags, c) && compress_buffer(in, c, packed)) {
+    in = std::move(packed);
+  }
+}
+
+static void decompress_reply(xatmibuf &out) {
+  if (compress_field == BADFLDID) {
+    return;
+  }
+  xatmibuf unpacked;
+  if (decompress_buffer(*out.pp, out.len, unpacked)) {
+    out = std::move(unpacked);
+  }
+}
+
+// Absolute deadlines of requests travel in an FML32 field as milliseconds
+// since the epoch, so clocks of the machines should be in sync. Services
+// fail requests past their deadline before decoding them and calls made
+// while serving one get what is left of it.
+static std::atomic<FLDID32> deadline_field(BADFLDID);
+static std::atomic<long> deadline_rcode(0);
+static std::atomic<long long> deadline_stamped(0), deadline_dropped(0);
+// Deadline of the request being served and of the next call
+static thread_local double deadline_current = 0;
+static thread_local double deadline_next = 0;
+
+static double deadline_now() {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+static void deadline_set_field(const char *name) {
+  FLDID32 fieldid = Fldid32(const_cast<char *>(name));
+  if (fieldid == BADFLDID) {
+    throw fml32_exception(Ferror32);
+  }
+  if (Fldtype32(fieldid) != FLD_DOUBLE && Fldtype32(fieldid) != FLD_LONG) {
+    throw std::invalid_argument(std::string(name) +
+                                " must be a double or long field");
+  }
+  deadline_field = fieldid;
+}
+
+// Block time of the next call in milliseconds, 0 for the configured one
+static long next_blocktime() {
+#if defined(TPBLK_MILLISECOND)
+  long ms = tpgblktime(TPBLK_MILLISECOND | TPBLK_NEXT);
+  if (ms <= 0) {
+    ms = tpgblktime(TPBLK_MILLISECOND | TPBLK_ALL);
+  }
+#else
+  long ms = tpgblktime(TPBLK_SECOND | TPBLK_NEXT) * 1000L;
+  if (ms <= 0) {
+    ms = tpgblktime(TPBLK_SECOND | TPBLK_ALL) * 1000L;
+  }
+#endif
+  return ms > 0 ? ms : 0;
+}
+
+// Keeps a shorter block time the application set for the next call
+static void set_next_blocktime(long ms) {
+#if defined(TPBLK_MILLISECOND)
+  long next = tpgblktime(TPBLK_MILLISECOND | TPBLK_NEXT);
+  if (next > 0 && next < ms) {
+    ms = next;
+  }
+  tpsblktime(ms, TPBLK_MILLISECOND | TPBLK_NEXT);
+#else
+  long next = tpgblktime(TPBLK_SECOND | TPBLK_NEXT);
+  ms = (ms + 999) / 1000;
+  if (next > 0 && next < ms) {
+    ms = next;
+  }
+  tpsblktime(ms, TPBLK_SECOND | TPBLK_NEXT);
+#endif
+}
+
+static void deadline_inject(xatmibuf &buf, double deadline) {
+  char type[8];
+  char subtype[16];
+  if (*buf.pp == nullptr || tptypes(*buf.pp, type, subtype) == -1 ||
+      strcmp(type, "FML32") != 0) {
+    return;
+  }
+  if (deadline_field == BADFLDID) {
+    deadline_set_field("PYDEADLINE");
+  }
+  FLDID32 field = deadline_field;
+  buf.mutate([&](FBFR32 *fbfr) {
+    return CFchg32(fbfr, field, 0, reinterpret_cast<char *>(&deadline), 0,
+                   FLD_DOUBLE);
+  });
+  deadline_stamped++;
+}
+
+// The earlier of the next call's and the current request's deadline
+static double deadline_effective() {
+  double deadline = deadline_next;
+  if (deadline_current > 0 && (deadline == 0 || deadline_current < deadline)) {
+    deadline = deadline_current;
+  }
+  return deadline;
+}
+
+// Stamps the effective deadline into the request, returns milliseconds left
+// or 0 without a deadline
+static long deadline_client(xatmibuf &in) {
+  double deadline = deadline_effective();
+  deadline_next = 0;
+  if (deadline == 0) {
+    return 0;
+  }
+  double left = deadline - deadline_now();
+  if (left < 1) {
+    throw xatmi_exception(TPETIME);
+  }
+  unshare(in);
+  deadline_inject(in, deadline);
+  return static_cast<long>(std::ceil(left));
+}
+
+#if !TUXEDO_WSC
+// Returns false when the request is already past its deadline
+static bool deadline_server_start(TPSVCINFO *svcinfo) {
+  char type[8];
+  char subtype[16];
+  if (svcinfo->data == nullptr ||
+      tptypes(svcinfo->data, type, subtype) == -1 ||
+      strcmp(type, "FML32") != 0) {
+    return true;
+  }
+  double deadline;
+  if (CFget32(reinterpret_cast<FBFR32 *>(svcinfo->data), deadline_field, 0,
+              reinterpret_cast<char *>(&deadline), nullptr,
+              FLD_DOUBLE) == -1) {
+    return true;
+  }
+  if (deadline <= deadline_now()) {
+    deadline_dropped++;
+    return false;
+  }
+  deadline_current = deadline;
+  return true;
+}
+#endif
+
+// Concurrent tpcall()s of a coalesced service with the same request share
+// one call: the first one calls the service and the others wait for its
+// reply, which each of them converts when it is used. Only replies and
+// TPESVCERR are shared, when the first call fails on its own (its deadline,
+// block time or a local error) the others call the service themselves.
+static const int FLIGHT_RETRY = -1;
+
+struct flight {
+  flight() : done(false), err(0), rval(0), rcode(0) {}
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done;
+  int err;
+  int rval;
+  long rcode;
+  std::shared_ptr<xatmibuf> reply;
+};
+
+struct coalesce_counters {
+  coalesce_counters() : calls(0), shared(0) {}
+  long long calls;
+  long long shared;
+};
+
+static std::mutex flights_mutex;
+static std::map<std::string, coalesce_counters> coalesced;
+static std::unordered_map<std::string, std::shared_ptr<flight>> flights;
+static std::atomic<int> coalesced_size(0);
+
+static void land(const std::string &key, std::shared_ptr<flight> f, int err,
+                 int rval, long rcode, std::shared_ptr<xatmibuf> reply) {
+  {
+    std::lock_guard<std::mutex> lock(flights_mutex);
+    auto it = flights.find(key);
+    if (it != flights.end() && it->second == f) {
+      flights.erase(it);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(f->mutex);
+    f->err = err;
+    f->rval = rval;
+    f->rcode = rcode;
+    f->reply = reply;
+    f->done = true;
+  }
+  f->cv.notify_all();
+}
+
+static pytpreply pytpcall_buf(const char *svc, xatmibuf &in, long flags,
+                              py::object decode = py::none()) {
+  std::string key;
+  if (reply_cache_size > 0) {
+    bool cached;
+    {
+      std::lock_guard<std::mutex> lock(reply_cache_mutex);
+      cached = reply_cache.count(svc) != 0;
+    }
+    if (cached && cache_key(in, key)) {
+      long rcode;
+      std::shared_ptr<xatmibuf> reply;
+      {
+        std::lock_guard<std::mutex> lock(reply_cache_mutex);
+        auto it = reply_cache.find(svc);
+        if (it != reply_cache.end()) {
+          reply = it->second.get(key, &rcode);
+        }
+      }
+      if (reply) {
+        return cached_reply(rcode, reply, decode);
+      }
+    }
+  }
+
+  std::string fkey;
+  std::shared_ptr<flight> leader;
+  if (coalesced_size > 0 && !(flags & TPNOREPLY) &&
+      ((flags & TPNOTRAN) || tpgetlev() <= 0)) {
+    std::shared_ptr<flight> f;
+    bool enabled;
+    {
+      std::lock_guard<std::mutex> lock(flights_mutex);
+      enabled = coalesced.count(svc) != 0;
+    }
+    if (enabled && (!key.empty() || cache_key(in, fkey))) {
+      fkey = std::string(svc) + '\0' + (key.empty() ? fkey : key);
+      std::lock_guard<std::mutex> lock(flights_mutex);
+      auto it = coalesced.find(svc);
+      if (it != coalesced.end()) {
+        it->second.calls++;
+        auto &slot = flights[fkey];
+        if (slot) {
+          it->second.shared++;
+          f = slot;
+        } else {
+          slot = leader = std::make_shared<flight>();
+        }
+      }
+    }
+    if (f) {
+      // Waits no longer than the call itself could take
+      long wait_ms = 0;
+      double deadline = deadline_effective();
+      if (deadline > 0) {
+        wait_ms = static_cast<long>(std::ceil(deadline - deadline_now()));
+        if (wait_ms < 1) {
+          throw xatmi_exception(TPETIME);
+        }
+      }
+      long blocktime = (flags & TPNOTIME) ? 0 : next_blocktime();
+      if (blocktime > 0 && (wait_ms == 0 || blocktime < wait_ms)) {
+        wait_ms = blocktime;
+      }
+      bool landed = true;
+      {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(f->mutex);
+        if (wait_ms > 0) {
+          landed = f->cv.wait_until(
+              lock,
+              std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(wait_ms),
+              [&] { return f->done; });
+        } else {
+          f->cv.wait(lock, [&] { return f->done; });
+        }
+      }
+      if (!landed) {
+        throw xatmi_exception(TPETIME);
+      }
+      if (f->err == 0) {
+        return cached_reply(f->rcode, f->reply, decode, f->rval);
+      } else if (f->err != FLIGHT_RETRY) {
+        throw xatmi_exception(f->err);
+      }
+    }
+  }
+
+  xatmibuf out;
+  int rc;
+  try {
+    long budget = deadline_client(in);
+    trace_span span;
+    bool traced = trace_client(span, svc, in);
+    out = reply_buffer(svc);
+    char *allocated = *out.pp;
+    long size = out.len;
+    py::gil_scoped_release release;
+    if (budget > 0) {
+      set_next_blocktime(budget);
+    }
+    rc = tpcall(const_cast<char *>(svc), *in.pp, in.len, out.pp, &out.len,
+                flags);
+    if (traced) {
+      trace_end(span, rc == -1);
+    }
+    if (rc == -1) {
+      if (tperrno != TPESVCFAIL) {
+        throw xatmi_exception(tperrno);
+      }
+    }
+    reply_received(svc, out, allocated, size);
+    decompress_reply(out);
+  } catch (const xatmi_exception &e) {
+    if (leader) {
+      land(fkey, leader, e.code() == TPESVCERR ? TPESVCERR : FLIGHT_RETRY, 0,
+           0, nullptr);
+    }
+    throw;
+  } catch (...) {
+    if (leader) {
+      land(fkey, leader, FLIGHT_RETRY, 0, 0, nullptr);
+    }
+    throw;
+  }
+  if ((!key.empty() && rc != -1) || leader) {
+    int rval = rc == -1 ? TPESVCFAIL : 0;
+    long rcode = tpurcode;
+    auto reply = std::make_shared<xatmibuf>(std::move(out));
+    if (!key.empty() && rc != -1) {
+      std::lock_guard<std::mutex> lock(reply_cache_mutex);
+      auto it = reply_cache.find(svc);
+      if (it != reply_cache.end()) {
+        it->second.put(key, rcode, reply);
+      }
+    }
+    if (leader) {
+      land(fkey, leader, 0, rval, rcode, reply);
+    }
+    return cached_reply(rcode, reply, decode, rval);
+  }
+  if (decode.is_none()) {
+    return pytpreply(tperrno, tpurcode, out);
+  }
+  int rval = tperrno;
+  long rcode = tpurcode;
+  return pytpreply(rval, rcode, decode_reply(out, decode, rval));
+}
+
+// Replies to other requests received while waiting with TPGETANY, returned
+// by a later tpgetrply()
+struct stashed_reply {
+  int err;
+  int rval;
+  long rcode;
+  xatmibuf out;
+};
+static thread_local std::map<int, std::unique_ptr<stashed_reply>>
+    stashed_replies;
+
+struct hedge_counters {
+  hedge_counters() : calls(0), fired(0), won(0) {}
+  long long calls;
+  long long fired;
+  long long won;
+};
+static std::mutex hedge_mutex;
+static std::map<std::string, hedge_counters> hedge_stats;
+
+// Sends a duplicate request when there is no reply after hedge_after_ms and
+// returns whichever reply comes first, the other request is cancelled. Only
+// for idempotent services and outside of transactions.
+static pytpreply pytpcall_hedged(const char *svc, xatmibuf &in, long flags,
+                                 py::object decode, long hedge_after_ms,
+                                 const char *hedge_svc) {
+  if (flags & TPNOREPLY) {
+    throw std::invalid_argument("Hedged calls need a reply");
+  }
+  if (!(flags & TPNOTRAN) && tpgetlev() > 0) {
+    throw std::invalid_argument(
+        "Hedged calls can't be part of a transaction, use TPNOTRAN");
+  }
+  const char *svc2 = hedge_svc != nullptr ? hedge_svc : svc;
+  long rflags = flags & (TPNOCHANGE | TPNOBLOCK | TPNOTIME | TPSIGRSTRT);
+
+  // The block time is used for the hedge delay, the whole call still ends
+  // within the caller's deadline or block time
+  long limit = deadline_client(in);
+  long blocktime = (flags & TPNOTIME) ? 0 : next_blocktime();
+  if (blocktime > 0 && (limit == 0 || blocktime < limit)) {
+    limit = blocktime;
+  }
+  typedef std::chrono::steady_clock clock;
+  auto end = clock::now() + std::chrono::milliseconds(limit);
+  // Sets the block time of the next tpgetrply(), false when none is left
+  auto wait_left = [&]() {
+    if (limit == 0) {
+      return true;
+    }
+    long left = static_cast<long>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(end -
+                                                              clock::now())
+            .count());
+    if (left < 1) {
+      return false;
+    }
+    set_next_blocktime(left);
+    return true;
+  };
+  trace_span span;
+  bool traced = trace_client(span, svc, in);
+  xatmibuf out = reply_buffer(svc);
+  char *allocated = *out.pp;
+  long size = out.len;
+  bool fired = false;
+  int cd1, cd2 = -1, cd, rc, err;
+  {
+    py::gil_scoped_release release;
+    cd1 = tpacall(const_cast<char *>(svc), *in.pp, in.len, flags);
+    if (cd1 == -1) {
+      if (traced) {
+        trace_end(span, true);
+      }
+      throw xatmi_exception(tperrno);
+    }
+    bool hedge = limit == 0 || hedge_after_ms < limit;
+    set_next_blocktime(hedge ? hedge_after_ms : limit);
+    cd = cd1;
+    rc = tpgetrply(&cd, out.pp, &out.len, rflags);
+    err = rc == -1 && tperrno != TPESVCFAIL ? tperrno : 0;
+
+    if (err == TPETIME && !hedge) {
+      tpcancel(cd1);
+    } else if (err == TPETIME &&
+               (cd2 = tpacall(const_cast<char *>(svc2), *in.pp, in.len,
+                              flags)) != -1) {
+      fired = true;
+      for (;;) {
+        if (wait_left()) {
+          rc = tpgetrply(&cd, out.pp, &out.len, rflags | TPGETANY);
+          err = rc == -1 && tperrno != TPESVCFAIL ? tperrno : 0;
+        } else {
+          rc = -1;
+          err = TPETIME;
+        }
+        if (err == TPETIME || err == TPEBLOCK || err == TPGOTSIG ||
+            err == TPEINVAL || err == TPEPROTO || err == TPESYSTEM ||
+            err == TPEOS) {
+          // No reply at all
+          tpcancel(cd1);
+          tpcancel(cd2);
+          break;
+        }
+        if (cd != cd1 && cd != cd2) {
+          std::unique_ptr<stashed_reply> r(new stashed_reply());
+          r->err = err;
+          r->rval = rc == -1 ? tperrno : 0;
+          r->rcode = tpurcode;
+          decompress_reply(out);
+          r->out = std::move(out);
+          stashed_replies[cd] = std::move(r);
+          out = reply_buffer(svc);
+          allocated = *out.pp;
+          size = out.len;
+          continue;
+        }
+        int other = cd == cd1 ? cd2 : cd1;
+        if (err != 0) {
+          // The other one may still succeed
+          cd = other;
+          if (wait_left()) {
+            rc = tpgetrply(&cd, out.pp, &out.len, rflags);
+            err = rc == -1 && tperrno != TPESVCFAIL ? tperrno : 0;
+          } else {
+            tpcancel(other);
+            rc = -1;
+            err = TPETIME;
+          }
+        } else {
+          tpcancel(other);
+        }
+        break;
+      }
+    } else if (err == TPETIME) {
+      // Could not send the duplicate, keep waiting for the first one
+      cd = cd1;
+      if (wait_left()) {
+        rc = tpgetrply(&cd, out.pp, &out.len, rflags);
+        err = rc == -1 && tperrno != TPESVCFAIL ? tperrno : 0;
+      } else {
+        tpcancel(cd1);
+      }
+    }
+    if (err == 0) {
+      reply_received(cd == cd2 ? svc2 : svc, out, allocated, size);
+      decompress_reply(out);
+    }
+    if (traced) {
+      trace_end(span, err != 0 || rc == -1);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(hedge_mutex);
+    auto &c = hedge_stats[svc];
+    c.calls++;
+    if (fired) {
+      c.fired++;
+      if (err == 0 && cd == cd2) {
+        c.won++;
+      }
+    }
+  }
+  if (err != 0) {
+    throw xatmi_exception(err);
+  }
+  int rval = rc == -1 ? TPESVCFAIL : 0;
+  long rcode = tpurcode;
+  if (decode.is_none()) {
+    return pytpreply(rval, rcode, out);
+  }
+  return pytpreply(rval, rcode, decode_reply(out, decode, rval));
+}
+
+static pytpreply pytpcall(const char *svc, py::object idata, long flags,
+                          py::object decode, long hedge_after_ms,
+                          const char *hedge_svc, long deadline_ms) {
+  with_context();
+  alloc_scope scope(alloc_tpcall);
+  // Cleared when the call does not reach Tuxedo
+  struct deadline_guard {
+    ~deadline_guard() { deadline_next = 0; }
+  } deadline_clear;
+  if (deadline_ms > 0) {
+    deadline_next = deadline_now() + deadline_ms;
+  }
+  auto in = from_py(idata);
+  if (compressed_size > 0 || (flags & TPCOMPRESS)) {
+    py::gil_scoped_release release;
+    compress_request(svc, in, flags);
+  }
+  flags &= ~TPCOMPRESS;
+  if (hedge_after_ms > 0) {
+    return pytpcall_hedged(svc, in, flags, decode, hedge_after_ms, hedge_svc);
+  }
+  return pytpcall_buf(svc, in, flags, decode);
+}
+
+// Request and reply stay in C++, the GIL is released for the whole call
+static pytpreply pytpcall_json(const char *svc, py::bytes idata, long flags,
+                               bool flat) {
+  with_context();
+  alloc_scope scope(alloc_tpcall);
+  const char *s = PyBytes_AsString(idata.ptr());
+  size_t n = PyBytes_Size(idata.ptr());
+  std::string result;
+  int rval;
+  long rcode;
+  {
+    py::gil_scoped_release release;
+    xatmibuf in = json_to_fml(s, n);
+    compress_request(svc, in, flags);
+    flags &= ~TPCOMPRESS;
+    long budget = deadline_client(in);
+    trace_span span;
+    bool traced = trace_client(span, svc, in);
+    xatmibuf out = reply_buffer(svc);
+    char *allocated = *out.pp;
+    long size = out.len;
+    if (budget > 0) {
+      set_next_blocktime(budget);
+    }
+    int rc = tpcall(const_cast<char *>(svc), *in.pp, in.len, out.pp, &out.len,
+                    flags);
+    if (traced) {
+      trace_end(span, rc == -1);
+    }
+    if (rc == -1) {
+      if (tperrno != TPESVCFAIL) {
+        throw xatmi_exception(tperrno);
+      }
+    }
+    rval = tperrno;
+    rcode = tpurcode;
+    reply_received(svc, out, allocated, size);
+    decompress_reply(out);
+
+    require_fml32(out);
+    fml_to_json(result, *out.fbfr(), flat);
+  }
+  return pytpreply(rval, rcode, py::bytes(result));
+}
+
+static TPQCTL pytpenqueue(const char *qspace, const char *qname, TPQCTL *ctl,
+                          py::object data, long flags) {
+  with_context();
+  alloc_scope scope(alloc_tpenqueue);
+  auto in = from_py(data);
+  {
+    py::gil_scoped_release release;
+    int rc = tpenqueue(const_cast<char *>(qspace), const_cast<char *>(qname),
+                       ctl, *in.pp, in.len, flags);
+    if (rc == -1) {
+      if (tperrno == TPEDIAGNOSTIC) {
+        throw qm_exception(ctl->diagnostic);
+      }
+      throw xatmi_exception(tperrno);
+    }
+  }
+  return *ctl;
+}
+
+static std::pair<TPQCTL, py::object> pytpdequeue(const char *qspace,
+                                                 const char *qname, TPQCTL *ctl,
+                                                 long flags) {
+  with_context();
+  alloc_scope scope(alloc_tpdequeue);
+  xatmibuf out("FML32", 1024);
+  {
+    py::gil_scoped_release release;
+    int rc = tpdequeue(const_cast<char *>(qspace), const_cast<char *>(qname),
+                       ctl, out.pp, &out.len, flags);
+    if (rc == -1) {
+      if (tperrno == TPEDIAGNOSTIC) {
+        throw qm_exception(ctl->diagnostic);
+      }
+      throw xatmi_exception(tperrno);
+    }
+  }
+  return std::make_pair(*ctl, to_py(out));
+}
+
+static void without_context() {
+#if !TUXEDO_WSC
+  if (server.ptr() != nullptr) {
+    thread_context.reset();
+    tpappthrterm();
+    return;
+  }
+#endif
+  thread_context.reset();
+  tpterm();
+}
+
+struct queue_consumer;
+static std::mutex consumers_mutex;
+static std::set<queue_consumer *> consumers;
+
+// Dequeues messages on native threads, each with its own context, and hands
+// them to a Python handler. A handler that raises an exception or returns
+// False fails the message: it is moved to the failure queue when one is
+// known, otherwise the transaction is rolled back. Without transactions
+// one more thread dequeues up to max_in_flight messages ahead of the
+// handlers. Each thread keeps the consumer alive, so a handler may stop it
+// or drop the last reference.
+struct queue_consumer : std::enable_shared_from_this<queue_consumer> {
+  typedef std::chrono::steady_clock clock;
+
+  queue_consumer(const std::string &qspace_, const std::string &qname_,
+                 py::object handler_, int max_in_flight, bool prefetch_,
+                 bool transactional_, unsigned long timeout_,
+                 const char *failurequeue_)
+      : qspace(qspace_),
+        qname(qname_),
+        failurequeue(failurequeue_ == nullptr ? "" : failurequeue_),
+        handler(handler_),
+        prefetch(prefetch_),
+        transactional(transactional_),
+        timeout(timeout_),
+        permits(max_in_flight),
+        stopping(false),
+        stopped(false),
+        started(clock::now()),
+        dequeued(0),
+        succeeded(0),
+        failed(0),
+        rerouted(0),
+        aborted(0),
+        errors(0),
+        lag_total(0),
+        lag_max(0),
+        handler_total(0) {}
+
+  // Deleted with the GIL held as the handler is a Python object
+  static std::shared_ptr<queue_consumer> start(
+      const std::string &qspace, const std::string &qname, py::object handler,
+      int threads, int max_in_flight, bool transactional,
+      unsigned long timeout, const char *failurequeue) {
+    if (threads < 1) {
+      throw std::invalid_argument("threads must be positive");
+    }
+    if (transactional && max_in_flight > threads) {
+      throw std::invalid_argument(
+          "max_in_flight above threads needs transactional=False");
+    }
+    bool prefetch = max_in_flight > threads;
+    std::shared_ptr<queue_consumer> c(
+        new queue_consumer(qspace, qname, handler,
+                           max_in_flight > 0 ? max_in_flight : threads,
+                           prefetch, transactional, timeout, failurequeue),
+        [](queue_consumer *p) {
+          py::gil_scoped_acquire acquire;
+          delete p;
+        });
+    {
+      std::lock_guard<std::mutex> lock(consumers_mutex);
+      consumers.insert(c.get());
+    }
+    for (int i = 0; i < threads; i++) {
+      c->workers.emplace_back(&queue_consumer::run, c);
+    }
+    if (prefetch) {
+      c->workers.emplace_back(&queue_consumer::fetch, c);
+    }
+    return c;
+  }
+
+  queue_consumer(const queue_consumer &) = delete;
+  queue_consumer &operator=(const queue_consumer &) = delete;
+
+  // The first caller joins the threads and others wait for it, except
+  // handlers stopping their own consumer
+  void stop() {
+    std::vector<std::thread> joining;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      joining.swap(workers);
+    }
+    cv.notify_all();
+    ready.notify_all();
+    {
+      py::gil_scoped_release release;
+      for (auto &t : joining) {
+        if (t.get_id() == std::this_thread::get_id()) {
+          t.detach();
+        } else if (t.joinable()) {
+          t.join();
+        }
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!joining.empty()) {
+        stopped = true;
+        cv.notify_all();
+      } else if (current_consumer != this) {
+        cv.wait(lock, [this] { return stopped; });
+      }
+    }
+    std::lock_guard<std::mutex> lock(consumers_mutex);
+    consumers.erase(this);
+  }
+
+  py::dict stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    double elapsed =
+        std::chrono::duration<double>(clock::now() - started).count();
+    long long handled = succeeded + failed;
+    py::dict d;
+    d["dequeued"] = py::int_(dequeued.load());
+    d["succeeded"] = py::int_(succeeded.load());
+    d["failed"] = py::int_(failed.load());
+    d["rerouted"] = py::int_(rerouted.load());
+    d["aborted"] = py::int_(aborted.load());
+    d["errors"] = py::int_(errors.load());
+    d["in_flight"] = py::int_(dequeued - handled);
+    d["elapsed"] = py::float_(elapsed);
+    d["throughput"] = py::float_(elapsed > 0 ? handled / elapsed : 0.0);
+    d["lag_avg_us"] = py::float_(handled > 0 ? double(lag_total) / handled : 0.0);
+    d["lag_max_us"] = py::int_(lag_max);
+    d["handler_avg_us"] =
+        py::float_(handled > 0 ? double(handler_total) / handled : 0.0);
+    return d;
+  }
+
+ private:
+  // A message dequeued ahead of the handlers
+  struct message {
+    TPQCTL ctl;
+    xatmibuf out;
+    clock::time_point dequeued_at;
+  };
+
+  bool enter() {
+    current_consumer = this;
+    try {
+      with_context();
+    } catch (const std::exception &e) {
+      userlog(const_cast<char *>("QueueConsumer %s: %s"), qname.c_str(),
+              e.what());
+      return false;
+    }
+    return true;
+  }
+
+  void run() {
+    py::gil_scoped_acquire acquire;
+    py::gil_scoped_release release;
+    alloc_scope scope(alloc_consumer);
+    if (!enter()) {
+      return;
+    }
+    if (prefetch) {
+      message m;
+      while (take_message(m)) {
+        try {
+          handle(m.ctl, m.out, m.dequeued_at);
+        } catch (const std::exception &e) {
+          errors++;
+          userlog(const_cast<char *>("QueueConsumer %s: %s"), qname.c_str(),
+                  e.what());
+        }
+        give_permit();
+      }
+    }
+    while (!prefetch && take_permit()) {
+      try {
+        consume();
+      } catch (const std::exception &e) {
+        errors++;
+        userlog(const_cast<char *>("QueueConsumer %s: %s"), qname.c_str(),
+                e.what());
+        if (transactional && tpgetlev() > 0) {
+          tpabort(0);
+        }
+      }
+      give_permit();
+    }
+    without_context();
+  }
+
+  // Keeps up to max_in_flight messages dequeued or handled, those not
+  // handled by stop() are enqueued again
+  void fetch() {
+    py::gil_scoped_acquire acquire;
+    py::gil_scoped_release release;
+    alloc_scope scope(alloc_consumer);
+    if (!enter()) {
+      return;
+    }
+    while (take_permit()) {
+      bool fetched = false;
+      try {
+        message m;
+        m.out = xatmibuf("FML32", 1024);
+        if (dequeue(m.ctl, m.out)) {
+          m.dequeued_at = clock::now();
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            prefetched.push_back(std::move(m));
+          }
+          ready.notify_one();
+          fetched = true;
+        }
+      } catch (const std::exception &e) {
+        errors++;
+        userlog(const_cast<char *>("QueueConsumer %s: %s"), qname.c_str(),
+                e.what());
+      }
+      if (!fetched) {
+        give_permit();
+      }
+    }
+
+    std::deque<message> left;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      left.swap(prefetched);
+    }
+    for (auto &m : left) {
+      TPQCTL ctl;
+      memset(&ctl, 0, sizeof(ctl));
+      if (m.ctl.flags & TPQCORRID) {
+        ctl.flags |= TPQCORRID;
+        memcpy(ctl.corrid, m.ctl.corrid, sizeof(ctl.corrid));
+      }
+      if (tpenqueue(const_cast<char *>(qspace.c_str()),
+                    const_cast<char *>(qname.c_str()), &ctl, *m.out.pp,
+                    m.out.len, TPNOTRAN) == -1) {
+        errors++;
+        userlog(const_cast<char *>("QueueConsumer %s: message dropped: %s"),
+                qname.c_str(), tpstrerror(tperrno));
+      } else {
+        dequeued--;
+      }
+    }
+    without_context();
+  }
+
+  void consume() {
+    if (transactional && tpbegin(timeout, 0) == -1) {
+      errors++;
+      userlog(const_cast<char *>("QueueConsumer %s: tpbegin() = %s"),
+              qname.c_str(), tpstrerror(tperrno));
+      idle();
+      return;
+    }
+
+    TPQCTL ctl;
+    xatmibuf out("FML32", 1024);
+    if (dequeue(ctl, out)) {
+      handle(ctl, out, clock::now());
+    }
+  }
+
+  // Returns false when there was no message
+  bool dequeue(TPQCTL &ctl, xatmibuf &out) {
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.flags = TPQWAIT;
+    // Wake up every second to notice stop()
+    tpsblktime(1, TPBLK_SECOND | TPBLK_NEXT);
+    if (tpdequeue(const_cast<char *>(qspace.c_str()),
+                  const_cast<char *>(qname.c_str()), &ctl, out.pp, &out.len,
+                  transactional ? 0 : TPNOTRAN) == -1) {
+      int err = tperrno;
+      if (transactional) {
+        tpabort(0);
+      }
+      if (err == TPETIME || err == TPEBLOCK ||
+          (err == TPEDIAGNOSTIC && ctl.diagnostic == QMENOMSG)) {
+        return false;
+      }
+      errors++;
+      userlog(const_cast<char *>("QueueConsumer %s: tpdequeue() = %s"),
+              qname.c_str(),
+              err == TPEDIAGNOSTIC ? qm_exception::qmstrerror(ctl.diagnostic)
+                                   : tpstrerror(err));
+      idle();
+      return false;
+    }
+    dequeued++;
+    return true;
+  }
+
+  void handle(TPQCTL &ctl, xatmibuf &out, clock::time_point dequeued_at) {
+    bool ok = false;
+    {
+      py::gil_scoped_acquire acquire;
+      auto started_at = clock::now();
+      try {
+        py::object rc = handler(to_py(out));
+        ok = !(py::isinstance<py::bool_>(rc) && !rc.cast<bool>());
+      } catch (const std::exception &e) {
+        userlog(const_cast<char *>("QueueConsumer %s: %s"), qname.c_str(),
+                e.what());
+      }
+      account(started_at - dequeued_at, clock::now() - started_at);
+    }
+
+    if (ok) {
+      if (transactional && tpcommit(0) == -1) {
+        failed++;
+        aborted++;
+        userlog(const_cast<char *>("QueueConsumer %s: tpcommit() = %s"),
+                qname.c_str(), tpstrerror(tperrno));
+      } else {
+        succeeded++;
+      }
+      return;
+    }
+
+    failed++;
+    const char *fq = !failurequeue.empty()
+                         ? failurequeue.c_str()
+                         : (ctl.failurequeue[0] != '\0' ? ctl.failurequeue
+                                                        : nullptr);
+    if (fq != nullptr) {
+      TPQCTL fctl;
+      memset(&fctl, 0, sizeof(fctl));
+      if (ctl.flags & TPQCORRID) {
+        fctl.flags |= TPQCORRID;
+        memcpy(fctl.corrid, ctl.corrid, sizeof(fctl.corrid));
+      }
+      if (tpenqueue(const_cast<char *>(qspace.c_str()), const_cast<char *>(fq),
+                    &fctl, *out.pp, out.len,
+                    transactional ? 0 : TPNOTRAN) != -1) {
+        if (!transactional || tpcommit(0) != -1) {
+          rerouted++;
+          return;
+        }
+      }
+      userlog(const_cast<char *>("QueueConsumer %s: failed to move message "
+                                 "to %s: %s"),
+              qname.c_str(), fq, tpstrerror(tperrno));
+    }
+    if (transactional) {
+      tpabort(0);
+      aborted++;
+    } else if (fq == nullptr) {
+      userlog(const_cast<char *>("QueueConsumer %s: message dropped"),
+              qname.c_str());
+    }
+  }
+
+  void account(clock::duration lag, clock::duration spent) {
+    long long lag_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(lag).count();
+    std::lock_guard<std::mutex> lock(mutex);
+    lag_total += lag_us;
+    lag_max = std::max(lag_max, lag_us);
+    handler_total +=
+        std::chrono::duration_cast<std::chrono::microseconds>(spent).count();
+  }
+
+  bool take_permit() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return stopping || permits > 0; });
+    if (stopping) {
+      return false;
+    }
+    permits--;
+    return true;
+  }
+
+  bool take_message(message &m) {
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return stopping || !prefetched.empty(); });
+    if (stopping) {
+      return false;
+    }
+    m = std::move(prefetched.front());
+    prefetched.pop_front();
+    return true;
+  }
+
+  void give_permit() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      permits++;
+    }
+    cv.notify_one();
+  }
+
+  void idle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait_for(lock, std::chrono::seconds(1), [this] { return stopping; });
+  }
+
+  std::string qspace;
+  std::string qname;
+  std::string failurequeue;
+  py::object handler;
+  bool prefetch;
+  bool transactional;
+  unsigned long timeout;
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::condition_variable ready;
+  std::deque<message> prefetched;
+  int permits;
+  bool stopping;
+  bool stopped;
+
+  static thread_local queue_consumer *current_consumer;
+
+  clock::time_point started;
+  std::atomic<long long> dequeued;
+  std::atomic<long long> succeeded;
+  std::atomic<long long> failed;
+  std::atomic<long long> rerouted;
+  std::atomic<long long> aborted;
+  std::atomic<long long> errors;
+  long long lag_total;
+  long long lag_max;
+  long long handler_total;
+};
+
+// The Python object, stops the consumer when garbage collected
+thread_local queue_consumer *queue_consumer::current_consumer = nullptr;
+
+struct queue_consumer_handle {
+  explicit queue_consumer_handle(std::shared_ptr<queue_consumer> c_)
+      : c(std::move(c_)) {}
+  ~queue_consumer_handle() { c->stop(); }
+
+  queue_consumer_handle(const queue_consumer_handle &) = delete;
+  queue_consumer_handle &operator=(const queue_consumer_handle &) = delete;
+
+  std::shared_ptr<queue_consumer> c;
+};
+
+static void stop_consumers() {
+  std::vector<queue_consumer *> running;
+  {
+    std::lock_guard<std::mutex> lock(consumers_mutex);
+    running.assign(consumers.begin(), consumers.end());
+  }
+  for (auto *c : running) {
+    c->stop();
+  }
+}
+
+// Opens a stream on a duplicate of fd, which is closed again on failure
+static FILE *fdopen_dup(int fd, const char *mode) {
+  int copy = dup(fd);
+  if (copy == -1) {
+    throw std::system_error(errno, std::generic_category());
+  }
+  FILE *f = fdopen(copy, mode);
+  if (f == nullptr) {
+    int err = errno;
+    close(copy);
+    throw std::system_error(err, std::generic_category());
+  }
+  return f;
+}
+
+// Opens a path, or a duplicate of a file descriptor or file object
+static FILE *open_stream(py::object target, const char *mode) {
+  if (py::isinstance<py::int_>(target) || hasattr(target, "fileno")) {
+    int fd = py::isinstance<py::int_>(target)
+                 ? target.cast<int>()
+                 : target.attr("fileno")().cast<int>();
+    return fdopen_dup(fd, mode);
+  }
+  FILE *f = fopen(std::string(py::str(target)).c_str(), mode);
+  if (f == nullptr) {
+    throw std::system_error(errno, std::generic_category());
+  }
+  return f;
+}
+
+static xatmibuf compact_fml32(FBFR32 *src) {
+  long n = std::min(Fused32(src), Fsizeof32(src));
+  for (;;) {
+    xatmibuf c("FML32", n);
+    if (Fcpy32(*c.fbfr(), src) != -1) {
+      return c;
+    }
+    if (Ferror32 != FNOSPACE || n >= Fsizeof32(src)) {
+      throw fml32_exception(Ferror32);
+    }
+    n = std::min(n * 2, Fsizeof32(src));
+  }
+}
+
+// Reads records in Fextread32 format one after another from one FILE with a
+// large stdio buffer. Records that do not fit are read again into a bigger
+// buffer, that needs a seekable file.
+struct fextread_reader {
+  fextread_reader(py::object source, bool raw_)
+      : fp(open_stream(source, "r"), &fclose),
+        scratch("FML32", 64 * 1024),
+        raw(raw_),
+        records(0) {
+    setvbuf(fp.get(), nullptr, _IOFBF, 1 << 20);
+  }
+
+  // Returns false at the end of input, called with mutex held
+  bool read(xatmibuf &buf) {
+    FILE *f = fp.get();
+    if (f == nullptr) {
+      return false;
+    }
+    int c;
+    while ((c = getc(f)) == '\n') {
+    }
+    if (c == EOF) {
+      return false;
+    }
+    ungetc(c, f);
+    long pos = ftell(f);
+    bool retry = false;
+    buf.mutate([&](FBFR32 *fbfr) {
+      if (retry && (pos == -1 || fseek(f, pos, SEEK_SET) != 0)) {
+        throw fml32_exception(FNOSPACE);
+      }
+      retry = true;
+      Finit32(fbfr, buf.len);
+      return Fextread32(fbfr, f);
+    });
+    records++;
+    return true;
+  }
+
+  py::object next() {
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    bool more;
+    {
+      py::gil_scoped_release release;
+      lock.lock();
+      more = read(scratch);
+    }
+    if (!more) {
+      throw py::stop_iteration();
+    }
+    if (raw) {
+      return py::cast(new pybuffer(compact_fml32(*scratch.fbfr())),
+                      py::return_value_policy::take_ownership);
+    }
+    return to_py(scratch);
+  }
+
+  std::unique_ptr<FILE, decltype(&fclose)> fp;
+  std::mutex mutex;
+  xatmibuf scratch;
+  bool raw;
+  long long records;
+};
+
+// Writes fielded buffers with Ffprint32 to one FILE
+struct ffprint_writer {
+  ffprint_writer(py::object target, bool append)
+      : fp(open_stream(target, append ? "a" : "w"), &fclose), records(0) {
+    setvbuf(fp.get(), nullptr, _IOFBF, 1 << 20);
+  }
+
+  void write(py::object fbfr) {
+    auto buf = from_py(fbfr);
+    if (!fp) {
+      throw std::invalid_argument("Writer is closed");
+    }
+    py::gil_scoped_release release;
+    if (Ffprint32(*buf.fbfr(), fp.get()) == -1) {
+      throw fml32_exception(Ferror32);
+    }
+    records++;
+  }
+
+  void flush() {
+    if (fp) {
+      py::gil_scoped_release release;
+      fflush(fp.get());
+    }
+  }
+
+  void close() {
+    py::gil_scoped_release release;
+    fp.reset();
+  }
+
+  std::unique_ptr<FILE, decltype(&fclose)> fp;
+  long long records;
+};
+
+// Sends records to a service or a queue from native threads, each with its
+// own context. Records come straight from an Fextread32 reader without the
+// GIL or are converted from a Python iterable by the calling thread.
+struct bulk_loader {
+  typedef std::chrono::steady_clock clock;
+
+  bulk_loader(const std::string &svc_, const std::string &qspace_,
+              const std::string &qname_, long flags_)
+      : svc(svc_),
+        qspace(qspace_),
+        qname(qname_),
+        flags(flags_ & ~TPCOMPRESS),
+        compress((flags_ & TPCOMPRESS) != 0),
+        reader(nullptr),
+        capacity(0),
+        alive(0),
+        done(false),
+        succeeded(0),
+        failed(0) {}
+
+  py::dict run(py::object records, int threads) {
+    if (threads < 1) {
+      throw std::invalid_argument("threads must be positive");
+    }
+    alloc_scope scope(alloc_bulk);
+    auto started = clock::now();
+    if (py::isinstance<fextread_reader>(records)) {
+      reader = &records.cast<fextread_reader &>();
+    }
+    capacity = threads * 16;
+    alive = threads;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+      workers.emplace_back(&bulk_loader::work, this);
+    }
+
+    std::exception_ptr error;
+    if (reader == nullptr) {
+      try {
+        for (auto item : records) {
+          xatmibuf rec;
+          if (py::isinstance<pybuffer>(item)) {
+            rec = item.cast<pybuffer &>().copy();
+          } else {
+            rec = from_py(py::reinterpret_borrow<py::object>(item));
+          }
+          if (!push(std::move(rec))) {
+            break;
+          }
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+    }
+    not_empty.notify_all();
+    {
+      py::gil_scoped_release release;
+      for (auto &t : workers) {
+        t.join();
+      }
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+
+    double elapsed =
+        std::chrono::duration<double>(clock::now() - started).count();
+    long long total = succeeded + failed;
+    py::dict d;
+    d["records"] = py::int_(total);
+    d["succeeded"] = py::int_(succeeded.load());
+    d["failed"] = py::int_(failed.load());
+    d["elapsed"] = py::float_(elapsed);
+    d["throughput"] = py::float_(elapsed > 0 ? total / elapsed : 0.0);
+    d["error"] = first_error.empty() ? py::object(py::none())
+                                     : py::object(py::str(first_error));
+    return d;
+  }
+
+ private:
+  // Returns false when no worker is left to take records
+  bool push(xatmibuf &&rec) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (queue.size() >= capacity && alive > 0) {
+      py::gil_scoped_release release;
+      not_full.wait(lock,
+                    [this] { return queue.size() < capacity || alive == 0; });
+    }
+    if (alive == 0) {
+      return false;
+    }
+    queue.push_back(std::move(rec));
+    lock.unlock();
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool next(xatmibuf &rec) {
+    if (reader != nullptr) {
+      std::lock_guard<std::mutex> lock(reader->mutex);
+      return reader->read(rec);
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return !queue.empty() || done; });
+    if (queue.empty()) {
+      return false;
+    }
+    rec = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+    not_full.notify_one();
+    return true;
+  }
+
+  void error(const char *message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (first_error.empty()) {
+      first_error = message;
+    }
+  }
+
+  void send(xatmibuf &rec, xatmibuf &out) {
+    if (!svc.empty()) {
+      if (compressed_size > 0 || compress) {
+        try {
+          compress_request(svc.c_str(), rec, compress ? TPCOMPRESS : 0);
+        } catch (const std::exception &e) {
+          failed++;
+          error(e.what());
+          return;
+        }
+      }
+      int rc;
+      if (flags & TPNOREPLY) {
+        rc = tpacall(const_cast<char *>(svc.c_str()), *rec.pp, rec.len, flags);
+      } else {
+        rc = tpcall(const_cast<char *>(svc.c_str()), *rec.pp, rec.len, out.pp,
+                    &out.len, flags);
+      }
+      if (rc == -1) {
+        failed++;
+        error(tpstrerror(tperrno));
+        return;
+      }
+    } else {
+      TPQCTL ctl;
+      memset(&ctl, 0, sizeof(ctl));
+      if (tpenqueue(const_cast<char *>(qspace.c_str()),
+                    const_cast<char *>(qname.c_str()), &ctl, *rec.pp, rec.len,
+                    flags) == -1) {
+        failed++;
+        if (tperrno == TPEDIAGNOSTIC) {
+          error(qm_exception(ctl.diagnostic).what());
+        } else {
+          error(tpstrerror(tperrno));
+        }
+        return;
+      }
+    }
+    succeeded++;
+  }
+
+  void work() {
+    alloc_scope scope(alloc_bulk);
+    bool attached = false;
+    try {
+      with_context();
+      attached = true;
+      xatmibuf rec("FML32", 64 * 1024);
+      xatmibuf out("FML32", 1024);
+      while (next(rec)) {
+        send(rec, out);
+      }
+    } catch (const std::exception &e) {
+      // A record that can't be read or the context
+      error(e.what());
+    }
+    if (attached) {
+      without_context();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      alive--;
+    }
+    not_full.notify_all();
+  }
+
+  std::string svc;
+  std::string qspace;
+  std::string qname;
+  long flags;
+  // TPCOMPRESS applies to service calls only
+  bool compress;
+  fextread_reader *reader;
+
+  std::deque<xatmibuf> queue;
+  size_t capacity;
+  int alive;
+  bool done;
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+
+  std::atomic<long long> succeeded;
+  std::atomic<long long> failed;
+  std::string first_error;
+};
+
+// Log-linear histogram like HdrHistogram: 128 linear sub-buckets per power
+// of two keep the relative error under 1%
+struct latency_histogram {
+  static const int SUB = 128;
+  static const int BUCKETS = 58;
+
+  latency_histogram()
+      : counts((BUCKETS + 1) * SUB, 0),
+        total(0),
+        sum(0),
+        min(UINT64_MAX),
+        max(0) {}
+
+  static size_t index(uint64_t v) {
+    int msb = 63;
+    while (msb > 0 && (v >> msb) == 0) {
+      msb--;
+    }
+    int bucket = msb < 8 ? 0 : msb - 7;
+    if (bucket == 0) {
+      return static_cast<size_t>(v);
+    }
+    return (bucket + 1) * SUB + ((v >> bucket) - SUB);
+  }
+
+  // Highest value that falls into the same sub-bucket
+  static uint64_t value(size_t i) {
+    if (i < 2 * SUB) {
+      return i;
+    }
+    size_t bucket = i / SUB - 1;
+    uint64_t sub = i % SUB + SUB;
+    return ((sub + 1) << bucket) - 1;
+  }
+
+  void record(uint64_t v) {
+    counts[index(v)]++;
+    total++;
+    sum += v;
+    min = std::min(min, v);
+    max = std::max(max, v);
+  }
+
+  void merge(const latency_histogram &other) {
+    for (size_t i = 0; i < counts.size(); i++) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+  }
+
+  uint64_t percentile(double q) const {
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(std::ceil(q / 100 * total));
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return std::min(value(i), max);
+      }
+    }
+    return max;
+  }
+
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+};
+
+// Calls a service from native threads, each with its own context, with the
+// request encoded once. Without a rate each thread calls again as soon as a
+// reply arrives. With a rate the calls are scheduled and latency is measured
+// from the scheduled time so that a slow reply also counts against the calls
+// that had to wait for it (coordinated omission).
+struct load_generator {
+  typedef std::chrono::steady_clock clock;
+
+  load_generator(const std::string &svc_, xatmibuf &payload_, long flags_)
+      : svc(svc_), payload(payload_), flags(flags_), ready(0), go(false) {}
+
+  py::dict run(int threads, double duration, double rate) {
+    if (threads < 1) {
+      throw std::invalid_argument("threads must be positive");
+    }
+    if (duration <= 0) {
+      throw std::invalid_argument("duration must be positive");
+    }
+    histograms.resize(threads);
+    errors.resize(threads);
+    succeeded.resize(threads);
+    std::vector<std::thread> workers;
+    double started;
+    {
+      py::gil_scoped_release release;
+      for (int i = 0; i < threads; i++) {
+        workers.emplace_back(&load_generator::work, this, i, duration,
+                             rate / threads);
+      }
+      {
+        // Contexts are created before the clock starts
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return ready == threads; });
+        start = clock::now();
+        go = true;
+      }
+      cv.notify_all();
+      for (auto &t : workers) {
+        t.join();
+      }
+      started = std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    latency_histogram all;
+    std::map<int, long long> failed;
+    long long ok = 0;
+    for (int i = 0; i < threads; i++) {
+      all.merge(histograms[i]);
+      ok += succeeded[i];
+      for (auto &e : errors[i]) {
+        failed[e.first] += e.second;
+      }
+    }
+    py::dict errs;
+    for (auto &e : failed) {
+      errs[py::int_(e.first)] = py::int_(e.second);
+    }
+    py::dict latency;
+    latency["min"] = py::int_(all.total > 0 ? all.min : 0);
+    latency["mean"] =
+        py::float_(all.total > 0 ? double(all.sum) / all.total : 0.0);
+    for (double q : {50.0, 90.0, 99.0, 99.9, 99.99}) {
+      char name[16] = "p";
+      c_format(name + 1, sizeof(name) - 1, 6, q);
+      latency[name] = py::int_(all.percentile(q));
+    }
+    latency["max"] = py::int_(all.max);
+
+    py::dict d;
+    d["requests"] = py::int_(all.total);
+    d["succeeded"] = py::int_(ok);
+    d["errors"] = errs;
+    d["elapsed"] = py::float_(started);
+    d["throughput"] = py::float_(started > 0 ? all.total / started : 0.0);
+    d["latency_us"] = latency;
+    return d;
+  }
+
+ private:
+  // Failures to set up a thread count as errors of a single call, other
+  // exceptions must not escape the thread
+  void work(int n, double duration, double rate) {
+    alloc_scope scope(alloc_loadgen);
+    int attach_error = 0;
+    bool attached = false;
+    xatmibuf in, out;
+    try {
+      with_context();
+      attached = true;
+      // Buffers are ready before the clock starts
+      in = pybuffer(xatmibuf(payload.pp, payload.len)).copy();
+      out = xatmibuf("FML32", 1024);
+    } catch (const xatmi_exception &e) {
+      attach_error = e.code();
+    } catch (const std::exception &e) {
+      userlog(const_cast<char *>("loadgen: %s"), e.what());
+      attach_error = TPEOS;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready++;
+      cv.notify_all();
+      cv.wait(lock, [this] { return go; });
+    }
+    if (attach_error != 0) {
+      errors[n][attach_error]++;
+      if (attached) {
+        without_context();
+      }
+      return;
+    }
+    try {
+      call(n, duration, rate, in, out);
+    } catch (const std::exception &e) {
+      userlog(const_cast<char *>("loadgen: %s"), e.what());
+      errors[n][TPEOS]++;
+    }
+    without_context();
+  }
+
+  void call(int n, double duration, double rate, xatmibuf &in,
+            xatmibuf &out) {
+    // Merged at the end to keep threads off each other's cache lines
+    latency_histogram h;
+    std::map<int, long long> e;
+    auto end = start + std::chrono::duration_cast<clock::duration>(
+                           std::chrono::duration<double>(duration));
+    clock::duration period =
+        rate > 0 ? std::chrono::duration_cast<clock::duration>(
+                       std::chrono::duration<double>(1 / rate))
+                 : clock::duration::zero();
+    // Threads start evenly spread over one period
+    auto scheduled = start + period * n / static_cast<int>(histograms.size());
+    long long ok = 0;
+    for (;;) {
+      auto now = clock::now();
+      if (rate > 0) {
+        if (scheduled >= end) {
+          break;
+        }
+        if (scheduled > now) {
+          std::this_thread::sleep_until(scheduled);
+        }
+      } else {
+        if (now >= end) {
+          break;
+        }
+        scheduled = now;
+      }
+      int rc = tpcall(const_cast<char *>(svc.c_str()), *in.pp, in.len,
+                      out.pp, &out.len, flags);
+      if (rc == -1) {
+        e[tperrno]++;
+      } else {
+        ok++;
+      }
+      h.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                   clock::now() - scheduled)
+                   .count());
+      scheduled += period;
+    }
+    histograms[n] = std::move(h);
+    errors[n] = std::move(e);
+    succeeded[n] = ok;
+  }
+
+  std::string svc;
+  xatmibuf &payload;
+  long flags;
+
+  std::vector<latency_histogram> histograms;
+  std::vector<std::map<int, long long>> errors;
+  std::vector<long long> succeeded;
+  std::mutex mutex;
+  std::condition_variable cv;
+  int ready;
+  bool go;
+  clock::time_point start;
+};
+
+#if defined(__linux__)
+struct http_server;
+static std::mutex http_servers_mutex;
+static std::set<http_server *> http_servers;
+
+// HTTP/1.1 keep-alive server on native threads, each with its own context
+// and epoll instance. Routes map a path to a service called with the JSON
+// request body as FML32 without taking the GIL, or to a Python callable
+// receiving the path and body and returning the response body or a
+// (status, body) tuple. Services are called with tpacall() and replies
+// collected with tpgetrply(TPGETANY) between events, so a slow service only
+// holds up its own connection. Each thread keeps the server alive, so a
+// hook may stop it or drop the last reference.
+struct http_server : std::enable_shared_from_this<http_server> {
+  typedef std::chrono::steady_clock clock;
+
+  struct connection {
+    explicit connection(int fd_)
+        : fd(fd_),
+          sent(0),
+          close(false),
+          eof(false),
+          reading(true),
+          writing(false),
+          cd(-1),
+          keepalive(false) {}
+    int fd;
+    std::string in;
+    std::string out;
+    size_t sent;
+    bool close;
+    bool eof;
+    bool reading;
+    bool writing;
+    // The service call awaiting its reply, later requests wait behind it
+    int cd;
+    std::string svc;
+    bool keepalive;
+    clock::time_point deadline;
+  };
+
+  typedef std::unordered_map<int, std::unique_ptr<connection>> connections;
+  typedef std::unordered_map<int, connection *> calls;
+
+  http_server(int port, py::dict routes_, long flags_, bool flat_,
+              const std::string &host, size_t max_body_)
+      : flags(flags_),
+        flat(flat_),
+        max_body(max_body_),
+        listenfd(-1),
+        stopfd(-1),
+        stopping(false),
+        stopped(false),
+        accepted(0),
+        active(0),
+        requests(0),
+        errors(0) {
+    for (auto it : routes_) {
+      route r;
+      if (py::isinstance<py::str>(it.second)) {
+        r.svc = py::str(it.second);
+      } else {
+        r.hook = py::reinterpret_borrow<py::object>(it.second);
+      }
+      routes[py::str(it.first)] = r;
+    }
+
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenfd == -1) {
+      throw std::system_error(errno, std::system_category(), "socket");
+    }
+    int one = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (!host.empty() && inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+      close_fds();
+      throw std::invalid_argument("Invalid address " + host);
+    }
+    if (bind(listenfd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ==
+            -1 ||
+        listen(listenfd, SOMAXCONN) == -1) {
+      int err = errno;
+      close_fds();
+      throw std::system_error(err, std::system_category(), "bind");
+    }
+    stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stopfd == -1) {
+      int err = errno;
+      close_fds();
+      throw std::system_error(err, std::system_category(), "eventfd");
+    }
+  }
+  ~http_server() {
+    close_fds();
+    std::lock_guard<std::mutex> lock(http_servers_mutex);
+    http_servers.erase(this);
+  }
+
+  // Deleted with the GIL held as hooks are Python objects
+  static std::shared_ptr<http_server> start(int port, py::dict routes,
+                                            int threads, long flags, bool flat,
+                                            const std::string &host,
+                                            size_t max_body) {
+    if (threads < 1) {
+      throw std::invalid_argument("threads must be positive");
+    }
+    std::shared_ptr<http_server> s(
+        new http_server(port, routes, flags, flat, host, max_body),
+        [](http_server *p) {
+          py::gil_scoped_acquire acquire;
+          delete p;
+        });
+    {
+      std::lock_guard<std::mutex> lock(http_servers_mutex);
+      http_servers.insert(s.get());
+    }
+    for (int i = 0; i < threads; i++) {
+      s->workers.emplace_back(&http_server::run, s);
+    }
+    return s;
+  }
+
+  http_server(const http_server &) = delete;
+  http_server &operator=(const http_server &) = delete;
+
+  // The first caller joins the threads and others wait for it, except
+  // hooks stopping their own server. The sockets are closed once no thread
+  // polls them, by the destructor when a hook stopped the server.
+  void stop() {
+    std::vector<std::thread> joining;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      joining.swap(workers);
+    }
+    if (!joining.empty()) {
+      uint64_t one = 1;
+      if (write(stopfd, &one, sizeof(one)) == -1) {
+        // Workers will not wake up, nothing else to do about it
+      }
+    }
+    {
+      py::gil_scoped_release release;
+      bool detached = false;
+      for (auto &t : joining) {
+        if (t.get_id() == std::this_thread::get_id()) {
+          t.detach();
+          detached = true;
+        } else if (t.joinable()) {
+          t.join();
+        }
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!joining.empty()) {
+        if (!detached) {
+          close_fds();
+        }
+        stopped = true;
+        cv.notify_all();
+      } else if (current_server != this) {
+        cv.wait(lock, [this] { return stopped; });
+      }
+    }
+    std::lock_guard<std::mutex> lock(http_servers_mutex);
+    http_servers.erase(this);
+  }
+
+  py::dict stats() {
+    py::dict d;
+    d["accepted"] = py::int_(accepted.load());
+    d["active"] = py::int_(active.load());
+    d["requests"] = py::int_(requests.load());
+    d["errors"] = py::int_(errors.load());
+    return d;
+  }
+
+ private:
+  struct route {
+    std::string svc;
+    py::object hook;
+  };
+
+  static const size_t max_header = 16384;
+  // Replies are waited for this long when no block time is set
+  static const long default_timeout = 60000;
+
+  void close_fds() {
+    if (listenfd != -1) {
+      ::close(listenfd);
+      listenfd = -1;
+    }
+    if (stopfd != -1) {
+      ::close(stopfd);
+      stopfd = -1;
+    }
+  }
+
+  void run() {
+    current_server = this;
+    py::gil_scoped_acquire acquire;
+    py::gil_scoped_release release;
+    alloc_scope scope(alloc_http);
+    try {
+      with_context();
+    } catch (const std::exception &e) {
+      userlog(const_cast<char *>("serve_http: %s"), e.what());
+      return;
+    }
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep == -1) {
+      userlog(const_cast<char *>("serve_http: epoll_create1() = %s"),
+              strerror(errno));
+      without_context();
+      return;
+    }
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    ev.events |= EPOLLEXCLUSIVE;
+#endif
+    ev.data.fd = listenfd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = stopfd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, stopfd, &ev);
+
+    connections conns;
+    calls pending;
+    xatmibuf reply("FML32", 1024);
+    auto expired_at = clock::now();
+    epoll_event events[64];
+    while (!stopping) {
+      // Replies do not wake up epoll, poll for them while calls are pending
+      int n = epoll_wait(ep, events, 64, pending.empty() ? -1 : 1);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        userlog(const_cast<char *>("serve_http: epoll_wait() = %s"),
+                strerror(errno));
+        break;
+      }
+      for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == stopfd) {
+          break;
+        } else if (fd == listenfd) {
+          accept_all(ep, conns);
+          continue;
+        }
+        auto it = conns.find(fd);
+        if (it == conns.end()) {
+          continue;
+        }
+        connection &c = *it->second;
+        bool ok = !(events[i].events & (EPOLLERR | EPOLLHUP));
+        if (ok && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+          ok = receive(c);
+          if (ok) {
+            handle_requests(c, pending);
+          }
+        }
+        if (!ok || !flush(ep, c)) {
+          drop(conns, fd, pending);
+        }
+      }
+      if (!pending.empty()) {
+        collect(ep, conns, pending, reply);
+        if (clock::now() - expired_at > std::chrono::milliseconds(100)) {
+          expire(ep, conns, pending);
+          expired_at = clock::now();
+        }
+      }
+    }
+
+    for (auto &it : conns) {
+      if (it.second->cd != -1) {
+        tpcancel(it.second->cd);
+      }
+      ::close(it.first);
+      active--;
+    }
+    ::close(ep);
+    without_context();
+  }
+
+  void accept_all(int ep, connections &conns) {
+    for (;;) {
+      int fd = accept4(listenfd, nullptr, nullptr,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          userlog(const_cast<char *>("serve_http: accept() = %s"),
+                  strerror(errno));
+        }
+        return;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.fd = fd;
+      if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        ::close(fd);
+        continue;
+      }
+      conns[fd].reset(new connection(fd));
+      accepted++;
+      active++;
+    }
+  }
+
+  // Cancels the call in progress, its reply is discarded
+  void drop(connections &conns, int fd, calls &pending) {
+    auto it = conns.find(fd);
+    if (it->second->cd != -1) {
+      tpcancel(it->second->cd);
+      pending.erase(it->second->cd);
+    }
+    ::close(fd);
+    conns.erase(it);
+    active--;
+  }
+
+  // Reads no more than the largest request allowed, the rest stays in the
+  // socket until requests are handled. A peer that shut down its side still
+  // gets the responses to the requests it sent.
+  bool receive(connection &c) {
+    char tmp[16384];
+    while (!c.eof && c.in.size() < max_header + 4 + max_body) {
+      ssize_t n = read(c.fd, tmp, sizeof(tmp));
+      if (n > 0) {
+        c.in.append(tmp, n);
+        continue;
+      } else if (n == 0) {
+        c.eof = true;
+      } else if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+      }
+      break;
+    }
+    return true;
+  }
+
+  // Writes what it can, then waits for EPOLLOUT for the rest and for
+  // EPOLLIN only while the connection may take another request, returns
+  // false once the connection is done
+  bool flush(int ep, connection &c) {
+    while (c.sent < c.out.size()) {
+      ssize_t n = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent,
+                       MSG_NOSIGNAL);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+        return false;
+      }
+      c.sent += n;
+    }
+    if (c.sent == c.out.size()) {
+      c.out.clear();
+      c.sent = 0;
+      if (c.cd == -1 && (c.close || c.eof)) {
+        return false;
+      }
+    }
+    bool reading = c.cd == -1 && !c.close && !c.eof;
+    bool writing = !c.out.empty();
+    if (c.reading != reading || c.writing != writing) {
+      c.reading = reading;
+      c.writing = writing;
+      epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      if (reading) {
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+      }
+      if (writing) {
+        ev.events |= EPOLLOUT;
+      }
+      ev.data.fd = c.fd;
+      epoll_ctl(ep, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+    return true;
+  }
+
+  // Takes all replies available now
+  void collect(int ep, connections &conns, calls &pending, xatmibuf &reply) {
+    for (;;) {
+      int cd = -1;
+      char *allocated = *reply.pp;
+      long size = reply.len;
+      int err = 0;
+      if (tpgetrply(&cd, reply.pp, &reply.len, TPGETANY | TPNOBLOCK) == -1) {
+        err = tperrno;
+      }
+      if (err == TPEBLOCK || err == TPEBADDESC) {
+        return;
+      }
+      auto it = pending.find(cd);
+      if (it == pending.end()) {
+        if (err != 0 && err != TPESVCFAIL && err != TPESVCERR) {
+          userlog(const_cast<char *>("serve_http: tpgetrply() = %s"),
+                  tpstrerror(err));
+          return;
+        }
+        continue;
+      }
+      connection &c = *it->second;
+      pending.erase(it);
+      c.cd = -1;
+      complete(c, err, reply, allocated, size);
+      handle_requests(c, pending);
+      if (!flush(ep, c)) {
+        drop(conns, c.fd, pending);
+      }
+    }
+  }
+
+  // Cancels calls past their deadline, as tpcall() would time out
+  void expire(int ep, connections &conns, calls &pending) {
+    auto now = clock::now();
+    std::vector<connection *> late;
+    for (auto &it : pending) {
+      if (it.second->deadline <= now) {
+        late.push_back(it.second);
+      }
+    }
+    for (auto *c : late) {
+      tpcancel(c->cd);
+      pending.erase(c->cd);
+      c->cd = -1;
+      respond_failure(*c, xatmi_exception(TPETIME), c->keepalive);
+      handle_requests(*c, pending);
+      if (!flush(ep, *c)) {
+        drop(conns, c->fd, pending);
+      }
+    }
+  }
+
+  void handle_requests(connection &c, calls &pending) {
+    while (!c.close && c.cd == -1) {
+      size_t end = c.in.find("\r\n\r\n");
+      if (end == std::string::npos ? c.in.size() > max_header
+                                   : end > max_header) {
+        respond(c, 431, "{\"error\":\"Headers too large\"}", false);
+        return;
+      } else if (end == std::string::npos) {
+        return;
+      }
+
+      size_t eol = c.in.find("\r\n");
+      std::string line = c.in.substr(0, eol);
+      size_t sp1 = line.find(' ');
+      size_t sp2 = line.find(' ', sp1 + 1);
+      if (sp1 == std::string::npos || sp2 == std::string::npos) {
+        respond(c, 400, "{\"error\":\"Malformed request\"}", false);
+        return;
+      }
+      std::string method = line.substr(0, sp1);
+      std::string path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+      path = path.substr(0, path.find('?'));
+      bool keepalive =
+          line.compare(sp2 + 1, std::string::npos, "HTTP/1.0") != 0;
+
+      size_t length = 0;
+      bool chunked = false;
+      for (size_t pos = eol + 2; pos < end;) {
+        size_t next = c.in.find("\r\n", pos);
+        const char *h = c.in.data() + pos;
+        size_t hlen = next - pos;
+        if (header(h, hlen, "content-length")) {
+          length = strtoul(h + 15, nullptr, 10);
+        } else if (header(h, hlen, "transfer-encoding")) {
+          chunked = true;
+        } else if (header(h, hlen, "connection")) {
+          std::string v(h + 11, hlen - 11);
+          if (strcasestr(v.c_str(), "close") != nullptr) {
+            keepalive = false;
+          } else if (strcasestr(v.c_str(), "keep-alive") != nullptr) {
+            keepalive = true;
+          }
+        }
+        pos = next + 2;
+      }
+
+      if (chunked) {
+        respond(c, 411, "{\"error\":\"Content-Length required\"}", false);
+        return;
+      }
+      if (length > max_body) {
+        respond(c, 413, "{\"error\":\"Request too large\"}", false);
+        return;
+      }
+      if (c.in.size() < end + 4 + length) {
+        return;
+      }
+
+      requests++;
+      const char *body = c.in.data() + end + 4;
+      auto it = routes.find(path);
+      if (it == routes.end()) {
+        respond(c, 404, "{\"error\":\"Not found\"}", keepalive);
+      } else if (method != "POST") {
+        respond(c, 405, "{\"error\":\"Method not allowed\"}", keepalive);
+      } else if (it->second.hook) {
+        call_hook(c, it->second.hook, path, body, length, keepalive);
+      } else {
+        call_service(c, pending, it->second.svc, body, length, keepalive);
+      }
+      c.in.erase(0, end + 4 + length);
+    }
+  }
+
+  static bool header(const char *h, size_t len, const char *name) {
+    size_t n = strlen(name);
+    return len > n && h[n] == ':' && strncasecmp(h, name, n) == 0;
+  }
+
+  // Sends the request, the response is written when the reply arrives
+  void call_service(connection &c, calls &pending, const std::string &svc,
+                    const char *body, size_t length, bool keepalive) {
+    xatmibuf in;
+    try {
+      in = length == 0 ? xatmibuf("FML32", 1024) : json_to_fml(body, length);
+    } catch (const std::exception &e) {
+      respond_error(c, 400, e.what(), keepalive);
+      return;
+    }
+
+    try {
+      compress_request(svc.c_str(), in, 0);
+      long timeout = (flags & TPNOTIME) ? 0 : next_blocktime();
+      if (timeout <= 0) {
+        timeout = default_timeout;
+      }
+      int cd = tpacall(const_cast<char *>(svc.c_str()), *in.pp, in.len, flags);
+      if (cd == -1) {
+        throw xatmi_exception(tperrno);
+      }
+      c.cd = cd;
+      c.svc = svc;
+      c.keepalive = keepalive;
+      c.deadline = (flags & TPNOTIME)
+                       ? clock::time_point::max()
+                       : clock::now() + std::chrono::milliseconds(timeout);
+      pending[cd] = &c;
+    } catch (const xatmi_exception &e) {
+      respond_failure(c, e, keepalive);
+    } catch (const std::exception &e) {
+      respond_error(c, 502, e.what(), keepalive);
+    }
+  }
+
+  void complete(connection &c, int err, xatmibuf &reply, char *allocated,
+                long size) {
+    try {
+      if (err != 0 && err != TPESVCFAIL) {
+        throw xatmi_exception(err);
+      }
+      reply_received(c.svc, reply, allocated, size);
+      decompress_reply(reply);
+      require_fml32(reply);
+      std::string json;
+      fml_to_json(json, *reply.fbfr(), flat);
+      respond(c, err == TPESVCFAIL ? 500 : 200, json, c.keepalive);
+    } catch (const xatmi_exception &e) {
+      respond_failure(c, e, c.keepalive);
+    } catch (const std::exception &e) {
+      respond_error(c, 502, e.what(), c.keepalive);
+    }
+  }
+
+  void call_hook(connection &c, py::object &hook, const std::string &path,
+                 const char *body, size_t length, bool keepalive) {
+    int status = 200;
+    std::string out;
+    {
+      py::gil_scoped_acquire acquire;
+      try {
+        py::object rc = hook(path, py::bytes(body, length));
+        if (py::isinstance<py::tuple>(rc)) {
+          py::tuple t = rc.cast<py::tuple>();
+          status = t[0].cast<int>();
+          rc = t[1];
+        }
+        if (py::isinstance<py::bytes>(rc)) {
+          out = rc.cast<std::string>();
+        } else if (!rc.is_none()) {
+          out = std::string(py::str(rc));
+        }
+      } catch (const std::exception &e) {
+        userlog(const_cast<char *>("serve_http %s: %s"), path.c_str(),
+                e.what());
+        status = 500;
+        out.clear();
+        json_string(out, e.what(), strlen(e.what()));
+        out = "{\"error\":" + out + "}";
+      }
+    }
+    respond(c, status, out, keepalive);
+  }
+
+  void respond_failure(connection &c, const xatmi_exception &e,
+                       bool keepalive) {
+    int status = 502;
+    if (e.code() == TPENOENT) {
+      status = 404;
+    } else if (e.code() == TPETIME) {
+      status = 504;
+    }
+    respond_error(c, status, e.what(), keepalive);
+  }
+
+  void respond_error(connection &c, int status, const char *what,
+                     bool keepalive) {
+    std::string out = "{\"error\":";
+    json_string(out, what, strlen(what));
+    out += '}';
+    respond(c, status, out, keepalive);
+  }
+
+  void respond(connection &c, int status, const std::string &body,
+               bool keepalive) {
+    if (status >= 500) {
+      errors++;
+    }
+    c.out += "HTTP/1.1 " + std::to_string(status) + " " + reason(status) +
+             "\r\nContent-Type: application/json\r\nContent-Length: " +
+             std::to_string(body.size()) + "\r\n";
+    if (!keepalive) {
+      c.out += "Connection: close\r\n";
+      c.close = true;
+    }
+    c.out += "\r\n";
+    c.out += body;
+  }
+
+  static const char *reason(int status) {
+    switch (status) {
+      case 200:
+        return "OK";
+      case 400:
+        return "Bad Request";
+      case 404:
+        return "Not Found";
+      case 405:
+        return "Method Not Allowed";
+      case 411:
+        return "Length Required";
+      case 413:
+        return "Payload Too Large";
+      case 431:
+        return "Request Header Fields Too Large";
+      case 500:
+        return "Internal Server Error";
+      case 502:
+        return "Bad Gateway";
+      case 504:
+        return "Gateway Timeout";
+      default:
+        return "Unknown";
+    }
+  }
+
+  std::map<std::string, route> routes;
+  long flags;
+  bool flat;
+  size_t max_body;
+  int listenfd;
+  int stopfd;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::atomic<bool> stopping;
+  bool stopped;
+
+  static thread_local http_server *current_server;
+
+  std::atomic<long long> accepted;
+  std::atomic<long long> active;
+  std::atomic<long long> requests;
+  std::atomic<long long> errors;
+};
+
+
+thread_local http_server *http_server::current_server = nullptr;
+
+// The Python object, stops the server when garbage collected
+struct http_server_handle {
+  explicit http_server_handle(std::shared_ptr<http_server> s_)
+      : s(std::move(s_)) {}
+  ~http_server_handle() { s->stop(); }
+
+  http_server_handle(const http_server_handle &) = delete;
+  http_server_handle &operator=(const http_server_handle &) = delete;
+
+  std::shared_ptr<http_server> s;
+};
+
+static void stop_http_servers() {
+  std::vector<http_server *> running;
+  {
+    std::lock_guard<std::mutex> lock(http_servers_mutex);
+    running.assign(http_servers.begin(), http_servers.end());
+  }
+  for (auto *s : running) {
+    s->stop();
+  }
+}
+#endif
+
+// Polls .TMIB on a native thread with its own context and publishes the
+// numeric attributes in Prometheus text format, either written to a file or
+// served over HTTP. Each object becomes one sample per attribute labelled
+// with the attributes that identify it.
+struct mib_exporter;
+static std::mutex mib_exporters_mutex;
+static std::set<mib_exporter *> mib_exporters;
+
+struct mib_exporter {
+  typedef std::chrono::steady_clock clock;
+
+  mib_exporter(double interval_, std::vector<std::string> classes_,
+               py::object target, long flags_)
+      : interval(interval_),
+        classes(classes_),
+        flags(flags_),
+        listenfd(-1),
+        stopping(false),
+        scrapes(0),
+        errors(0),
+        served(0) {
+    if (interval <= 0) {
+      throw std::invalid_argument("interval must be positive");
+    }
+    if (py::isinstance<py::int_>(target)) {
+#if defined(__linux__)
+      listen_on(target.cast<int>());
+#else
+      throw std::invalid_argument("Serving metrics needs Linux, use a path");
+#endif
+    } else {
+      path = py::str(target);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mib_exporters_mutex);
+      mib_exporters.insert(this);
+    }
+    worker = std::thread(&mib_exporter::run, this);
+  }
+  ~mib_exporter() { stop(); }
+
+  mib_exporter(const mib_exporter &) = delete;
+  mib_exporter &operator=(const mib_exporter &) = delete;
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cv.notify_all();
+    {
+      py::gil_scoped_release release;
+      if (worker.joinable()) {
+        worker.join();
+      }
+    }
+#if defined(__linux__)
+    if (listenfd != -1) {
+      ::close(listenfd);
+      listenfd = -1;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(mib_exporters_mutex);
+    mib_exporters.erase(this);
+  }
+
+  std::string text() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return metrics;
+  }
+
+  py::dict stats() {
+    py::dict d;
+    d["scrapes"] = py::int_(scrapes.load());
+    d["errors"] = py::int_(errors.load());
+    d["served"] = py::int_(served.load());
+    std::lock_guard<std::mutex> lock(mutex);
+    d["last_error"] = last_error.empty() ? py::object(py::none())
+                                         : py::object(py::str(last_error));
+    return d;
+  }
+
+ private:
+#if defined(__linux__)
+  void listen_on(int port) {
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenfd == -1) {
+      throw std::system_error(errno, std::system_category(), "socket");
+    }
+    int one = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(listenfd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ==
+            -1 ||
+        listen(listenfd, 16) == -1) {
+      int err = errno;
+      ::close(listenfd);
+      listenfd = -1;
+      throw std::system_error(err, std::system_category(), "bind");
+    }
+  }
+
+  // Answers any request with the latest metrics and closes the connection
+  void serve() {
+    int fd;
+    while ((fd = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC)) != -1) {
+      timeval tv = {1, 0};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      std::string request;
+      char buf[1024];
+      ssize_t n;
+      while (request.find("\r\n\r\n") == std::string::npos &&
+             request.size() < 8192 && (n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        request.append(buf, n);
+      }
+      std::string body = text();
+      std::string response =
+          "HTTP/1.1 200 OK\r\n"
+          "Content-Type: text/plain; version=0.0.4\r\n"
+          "Connection: close\r\n"
+          "Content-Length: " +
+          std::to_string(body.size()) + "\r\n\r\n" + body;
+      size_t sent = 0;
+      while (sent < response.size() &&
+             (n = send(fd, response.data() + sent, response.size() - sent,
+                       MSG_NOSIGNAL)) > 0) {
+        sent += n;
+      }
+      ::close(fd);
+      served++;
+    }
+  }
+#endif
+
+  void run() {
+    try {
+      with_context();
+    } catch (const std::exception &e) {
+      fail(e.what());
+      return;
+    }
+    auto period = std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(interval));
+    auto next = clock::now();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+      if (clock::now() >= next) {
+        lock.unlock();
+        scrape();
+        lock.lock();
+        next += period;
+        if (next < clock::now()) {
+          next = clock::now() + period;
+        }
+        continue;
+      }
+#if defined(__linux__)
+      if (listenfd != -1) {
+        lock.unlock();
+        pollfd p = {listenfd, POLLIN, 0};
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        next - clock::now())
+                        .count();
+        if (poll(&p, 1, static_cast<int>(std::min<long long>(
+                            std::max<long long>(wait, 0), 100))) > 0) {
+          serve();
+        }
+        lock.lock();
+        continue;
+      }
+#endif
+      cv.wait_until(lock, next);
+    }
+    lock.unlock();
+    without_context();
+  }
+
+  void fail(const std::string &message) {
+    errors++;
+    std::lock_guard<std::mutex> lock(mutex);
+    last_error = message;
+  }
+
+  void scrape() {
+    auto started = clock::now();
+    std::string out;
+    for (auto &cls : classes) {
+      try {
+        scrape(cls, out);
+      } catch (const std::exception &e) {
+        fail(cls + ": " + e.what());
+      }
+    }
+    double took =
+        std::chrono::duration<double>(clock::now() - started).count();
+    out += "tuxedo_mib_scrape_seconds " + std::to_string(took) + "\n";
+    out += "tuxedo_mib_errors_total " + std::to_string(errors.load()) + "\n";
+    scrapes++;
+
+    if (!path.empty()) {
+      // Replaced atomically for the node_exporter textfile collector
+      std::string tmp = path + ".tmp";
+      FILE *f = fopen(tmp.c_str(), "w");
+      if (f == nullptr) {
+        fail(tmp + ": " + strerror(errno));
+      } else {
+        bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+        ok = fclose(f) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+          fail(path + ": " + strerror(errno));
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    metrics.swap(out);
+  }
+
+  // GET and GETNEXT until TA_MORE is 0
+  void scrape(const std::string &cls, std::string &out) {
+    std::string prefix = "tuxedo_" + lower(cls.compare(0, 2, "T_") == 0
+                                               ? cls.substr(2)
+                                               : cls) +
+                         "_";
+    xatmibuf in("FML32", 1024);
+    xatmibuf rsp("FML32", 64 * 1024);
+    std::string cursor;
+    for (;;) {
+      Finit32(*in.fbfr(), in.len);
+      in.mutate([&](FBFR32 *fbfr) {
+        return CFchg32(fbfr, TA_CLASS, 0, const_cast<char *>(cls.c_str()), 0,
+                       FLD_STRING);
+      });
+      const char *op = cursor.empty() ? "GET" : "GETNEXT";
+      in.mutate([&](FBFR32 *fbfr) {
+        return CFchg32(fbfr, TA_OPERATION, 0, const_cast<char *>(op), 0,
+                       FLD_STRING);
+      });
+      long f = flags;
+      in.mutate([&](FBFR32 *fbfr) {
+        return CFchg32(fbfr, TA_FLAGS, 0, reinterpret_cast<char *>(&f), 0,
+                       FLD_LONG);
+      });
+      if (!cursor.empty()) {
+        in.mutate([&](FBFR32 *fbfr) {
+          return CFchg32(fbfr, TA_CURSOR, 0,
+                         const_cast<char *>(cursor.c_str()), 0, FLD_STRING);
+        });
+      }
+      if (tpcall(const_cast<char *>(".TMIB"), *in.pp, 0, rsp.pp, &rsp.len,
+                 0) == -1) {
+        throw xatmi_exception(tperrno);
+      }
+      FBFR32 *fbfr = *rsp.fbfr();
+      append(fbfr, prefix, out);
+
+      long more = 0;
+      FLDLEN32 len = sizeof(more);
+      if (CFget32(fbfr, TA_MORE, 0, reinterpret_cast<char *>(&more), &len,
+                  FLD_LONG) == -1 ||
+          more <= 0) {
+        break;
+      }
+      char *c = CFfind32(fbfr, TA_CURSOR, 0, nullptr, FLD_STRING);
+      if (c == nullptr) {
+        break;
+      }
+      cursor = c;
+    }
+  }
+
+  static std::string lower(std::string s) {
+    for (auto &c : s) {
+      c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    return s;
+  }
+
+  // Attributes that identify an object and become labels
+  bool is_label(FLDID32 fieldid, std::string &name) {
+    static const char *const keys[] = {
+        "TA_LMID",        "TA_SRVGRP", "TA_SRVID",    "TA_GRPNO",
+        "TA_SERVERNAME",  "TA_RQADDR", "TA_SERVICENAME",
+        "TA_QSPACENAME",  "TA_QMCONFIG", "TA_QNAME", "TA_STATE"};
+    const std::string &n = field_name(fieldid);
+    for (auto k : keys) {
+      if (n == k) {
+        name = lower(n.substr(3));
+        return true;
+      }
+    }
+    return false;
+  }
+
+  const std::string &field_name(FLDID32 fieldid) {
+    auto it = names.find(fieldid);
+    if (it == names.end()) {
+      char *n = Fname32(fieldid);
+      it = names
+               .insert(std::make_pair(
+                   fieldid, n != nullptr ? std::string(n)
+                                         : "FLD" + std::to_string(fieldid)))
+               .first;
+    }
+    return it->second;
+  }
+
+  void append(FBFR32 *fbfr, const std::string &prefix, std::string &out) {
+    long occurs = 0;
+    FLDLEN32 len = sizeof(occurs);
+    if (CFget32(fbfr, TA_OCCURS, 0, reinterpret_cast<char *>(&occurs), &len,
+                FLD_LONG) == -1 ||
+        occurs <= 0) {
+      return;
+    }
+    std::vector<std::string> labels(occurs);
+    std::vector<FLDID32> values;
+    FLDID32 fieldid = FIRSTFLDID;
+    FLDOCC32 oc = 0;
+    std::string label;
+    while (Fnext32(fbfr, &fieldid, &oc, nullptr, nullptr) == 1) {
+      if (oc != 0 || fieldid == TA_OCCURS || fieldid == TA_MORE ||
+          fieldid == TA_FLAGS || fieldid == TA_ERROR) {
+        continue;
+      }
+      if (is_label(fieldid, label)) {
+        for (FLDOCC32 i = 0; i < occurs; i++) {
+          char *v = CFfind32(fbfr, fieldid, i, nullptr, FLD_STRING);
+          if (v == nullptr) {
+            continue;
+          }
+          std::string &l = labels[i];
+          l += l.empty() ? "{" : ",";
+          l += label + "=\"";
+          for (; *v != '\0'; v++) {
+            if (*v == '"' || *v == '\\') {
+              l += '\\';
+            } else if (*v == '\n') {
+              l += "\\n";
+              continue;
+            }
+            l += *v;
+          }
+          l += '"';
+        }
+        continue;
+      }
+      int type = Fldtype32(fieldid);
+      if (type == FLD_SHORT || type == FLD_LONG || type == FLD_FLOAT ||
+          type == FLD_DOUBLE) {
+        values.push_back(fieldid);
+      }
+    }
+    for (auto &l : labels) {
+      if (!l.empty()) {
+        l += '}';
+      }
+    }
+    char number[64];
+    for (auto id : values) {
+      std::string name = prefix + lower(field_name(id).substr(
+                                      field_name(id).compare(0, 3, "TA_") == 0
+                                          ? 3
+                                          : 0));
+      for (FLDOCC32 i = 0; i < occurs; i++) {
+        double v;
+        FLDLEN32 len = sizeof(v);
+        if (CFget32(fbfr, id, i, reinterpret_cast<char *>(&v), &len,
+                    FLD_DOUBLE) == -1) {
+          continue;
+        }
+        c_format(number, sizeof(number), 17, v);
+        out += name;
+        out += labels[i];
+        out += ' ';
+        out += number;
+        out += '\n';
+      }
+    }
+  }
+
+  double interval;
+  std::vector<std::string> classes;
+  long flags;
+  std::string path;
+  int listenfd;
+  std::unordered_map<FLDID32, std::string> names;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping;
+  std::string metrics;
+  std::string last_error;
+
+  std::atomic<long long> scrapes;
+  std::atomic<long long> errors;
+  std::atomic<long long> served;
+};
+
+static void stop_mib_exporters() {
+  std::vector<mib_exporter *> running;
+  {
+    std::lock_guard<std::mutex> lock(mib_exporters_mutex);
+    running.assign(mib_exporters.begin(), mib_exporters.end());
+  }
+  for (auto *e : running) {
+    e->stop();
+  }
+}
 
+static int pytpacall_buf(const char *svc, xatmibuf &in, long flags) {
+  deadline_client(in);
+  trace_span span;
+  bool traced = trace_client(span, svc, in);
   py::gil_scoped_release release;
   int rc = tpacall(const_cast<char *>(svc), *in.pp, in.len, flags);
   if (rc == -1) {
+    if (traced) {
+      trace_end(span, true);
+    }
     throw xatmi_exception(tperrno);
   }
-  return rc;
+  if (!(flags & TPNOREPLY)) {
+    pending_replies[rc] = svc;
+    if (traced) {
+      trace_pending[rc] = span;
+    }
+  } else if (traced) {
+    trace_end(span, false);
+  }
+  return rc;
+}
+
+static int pytpacall(const char *svc, py::object idata, long flags) {
+  with_context();
+  alloc_scope scope(alloc_tpacall);
+  auto in = from_py(idata);
+  if (compressed_size > 0 || (flags & TPCOMPRESS)) {
+    py::gil_scoped_release release;
+    compress_request(svc, in, flags);
+  }
+  return pytpacall_buf(svc, in, flags & ~TPCOMPRESS);
+}
+
+static pytpreply pytpgetrply(int cd, long flags, py::object decode) {
+  with_context();
+  alloc_scope scope(alloc_tpgetrply);
+  if (!stashed_replies.empty()) {
+    auto it = (flags & TPGETANY) ? stashed_replies.begin()
+                                 : stashed_replies.find(cd);
+    if (it != stashed_replies.end()) {
+      auto r = std::move(it->second);
+      cd = it->first;
+      stashed_replies.erase(it);
+      pending_replies.erase(cd);
+      auto t = trace_pending.find(cd);
+      if (t != trace_pending.end()) {
+        trace_end(t->second, r->err != 0 || r->rval != 0);
+        trace_pending.erase(t);
+      }
+      if (r->err != 0) {
+        throw xatmi_exception(r->err);
+      }
+      if (decode.is_none()) {
+        return pytpreply(r->rval, r->rcode, r->out, cd);
+      }
+      return pytpreply(r->rval, r->rcode,
+                       decode_reply(r->out, decode, r->rval), cd);
+    }
+  }
+  std::string svc;
+  if (!(flags & TPGETANY)) {
+    auto it = pending_replies.find(cd);
+    if (it != pending_replies.end()) {
+      svc = it->second;
+    }
+  }
+  xatmibuf out = reply_buffer(svc);
+  char *allocated = *out.pp;
+  long size = out.len;
+  {
+    py::gil_scoped_release release;
+    int rc = tpgetrply(&cd, out.pp, &out.len, flags);
+    if (!trace_pending.empty() && (rc != -1 || tperrno == TPESVCFAIL ||
+                                   tperrno == TPESVCERR)) {
+      auto it = trace_pending.find(cd);
+      if (it != trace_pending.end()) {
+        trace_end(it->second, rc == -1);
+        trace_pending.erase(it);
+      }
+    }
+    if (rc == -1) {
+      if (tperrno == TPESVCERR) {
+        pending_replies.erase(cd);
+      }
+      if (tperrno != TPESVCFAIL) {
+        throw xatmi_exception(tperrno);
+      }
+    }
+    auto it = pending_replies.find(cd);
+    if (it != pending_replies.end()) {
+      reply_received(it->second, out, allocated, size);
+      pending_replies.erase(it);
+    }
+    decompress_reply(out);
+  }
+  if (decode.is_none()) {
+    return pytpreply(tperrno, tpurcode, out, cd);
+  }
+  int rval = tperrno;
+  long rcode = tpurcode;
+  return pytpreply(rval, rcode, decode_reply(out, decode, rval), cd);
+}
+
+// Messages for userlog() written by a background thread. Producers copy
+// them into a bounded lock-free MPMC queue (Vyukov) and never do I/O; when
+// the queue is full they either wait or count the message as dropped.
+struct async_userlog {
+  static const size_t SLOT = 1024;
+
+  struct cell {
+    std::atomic<size_t> seq;
+    size_t len;
+    char data[SLOT];
+  };
+
+  async_userlog(size_t capacity, bool block_, long flush_ms_)
+      : mask(capacity - 1),
+        cells(new cell[capacity]),
+        enqueue_pos(0),
+        dequeue_pos(0),
+        block(block_),
+        flush_ms(flush_ms_),
+        stopping(false),
+        waiting(0),
+        written(0),
+        dropped(0),
+        direct(0) {
+    for (size_t i = 0; i < capacity; i++) {
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    writer = std::thread(&async_userlog::run, this);
+  }
+  ~async_userlog() { stop(); }
+
+  // Returns false for messages that do not fit a slot
+  bool write(const char *message) {
+    size_t len = strlen(message);
+    if (len >= SLOT) {
+      direct++;
+      return false;
+    }
+    if (push(message, len)) {
+      return true;
+    }
+    if (!block) {
+      dropped++;
+      return true;
+    }
+    // Wakes up the writer and waits until it has made room
+    py::gil_scoped_release release;
+    std::unique_lock<std::mutex> lock(mutex);
+    waiting++;
+    while (!push(message, len)) {
+      cv.notify_one();
+      space.wait(lock);
+    }
+    waiting--;
+    return true;
+  }
+
+  void flush() {
+    std::lock_guard<std::mutex> lock(drain_mutex);
+    drain();
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (stopping) {
+        return;
+      }
+      stopping = true;
+    }
+    cv.notify_one();
+    if (writer.joinable()) {
+      writer.join();
+    }
+    flush();
+  }
+
+  py::dict stats() {
+    py::dict d;
+    d["written"] = py::int_(written.load());
+    d["dropped"] = py::int_(dropped.load());
+    d["direct"] = py::int_(direct.load());
+    d["queued"] = py::int_(enqueue_pos.load() - dequeue_pos.load());
+    return d;
+  }
+
+ private:
+  bool push(const char *message, size_t len) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    cell *c;
+    for (;;) {
+      c = &cells[pos & mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      intptr_t dif = intptr_t(seq) - intptr_t(pos);
+      if (dif == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    memcpy(c->data, message, len + 1);
+    c->len = len;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(std::string &message) {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    cell *c;
+    for (;;) {
+      c = &cells[pos & mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      intptr_t dif = intptr_t(seq) - intptr_t(pos + 1);
+      if (dif == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    message.assign(c->data, c->len);
+    c->seq.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Called with drain_mutex held so that messages are written in order
+  void drain() {
+    std::string message;
+    while (pop(message)) {
+      if (waiting > 0) {
+        // Taken so that a waiting writer is either asleep or sees the room
+        std::lock_guard<std::mutex> lock(mutex);
+        space.notify_all();
+      }
+      userlog(const_cast<char *>("%s"), message.c_str());
+      written++;
+    }
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+      cv.wait_for(lock, std::chrono::milliseconds(flush_ms));
+      lock.unlock();
+      flush();
+      lock.lock();
+    }
+  }
+
+  size_t mask;
+  std::unique_ptr<cell[]> cells;
+  std::atomic<size_t> enqueue_pos;
+  std::atomic<size_t> dequeue_pos;
+  bool block;
+  long flush_ms;
+
+  std::thread writer;
+  std::mutex mutex;
+  std::mutex drain_mutex;
+  std::condition_variable cv;
+  bool stopping;
+  // Writers blocked on a full queue
+  std::condition_variable space;
+  std::atomic<int> waiting;
+
+  std::atomic<long long> written;
+  std::atomic<long long> dropped;
+  std::atomic<long long> direct;
+};
+
+static std::shared_ptr<async_userlog> async_log;
+
+static void flush_userlog() {
+  auto log = async_log;
+  if (log) {
+    py::gil_scoped_release release;
+    log->flush();
+  }
 }
 
-static pytpreply pytpgetrply(int cd, long flags) {
-  with_context();
-  xatmibuf out("FML32", 1024);
-  {
+static void stop_userlog() {
+  auto log = async_log;
+  async_log.reset();
+  if (log) {
     py::gil_scoped_release release;
-    int rc = tpgetrply(&cd, out.pp, &out.len, flags);
-    if (rc == -1) {
-      if (tperrno != TPESVCFAIL) {
-        throw xatmi_exception(tperrno);
-      }
-    }
+    log->stop();
   }
-  return pytpreply(tperrno, tpurcode, out, cd);
 }
 
+// FML32 request encoded once, each call copies it and changes only the
+// fields passed as keyword arguments
+struct prepared_call {
+  prepared_call(const std::string &name_, py::dict data, long flags_)
+      : name(name_), flags(flags_) {
+    with_context();
+    tmpl = from_py(data);
+  }
+
+  xatmibuf with(py::kwargs changes) {
+    xatmibuf buf("FML32", Fsizeof32(*tmpl.fbfr()));
+    if (Fcpy32(*buf.fbfr(), *tmpl.fbfr()) == -1) {
+      throw fml32_exception(Ferror32);
+    }
+
+    for (auto it : changes) {
+      set_field(buf, lookup(it.first), it.second);
+    }
+    return buf;
+  }
+
+  FLDID32 lookup(py::handle key) {
+    if (py::isinstance<py::int_>(key)) {
+      return key.cast<py::int_>();
+    }
+    std::string k = py::str(key);
+    auto it = fieldids.find(k);
+    if (it != fieldids.end()) {
+      return it->second;
+    }
+    FLDID32 fieldid = Fldid32(const_cast<char *>(k.c_str()));
+    if (fieldid == BADFLDID) {
+      throw fml32_exception(Ferror32);
+    }
+    fieldids[k] = fieldid;
+    return fieldid;
+  }
+
+  std::string name;
+  long flags;
+  xatmibuf tmpl;
+  std::map<std::string, FLDID32> fieldids;
+};
+
 #if !TUXEDO_WSC
 #define MODULE "tuxedo"
 #else
@@ -574,6 +6454,7 @@ struct svcresult {
   char name[XATMI_SERVICE_NAME_LENGTH];
   enum state_t { NONE, FORWARD, RETURN };
   state_t state;
+  bool noreply;
   void reset() { state = NONE; }
   svcresult &with_state(state_t newstate) {
     if (state != NONE) {
@@ -583,6 +6464,17 @@ struct svcresult {
     return *this;
   }
   svcresult &with_data(py::object data) {
+    if (state == RETURN && noreply) {
+      // Nobody waits for the reply
+      odata = nullptr;
+      olen = 0;
+      return *this;
+    }
+    if (py::isinstance<pybuffer>(data)) {
+      odata = data.cast<pybuffer &>().take(&olen);
+      return *this;
+    }
+    alloc_scope scope(alloc_tpreturn);
     auto &&tdata = from_py(data);
     olen = tdata.len;
     odata = tdata.release();
@@ -600,6 +6492,16 @@ static void pytpreturn(int rval, long rcode, py::object data, long flags) {
 static void pytpforward(const std::string &svc, py::object data, long flags) {
   tsvcresult.with_state(svcresult::FORWARD).with_data(data);
   strncpy(tsvcresult.name, svc.c_str(), sizeof(tsvcresult.name));
+  if (trace_current.valid && tsvcresult.odata != nullptr) {
+    xatmibuf odata(&tsvcresult.odata, tsvcresult.olen);
+    trace_inject(odata, trace_current);
+    tsvcresult.olen = odata.len;
+  }
+  if (deadline_current > 0 && tsvcresult.odata != nullptr) {
+    xatmibuf odata(&tsvcresult.odata, tsvcresult.olen);
+    deadline_inject(odata, deadline_current);
+    tsvcresult.olen = odata.len;
+  }
 }
 
 static pytpreply pytpadmcall(py::object idata, long flags) {
@@ -617,6 +6519,166 @@ static pytpreply pytpadmcall(py::object idata, long flags) {
   return pytpreply(tperrno, tpurcode, out);
 }
 
+// With gc='managed' tuxedo.run() freezes the objects created until
+// tpsvrinit() returns and turns automatic collection off. A background
+// thread collects when no request is being served, or after max_interval
+// even when busy, following the thresholds of gc.get_threshold().
+struct gc_pause_counters {
+  gc_pause_counters() : collections(0), total_ms(0), max_ms(0) {}
+  long long collections;
+  double total_ms;
+  double max_ms;
+};
+
+static std::mutex gc_mutex;
+static std::map<std::string, gc_pause_counters> gc_pauses;
+static std::chrono::steady_clock::time_point gc_started;
+static thread_local const char *gc_service = nullptr;
+static std::atomic<int> gc_busy(0);
+static bool gc_managed = false;
+static double gc_max_interval_ms = 1000;
+
+// Collections during a service function count as its pauses
+struct gc_scope {
+  explicit gc_scope(const char *svc) : prev(gc_service), active(true) {
+    gc_service = svc;
+    gc_busy++;
+  }
+  void done() {
+    if (active) {
+      active = false;
+      gc_busy--;
+      gc_service = prev;
+    }
+  }
+  ~gc_scope() { done(); }
+
+  gc_scope(const gc_scope &) = delete;
+  gc_scope &operator=(const gc_scope &) = delete;
+
+ private:
+  const char *prev;
+  bool active;
+};
+
+// gc.callbacks entry, called with the GIL
+static void gc_callback(const std::string &phase, py::dict info) {
+  auto now = std::chrono::steady_clock::now();
+  if (phase == "start") {
+    gc_started = now;
+    return;
+  }
+  double ms =
+      std::chrono::duration<double, std::milli>(now - gc_started).count();
+  std::lock_guard<std::mutex> lock(gc_mutex);
+  auto &c = gc_pauses[gc_service != nullptr ? gc_service : "(other)"];
+  c.collections++;
+  c.total_ms += ms;
+  c.max_ms = std::max(c.max_ms, ms);
+}
+
+struct gc_collector {
+  typedef std::chrono::steady_clock clock;
+
+  explicit gc_collector(double max_interval_ms)
+      : max_interval(max_interval_ms),
+        poll(std::min(max_interval_ms, 10.0)),
+        young(0),
+        middle(0),
+        stopping(false) {
+    worker = std::thread(&gc_collector::run, this);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cv.notify_one();
+    worker.join();
+  }
+
+  void run() {
+    auto last = clock::now();
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_for(lock, poll, [this] { return stopping; });
+        if (stopping) {
+          return;
+        }
+      }
+      bool due = clock::now() - last >= max_interval;
+      if (!due && gc_busy > 0) {
+        continue;
+      }
+      py::gil_scoped_acquire acquire;
+      // A request may have started while waiting for the GIL
+      if (!due && gc_busy > 0) {
+        continue;
+      }
+      try {
+        auto gc = py::module::import("gc");
+        py::tuple threshold = gc.attr("get_threshold")();
+        py::tuple count = gc.attr("get_count")();
+        if (count[0].cast<long>() < threshold[0].cast<long>() &&
+            !(due && count[0].cast<long>() > 0)) {
+          continue;
+        }
+        int generation = 0;
+        if (++young >= threshold[1].cast<long>()) {
+          young = 0;
+          generation = 1;
+          if (++middle >= threshold[2].cast<long>()) {
+            middle = 0;
+            generation = 2;
+          }
+        }
+        const char *prev = gc_service;
+        gc_service = "(managed)";
+        gc.attr("collect")(generation);
+        gc_service = prev;
+      } catch (const std::exception &e) {
+        userlog(const_cast<char *>("%s"), e.what());
+      }
+      last = clock::now();
+    }
+  }
+
+  const std::chrono::duration<double, std::milli> max_interval;
+  const std::chrono::duration<double, std::milli> poll;
+  long young;
+  long middle;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping;
+};
+
+static std::unique_ptr<gc_collector> gc_thread;
+
+// After tpsvrinit(), with the GIL
+static void gc_manage() {
+  auto gc = py::module::import("gc");
+  gc.attr("collect")();
+  if (hasattr(gc, "freeze")) {
+    gc.attr("freeze")();
+  }
+  gc.attr("disable")();
+  gc_thread.reset(new gc_collector(gc_max_interval_ms));
+}
+
+// Before tpsvrdone(), without the GIL
+static void gc_unmanage() {
+  if (!gc_thread) {
+    return;
+  }
+  gc_thread->stop();
+  gc_thread.reset();
+  py::gil_scoped_acquire acquire;
+  py::module::import("gc").attr("enable")();
+}
+
 int tpsvrinit(int argc, char *argv[]) {
   if (!thread_context) {
     thread_context.reset(new context());
@@ -632,17 +6694,30 @@ int tpsvrinit(int argc, char *argv[]) {
     for (int i = 0; i < argc; i++) {
       args.push_back(argv[i]);
     }
-    return server.attr(__func__)(args).cast<int>();
+    int rc = server.attr(__func__)(args).cast<int>();
+    if (rc != -1 && gc_managed) {
+      gc_manage();
+    }
+    return rc;
+  }
+  if (gc_managed) {
+    gc_manage();
   }
   return 0;
 }
 void tpsvrdone() {
+  gc_unmanage();
   py::gil_scoped_acquire acquire;
   if (hasattr(server, __func__)) {
     server.attr(__func__)();
   }
+  flush_userlog();
 }
+// Dispatch threads of a multithreaded server
+static std::atomic<int> dispatch_threads(0);
+
 int tpsvrthrinit(int argc, char *argv[]) {
+  dispatch_threads++;
   if (!thread_context) {
     thread_context.reset(new context());
   }
@@ -668,23 +6743,749 @@ int tpsvrthrinit(int argc, char *argv[]) {
   return 0;
 }
 void tpsvrthrdone() {
+  dispatch_threads--;
   py::gil_scoped_acquire acquire;
   if (hasattr(server, __func__)) {
     server.attr(__func__)();
   }
 }
+// Per-service concurrency limit checked before the request is converted or
+// the GIL is taken, requests over the limit fail right away with TPFAIL.
+// The adaptive limit grows by one per limit requests answered within the
+// target latency and shrinks by 10% at most once per target when slower.
+struct admission_limiter {
+  typedef std::chrono::steady_clock clock;
+
+  admission_limiter(int limit_, bool adaptive_, double target_ms,
+                    int min_limit_, long rcode_)
+      : max_limit(limit_),
+        min_limit(std::max(1, std::min(min_limit_, limit_))),
+        adaptive(adaptive_),
+        target(std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double, std::milli>(target_ms))),
+        rcode(rcode_),
+        limit(limit_),
+        current(limit_),
+        inflight(0),
+        admitted(0),
+        rejected(0),
+        slow(0),
+        decreased(clock::now()) {}
+
+  bool acquire() {
+    if (inflight.fetch_add(1, std::memory_order_acquire) >=
+        limit.load(std::memory_order_relaxed)) {
+      inflight.fetch_sub(1, std::memory_order_release);
+      rejected++;
+      return false;
+    }
+    admitted++;
+    return true;
+  }
+
+  void release(clock::time_point started) {
+    inflight.fetch_sub(1, std::memory_order_release);
+    if (!adaptive) {
+      return;
+    }
+    auto now = clock::now();
+    bool late = now - started > target;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (late) {
+      slow++;
+      if (now - decreased > target) {
+        current = std::max<double>(min_limit, current * 0.9);
+        decreased = now;
+      }
+    } else {
+      current = std::min<double>(max_limit, current + 1 / current);
+    }
+    limit.store(static_cast<int>(current), std::memory_order_relaxed);
+  }
+
+  py::dict stats() {
+    py::dict d;
+    d["limit"] = py::int_(limit.load());
+    d["inflight"] = py::int_(inflight.load());
+    d["admitted"] = py::int_(admitted.load());
+    d["rejected"] = py::int_(rejected.load());
+    d["slow"] = py::int_(slow.load());
+    return d;
+  }
+
+  const int max_limit;
+  const int min_limit;
+  const bool adaptive;
+  const clock::duration target;
+  const long rcode;
+
+ private:
+  std::atomic<int> limit;
+  double current;
+  std::atomic<int> inflight;
+  std::atomic<long long> admitted;
+  std::atomic<long long> rejected;
+  std::atomic<long long> slow;
+  std::mutex mutex;
+  clock::time_point decreased;
+};
+
+typedef std::map<std::string, std::shared_ptr<admission_limiter>>
+    admission_map;
+// Replaced as a whole so that dispatch reads it without a lock
+static std::shared_ptr<const admission_map> admission_limits;
+static std::atomic<bool> admission_enabled(false);
+static std::mutex admission_mutex;
+
+static std::shared_ptr<admission_limiter> find_limiter(const char *svc) {
+  auto limits = std::atomic_load(&admission_limits);
+  if (!limits) {
+    return nullptr;
+  }
+  auto it = limits->find(svc);
+  return it == limits->end() ? nullptr : it->second;
+}
+
+static void set_limiter(const std::string &svc,
+                        std::shared_ptr<admission_limiter> limiter) {
+  std::lock_guard<std::mutex> lock(admission_mutex);
+  auto limits = std::atomic_load(&admission_limits);
+  std::shared_ptr<admission_map> copy =
+      limits ? std::make_shared<admission_map>(*limits)
+             : std::make_shared<admission_map>();
+  if (limiter) {
+    (*copy)[svc] = limiter;
+  } else {
+    copy->erase(svc);
+  }
+  admission_enabled = !copy->empty();
+  std::atomic_store(&admission_limits,
+                    std::shared_ptr<const admission_map>(copy));
+}
+
+// Continues the trace of the caller or starts a new one, the service becomes
+// the current context for calls it makes
+static bool trace_server_start(trace_span &s, TPSVCINFO *svcinfo) {
+  trace_context parent;
+  char type[8];
+  char subtype[16];
+  if (svcinfo->data != nullptr &&
+      tptypes(svcinfo->data, type, subtype) != -1 &&
+      strcmp(type, "FML32") == 0) {
+    auto fbfr = reinterpret_cast<FBFR32 *>(svcinfo->data);
+    FLDID32 field = trace_field.load(std::memory_order_relaxed);
+    FLDLEN32 len;
+    auto value = Ffind32(fbfr, field, 0, &len);
+    if (value != nullptr) {
+      trace_parse(value, parent);
+      // The service sees the request without the caller's context, so it
+      // can be cached, coalesced or returned as it is
+      Fdel32(fbfr, field, 0);
+    }
+  }
+  if (!trace_start(s, svcinfo->name, SPAN_SERVER, parent)) {
+    trace_current = parent;
+    return false;
+  }
+  memcpy(trace_current.trace_id, s.trace_id, sizeof(s.trace_id));
+  memcpy(trace_current.span_id, s.span_id, sizeof(s.span_id));
+  trace_current.valid = trace_current.sampled = true;
+  return true;
+}
+
+static void trace_server_end(trace_span &s, bool traced, bool error) {
+  if (traced) {
+    trace_end(s, error);
+  }
+  trace_current.valid = false;
+}
+
+// Profiles calls of one service on demand, either with cProfile or by
+// sampling the Python stack of the dispatching thread. One call at a time is
+// profiled, concurrent calls of the same service run as usual. Sessions are
+// only touched with the GIL held.
+struct profile_session {
+  typedef std::chrono::steady_clock clock;
+
+  profile_session(const std::string &svc_, double seconds, long max_calls_,
+                  bool sampling_, double interval_ms, bool memory_,
+                  const std::string &path_, size_t limit_)
+      : svc(svc_),
+        max_calls(max_calls_),
+        sampling(sampling_),
+        memory(memory_),
+        path(path_),
+        limit(limit_),
+        interval(interval_ms),
+        started(clock::now()),
+        deadline(seconds > 0
+                     ? started + std::chrono::duration_cast<clock::duration>(
+                                     std::chrono::duration<double>(seconds))
+                     : clock::time_point::max()),
+        calls(0),
+        peak(0),
+        finished(false),
+        active(0),
+        stopping(false) {
+    if (memory) {
+      tracemalloc = py::module::import("tracemalloc");
+      if (tracemalloc.attr("is_tracing")().cast<bool>()) {
+        throw std::invalid_argument("tracemalloc is already tracing");
+      }
+    }
+    if (sampling) {
+      sampler = std::thread(&profile_session::sample, this);
+    } else {
+      profiler = py::module::import("cProfile").attr("Profile")();
+    }
+  }
+
+  bool expired() {
+    return (max_calls > 0 && calls >= max_calls) || clock::now() >= deadline;
+  }
+
+  // Before the service function
+  bool begin() {
+    if (finished || !busy.try_lock()) {
+      return false;
+    }
+    if (expired()) {
+      busy.unlock();
+      finish();
+      return false;
+    }
+    try {
+      if (memory) {
+        tracemalloc.attr("start")(25);
+      }
+      if (sampling) {
+        active = PyThread_get_thread_ident();
+      } else {
+        // Fails when another profiler is active in this thread
+        profiler.attr("enable")();
+      }
+    } catch (py::error_already_set &e) {
+      if (memory) {
+        tracemalloc.attr("stop")();
+      }
+      busy.unlock();
+      return false;
+    }
+    return true;
+  }
+
+  // After the service function, also when it raised
+  void end() {
+    if (sampling) {
+      active = 0;
+    } else {
+      profiler.attr("disable")();
+    }
+    if (memory) {
+      auto snapshot = tracemalloc.attr("take_snapshot")();
+      peak = std::max(peak, tracemalloc.attr("get_traced_memory")()
+                                .cast<py::tuple>()[1]
+                                .cast<long long>());
+      tracemalloc.attr("stop")();
+      for (auto stat : snapshot.attr("statistics")("lineno")) {
+        auto frame = stat.attr("traceback")[py::int_(0)];
+        auto &a = allocs[frame.attr("filename").cast<std::string>() + ":" +
+                         std::to_string(frame.attr("lineno").cast<long>())];
+        a.first += stat.attr("size").cast<long long>();
+        a.second += stat.attr("count").cast<long long>();
+      }
+    }
+    calls++;
+    busy.unlock();
+    if (expired()) {
+      finish();
+    }
+  }
+
+  void sample() {
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_for(lock, interval, [this] { return stopping; });
+        if (stopping) {
+          return;
+        }
+      }
+      unsigned long tid = active.load();
+      if (tid == 0) {
+        continue;
+      }
+      py::gil_scoped_acquire acquire;
+      // The call may have ended while waiting for the GIL
+      if (active.load() != tid) {
+        continue;
+      }
+      try {
+        py::dict frames = py::module::import("sys").attr("_current_frames")();
+        py::int_ key(tid);
+        if (!frames.contains(key)) {
+          continue;
+        }
+        std::string stack;
+        for (py::object f = frames[key]; !f.is_none(); f = f.attr("f_back")) {
+          auto code = f.attr("f_code");
+          auto name = code.attr("co_name").cast<std::string>() + " (" +
+                      code.attr("co_filename").cast<std::string>() + ":" +
+                      std::to_string(code.attr("co_firstlineno").cast<long>()) +
+                      ")";
+          stack = stack.empty() ? name : name + ";" + stack;
+        }
+        stacks[stack]++;
+      } catch (py::error_already_set &e) {
+        return;
+      }
+    }
+  }
+
+  // Stops sampling and writes the file, called with the GIL held
+  void finish() {
+    if (finished) {
+      return;
+    }
+    finished = true;
+    elapsed = clock::now() - started;
+    if (sampler.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      cv.notify_all();
+      py::gil_scoped_release release;
+      sampler.join();
+    }
+    if (path.empty()) {
+      return;
+    }
+    if (!sampling) {
+      if (calls > 0) {
+        profiler.attr("dump_stats")(path);
+      }
+      return;
+    }
+    std::unique_ptr<FILE, decltype(&fclose)> f(fopen(path.c_str(), "w"),
+                                               &fclose);
+    if (!f) {
+      userlog(const_cast<char *>("Failed to write profile %s: %s"),
+              path.c_str(), strerror(errno));
+      return;
+    }
+    for (auto &it : stacks) {
+      fprintf(f.get(), "%s %lld\n", it.first.c_str(), it.second);
+    }
+  }
+
+  template <typename T>
+  std::vector<std::pair<std::string, T>> top(
+      const std::map<std::string, T> &m,
+      std::function<bool(const T &, const T &)> greater) {
+    std::vector<std::pair<std::string, T>> v(m.begin(), m.end());
+    std::sort(v.begin(), v.end(),
+              [&](const std::pair<std::string, T> &a,
+                  const std::pair<std::string, T> &b) {
+                return greater(a.second, b.second);
+              });
+    if (v.size() > limit) {
+      v.resize(limit);
+    }
+    return v;
+  }
+
+  // Field names are the same when returned by the admin service as FML32
+  py::dict result() {
+    if (!finished && expired() && busy.try_lock()) {
+      busy.unlock();
+      finish();
+    }
+    py::dict d;
+    d["PROFILE_SVC"] = py::str(svc);
+    d["PROFILE_STATE"] = py::str(finished ? "DONE" : "RUNNING");
+    d["PROFILE_CALLS"] = py::int_(calls);
+    d["PROFILE_SECONDS"] = py::float_(
+        std::chrono::duration<double>(finished ? elapsed
+                                               : clock::now() - started)
+            .count());
+
+    // pstats would disable the profiler of a call in progress
+    if (!sampling && calls > 0 && busy.try_lock()) {
+      std::lock_guard<std::mutex> lock(busy, std::adopt_lock);
+      std::map<std::string, std::tuple<long long, double, double>> funcs;
+      py::dict stats =
+          py::module::import("pstats").attr("Stats")(profiler).attr("stats");
+      for (auto item : stats) {
+        auto func = item.first.cast<py::tuple>();
+        auto value = item.second.cast<py::tuple>();
+        funcs[func[0].cast<std::string>() + ":" +
+              std::to_string(func[1].cast<long>()) + "(" +
+              func[2].cast<std::string>() + ")"] =
+            std::make_tuple(value[1].cast<long long>(),
+                            value[2].cast<double>(), value[3].cast<double>());
+      }
+      py::list names, ncalls, tottime, cumtime;
+      for (auto &it : top<std::tuple<long long, double, double>>(
+               funcs, [](const std::tuple<long long, double, double> &a,
+                         const std::tuple<long long, double, double> &b) {
+                 return std::get<1>(a) > std::get<1>(b);
+               })) {
+        names.append(py::str(it.first));
+        ncalls.append(py::int_(std::get<0>(it.second)));
+        tottime.append(py::float_(std::get<1>(it.second)));
+        cumtime.append(py::float_(std::get<2>(it.second)));
+      }
+      d["PROFILE_FUNC"] = names;
+      d["PROFILE_NCALLS"] = ncalls;
+      d["PROFILE_TOTTIME"] = tottime;
+      d["PROFILE_CUMTIME"] = cumtime;
+    }
+    if (sampling) {
+      py::list names, samples;
+      for (auto &it : top<long long>(stacks, [](const long long &a,
+                                                const long long &b) {
+             return a > b;
+           })) {
+        names.append(py::str(it.first));
+        samples.append(py::int_(it.second));
+      }
+      d["PROFILE_STACK"] = names;
+      d["PROFILE_SAMPLES"] = samples;
+    }
+    if (memory) {
+      py::list names, sizes, counts;
+      for (auto &it : top<std::pair<long long, long long>>(
+               allocs, [](const std::pair<long long, long long> &a,
+                          const std::pair<long long, long long> &b) {
+                 return a.first > b.first;
+               })) {
+        names.append(py::str(it.first));
+        sizes.append(py::int_(it.second.first));
+        counts.append(py::int_(it.second.second));
+      }
+      d["PROFILE_ALLOC"] = names;
+      d["PROFILE_ALLOC_SIZE"] = sizes;
+      d["PROFILE_ALLOC_COUNT"] = counts;
+      d["PROFILE_PEAK"] = py::int_(peak);
+    }
+    return d;
+  }
+
+  const std::string svc;
+  const long max_calls;
+  const bool sampling;
+  const bool memory;
+  const std::string path;
+  const size_t limit;
+  const std::chrono::duration<double, std::milli> interval;
+  const clock::time_point started;
+  const clock::time_point deadline;
+  clock::duration elapsed;
+  long calls;
+  long long peak;
+  bool finished;
+  py::object profiler;
+  py::object tracemalloc;
+  std::map<std::string, long long> stacks;
+  std::map<std::string, std::pair<long long, long long>> allocs;
+  std::mutex busy;
+
+  std::thread sampler;
+  std::atomic<unsigned long> active;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping;
+};
+
+// Never destroyed, holds Python objects that must not outlive the interpreter
+static auto &profiles =
+    *new std::map<std::string, std::shared_ptr<profile_session>>();
+// Set while a profile has not finished
+static std::atomic<bool> profile_enabled(false);
+static std::string profile_admin_name;
+static std::atomic<bool> profile_admin_enabled(false);
+
+static void profile_update_enabled() {
+  bool running = false;
+  for (auto &it : profiles) {
+    running = running || !it.second->finished;
+  }
+  profile_enabled = running;
+}
+
+static void start_profile(const std::string &svc, double seconds, long calls,
+                          bool sampling, double interval_ms, bool memory,
+                          const std::string &path, size_t limit) {
+  if (seconds <= 0 && calls <= 0) {
+    throw std::invalid_argument("seconds or calls must be given");
+  }
+  if (sampling && interval_ms <= 0) {
+    throw std::invalid_argument("interval_ms must be positive");
+  }
+  // tracemalloc sees the allocations of all threads
+  if (memory && dispatch_threads > 1) {
+    throw std::invalid_argument(
+        "memory=True needs a server with a single dispatch thread");
+  }
+  for (auto &it : profiles) {
+    if (memory && it.second->memory && !it.second->finished &&
+        it.first != svc) {
+      throw std::invalid_argument("tracemalloc is used by profile of " +
+                                  it.first);
+    }
+  }
+  auto it = profiles.find(svc);
+  if (it != profiles.end()) {
+    it->second->finish();
+  }
+  profiles[svc] = std::make_shared<profile_session>(
+      svc, seconds, calls, sampling, interval_ms, memory, path, limit);
+  profile_enabled = true;
+}
+
+static py::object profile_result(const std::string &svc, bool stop) {
+  auto it = profiles.find(svc);
+  if (it == profiles.end()) {
+    return py::none();
+  }
+  auto session = it->second;
+  if (stop) {
+    session->finish();
+    profiles.erase(it);
+  }
+  auto result = session->result();
+  profile_update_enabled();
+  return result;
+}
+
+static void stop_profiles() {
+  for (auto &it : profiles) {
+    it.second->finish();
+  }
+}
+
+struct profile_scope {
+  explicit profile_scope(const char *svc) {
+    if (!profile_enabled.load(std::memory_order_relaxed)) {
+      return;
+    }
+    auto it = profiles.find(svc);
+    if (it != profiles.end()) {
+      if (it->second->begin()) {
+        session = it->second;
+      } else if (it->second->finished) {
+        profile_update_enabled();
+      }
+    }
+  }
+  ~profile_scope() {
+    if (session) {
+      try {
+        session->end();
+      } catch (const std::exception &e) {
+        userlog(const_cast<char *>("Profile of %s: %s"), session->svc.c_str(),
+                e.what());
+      }
+      if (session->finished) {
+        profile_update_enabled();
+      }
+    }
+  }
+  std::shared_ptr<profile_session> session;
+};
+
+// The admin service starts a profile when PROFILE_SECONDS or PROFILE_CALLS
+// is given and returns the result so far otherwise
+static void profile_admin(TPSVCINFO *svcinfo) {
+  tsvcresult.reset();
+  tsvcresult.noreply = (svcinfo->flags & TPNOREPLY) != 0;
+  try {
+    py::gil_scoped_acquire acquire;
+    auto in = xatmibuf(svcinfo);
+    py::dict req = to_py(in);
+    auto get = [&](const char *name) -> py::object {
+      if (!req.contains(name)) {
+        return py::none();
+      }
+      return req[name].cast<py::list>()[0];
+    };
+    if (get("PROFILE_SVC").is_none()) {
+      throw std::invalid_argument("PROFILE_SVC is missing");
+    }
+    auto svc = get("PROFILE_SVC").cast<std::string>();
+    auto seconds = get("PROFILE_SECONDS");
+    auto calls = get("PROFILE_CALLS");
+    py::object result;
+    if (!seconds.is_none() || !calls.is_none()) {
+      auto mode = get("PROFILE_MODE");
+      auto memory = get("PROFILE_MEMORY");
+      auto path = get("PROFILE_PATH");
+      start_profile(svc, seconds.is_none() ? 0.0 : seconds.cast<double>(),
+                    calls.is_none() ? 0 : calls.cast<long>(),
+                    !mode.is_none() && mode.cast<std::string>() == "sampling",
+                    10.0, !memory.is_none() && memory.cast<long>() != 0,
+                    path.is_none() ? "" : path.cast<std::string>(), 50);
+      result = profiles[svc]->result();
+    } else {
+      result = profile_result(svc, false);
+      if (result.is_none()) {
+        throw std::invalid_argument("No profile of " + svc);
+      }
+    }
+    tsvcresult.with_state(svcresult::RETURN).with_data(result);
+    tsvcresult.rval = TPSUCCESS;
+    tsvcresult.rcode = 0;
+  } catch (const std::exception &e) {
+    userlog(const_cast<char *>("%s: %s"), svcinfo->name, e.what());
+    tpreturn(TPFAIL, 0, nullptr, 0, 0);
+    return;
+  }
+  tpreturn(tsvcresult.rval, tsvcresult.rcode, tsvcresult.odata,
+           tsvcresult.olen, 0);
+}
+
+// Compresses the reply or the forwarded request once the service is done,
+// without the GIL
+static void compress_reply(TPSVCINFO *svcinfo, char *unpacked) {
+  bool forward = tsvcresult.state == svcresult::FORWARD;
+  compress_config c;
+  if (!compress_settings(forward ? tsvcresult.name : svcinfo->name, 0, c)) {
+    return;
+  }
+  try {
+    xatmibuf reply(&tsvcresult.odata, tsvcresult.olen);
+    xatmibuf packed;
+    if (!compress_buffer(reply, c, packed)) {
+      return;
+    }
+    if (forward && trace_current.valid) {
+      trace_inject(packed, trace_current);
+    }
+    if (forward && deadline_current > 0) {
+      deadline_inject(packed, deadline_current);
+    }
+    if (tsvcresult.odata != svcinfo->data && tsvcresult.odata != unpacked) {
+      tpfree(tsvcresult.odata);
+    }
+    tsvcresult.olen = packed.len;
+    tsvcresult.odata = packed.release();
+  } catch (const std::exception &e) {
+    // Sent as it is
+    userlog(const_cast<char *>("%s"), e.what());
+  }
+}
+
 void PY(TPSVCINFO *svcinfo) {
   if (!thread_context) {
     thread_context.reset(new context());
   }
   tsvcresult.reset();
+  tsvcresult.noreply = (svcinfo->flags & TPNOREPLY) != 0;
+
+  // Without TPSECONDARYRQ the event services of other servers of an MSSQ
+  // set may get here, all caches with subscriptions are cleared then
+  if (strncmp(svcinfo->name, ".PYC", 4) == 0) {
+    {
+      std::lock_guard<std::mutex> lock(reply_cache_mutex);
+      auto it = cache_event_services.find(svcinfo->name);
+      if (it != cache_event_services.end()) {
+        auto c = reply_cache.find(it->second);
+        if (c != reply_cache.end()) {
+          c->second.clear();
+        }
+      } else {
+        cache_clear_subscribed();
+      }
+    }
+    tpreturn(TPSUCCESS, 0, nullptr, 0, 0);
+    return;
+  }
+
+  if (profile_admin_enabled.load(std::memory_order_acquire) &&
+      profile_admin_name == svcinfo->name) {
+    profile_admin(svcinfo);
+    return;
+  }
+
+  deadline_current = 0;
+  if (deadline_field != BADFLDID && !deadline_server_start(svcinfo)) {
+    tpreturn(TPFAIL, deadline_rcode, nullptr, 0, 0);
+    return;
+  }
+
+  struct admission_guard {
+    std::shared_ptr<admission_limiter> limiter;
+    admission_limiter::clock::time_point started;
+    void done() {
+      if (limiter) {
+        limiter->release(started);
+        limiter.reset();
+      }
+    }
+    ~admission_guard() { done(); }
+  } admission;
+  if (admission_enabled.load(std::memory_order_relaxed)) {
+    auto limiter = find_limiter(svcinfo->name);
+    if (limiter) {
+      if (!limiter->acquire()) {
+        tpreturn(TPFAIL, limiter->rcode, nullptr, 0, 0);
+        return;
+      }
+      admission.limiter = limiter;
+      admission.started = admission_limiter::clock::now();
+    }
+  }
+
+  trace_span span;
+  bool traced = trace_enabled.load(std::memory_order_relaxed) &&
+                trace_server_start(span, svcinfo);
+
+  // A compressed request is unpacked for the service, svcinfo->data stays
+  // as Tuxedo passed it
+  xatmibuf unpacked;
+  char **ipp = &svcinfo->data;
+  long ilen = svcinfo->len;
 
   try {
-    py::gil_scoped_acquire acquire;
-    auto in = xatmibuf(svcinfo);
-    auto idata = to_py(in);
+    if (compress_field != BADFLDID &&
+        decompress_buffer(svcinfo->data, svcinfo->len, unpacked)) {
+      ipp = unpacked.pp;
+      ilen = unpacked.len;
+    }
+    // The service sees the request without its deadline
+    if (deadline_current > 0) {
+      Fdel32(reinterpret_cast<FBFR32 *>(svcinfo->data), deadline_field, 0);
+    }
 
+    py::gil_scoped_acquire acquire;
+    gc_scope gc(svcinfo->name);
     auto &&func = server.attr(svcinfo->name);
+
+    py::object idata;
+    pybuffer *view = nullptr;
+    char type[8];
+    char subtype[16];
+    if (hasattr(func, "__tuxedo_inplace__") &&
+        tptypes(*ipp, type, subtype) != -1 && strcmp(type, "FML32") == 0) {
+      idata = py::cast(new pybuffer(xatmibuf(ipp, ilen)),
+                       py::return_value_policy::take_ownership);
+      view = idata.cast<pybuffer *>();
+    } else {
+      auto in = xatmibuf(ipp, ilen);
+      auto mode = py::getattr(func, "__tuxedo_decode__", py::none());
+      idata = mode.is_none() ? to_py(in) : to_py(in, mode.cast<int>());
+    }
+    // The request buffer belongs to Tuxedo once the service returns
+    struct view_guard {
+      pybuffer *view;
+      ~view_guard() {
+        if (view != nullptr) {
+          view->valid = false;
+        }
+      }
+    } guard{view};
+
     auto &&code = func.attr("__code__");
     long argcount = (code.attr("co_argcount")
 #if PY_MAJOR_VERSION >= 3
@@ -710,17 +7511,41 @@ void PY(TPSVCINFO *svcinfo) {
           reinterpret_cast<char *>(&svcinfo->cltid), sizeof(svcinfo->cltid));
     }
 
-    func(idata, **kwargs);
+    {
+      profile_scope profiling(svcinfo->name);
+      func(idata, **kwargs);
+    }
 
     if (tsvcresult.state == svcresult::NONE) {
       userlog(const_cast<char *>("tpreturn() not called"));
+      trace_server_end(span, traced, true);
+      traced = false;
+      admission.done();
+      gc.done();
       tpreturn(TPEXIT, 0, nullptr, 0, 0);
     }
   } catch (const std::exception &e) {
     userlog(const_cast<char *>("%s"), e.what());
+    trace_server_end(span, traced, true);
+    traced = false;
+    admission.done();
     tpreturn(TPEXIT, 0, nullptr, 0, 0);
   }
 
+  if (tsvcresult.odata != nullptr &&
+      (compressed_size > 0 || compress_field != BADFLDID)) {
+    compress_reply(svcinfo, unpacked.p);
+  }
+  if (unpacked.p != nullptr && tsvcresult.odata == unpacked.p) {
+    // Now owned by tpreturn()
+    unpacked.release();
+  }
+
+  trace_server_end(span, traced,
+                   tsvcresult.state == svcresult::RETURN &&
+                       tsvcresult.rval != TPSUCCESS);
+  admission.done();
+  deadline_current = 0;
   if (tsvcresult.state == svcresult::FORWARD) {
     tpforward(tsvcresult.name, tsvcresult.odata, tsvcresult.olen, 0);
   } else {
@@ -793,7 +7618,26 @@ struct tmsvrargs_t *_tmgetsvrargs(const char *rmname) {
 }
 
 static void pyrun(py::object svr, std::vector<std::string> args,
-                  const char *rmname) {
+                  const char *rmname, const std::string &gc,
+                  double gc_interval_ms) {
+  if (gc != "auto" && gc != "managed") {
+    throw std::invalid_argument("gc must be 'auto' or 'managed'");
+  }
+  gc_managed = gc == "managed";
+  gc_max_interval_ms = gc_interval_ms;
+  auto callbacks = py::module::import("gc").attr("callbacks");
+  py::object callback = py::cpp_function(&gc_callback);
+  callbacks.attr("append")(callback);
+  struct callback_guard {
+    py::object callbacks, callback;
+    ~callback_guard() {
+      try {
+        callbacks.attr("remove")(callback);
+      } catch (py::error_already_set &e) {
+      }
+    }
+  } guard{callbacks, callback};
+
   server = svr;
   try {
     py::gil_scoped_release release;
@@ -855,16 +7699,19 @@ static PyObject *make_exception(PyObject *obj) {
   return obj;
 }
 
+static PyObject *XatmiException;
+static PyObject *QmException;
+static PyObject *Fml32Exception;
+
 static void register_exceptions(py::module &m) {
-  static auto *XatmiException =
+  XatmiException =
       PyErr_NewException(MODULE ".XatmiException", nullptr, nullptr);
   m.add_object("XatmiException", py::handle(make_exception(XatmiException)));
 
-  static auto *QmException =
-      PyErr_NewException(MODULE ".QmException", nullptr, nullptr);
+  QmException = PyErr_NewException(MODULE ".QmException", nullptr, nullptr);
   m.add_object("QmException", py::handle(make_exception(QmException)));
 
-  static auto *Fml32Exception =
+  Fml32Exception =
       PyErr_NewException(MODULE ".Fml32Exception", nullptr, nullptr);
   m.add_object("Fml32Exception", py::handle(make_exception(Fml32Exception)));
 
@@ -883,6 +7730,315 @@ static void register_exceptions(py::module &m) {
   });
 }
 
+// Sets the Python error for the exception being handled the way pybind11
+// does, for functions called without it
+static void set_python_error() {
+  try {
+    throw;
+  } catch (const qm_exception &e) {
+    PyErr_SetObject(QmException, py::make_tuple(e.what(), e.code()).ptr());
+  } catch (const xatmi_exception &e) {
+    PyErr_SetObject(XatmiException, py::make_tuple(e.what(), e.code()).ptr());
+  } catch (const fml32_exception &e) {
+    PyErr_SetObject(Fml32Exception, py::make_tuple(e.what(), e.code()).ptr());
+  } catch (py::error_already_set &e) {
+    e.restore();
+  } catch (const py::builtin_exception &e) {
+    e.set_error();
+  } catch (const std::bad_alloc &e) {
+    PyErr_SetString(PyExc_MemoryError, e.what());
+  } catch (const std::domain_error &e) {
+    PyErr_SetString(PyExc_ValueError, e.what());
+  } catch (const std::invalid_argument &e) {
+    PyErr_SetString(PyExc_ValueError, e.what());
+  } catch (const std::length_error &e) {
+    PyErr_SetString(PyExc_ValueError, e.what());
+  } catch (const std::out_of_range &e) {
+    PyErr_SetString(PyExc_IndexError, e.what());
+  } catch (const std::range_error &e) {
+    PyErr_SetString(PyExc_ValueError, e.what());
+  } catch (const std::overflow_error &e) {
+    PyErr_SetString(PyExc_OverflowError, e.what());
+  } catch (const std::exception &e) {
+    PyErr_SetString(PyExc_RuntimeError, e.what());
+  } catch (...) {
+    PyErr_SetString(PyExc_RuntimeError, "Caught an unknown exception!");
+  }
+}
+
+// Replies unpack natively into rval, rcode, data, cd is only an attribute
+// as the use is rare case of tpgetrply(TPGETANY)
+static PyStructSequence_Field TpReply_fields[] = {
+    {const_cast<char *>("rval"), nullptr},
+    {const_cast<char *>("rcode"), nullptr},
+    {const_cast<char *>("data"), nullptr},
+    {const_cast<char *>("cd"), nullptr},
+    {nullptr, nullptr}};
+static PyStructSequence_Desc TpReply_desc = {
+    const_cast<char *>(MODULE ".TpReply"),
+    const_cast<char *>("Reply of a service, unpacks into rval, rcode, data"),
+    TpReply_fields, 3};
+static PyTypeObject TpReplyType;
+
+static void TpReply_init_type() {
+#if PY_MAJOR_VERSION >= 3
+  if (PyStructSequence_InitType2(&TpReplyType, &TpReply_desc) != 0) {
+    throw py::error_already_set();
+  }
+#else
+  PyStructSequence_InitType(&TpReplyType, &TpReply_desc);
+#endif
+}
+
+// A cached or shared reply is converted here, each caller gets its own
+// objects to change
+static PyObject *reply_to_py(pytpreply &r) {
+  py::object data = r.data;
+  if (r.raw) {
+    data = to_py(*r.raw);
+  } else if (!data) {
+    data = py::none();
+  }
+  PyObject *ret = PyStructSequence_New(&TpReplyType);
+  if (ret == nullptr) {
+    throw py::error_already_set();
+  }
+  PyStructSequence_SET_ITEM(ret, 0, PyLong_FromLong(r.rval));
+  PyStructSequence_SET_ITEM(ret, 1, PyLong_FromLong(r.rcode));
+  PyStructSequence_SET_ITEM(ret, 2, data.release().ptr());
+  PyStructSequence_SET_ITEM(ret, 3, PyLong_FromLong(r.cd));
+  return ret;
+}
+
+namespace pybind11 {
+namespace detail {
+template <>
+struct type_caster<pytpreply> {
+#if PYBIND11_VERSION_MAJOR > 2 || PYBIND11_VERSION_MINOR >= 9
+  static constexpr auto name = const_name("TpReply");
+#else
+  static constexpr auto name = _("TpReply");
+#endif
+  static handle cast(pytpreply src, return_value_policy, handle) {
+    return reply_to_py(src);
+  }
+};
+}  // namespace detail
+}  // namespace pybind11
+
+#if PY_VERSION_HEX >= 0x03070000
+// The hottest functions are called with METH_FASTCALL, without the argument
+// conversions and overload resolution of pybind11
+
+// Puts arguments by position or keyword in args_, nullptr when not passed
+static bool fast_args(const char *fname, const char *const *names,
+                      Py_ssize_t count, Py_ssize_t required,
+                      PyObject *const *args, Py_ssize_t nargs,
+                      PyObject *kwnames, PyObject **args_) {
+  if (nargs > count) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s() takes at most %zd arguments (%zd given)", fname, count,
+                 nargs);
+    return false;
+  }
+  for (Py_ssize_t i = 0; i < count; i++) {
+    args_[i] = i < nargs ? args[i] : nullptr;
+  }
+  Py_ssize_t nkw = kwnames == nullptr ? 0 : PyTuple_GET_SIZE(kwnames);
+  for (Py_ssize_t k = 0; k < nkw; k++) {
+    const char *kw = PyUnicode_AsUTF8(PyTuple_GET_ITEM(kwnames, k));
+    if (kw == nullptr) {
+      return false;
+    }
+    Py_ssize_t i = 0;
+    while (i < count && strcmp(kw, names[i]) != 0) {
+      i++;
+    }
+    if (i == count) {
+      PyErr_Format(PyExc_TypeError,
+                   "%s() got an unexpected keyword argument '%s'", fname, kw);
+      return false;
+    }
+    if (args_[i] != nullptr) {
+      PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'",
+                   fname, kw);
+      return false;
+    }
+    args_[i] = args[nargs + k];
+  }
+  for (Py_ssize_t i = 0; i < required; i++) {
+    if (args_[i] == nullptr) {
+      PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'",
+                   fname, names[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static const char *fast_str(PyObject *obj, const char *name) {
+  const char *s = nullptr;
+  if (PyUnicode_Check(obj)) {
+    s = PyUnicode_AsUTF8(obj);
+  } else if (PyBytes_Check(obj)) {
+    s = PyBytes_AS_STRING(obj);
+  } else {
+    throw py::type_error(std::string(name) + " must be str");
+  }
+  if (s == nullptr) {
+    throw py::error_already_set();
+  }
+  return s;
+}
+
+static long fast_long(PyObject *obj, const char *name, long dflt = 0) {
+  if (obj == nullptr) {
+    return dflt;
+  }
+  auto index = py::reinterpret_steal<py::object>(PyNumber_Index(obj));
+  if (!index) {
+    PyErr_Clear();
+    throw py::type_error(std::string(name) + " must be int");
+  }
+  long n = PyLong_AsLong(index.ptr());
+  if (n == -1 && PyErr_Occurred()) {
+    throw py::error_already_set();
+  }
+  return n;
+}
+
+static py::object fast_object(PyObject *obj) {
+  return obj == nullptr ? py::none() : py::reinterpret_borrow<py::object>(obj);
+}
+
+static PyObject *fast_tpcall(PyObject *, PyObject *const *args,
+                             Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {
+      "svc",       "idata",         "flags", "decode", "hedge_after_ms",
+      "hedge_svc", "deadline_ms"};
+  PyObject *a[7];
+  if (!fast_args("tpcall", names, 7, 2, args, nargs, kwnames, a)) {
+    return nullptr;
+  }
+  try {
+    const char *hedge_svc = a[5] == nullptr || a[5] == Py_None
+                                ? nullptr
+                                : fast_str(a[5], "hedge_svc");
+    auto r = pytpcall(fast_str(a[0], "svc"), fast_object(a[1]),
+                      fast_long(a[2], "flags"), fast_object(a[3]),
+                      fast_long(a[4], "hedge_after_ms"), hedge_svc,
+                      fast_long(a[6], "deadline_ms"));
+    return reply_to_py(r);
+  } catch (...) {
+    set_python_error();
+    return nullptr;
+  }
+}
+
+static PyObject *fast_tpacall(PyObject *, PyObject *const *args,
+                              Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"svc", "idata", "flags"};
+  PyObject *a[3];
+  if (!fast_args("tpacall", names, 3, 2, args, nargs, kwnames, a)) {
+    return nullptr;
+  }
+  try {
+    return PyLong_FromLong(pytpacall(fast_str(a[0], "svc"), fast_object(a[1]),
+                                     fast_long(a[2], "flags")));
+  } catch (...) {
+    set_python_error();
+    return nullptr;
+  }
+}
+
+static PyObject *fast_tpgetrply(PyObject *, PyObject *const *args,
+                                Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"cd", "flags", "decode"};
+  PyObject *a[3];
+  if (!fast_args("tpgetrply", names, 3, 1, args, nargs, kwnames, a)) {
+    return nullptr;
+  }
+  try {
+    auto r = pytpgetrply(static_cast<int>(fast_long(a[0], "cd")),
+                         fast_long(a[1], "flags"), fast_object(a[2]));
+    return reply_to_py(r);
+  } catch (...) {
+    set_python_error();
+    return nullptr;
+  }
+}
+
+#if !TUXEDO_WSC
+static PyObject *fast_tpreturn(PyObject *, PyObject *const *args,
+                               Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"rval", "rcode", "data", "flags"};
+  PyObject *a[4];
+  if (!fast_args("tpreturn", names, 4, 3, args, nargs, kwnames, a)) {
+    return nullptr;
+  }
+  try {
+    pytpreturn(static_cast<int>(fast_long(a[0], "rval")),
+               fast_long(a[1], "rcode"), fast_object(a[2]),
+               fast_long(a[3], "flags"));
+  } catch (...) {
+    set_python_error();
+    return nullptr;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *fast_tpforward(PyObject *, PyObject *const *args,
+                                Py_ssize_t nargs, PyObject *kwnames) {
+  static const char *const names[] = {"svc", "data", "flags"};
+  PyObject *a[3];
+  if (!fast_args("tpforward", names, 3, 2, args, nargs, kwnames, a)) {
+    return nullptr;
+  }
+  try {
+    pytpforward(fast_str(a[0], "svc"), fast_object(a[1]),
+                fast_long(a[2], "flags"));
+  } catch (...) {
+    set_python_error();
+    return nullptr;
+  }
+  Py_RETURN_NONE;
+}
+#endif
+
+// Replace the pybind11 functions of the same name, the text signature before
+// "--" is what inspect.signature() shows
+static PyMethodDef fast_methods[] = {
+    {"tpcall", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(
+                   fast_tpcall)),
+     METH_FASTCALL | METH_KEYWORDS,
+     "tpcall(svc, idata, flags=0, decode=None, hedge_after_ms=0, "
+     "hedge_svc=None, deadline_ms=0)\n--\n\n"
+     "Routine for sending service request and awaiting its reply"},
+    {"tpacall", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(
+                    fast_tpacall)),
+     METH_FASTCALL | METH_KEYWORDS,
+     "tpacall(svc, idata, flags=0)\n--\n\n"
+     "Routine for sending a service request"},
+    {"tpgetrply", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(
+                      fast_tpgetrply)),
+     METH_FASTCALL | METH_KEYWORDS,
+     "tpgetrply(cd, flags=0, decode=None)\n--\n\n"
+     "Routine for getting a reply from a previous request"},
+#if !TUXEDO_WSC
+    {"tpreturn", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(
+                     fast_tpreturn)),
+     METH_FASTCALL | METH_KEYWORDS,
+     "tpreturn(rval, rcode, data, flags=0)\n--\n\n"
+     "Routine for returning from a service routine"},
+    {"tpforward", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(
+                      fast_tpforward)),
+     METH_FASTCALL | METH_KEYWORDS,
+     "tpforward(svc, data, flags=0)\n--\n\n"
+     "Routine for forwarding a service request to another service routine"},
+#endif
+    {nullptr, nullptr, 0, nullptr}};
+#endif
+
 #if !TUXEDO_WSC
 PYBIND11_MODULE(tuxedo, m) {
 #else
@@ -890,24 +8046,73 @@ PYBIND11_MODULE(tuxedowsc, m) {
 #endif
   register_exceptions(m);
 
-  // Poor man's namedtuple
-  py::class_<pytpreply>(m, "TpReply")
-      .def_readonly("rval", &pytpreply::rval)
-      .def_readonly("rcode", &pytpreply::rcode)
-      .def_readonly("data", &pytpreply::data)
-      .def_readonly("cd", &pytpreply::cd)  // Does not unpack as the use is
-                                           // rare case of tpgetrply(TPGETANY)
-      .def("__getitem__", [](const pytpreply &s, size_t i) -> py::object {
-        if (i == 0) {
-          return py::int_(s.rval);
-        } else if (i == 1) {
-          return py::int_(s.rcode);
-        } else if (i == 2) {
-          return s.data;
-        } else {
-          throw py::index_error();
-        }
+  TpReply_init_type();
+  Py_INCREF(&TpReplyType);
+  m.add_object("TpReply",
+               py::handle(reinterpret_cast<PyObject *>(&TpReplyType)));
+
+  py::class_<pybuffer>(m, "Buffer")
+      .def(py::init([](py::object data) {
+             with_context();
+             if (py::isinstance<pybuffer>(data)) {
+               return std::unique_ptr<pybuffer>(
+                   new pybuffer(data.cast<pybuffer &>().copy()));
+             }
+             return std::unique_ptr<pybuffer>(new pybuffer(from_py(data)));
+           }),
+           "Encodes data into a typed buffer", py::arg("data"))
+      .def_readonly("type", &pybuffer::type)
+      .def("__getitem__", &pybuffer::getitem)
+      .def("__setitem__", &pybuffer::setitem)
+      .def("__delitem__", &pybuffer::delitem)
+      .def("__contains__", &pybuffer::contains)
+      .def(
+          "get",
+          [](pybuffer &self, py::handle key, py::object dflt) -> py::object {
+            if (!self.contains(key)) {
+              return dflt;
+            }
+            return self.getitem(key);
+          },
+          py::arg("key"), py::arg("default") = py::none())
+      .def(
+          "copy",
+          [](pybuffer &self) {
+            return std::unique_ptr<pybuffer>(new pybuffer(self.copy()));
+          },
+          "Returns a copy that can be kept after the service returns")
+      .def(
+          "decode", [](pybuffer &self) { return to_py(self.get()); },
+          "Converts the buffer to Python types");
+
+#if PY_MAJOR_VERSION >= 3
+  py::class_<schema>(m, "Schema")
+      .def(py::init([](py::object spec, py::object name) {
+             with_context();
+             return std::unique_ptr<schema>(new schema(spec, name));
+           }),
+           "Declares a FML32 message from a dataclass or a dict of "
+           "{name: (type, cardinality)}",
+           py::arg("spec"), py::arg("name") = py::none())
+      .def_readonly("type", &schema::type)
+      .def(
+          "encode",
+          [](schema &self, py::handle obj) {
+            with_context();
+            return std::unique_ptr<pybuffer>(new pybuffer(self.encode(obj)));
+          },
+          "Validates an object or dict and encodes it into a Buffer",
+          py::arg("obj"))
+      .def(
+          "decode",
+          [](schema &self, pybuffer &buf) {
+            return self.decode(*buf.fml32().fbfr());
+          },
+          "Decodes a Buffer into an object", py::arg("buf"))
+      .def("__call__", [](schema &self, pybuffer &buf) {
+        return self.decode(*buf.fml32().fbfr());
       });
+#endif
 
   py::class_<TPQCTL>(m, "TPQCTL")
       .def(py::init([](long flags, long deq_time, long priority, long exp_time,
@@ -977,6 +8182,7 @@ PYBIND11_MODULE(tuxedowsc, m) {
   m.def(
       "tpterm",
       []() {
+        flush_userlog();
         py::gil_scoped_release release;
         thread_context.reset();
         if (tpterm() == -1) {
@@ -1059,11 +8265,102 @@ PYBIND11_MODULE(tuxedowsc, m) {
   m.def(
       "userlog",
       [](const char *message) {
+        auto log = async_log;
+        if (log && log->write(message)) {
+          return;
+        }
         py::gil_scoped_release release;
         userlog(const_cast<char *>("%s"), message);
       },
       "Writes a message to the Oracle Tuxedo ATMI system central event log",
       py::arg("message"));
+  m.def(
+      "userlog_async",
+      [](size_t capacity, bool block, long flush_ms) {
+        stop_userlog();
+        if (capacity == 0) {
+          return;
+        }
+        if ((capacity & (capacity - 1)) != 0) {
+          throw std::invalid_argument("capacity must be a power of two");
+        }
+        async_log = std::make_shared<async_userlog>(capacity, block, flush_ms);
+      },
+      "Writes userlog messages from a background thread every flush_ms, "
+      "when the queue is full waits or drops messages, capacity=0 turns it "
+      "off",
+      py::arg("capacity") = 4096, py::arg("block") = false,
+      py::arg("flush_ms") = 100);
+  m.def("userlog_flush", &flush_userlog,
+        "Writes all queued userlog messages");
+  m.def(
+      "userlog_stats",
+      []() {
+        auto log = async_log;
+        return log ? log->stats() : py::dict();
+      },
+      "Returns counters of asynchronous userlog");
+  py::module::import("atexit").attr("register")(
+      py::cpp_function(&stop_userlog));
+
+  m.def(
+      "tracing",
+      [](py::object path, const char *field, double sample,
+         const std::string &service, long flush_ms) {
+        stop_tracing();
+        if (path.is_none()) {
+          return;
+        }
+        FLDID32 fieldid = Fldid32(const_cast<char *>(field));
+        if (fieldid == BADFLDID) {
+          throw fml32_exception(Ferror32);
+        }
+        if (Fldtype32(fieldid) != FLD_STRING) {
+          throw std::invalid_argument(std::string(field) +
+                                      " must be a string field");
+        }
+        trace_field = fieldid;
+        trace_sample = sample;
+        tracer = std::make_shared<trace_exporter>(py::str(path), service,
+                                                  flush_ms);
+        trace_enabled = true;
+      },
+      "Propagates trace context in an FML32 field and appends spans to a "
+      "file as OTLP/JSON every flush_ms, sample is the share of new traces "
+      "recorded, path=None turns it off",
+      py::arg("path"), py::arg("field") = "TRACEPARENT",
+      py::arg("sample") = 0.0, py::arg("service") = "tuxedo",
+      py::arg("flush_ms") = 1000);
+  m.def(
+      "traceparent",
+      []() -> py::object {
+        if (!trace_current.valid) {
+          return py::none();
+        }
+        char value[TRACEPARENT_LEN + 1];
+        trace_format(value, trace_current);
+        return py::str(value);
+      },
+      "Returns the trace context of the current service as W3C traceparent");
+  m.def(
+      "tracing_stats",
+      []() {
+        size_t queued = 0;
+        {
+          std::lock_guard<std::mutex> lock(trace_rings_mutex);
+          for (auto &ring : trace_rings) {
+            queued += ring->size();
+          }
+        }
+        py::dict d;
+        d["exported"] = py::int_(trace_exported.load());
+        d["dropped"] = py::int_(trace_dropped.load());
+        d["queued"] = py::int_(queued);
+        return d;
+      },
+      "Returns counters of span export");
+  py::module::import("atexit").attr("register")(
+      py::cpp_function(&stop_tracing));
 
 #if !TUXEDO_WSC
 #if defined(TPSINGLETON) && defined(TPSECONDARYRQ)
@@ -1076,9 +8373,93 @@ PYBIND11_MODULE(tuxedowsc, m) {
   m.def(
       "tpadvertise", [](const char *svcname) { pytpadvertisex(svcname, 0); },
       "Routine for advertising a service name", py::arg("svcname"));
-
-  m.def("run", &pyrun, "Run Tuxedo server", py::arg("server"), py::arg("args"),
-        py::arg("rmname") = "NONE");
+  m.def(
+      "admission",
+      [](const std::string &svc, int limit, bool adaptive, double target_ms,
+         int min_limit, long rcode) {
+        if (limit < 0) {
+          throw std::invalid_argument("limit must not be negative");
+        }
+        set_limiter(svc, limit == 0 ? nullptr
+                                    : std::make_shared<admission_limiter>(
+                                          limit, adaptive, target_ms,
+                                          min_limit, rcode));
+      },
+      "Limits concurrent requests of a service, requests over the limit fail "
+      "with TPFAIL and rcode before reaching Python. With adaptive=True the "
+      "limit moves between min_limit and limit depending on whether "
+      "requests finish within target_ms, limit=0 removes it",
+      py::arg("svc"), py::arg("limit"), py::arg("adaptive") = false,
+      py::arg("target_ms") = 100.0, py::arg("min_limit") = 1,
+      py::arg("rcode") = 0);
+  m.def(
+      "admission_stats",
+      []() {
+        py::dict d;
+        auto limits = std::atomic_load(&admission_limits);
+        if (limits) {
+          for (auto &it : *limits) {
+            d[py::str(it.first)] = it.second->stats();
+          }
+        }
+        return d;
+      },
+      "Returns limits and admitted and rejected request counters by service");
+
+  m.def("profile", &start_profile,
+        "Profiles the next calls of a service for seconds or calls with "
+        "cProfile, or by sampling its stack every interval_ms. With "
+        "memory=True allocations are traced with tracemalloc. The result is "
+        "written to path as pstats or collapsed stacks when it ends",
+        py::arg("svc"), py::arg("seconds") = 0.0, py::arg("calls") = 0,
+        py::arg("sampling") = false, py::arg("interval_ms") = 10.0,
+        py::arg("memory") = false, py::arg("path") = "",
+        py::arg("limit") = 50);
+  m.def("profile_result", &profile_result,
+        "Returns the profile of a service collected so far, stop=True ends "
+        "and removes it",
+        py::arg("svc"), py::arg("stop") = false);
+  m.def(
+      "profile_service",
+      [](const std::string &name) {
+        if (profile_admin_enabled) {
+          if (profile_admin_name != name) {
+            throw std::invalid_argument("Admin service is already " +
+                                        profile_admin_name);
+          }
+          return;
+        }
+        pytpadvertisex(name, 0);
+        profile_admin_name = name;
+        profile_admin_enabled.store(true, std::memory_order_release);
+      },
+      "Advertises a service that starts profiles and returns their results "
+      "as FML32",
+      py::arg("name") = ".PYPROFILE");
+  py::module::import("atexit").attr("register")(
+      py::cpp_function(&stop_profiles));
+
+  m.def("run", &pyrun,
+        "Run Tuxedo server. With gc='managed' objects created by tpsvrinit() "
+        "are frozen and garbage is collected between requests or at least "
+        "every gc_interval_ms instead of during them",
+        py::arg("server"), py::arg("args"), py::arg("rmname") = "NONE",
+        py::arg("gc") = "auto", py::arg("gc_interval_ms") = 1000.0);
+  m.def(
+      "gc_stats",
+      []() {
+        py::dict result;
+        std::lock_guard<std::mutex> lock(gc_mutex);
+        for (auto &it : gc_pauses) {
+          py::dict d;
+          d["collections"] = py::int_(it.second.collections);
+          d["total_ms"] = py::float_(it.second.total_ms);
+          d["max_ms"] = py::float_(it.second.max_ms);
+          result[py::str(it.first)] = d;
+        }
+        return result;
+      },
+      "Returns garbage collector pauses by the service they interrupted");
 
   m.def("tpadmcall", &pytpadmcall, "Administers unbooted application",
         py::arg("idata"), py::arg("flags") = 0);
@@ -1090,6 +8471,26 @@ PYBIND11_MODULE(tuxedowsc, m) {
         "Routine for forwarding a service request to another service routine",
         py::arg("svc"), py::arg("data"), py::arg("flags") = 0);
 
+  m.def(
+      "inplace",
+      [](py::object func) {
+        func.attr("__tuxedo_inplace__") = py::bool_(true);
+        return func;
+      },
+      "Decorator for services that receive the FML32 request as a Buffer",
+      py::arg("func"));
+  m.def(
+      "decoding",
+      [](int mode) {
+        return py::cpp_function([mode](py::object func) {
+          func.attr("__tuxedo_decode__") = py::int_(mode);
+          return func;
+        });
+      },
+      "Decorator for services that receive the request decoded with FLAT "
+      "and FIELD_IDS",
+      py::arg("mode"));
+
   m.def(
       "tpappthrinit",
       [](const char *usrname, const char *cltname, const char *passwd,
@@ -1136,15 +8537,556 @@ PYBIND11_MODULE(tuxedowsc, m) {
         py::arg("qspace"), py::arg("qname"), py::arg("ctl"),
         py::arg("flags") = 0);
 
+  py::class_<queue_consumer_handle>(m, "QueueConsumer")
+      .def(py::init([](const std::string &qspace, const std::string &qname,
+                       py::object handler, int threads, int max_in_flight,
+                       bool transactional, unsigned long timeout,
+                       const char *failurequeue) {
+             return new queue_consumer_handle(queue_consumer::start(
+                 qspace, qname, handler, threads, max_in_flight,
+                 transactional, timeout, failurequeue));
+           }),
+           "Starts threads dequeuing messages and passing them to handler",
+           py::arg("qspace"), py::arg("qname"), py::arg("handler"),
+           py::arg("threads") = 1, py::arg("max_in_flight") = 0,
+           py::arg("transactional") = true, py::arg("timeout") = 30,
+           py::arg("failurequeue") = nullptr)
+      .def("stop", [](queue_consumer_handle &self) { self.c->stop(); },
+           "Stops dequeuing and waits for threads to finish")
+      .def("stats", [](queue_consumer_handle &self) { return self.c->stats(); },
+           "Returns message counters, throughput and lag")
+      .def("__enter__",
+           [](queue_consumer_handle &self) -> queue_consumer_handle & {
+             return self;
+           },
+           py::return_value_policy::reference)
+      .def("__exit__",
+           [](queue_consumer_handle &self, py::args) { self.c->stop(); });
+
+  py::module::import("atexit").attr("register")(
+      py::cpp_function(&stop_consumers));
+
+  py::class_<mib_exporter>(m, "MibExporter")
+      .def("stop", &mib_exporter::stop,
+           "Stops polling and waits for the thread to finish")
+      .def("stats", &mib_exporter::stats, "Returns scrape counters")
+      .def("text", &mib_exporter::text,
+           "Returns the latest metrics in Prometheus text format")
+      .def("__enter__",
+           [](mib_exporter &self) -> mib_exporter & { return self; },
+           py::return_value_policy::reference)
+      .def("__exit__", [](mib_exporter &self, py::args) { self.stop(); });
+  m.def(
+      "start_mib_exporter",
+      [](double interval, std::vector<std::string> classes,
+         py::object path_or_port, long flags) {
+        return std::unique_ptr<mib_exporter>(
+            new mib_exporter(interval, classes, path_or_port, flags));
+      },
+      "Polls .TMIB every interval seconds on a native thread and publishes "
+      "numeric attributes in Prometheus text format to a file or on a port",
+      py::arg("interval"), py::arg("classes"), py::arg("path_or_port"),
+      py::arg("flags") = MIB_LOCAL);
+  py::module::import("atexit").attr("register")(
+      py::cpp_function(&stop_mib_exporters));
+
+  m.def(
+      "bulk_call",
+      [](const std::string &svc, py::object records, int threads, long flags) {
+        with_context();
+        return bulk_loader(svc, "", "", flags).run(records, threads);
+      },
+      "Calls a service with every record from native threads and returns "
+      "counters, records may come from Fextread32_iter() or any iterable",
+      py::arg("svc"), py::arg("records"), py::arg("threads") = 4,
+      py::arg("flags") = 0);
+  m.def(
+      "bulk_enqueue",
+      [](const std::string &qspace, const std::string &qname,
+         py::object records, int threads, long flags) {
+        with_context();
+        return bulk_loader("", qspace, qname, flags).run(records, threads);
+      },
+      "Enqueues every record from native threads and returns counters, "
+      "records may come from Fextread32_iter() or any iterable",
+      py::arg("qspace"), py::arg("qname"), py::arg("records"),
+      py::arg("threads") = 4, py::arg("flags") = 0);
+  m.def(
+      "loadgen",
+      [](const std::string &svc, py::object payload, int threads,
+         double duration, py::object rate, long flags) {
+        with_context();
+        alloc_scope scope(alloc_loadgen);
+        auto in = from_py(payload);
+        if (compressed_size > 0 || (flags & TPCOMPRESS)) {
+          py::gil_scoped_release release;
+          compress_request(svc.c_str(), in, flags);
+        }
+        return load_generator(svc, in, flags & ~TPCOMPRESS)
+            .run(threads, duration, rate.is_none() ? 0.0 : rate.cast<double>());
+      },
+      "Calls a service from native threads for duration seconds, as fast as "
+      "possible or at rate calls per second, and returns throughput, errors "
+      "by tperrno and latency percentiles in microseconds",
+      py::arg("svc"), py::arg("payload"), py::arg("threads") = 4,
+      py::arg("duration") = 10.0, py::arg("rate") = py::none(),
+      py::arg("flags") = 0);
+
+#if defined(__linux__)
+  py::class_<http_server_handle>(m, "HttpServer")
+      .def("stop", [](http_server_handle &self) { self.s->stop(); },
+           "Stops accepting connections and waits for threads to finish")
+      .def("stats", [](http_server_handle &self) { return self.s->stats(); },
+           "Returns connection and request counters")
+      .def("__enter__",
+           [](http_server_handle &self) -> http_server_handle & {
+             return self;
+           },
+           py::return_value_policy::reference)
+      .def("__exit__",
+           [](http_server_handle &self, py::args) { self.s->stop(); });
+
+  m.def(
+      "serve_http",
+      [](int port, py::dict routes, int threads, long flags, bool flat,
+         const std::string &host, size_t max_body) {
+        return std::unique_ptr<http_server_handle>(
+            new http_server_handle(http_server::start(
+                port, routes, threads, flags, flat, host, max_body)));
+      },
+      "Starts a HTTP/JSON gateway to services on native threads",
+      py::arg("port"), py::arg("routes"), py::arg("threads") = 4,
+      py::arg("flags") = 0, py::arg("flat") = false, py::arg("host") = "",
+      py::arg("max_body") = 1024 * 1024);
+
+  py::module::import("atexit").attr("register")(
+      py::cpp_function(&stop_http_servers));
+#endif
+
   m.def("tpcall", &pytpcall,
         "Routine for sending service request and awaiting its reply",
-        py::arg("svc"), py::arg("idata"), py::arg("flags") = 0);
+        py::arg("svc"), py::arg("idata"), py::arg("flags") = 0,
+        py::arg("decode") = py::none(), py::arg("hedge_after_ms") = 0,
+        py::arg("hedge_svc") = nullptr, py::arg("deadline_ms") = 0);
+
+  m.def(
+      "deadlines",
+      [](const char *field, long rcode) {
+        deadline_set_field(field);
+        deadline_rcode = rcode;
+      },
+      "Sets the field that carries request deadlines. Once set, services fail "
+      "requests past their deadline with TPFAIL and rcode before decoding "
+      "them",
+      py::arg("field") = "PYDEADLINE", py::arg("rcode") = 0);
+  m.def(
+      "deadline_remaining",
+      []() -> py::object {
+        if (deadline_current <= 0) {
+          return py::none();
+        }
+        return py::float_(std::max(0.0, deadline_current - deadline_now()));
+      },
+      "Returns milliseconds left until the deadline of the current request, "
+      "None without a deadline");
+  m.def(
+      "deadline_stats",
+      []() {
+        py::dict d;
+        d["stamped"] = py::int_(deadline_stamped.load());
+        d["dropped"] = py::int_(deadline_dropped.load());
+        return d;
+      },
+      "Returns counters of requests sent with a deadline and dropped as "
+      "expired");
+
+  m.def(
+      "hedge_stats",
+      []() {
+        py::dict result;
+        std::lock_guard<std::mutex> lock(hedge_mutex);
+        for (auto &it : hedge_stats) {
+          py::dict d;
+          d["calls"] = py::int_(it.second.calls);
+          d["fired"] = py::int_(it.second.fired);
+          d["won"] = py::int_(it.second.won);
+          result[py::str(it.first)] = d;
+        }
+        return result;
+      },
+      "Returns how often hedged requests were sent and won for each service");
+
+  m.def("tpcall_json", &pytpcall_json,
+        "Calls a service with a JSON object as FML32 and returns the reply "
+        "as JSON",
+        py::arg("svc"), py::arg("idata"), py::arg("flags") = 0,
+        py::arg("flat") = false);
+
+  m.def(
+      "json_to_fml",
+      [](py::bytes data) {
+        with_context();
+        const char *s = PyBytes_AsString(data.ptr());
+        size_t n = PyBytes_Size(data.ptr());
+        xatmibuf buf;
+        {
+          py::gil_scoped_release release;
+          buf = json_to_fml(s, n);
+        }
+        return std::unique_ptr<pybuffer>(new pybuffer(std::move(buf)));
+      },
+      "Parses a JSON object into a FML32 Buffer", py::arg("data"));
+  m.def(
+      "fml_to_json",
+      [](py::object data, bool flat) {
+        with_context();
+        auto buf = from_py(data);
+        require_fml32(buf);
+        std::string result;
+        {
+          py::gil_scoped_release release;
+          fml_to_json(result, *buf.fbfr(), flat);
+        }
+        return py::bytes(result);
+      },
+      "Serializes a FML32 Buffer or dict into JSON, with flat=True single "
+      "occurrences are not wrapped in arrays",
+      py::arg("data"), py::arg("flat") = false);
 
   m.def("tpacall", &pytpacall, "Routine for sending a service request",
         py::arg("svc"), py::arg("idata"), py::arg("flags") = 0);
+
+  py::class_<prepared_call>(m, "PreparedCall")
+      .def_readonly("name", &prepared_call::name)
+      .def_readonly("flags", &prepared_call::flags)
+      .def(
+          "call",
+          [](prepared_call &self, py::kwargs changes) {
+            with_context();
+            alloc_scope scope(alloc_prepare);
+            auto in = self.with(changes);
+            return pytpcall_buf(self.name.c_str(), in, self.flags);
+          },
+          "Calls the service with the template and changed fields")
+      .def(
+          "acall",
+          [](prepared_call &self, py::kwargs changes) {
+            with_context();
+            alloc_scope scope(alloc_prepare);
+            auto in = self.with(changes);
+            return pytpacall_buf(self.name.c_str(), in, self.flags);
+          },
+          "Sends a request with the template and changed fields")
+      .def(
+          "post",
+          [](prepared_call &self, py::kwargs changes) {
+            with_context();
+            alloc_scope scope(alloc_prepare);
+            auto in = self.with(changes);
+            pytppost_buf(self.name, in, self.flags);
+          },
+          "Posts an event with the template and changed fields");
+
+  m.def(
+      "prepare",
+      [](const std::string &name, py::dict data, long flags) {
+        return std::unique_ptr<prepared_call>(
+            new prepared_call(name, data, flags));
+      },
+      "Encodes a request template for a service or event once",
+      py::arg("svc"), py::arg("data"), py::arg("flags") = 0);
   m.def("tpgetrply", &pytpgetrply,
         "Routine for getting a reply from a previous request", py::arg("cd"),
-        py::arg("flags") = 0);
+        py::arg("flags") = 0, py::arg("decode") = py::none());
+
+  m.def(
+      "reply_stats",
+      []() {
+        py::dict result;
+        std::lock_guard<std::mutex> lock(reply_sizes_mutex);
+        for (auto &it : reply_sizes) {
+          py::dict d;
+          d["type"] = py::str(it.second.type);
+          d["samples"] = py::int_(it.second.samples);
+          d["ewma"] = py::float_(it.second.ewma);
+          d["p95"] = py::int_(it.second.percentile(0.95));
+          d["prealloc"] = py::int_(it.second.size());
+          result[py::str(it.first)] = d;
+        }
+        return result;
+      },
+      "Returns reply buffer type and sizes seen for each service");
+
+  m.def(
+      "alloc_stats",
+      [](bool reset) {
+        py::dict result;
+        for (auto *c : alloc_counters::registry()) {
+          py::dict d;
+          d["tpalloc"] = py::int_(reset ? c->tpalloc.exchange(0)
+                                        : c->tpalloc.load());
+          d["tprealloc"] = py::int_(reset ? c->tprealloc.exchange(0)
+                                          : c->tprealloc.load());
+          d["tpfree"] = py::int_(reset ? c->tpfree.exchange(0)
+                                       : c->tpfree.load());
+          d["doublings"] = py::int_(reset ? c->doublings.exchange(0)
+                                          : c->doublings.load());
+          d["grown"] = py::int_(reset ? c->grown.exchange(0)
+                                      : c->grown.load());
+          d["bytes"] = py::int_(reset ? c->bytes.exchange(0)
+                                      : c->bytes.load());
+          result[py::str(c->site)] = d;
+        }
+        return result;
+      },
+      "Returns buffer allocation counters for each call site",
+      py::arg("reset") = false);
+
+  m.def(
+      "set_codec",
+      [](const std::string &name) {
+        if (name == "locale") {
+          string_codec = CODEC_LOCALE;
+        } else if (name == "utf-8" || name == "utf8") {
+          string_codec = CODEC_UTF8;
+        } else if (name == "latin-1" || name == "latin1" ||
+                   name == "iso-8859-1") {
+          string_codec = CODEC_LATIN1;
+        } else if (name == "bytes") {
+          string_codec = CODEC_BYTES;
+        } else {
+          throw std::invalid_argument("Unsupported codec " + name);
+        }
+      },
+      "Sets the encoding of FML32 string fields: 'locale', 'utf-8', "
+      "'latin-1' or 'bytes'",
+      py::arg("codec"));
+  m.def(
+      "get_codec",
+      []() {
+        switch (string_codec) {
+          case CODEC_UTF8:
+            return "utf-8";
+          case CODEC_LATIN1:
+            return "latin-1";
+          case CODEC_BYTES:
+            return "bytes";
+          default:
+            return "locale";
+        }
+      },
+      "Returns the encoding of FML32 string fields");
+
+#if !defined(_WIN32) && !defined(_WIN64)
+  py::class_<shared_store>(m, "SharedStore")
+      .def(py::init([](const std::string &name, size_t size,
+                       const char *snapshot) {
+             return std::unique_ptr<shared_store>(
+                 new shared_store(name, size, snapshot));
+           }),
+           "Opens or creates a key/value store in shared memory",
+           py::arg("name"), py::arg("size") = 64 * 1024 * 1024,
+           py::arg("snapshot") = nullptr)
+      .def_readonly("name", &shared_store::name)
+      .def("__getitem__",
+           [](shared_store &self, py::handle key) {
+             std::string k = store_key(key);
+             std::string type, value;
+             bool found;
+             {
+               py::gil_scoped_release release;
+               found = self.find(k, type, value);
+             }
+             if (!found) {
+               throw py::key_error(k);
+             }
+             with_context();
+             xatmibuf buf(type.c_str(), value.size());
+             memcpy(*buf.pp, value.data(), value.size());
+             return std::unique_ptr<pybuffer>(new pybuffer(std::move(buf)));
+           })
+      .def("__setitem__",
+           [](shared_store &self, py::handle key, py::object value) {
+             std::string k = store_key(key);
+             with_context();
+             auto buf = from_py(value);
+             std::string type;
+             auto bytes = buffer_bytes(buf, type);
+             py::gil_scoped_release release;
+             self.put(k, type.c_str(), bytes.data(), bytes.size());
+           })
+      .def("__delitem__",
+           [](shared_store &self, py::handle key) {
+             std::string k = store_key(key);
+             bool found;
+             {
+               py::gil_scoped_release release;
+               found = self.erase(k);
+             }
+             if (!found) {
+               throw py::key_error(k);
+             }
+           })
+      .def("__contains__",
+           [](shared_store &self, py::handle key) {
+             std::string type, value;
+             return self.find(store_key(key), type, value);
+           })
+      .def("__len__", &shared_store::count)
+      .def(
+          "get",
+          [](shared_store &self, py::handle key,
+             py::object dflt) -> py::object {
+            std::string type, value;
+            if (!self.find(store_key(key), type, value)) {
+              return dflt;
+            }
+            with_context();
+            xatmibuf buf(type.c_str(), value.size());
+            memcpy(*buf.pp, value.data(), value.size());
+            return py::cast(new pybuffer(std::move(buf)),
+                            py::return_value_policy::take_ownership);
+          },
+          py::arg("key"), py::arg("default") = py::none())
+      .def("clear", &shared_store::clear, "Removes all entries")
+      .def("stats", &shared_store::stats, "Returns entry and memory counters")
+      .def(
+          "save",
+          [](shared_store &self, py::object path) {
+            std::string p =
+                path.is_none() ? self.snapshot : std::string(py::str(path));
+            if (p.empty()) {
+              throw std::invalid_argument("No snapshot path");
+            }
+            py::gil_scoped_release release;
+            self.save(p);
+          },
+          "Writes all entries to the snapshot file",
+          py::arg("path") = py::none())
+      .def("close", &shared_store::close, "Unmaps the shared memory")
+      .def(
+          "unlink",
+          [](shared_store &self) {
+            if (shm_unlink(self.name.c_str()) == -1) {
+              throw std::system_error(errno, std::system_category(),
+                                      "shm_unlink");
+            }
+          },
+          "Removes the shared memory once all processes close it");
+#endif
+
+  m.def("cache", &cache_configure,
+        "Caches successful replies of a service for ttl seconds, ttl=0 "
+        "disables caching",
+        py::arg("svc"), py::arg("ttl") = 60.0,
+        py::arg("max_bytes") = 16 * 1024 * 1024,
+        py::arg("events") = std::vector<std::string>());
+  m.def(
+      "invalidate",
+      [](py::object svc) {
+        if (!svc.is_none()) {
+          cache_invalidate(py::str(svc));
+          return;
+        }
+        std::lock_guard<std::mutex> lock(reply_cache_mutex);
+        for (auto &it : reply_cache) {
+          it.second.clear();
+        }
+      },
+      "Removes cached replies of a service or all services",
+      py::arg("svc") = py::none());
+  m.def(
+      "cache_stats",
+      []() {
+        py::dict result;
+        std::lock_guard<std::mutex> lock(reply_cache_mutex);
+        for (auto &it : reply_cache) {
+          py::dict d;
+          d["entries"] = py::int_(it.second.index.size());
+          d["bytes"] = py::int_(it.second.bytes);
+          d["hits"] = py::int_(it.second.hits);
+          d["misses"] = py::int_(it.second.misses);
+          d["expired"] = py::int_(it.second.expired);
+          d["evicted"] = py::int_(it.second.evicted);
+          result[py::str(it.first)] = d;
+        }
+        return result;
+      },
+      "Returns reply cache counters for each service");
+  m.def(
+      "coalesce",
+      [](const std::string &svc, bool enabled) {
+        std::lock_guard<std::mutex> lock(flights_mutex);
+        if (enabled) {
+          coalesced[svc];
+        } else {
+          coalesced.erase(svc);
+        }
+        coalesced_size = static_cast<int>(coalesced.size());
+      },
+      "Concurrent tpcall()s of the service with the same request share one "
+      "call and its reply, only for idempotent services",
+      py::arg("svc"), py::arg("enabled") = true);
+  m.def(
+      "coalesce_stats",
+      []() {
+        py::dict result;
+        std::lock_guard<std::mutex> lock(flights_mutex);
+        for (auto &it : coalesced) {
+          py::dict d;
+          d["calls"] = py::int_(it.second.calls);
+          d["shared"] = py::int_(it.second.shared);
+          result[py::str(it.first)] = d;
+        }
+        return result;
+      },
+      "Returns how many calls of each coalesced service shared a reply");
+  m.def(
+      "compress",
+      [](const std::string &svc, long threshold, int level, const char *field,
+         long max_size) {
+#if !TUXEDO_ZLIB
+        if (threshold > 0) {
+          throw std::runtime_error(
+              "Built without zlib, compression not available");
+        }
+#endif
+        if (level < 1 || level > 9) {
+          throw std::invalid_argument("level must be between 1 and 9");
+        }
+        if (max_size <= 0) {
+          throw std::invalid_argument("max_size must be positive");
+        }
+        compress_set_field(field);
+        compress_max_size = max_size;
+        std::lock_guard<std::mutex> lock(compress_mutex);
+        if (threshold > 0) {
+          auto &c = compressed[svc];
+          c.threshold = threshold;
+          c.level = level;
+        } else {
+          compressed.erase(svc);
+        }
+        compressed_size = static_cast<int>(compressed.size());
+      },
+      "Compresses requests to the service and replies of the service larger "
+      "than threshold bytes with zlib, FML32 is sent in the carray field. "
+      "Compressed buffers up to max_size bytes are unpacked once compress() "
+      "has been called, threshold=0 removes it",
+      py::arg("svc"), py::arg("threshold") = 65536, py::arg("level") = 1,
+      py::arg("field") = "PYZ", py::arg("max_size") = 256 * 1024 * 1024);
+  m.def(
+      "compress_stats",
+      []() {
+        py::dict d;
+        d["packed"] = py::int_(compress_packed.load());
+        d["skipped"] = py::int_(compress_skipped.load());
+        d["unpacked"] = py::int_(compress_unpacked.load());
+        d["bytes_in"] = py::int_(compress_bytes_in.load());
+        d["bytes_out"] = py::int_(compress_bytes_out.load());
+        return d;
+      },
+      "Returns counters of compressed and unpacked buffers");
 
   m.def("tpexport", &pytpexport,
         "Converts a typed message buffer into an exportable, "
@@ -1224,7 +9166,7 @@ PYBIND11_MODULE(tuxedowsc, m) {
         }
 
         int fd = iop.attr("fileno")().cast<py::int_>();
-        std::unique_ptr<FILE, decltype(&fclose)> fiop(fdopen(dup(fd), "w"),
+        std::unique_ptr<FILE, decltype(&fclose)> fiop(fdopen_dup(fd, "w"),
                                                       &fclose);
         Fboolpr32(guard.get(), fiop.get());
       },
@@ -1272,7 +9214,7 @@ PYBIND11_MODULE(tuxedowsc, m) {
       [](py::object fbfr, py::object iop) {
         auto buf = from_py(fbfr);
         int fd = iop.attr("fileno")().cast<py::int_>();
-        std::unique_ptr<FILE, decltype(&fclose)> fiop(fdopen(dup(fd), "w"),
+        std::unique_ptr<FILE, decltype(&fclose)> fiop(fdopen_dup(fd, "w"),
                                                       &fclose);
         auto rc = Ffprint32(*buf.fbfr(), fiop.get());
         if (rc == -1) {
@@ -1287,7 +9229,7 @@ PYBIND11_MODULE(tuxedowsc, m) {
       [](py::object iop) {
         xatmibuf obuf("FML32", 1024);
         int fd = iop.attr("fileno")().cast<py::int_>();
-        std::unique_ptr<FILE, decltype(&fclose)> fiop(fdopen(dup(fd), "r"),
+        std::unique_ptr<FILE, decltype(&fclose)> fiop(fdopen_dup(fd, "r"),
                                                       &fclose);
 
         obuf.mutate([&](FBFR32 *fbfr) { return Fextread32(fbfr, fiop.get()); });
@@ -1295,6 +9237,49 @@ PYBIND11_MODULE(tuxedowsc, m) {
       },
       "Builds fielded buffer from printed format", py::arg("iop"));
 
+  py::class_<fextread_reader>(m, "Fextread32Iter")
+      .def("__iter__",
+           [](fextread_reader &self) -> fextread_reader & { return self; },
+           py::return_value_policy::reference)
+      .def("__next__", &fextread_reader::next)
+      .def_property_readonly(
+          "records", [](fextread_reader &self) { return self.records; })
+      .def("close", [](fextread_reader &self) {
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(self.mutex);
+        self.fp.reset();
+      });
+  m.def(
+      "Fextread32_iter",
+      [](py::object source, bool raw) {
+        return std::unique_ptr<fextread_reader>(
+            new fextread_reader(source, raw));
+      },
+      "Iterates over fielded buffers in printed format read from a path, "
+      "file descriptor or file object, as dicts or as Buffers when raw=True",
+      py::arg("source"), py::arg("raw") = false);
+
+  py::class_<ffprint_writer>(m, "Ffprint32Writer")
+      .def("write", &ffprint_writer::write, "Prints fielded buffer",
+           py::arg("fbfr"))
+      .def("flush", &ffprint_writer::flush)
+      .def("close", &ffprint_writer::close)
+      .def_property_readonly("records",
+                             [](ffprint_writer &self) { return self.records; })
+      .def("__enter__",
+           [](ffprint_writer &self) -> ffprint_writer & { return self; },
+           py::return_value_policy::reference)
+      .def("__exit__", [](ffprint_writer &self, py::args) { self.close(); });
+  m.def(
+      "Ffprint32_writer",
+      [](py::object target, bool append) {
+        return std::unique_ptr<ffprint_writer>(
+            new ffprint_writer(target, append));
+      },
+      "Returns a writer printing fielded buffers to a path, file descriptor "
+      "or file object",
+      py::arg("target"), py::arg("append") = false);
+
   m.attr("TPNOFLAGS") = py::int_(TPNOFLAGS);
 
   m.attr("TPNOBLOCK") = py::int_(TPNOBLOCK);
@@ -1312,6 +9297,10 @@ PYBIND11_MODULE(tuxedowsc, m) {
   m.attr("TPACK") = py::int_(TPACK);
   m.attr("TPACK_INTL") = py::int_(TPACK_INTL);
   m.attr("TPNOCOPY") = py::int_(TPNOCOPY);
+  m.attr("TPCOMPRESS") = py::int_(TPCOMPRESS);
+
+  m.attr("FLAT") = py::int_(static_cast<int>(DECODE_FLAT));
+  m.attr("FIELD_IDS") = py::int_(static_cast<int>(DECODE_FIELD_IDS));
 
 #ifdef TPSINGLETON
   m.attr("TPSINGLETON") = py::int_(TPSINGLETON);
@@ -1425,6 +9414,17 @@ PYBIND11_MODULE(tuxedowsc, m) {
   m.attr("TPQQOSPERSISTENT ") = py::int_(TPQQOSPERSISTENT);
   m.attr("TPQQOSNONPERSISTENT") = py::int_(TPQQOSNONPERSISTENT);
 
+#if PY_VERSION_HEX >= 0x03070000
+  for (auto *def = fast_methods; def->ml_name != nullptr; def++) {
+    auto func = py::reinterpret_steal<py::object>(
+        PyCFunction_NewEx(def, nullptr, m.attr("__name__").ptr()));
+    if (!func) {
+      throw py::error_already_set();
+    }
+    m.add_object(def->ml_name, func, true);
+  }
+#endif
+
   m.doc() =
       R"(Python3 bindings for writing Oracle Tuxedo clients and servers
 
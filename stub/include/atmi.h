@@ -0,0 +1,264 @@
+/* ATMI subset implemented in-process by ../tuxstub.cpp */
+#ifndef _ATMI_H
+#define _ATMI_H
+
+#include <fml32.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XATMI_SERVICE_NAME_LENGTH 128
+#define MAXTIDENT 30
+
+#define TPNOFLAGS 0x00000000
+#define TPNOBLOCK 0x00000001
+#define TPSIGRSTRT 0x00000002
+#define TPNOREPLY 0x00000004
+#define TPNOTRAN 0x00000008
+#define TPTRAN 0x00000010
+#define TPNOTIME 0x00000020
+#define TPABSOLUTE 0x00000040
+#define TPGETANY 0x00000080
+#define TPNOCHANGE 0x00000100
+#define TPCONV 0x00000400
+#define TPSENDONLY 0x00000800
+#define TPRECVONLY 0x00001000
+#define TPACK 0x00002000
+#define TPACK_INTL 0x00004000
+#define TPNOCOPY 0x00008000
+#define TPSINGLETON 0x00010000
+#define TPSECONDARYRQ 0x00020000
+
+#define TPFAIL 0x00000001
+#define TPSUCCESS 0x00000002
+#define TPEXIT 0x08000000
+
+#define TPEABORT 1
+#define TPEBADDESC 2
+#define TPEBLOCK 3
+#define TPEINVAL 4
+#define TPELIMIT 5
+#define TPENOENT 6
+#define TPEOS 7
+#define TPEPERM 8
+#define TPEPROTO 9
+#define TPESVCERR 10
+#define TPESVCFAIL 11
+#define TPESYSTEM 12
+#define TPETIME 13
+#define TPETRAN 14
+#define TPGOTSIG 15
+#define TPERMERR 16
+#define TPEITYPE 17
+#define TPEOTYPE 18
+#define TPERELEASE 19
+#define TPEHAZARD 20
+#define TPEHEURISTIC 21
+#define TPEEVENT 22
+#define TPEMATCH 23
+#define TPEDIAGNOSTIC 24
+#define TPEMIB 25
+#define TPENOSINGLETON 26
+#define TPENOSECONDARYRQ 27
+
+#define TPU_MASK 0x00000047
+#define TPU_SIG 0x00000001
+#define TPU_DIP 0x00000002
+#define TPU_IGN 0x00000004
+#define TPU_THREAD 0x00000040
+#define TPSA_FASTPATH 0x00000008
+#define TPSA_PROTECTED 0x00000010
+#define TPMULTICONTEXTS 0x00000020
+
+#define TPBLK_MILLISECOND 0x00000001
+#define TPBLK_SECOND 0x00000002
+#define TPBLK_NEXT 0x00000004
+#define TPBLK_ALL 0x00000008
+
+#define TPEX_STRING 0x00000001
+
+#define TPEVSERVICE 0x00000001
+#define TPEVQUEUE 0x00000002
+#define TPEVTRAN 0x00000004
+#define TPEVPERSIST 0x00000008
+
+#define TPINVALIDCONTEXT -1
+#define TPNULLCONTEXT -2
+#define TPSINGLECONTEXT 0
+
+typedef long TPCONTEXT_T;
+
+typedef struct {
+  long clientdata[4];
+} CLIENTID;
+
+typedef struct {
+  long info[6];
+} TPTRANID;
+
+struct tpinfo_t {
+  char usrname[MAXTIDENT + 2];
+  char cltname[MAXTIDENT + 2];
+  char passwd[MAXTIDENT + 2];
+  char grpname[MAXTIDENT + 2];
+  long flags;
+  long datalen;
+  long data;
+};
+typedef struct tpinfo_t TPINIT;
+#define TPINITNEED(u) (sizeof(TPINIT) - sizeof(long) + (u))
+
+struct tpsvcinfo {
+  char name[XATMI_SERVICE_NAME_LENGTH];
+  char *data;
+  long len;
+  long flags;
+  int cd;
+  long appkey;
+  CLIENTID cltid;
+  char fname[XATMI_SERVICE_NAME_LENGTH];
+};
+typedef struct tpsvcinfo TPSVCINFO;
+
+#define TMMSGIDLEN 32
+#define TMCORRIDLEN 32
+#define TMQNAMELEN 15
+
+struct tpqctl_t {
+  long flags;
+  long deq_time;
+  long priority;
+  long diagnostic;
+  char msgid[TMMSGIDLEN];
+  char corrid[TMCORRIDLEN];
+  char replyqueue[TMQNAMELEN + 1];
+  char failurequeue[TMQNAMELEN + 1];
+  CLIENTID cltid;
+  long urcode;
+  long appkey;
+  long delivery_qos;
+  long reply_qos;
+  long exp_time;
+};
+typedef struct tpqctl_t TPQCTL;
+
+#define TPQCORRID 0x00000001
+#define TPQFAILUREQ 0x00000002
+#define TPQBEFOREMSGID 0x00000004
+#define TPQGETBYMSGIDOLD 0x00000008
+#define TPQMSGID 0x00000010
+#define TPQPRIORITY 0x00000020
+#define TPQTOP 0x00000040
+#define TPQWAIT 0x00000080
+#define TPQREPLYQ 0x00000100
+#define TPQTIME_ABS 0x00000200
+#define TPQTIME_REL 0x00000400
+#define TPQGETBYCORRIDOLD 0x00000800
+#define TPQPEEK 0x00001000
+#define TPQDELIVERYQOS 0x00002000
+#define TPQREPLYQOS 0x00004000
+#define TPQEXPTIME_ABS 0x00008000
+#define TPQEXPTIME_REL 0x00010000
+#define TPQEXPTIME_NONE 0x00020000
+#define TPQGETBYMSGID 0x00040008
+#define TPQGETBYCORRID 0x00080800
+
+#define TPQQOSDEFAULTPERSIST 0x00000001
+#define TPQQOSPERSISTENT 0x00000002
+#define TPQQOSNONPERSISTENT 0x00000004
+
+#define QMEINVAL -1
+#define QMEBADRMID -2
+#define QMENOTOPEN -3
+#define QMETRAN -4
+#define QMEBADMSGID -5
+#define QMESYSTEM -6
+#define QMEOS -7
+#define QMEABORTED -8
+#define QMENOTA -8
+#define QMEPROTO -9
+#define QMEBADQUEUE -10
+#define QMENOMSG -11
+#define QMEINUSE -12
+#define QMENOSPACE -13
+#define QMERELEASE -14
+#define QMEINVHANDLE -15
+#define QMESHARE -16
+
+struct tpevctl_t {
+  long flags;
+  char name1[XATMI_SERVICE_NAME_LENGTH];
+  char name2[XATMI_SERVICE_NAME_LENGTH];
+  TPQCTL qctl;
+};
+typedef struct tpevctl_t TPEVCTL;
+
+int *_tmget_tperrno_addr(void);
+#define tperrno (*_tmget_tperrno_addr())
+long *_tmget_tpurcode_addr(void);
+#define tpurcode (*_tmget_tpurcode_addr())
+
+char *tpstrerror(int err);
+
+char *tpalloc(char *type, char *subtype, long size);
+char *tprealloc(char *ptr, long size);
+void tpfree(char *ptr);
+long tptypes(char *ptr, char *type, char *subtype);
+
+int tpinit(TPINIT *tpinfo);
+int tpterm(void);
+int tpappthrinit(TPINIT *tpinfo);
+int tpappthrterm(void);
+int tpgetctxt(TPCONTEXT_T *context, long flags);
+int tpsetctxt(TPCONTEXT_T context, long flags);
+
+int tpcall(char *svc, char *idata, long ilen, char **odata, long *olen,
+           long flags);
+int tpacall(char *svc, char *data, long len, long flags);
+int tpgetrply(int *cd, char **data, long *len, long flags);
+int tpcancel(int cd);
+void tpreturn(int rval, long rcode, char *data, long len, long flags);
+void tpforward(char *svc, char *data, long len, long flags);
+
+int tpbegin(unsigned long timeout, long flags);
+int tpcommit(long flags);
+int tpabort(long flags);
+int tpsuspend(TPTRANID *tranid, long flags);
+int tpresume(TPTRANID *tranid, long flags);
+int tpgetlev(void);
+
+int tpenqueue(char *qspace, char *qname, TPQCTL *ctl, char *data, long len,
+              long flags);
+int tpdequeue(char *qspace, char *qname, TPQCTL *ctl, char **data, long *len,
+              long flags);
+
+int tppost(char *eventname, char *data, long len, long flags);
+long tpsubscribe(char *eventexpr, char *filter, TPEVCTL *ctl, long flags);
+int tpunsubscribe(long subscription, long flags);
+typedef void(UNSOLFUNC)(char *data, long len, long flags);
+UNSOLFUNC *tpsetunsol(UNSOLFUNC *disp);
+int tpchkunsol(void);
+
+int tpexport(char *ibuf, long ilen, char *ostr, long *olen, long flags);
+int tpimport(char *istr, long ilen, char **obuf, long *olen, long flags);
+
+int tpsblktime(int blktime, long flags);
+int tpgblktime(long flags);
+
+int tpopen(void);
+int tpclose(void);
+int tpadvertise(char *svcname, void (*func)(TPSVCINFO *));
+int tpadvertisex(char *svcname, void (*func)(TPSVCINFO *), long flags);
+int tpunadvertise(char *svcname);
+
+int tpsvrinit(int argc, char *argv[]);
+void tpsvrdone(void);
+int tpsvrthrinit(int argc, char *argv[]);
+void tpsvrthrdone(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,109 @@
+/* FML32 subset implemented by ../tuxstub.cpp */
+#ifndef _FML32_H
+#define _FML32_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef unsigned int FLDID32;
+typedef unsigned int FLDLEN32;
+typedef int FLDOCC32;
+typedef struct Fbfr32 FBFR32;
+
+#define BADFLDID ((FLDID32)0)
+#define FIRSTFLDID ((FLDID32)0)
+
+#define FLD_SHORT 0
+#define FLD_LONG 1
+#define FLD_CHAR 2
+#define FLD_FLOAT 3
+#define FLD_DOUBLE 4
+#define FLD_STRING 5
+#define FLD_CARRAY 6
+#define FLD_INT 7
+#define FLD_DECIMAL 8
+#define FLD_PTR 9
+#define FLD_FML32 10
+#define FLD_VIEW32 11
+
+#define FMINVAL 0
+#define FALIGNERR 1
+#define FNOTFLD 2
+#define FNOSPACE 3
+#define FNOTPRES 4
+#define FBADFLD 5
+#define FTYPERR 6
+#define FEUNIX 7
+#define FBADNAME 8
+#define FMALLOC 9
+#define FSYNTAX 10
+#define FFTOPEN 11
+#define FFTSYNTAX 12
+#define FEINVAL 13
+#define FBADTBL 14
+#define FBADVIEW 15
+#define FVFSYNTAX 16
+#define FVFOPEN 17
+#define FBADACM 18
+#define FNOCNAME 19
+#define FEBADOP 20
+#define FMAXVAL 21
+
+int *_Fget_Ferror_addr32(void);
+#define Ferror32 (*_Fget_Ferror_addr32())
+
+char *Fstrerror32(int err);
+
+long Fneeded32(FLDOCC32 F, FLDLEN32 V);
+int Finit32(FBFR32 *fbfr, FLDLEN32 buflen);
+FBFR32 *Falloc32(FLDOCC32 F, FLDLEN32 V);
+int Ffree32(FBFR32 *fbfr);
+long Fsizeof32(FBFR32 *fbfr);
+long Fused32(FBFR32 *fbfr);
+long Funused32(FBFR32 *fbfr);
+int Fcpy32(FBFR32 *dest, FBFR32 *src);
+
+int Fadd32(FBFR32 *fbfr, FLDID32 fieldid, char *value, FLDLEN32 len);
+int Fchg32(FBFR32 *fbfr, FLDID32 fieldid, FLDOCC32 oc, char *value,
+           FLDLEN32 len);
+int CFchg32(FBFR32 *fbfr, FLDID32 fieldid, FLDOCC32 oc, char *value,
+            FLDLEN32 len, int type);
+int Fget32(FBFR32 *fbfr, FLDID32 fieldid, FLDOCC32 oc, char *loc,
+           FLDLEN32 *maxlen);
+int CFget32(FBFR32 *fbfr, FLDID32 fieldid, FLDOCC32 oc, char *buf,
+            FLDLEN32 *len, int type);
+char *Ffind32(FBFR32 *fbfr, FLDID32 fieldid, FLDOCC32 oc, FLDLEN32 *len);
+char *CFfind32(FBFR32 *fbfr, FLDID32 fieldid, FLDOCC32 oc, FLDLEN32 *len,
+               int type);
+int Fdel32(FBFR32 *fbfr, FLDID32 fieldid, FLDOCC32 oc);
+int Fdelall32(FBFR32 *fbfr, FLDID32 fieldid);
+int Fpres32(FBFR32 *fbfr, FLDID32 fieldid, FLDOCC32 oc);
+FLDOCC32 Foccur32(FBFR32 *fbfr, FLDID32 fieldid);
+FLDOCC32 Fnum32(FBFR32 *fbfr);
+int Fnext32(FBFR32 *fbfr, FLDID32 *fieldid, FLDOCC32 *oc, char *value,
+            FLDLEN32 *len);
+FLDLEN32 Flen32(FBFR32 *fbfr, FLDID32 fieldid, FLDOCC32 oc);
+
+FLDID32 Fldid32(char *name);
+char *Fname32(FLDID32 fieldid);
+int Fldtype32(FLDID32 fieldid);
+long Fldno32(FLDID32 fieldid);
+FLDID32 Fmkfldid32(int type, FLDID32 num);
+
+char *Fboolco32(char *expression);
+int Fboolev32(FBFR32 *fbfr, char *tree);
+double Ffloatev32(FBFR32 *fbfr, char *tree);
+void Fboolpr32(char *tree, FILE *iop);
+
+int Fprint32(FBFR32 *fbfr);
+int Ffprint32(FBFR32 *fbfr, FILE *iop);
+int Fextread32(FBFR32 *fbfr, FILE *iop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
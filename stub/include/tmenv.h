@@ -0,0 +1,43 @@
+/* Server startup structures used by ../tuxstub.cpp */
+#ifndef _TMENV_H
+#define _TMENV_H
+
+#include <atmi.h>
+#include <xa.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tmdsptchtbl_t {
+  char *svcname;
+  char *funcname;
+  void (*svcfunc)(TPSVCINFO *);
+  long index;
+  long flags;
+};
+
+struct tmsvrargs_t {
+  struct xa_switch_t *xa_switch;
+  struct tmdsptchtbl_t *tmdsptchtbl;
+  long flags;
+  int (*svrinit)(int, char **);
+  void (*svrdone)(void);
+  int (*mainloop)(int);
+  void *reserved0;
+  void *reserved1;
+  void *reserved2;
+  void *reserved3;
+  int (*rminit)(int, char **);
+  int (*svrthrinit)(int, char **);
+  void (*svrthrdone)(void);
+};
+
+int _tmstartserver(int argc, char **argv, struct tmsvrargs_t *tmsvrargs);
+int tprminit(int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
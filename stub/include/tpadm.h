@@ -0,0 +1,44 @@
+/* MIB attributes known to ../tuxstub.cpp without field tables */
+#ifndef _TPADM_H
+#define _TPADM_H
+
+#include <atmi.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIB_PREIMAGE 0x00000001
+#define MIB_LOCAL 0x00010000
+#define MIB_SELF 0x00020000
+
+#define TAOK 0
+#define TAUPDATED 1
+#define TAPARTIAL 2
+
+#define TA_CLASS ((FLDID32)167773162)
+#define TA_OPERATION ((FLDID32)167773163)
+#define TA_CURSOR ((FLDID32)167773164)
+#define TA_OCCURS ((FLDID32)33555437)
+#define TA_MORE ((FLDID32)33555438)
+#define TA_FLAGS ((FLDID32)33555439)
+#define TA_ERROR ((FLDID32)33555440)
+#define TA_STATUS ((FLDID32)167773169)
+#define TA_STATE ((FLDID32)167773261)
+#define TA_LMID ((FLDID32)167773277)
+#define TA_SRVGRP ((FLDID32)167773301)
+#define TA_SRVID ((FLDID32)33555574)
+#define TA_SERVERNAME ((FLDID32)167773271)
+#define TA_SERVICENAME ((FLDID32)167773386)
+#define TA_RQADDR ((FLDID32)167773345)
+#define TA_NCOMPLETED ((FLDID32)33555656)
+#define TA_NQUEUED ((FLDID32)33555657)
+#define TA_CURRSERVICE ((FLDID32)167773359)
+
+int tpadmcall(FBFR32 *inbuf, FBFR32 **outbuf, long flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
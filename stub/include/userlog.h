@@ -0,0 +1,14 @@
+#ifndef _USERLOG_H
+#define _USERLOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int userlog(char *fmt, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _XA_H
+#define _XA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RMNAMESZ 32
+
+struct xa_switch_t {
+  char name[RMNAMESZ];
+  long flags;
+  long version;
+  int (*xa_open_entry)(char *, int, long);
+  int (*xa_close_entry)(char *, int, long);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
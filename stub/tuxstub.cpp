@@ -0,0 +1,2989 @@
+// In-process stand-in for the Oracle Tuxedo ATMI and FML32 libraries, enough
+// to build the module and benchmark conversion and dispatch without a
+// domain. Services advertised by a server started with tuxedo.run() are
+// dispatched on a pool of threads in the same process, /Q queues and events
+// live in memory.
+//
+// Environment:
+//   TUXSTUB_SERVICES   built-in echo services and extra latency of any
+//                      service, "ECHO=0,SLOW=5000" (microseconds)
+//   TUXSTUB_THREADS    maximum number of dispatch threads, 16 by default
+//   TUXSTUB_BLOCKTIME  default blocking timeout in seconds, 60 by default
+//   FLDTBLDIR32, FIELDTBLS32  field tables as with Tuxedo
+//   ULOGPFX            userlog() file prefix, stderr when not set
+
+#include <atmi.h>
+#include <fml32.h>
+#include <tmenv.h>
+#include <tpadm.h>
+#include <userlog.h>
+#include <xa.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+thread_local int tperrno_ = 0;
+thread_local long tpurcode_ = 0;
+thread_local int ferror_ = 0;
+
+int fail(int err) {
+  tperrno_ = err;
+  return -1;
+}
+
+int ffail(int err) {
+  ferror_ = err;
+  return -1;
+}
+
+long env_long(const char *name, long dflt) {
+  const char *v = getenv(name);
+  return v != nullptr && *v != '\0' ? strtol(v, nullptr, 10) : dflt;
+}
+
+// Typed buffers
+
+const uint32_t BUF_MAGIC = 0x54555842;
+
+struct alignas(16) bufhdr {
+  uint32_t magic;
+  char type[8];
+  char subtype[16];
+  long size;
+};
+
+bufhdr *header(char *ptr) {
+  if (ptr == nullptr) {
+    return nullptr;
+  }
+  bufhdr *h = reinterpret_cast<bufhdr *>(ptr) - 1;
+  return h->magic == BUF_MAGIC ? h : nullptr;
+}
+
+// Number of bytes that carry data, what a reply or a message copies
+long data_len(char *ptr, long len) {
+  bufhdr *h = header(ptr);
+  if (h == nullptr) {
+    return len;
+  }
+  if (strcmp(h->type, "FML32") == 0) {
+    return Fused32(reinterpret_cast<FBFR32 *>(ptr));
+  }
+  if (strcmp(h->type, "STRING") == 0) {
+    return static_cast<long>(strnlen(ptr, h->size)) + 1;
+  }
+  if (len <= 0 || len > h->size) {
+    return h->size;
+  }
+  return len;
+}
+
+char *copy_buffer(char *ptr, long len) {
+  bufhdr *h = header(ptr);
+  long n = data_len(ptr, len);
+  char *c = tpalloc(h->type, h->subtype, n);
+  if (c == nullptr) {
+    return nullptr;
+  }
+  if (strcmp(h->type, "FML32") == 0) {
+    Fcpy32(reinterpret_cast<FBFR32 *>(c), reinterpret_cast<FBFR32 *>(ptr));
+  } else {
+    memcpy(c, ptr, std::min(n, header(c)->size));
+  }
+  return c;
+}
+
+// FML32 buffer: a header followed by fields sorted by identifier, each
+// occurrence is an id, a length and the value padded to 8 bytes
+
+const uint32_t FML_MAGIC = 0x464d4c33;
+
+struct fbfr {
+  uint32_t magic;
+  uint32_t size;
+  uint32_t used;
+  uint32_t count;
+};
+
+struct fentry {
+  FLDID32 id;
+  FLDLEN32 len;
+  char *value() { return reinterpret_cast<char *>(this + 1); }
+  size_t total() const { return sizeof(fentry) + ((len + 7) & ~7u); }
+  fentry *next() {
+    return reinterpret_cast<fentry *>(reinterpret_cast<char *>(this) +
+                                      total());
+  }
+};
+
+fbfr *fml(FBFR32 *p) {
+  fbfr *b = reinterpret_cast<fbfr *>(p);
+  if (b == nullptr) {
+    ffail(FNOTFLD);
+    return nullptr;
+  }
+  if (reinterpret_cast<uintptr_t>(b) % 4 != 0) {
+    ffail(FALIGNERR);
+    return nullptr;
+  }
+  if (b->magic != FML_MAGIC) {
+    ffail(FNOTFLD);
+    return nullptr;
+  }
+  return b;
+}
+
+fentry *first(fbfr *b) { return reinterpret_cast<fentry *>(b + 1); }
+fentry *end(fbfr *b) {
+  return reinterpret_cast<fentry *>(reinterpret_cast<char *>(b) + b->used);
+}
+
+bool valid_type(int type) {
+  return type == FLD_SHORT || type == FLD_LONG || type == FLD_CHAR ||
+         type == FLD_FLOAT || type == FLD_DOUBLE || type == FLD_STRING ||
+         type == FLD_CARRAY || type == FLD_FML32;
+}
+
+bool valid_field(FLDID32 id) {
+  return id != BADFLDID && valid_type(Fldtype32(id)) && Fldno32(id) > 0;
+}
+
+// Length of a value as stored
+long value_len(FLDID32 id, const char *value, FLDLEN32 len) {
+  switch (Fldtype32(id)) {
+    case FLD_SHORT:
+      return sizeof(short);
+    case FLD_LONG:
+      return sizeof(long);
+    case FLD_CHAR:
+      return 1;
+    case FLD_FLOAT:
+      return sizeof(float);
+    case FLD_DOUBLE:
+      return sizeof(double);
+    case FLD_STRING:
+      return static_cast<long>(strlen(value)) + 1;
+    case FLD_CARRAY:
+      return len;
+    case FLD_FML32: {
+      fbfr *sub = fml(reinterpret_cast<FBFR32 *>(const_cast<char *>(value)));
+      return sub == nullptr ? -1 : sub->used;
+    }
+  }
+  return -1;
+}
+
+// The entry of the occurrence or where it would be inserted
+fentry *locate(fbfr *b, FLDID32 id, FLDOCC32 oc, FLDOCC32 *found) {
+  fentry *e = first(b);
+  fentry *last = end(b);
+  FLDOCC32 n = 0;
+  while (e < last && e->id < id) {
+    e = e->next();
+  }
+  while (e < last && e->id == id && n < oc) {
+    e = e->next();
+    n++;
+  }
+  *found = n;
+  return e;
+}
+
+fentry *find(fbfr *b, FLDID32 id, FLDOCC32 oc) {
+  FLDOCC32 n;
+  fentry *e = locate(b, id, oc, &n);
+  return e < end(b) && e->id == id && n == oc ? e : nullptr;
+}
+
+int insert(fbfr *b, fentry *at, FLDID32 id, const char *value, long len) {
+  size_t total = sizeof(fentry) + ((len + 7) & ~7L);
+  if (b->used + total > b->size) {
+    return ffail(FNOSPACE);
+  }
+  char *p = reinterpret_cast<char *>(at);
+  memmove(p + total, p, reinterpret_cast<char *>(end(b)) - p);
+  at->id = id;
+  at->len = static_cast<FLDLEN32>(len);
+  memset(at->value(), 0, total - sizeof(fentry));
+  if (Fldtype32(id) == FLD_FML32) {
+    memcpy(at->value(), value, len);
+    reinterpret_cast<fbfr *>(at->value())->size = static_cast<uint32_t>(len);
+  } else {
+    memcpy(at->value(), value, len);
+  }
+  b->used += static_cast<uint32_t>(total);
+  b->count++;
+  return 1;
+}
+
+void remove(fbfr *b, fentry *at) {
+  size_t total = at->total();
+  char *p = reinterpret_cast<char *>(at);
+  memmove(p, p + total, reinterpret_cast<char *>(end(b)) - p - total);
+  b->used -= static_cast<uint32_t>(total);
+  b->count--;
+}
+
+int replace(fbfr *b, fentry *at, const char *value, long len) {
+  size_t old_total = at->total();
+  size_t total = sizeof(fentry) + ((len + 7) & ~7L);
+  if (b->used - old_total + total > b->size) {
+    return ffail(FNOSPACE);
+  }
+  char *p = reinterpret_cast<char *>(at);
+  memmove(p + total, p + old_total,
+          reinterpret_cast<char *>(end(b)) - p - old_total);
+  b->used = static_cast<uint32_t>(b->used - old_total + total);
+  at->len = static_cast<FLDLEN32>(len);
+  memset(at->value(), 0, total - sizeof(fentry));
+  memcpy(at->value(), value, len);
+  if (Fldtype32(at->id) == FLD_FML32) {
+    reinterpret_cast<fbfr *>(at->value())->size = static_cast<uint32_t>(len);
+  }
+  return 1;
+}
+
+// Value used for occurrences added to reach the one being changed
+const char *null_value(FLDID32 id, long *len) {
+  static const char zeros[16] = {0};
+  static const fbfr empty = {FML_MAGIC, sizeof(fbfr), sizeof(fbfr), 0};
+  switch (Fldtype32(id)) {
+    case FLD_STRING:
+      *len = 1;
+      return zeros;
+    case FLD_CARRAY:
+      *len = 0;
+      return zeros;
+    case FLD_FML32:
+      *len = sizeof(empty);
+      return reinterpret_cast<const char *>(&empty);
+  }
+  *len = value_len(id, zeros, 0);
+  return zeros;
+}
+
+// Conversions between field types go through a double or a string
+
+bool is_numeric(int type) {
+  return type == FLD_SHORT || type == FLD_LONG || type == FLD_FLOAT ||
+         type == FLD_DOUBLE;
+}
+
+double to_double(int type, const char *v, long len) {
+  switch (type) {
+    case FLD_SHORT:
+      return *reinterpret_cast<const short *>(v);
+    case FLD_LONG:
+      return static_cast<double>(*reinterpret_cast<const long *>(v));
+    case FLD_FLOAT:
+      return *reinterpret_cast<const float *>(v);
+    case FLD_DOUBLE:
+      return *reinterpret_cast<const double *>(v);
+    case FLD_CHAR:
+      return static_cast<unsigned char>(v[0]);
+  }
+  return strtod(std::string(v, len).c_str(), nullptr);
+}
+
+std::string to_string(int type, const char *v, long len) {
+  char buf[64];
+  switch (type) {
+    case FLD_SHORT:
+      snprintf(buf, sizeof(buf), "%d", *reinterpret_cast<const short *>(v));
+      return buf;
+    case FLD_LONG:
+      snprintf(buf, sizeof(buf), "%ld", *reinterpret_cast<const long *>(v));
+      return buf;
+    case FLD_FLOAT:
+      snprintf(buf, sizeof(buf), "%f", *reinterpret_cast<const float *>(v));
+      return buf;
+    case FLD_DOUBLE:
+      snprintf(buf, sizeof(buf), "%f", *reinterpret_cast<const double *>(v));
+      return buf;
+    case FLD_CHAR:
+      return std::string(v, 1);
+    case FLD_STRING:
+      return std::string(v);
+  }
+  return std::string(v, len);
+}
+
+// Converts into out, returns the length or -1
+long convert(int from, const char *v, long len, int to, std::string &out) {
+  if (from == FLD_FML32 || to == FLD_FML32) {
+    if (from != to) {
+      return ffail(FTYPERR);
+    }
+    out.assign(v, len);
+    return len;
+  }
+  if (from == FLD_STRING && len <= 0) {
+    len = static_cast<long>(strlen(v));
+  } else if (from == FLD_STRING) {
+    len = static_cast<long>(strnlen(v, len));
+  }
+  if (from == to) {
+    out.assign(v, from == FLD_STRING ? len + 1 : len);
+    return static_cast<long>(out.size());
+  }
+  bool numeric_source = is_numeric(from) ||
+                        (from == FLD_CHAR && is_numeric(to));
+  switch (to) {
+    case FLD_SHORT: {
+      short s = static_cast<short>(to_double(numeric_source ? from : FLD_STRING,
+                                             v, len));
+      out.assign(reinterpret_cast<char *>(&s), sizeof(s));
+      break;
+    }
+    case FLD_LONG: {
+      long l;
+      if (numeric_source) {
+        l = static_cast<long>(to_double(from, v, len));
+      } else {
+        l = strtol(std::string(v, len).c_str(), nullptr, 10);
+      }
+      out.assign(reinterpret_cast<char *>(&l), sizeof(l));
+      break;
+    }
+    case FLD_FLOAT: {
+      float f = static_cast<float>(
+          to_double(numeric_source ? from : FLD_STRING, v, len));
+      out.assign(reinterpret_cast<char *>(&f), sizeof(f));
+      break;
+    }
+    case FLD_DOUBLE: {
+      double d = to_double(numeric_source ? from : FLD_STRING, v, len);
+      out.assign(reinterpret_cast<char *>(&d), sizeof(d));
+      break;
+    }
+    case FLD_CHAR: {
+      char c;
+      if (is_numeric(from)) {
+        c = static_cast<char>(to_double(from, v, len));
+      } else {
+        c = len > 0 ? v[0] : '\0';
+      }
+      out.assign(1, c);
+      break;
+    }
+    case FLD_STRING:
+      out = to_string(from, v, len);
+      out += '\0';
+      break;
+    case FLD_CARRAY:
+      out = to_string(from, v, len);
+      break;
+    default:
+      return ffail(FTYPERR);
+  }
+  return static_cast<long>(out.size());
+}
+
+// Field tables
+
+struct field_tables {
+  std::mutex mutex;
+  bool loaded = false;
+  std::unordered_map<std::string, FLDID32> ids;
+  std::unordered_map<FLDID32, std::string> names;
+
+  void add(const std::string &name, FLDID32 id) {
+    ids[name] = id;
+    names[id] = name;
+  }
+
+  void load() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (loaded) {
+      return;
+    }
+    loaded = true;
+    add("TA_CLASS", TA_CLASS);
+    add("TA_OPERATION", TA_OPERATION);
+    add("TA_CURSOR", TA_CURSOR);
+    add("TA_OCCURS", TA_OCCURS);
+    add("TA_MORE", TA_MORE);
+    add("TA_FLAGS", TA_FLAGS);
+    add("TA_ERROR", TA_ERROR);
+    add("TA_STATUS", TA_STATUS);
+    add("TA_STATE", TA_STATE);
+    add("TA_LMID", TA_LMID);
+    add("TA_SRVGRP", TA_SRVGRP);
+    add("TA_SRVID", TA_SRVID);
+    add("TA_SERVERNAME", TA_SERVERNAME);
+    add("TA_SERVICENAME", TA_SERVICENAME);
+    add("TA_RQADDR", TA_RQADDR);
+    add("TA_NCOMPLETED", TA_NCOMPLETED);
+    add("TA_NQUEUED", TA_NQUEUED);
+    add("TA_CURRSERVICE", TA_CURRSERVICE);
+
+    const char *tables = getenv("FIELDTBLS32");
+    const char *dirs = getenv("FLDTBLDIR32");
+    if (tables == nullptr) {
+      return;
+    }
+    for (auto &table : split(tables, ',')) {
+      if (table.empty()) {
+        continue;
+      }
+      if (table[0] == '/') {
+        parse(table);
+        continue;
+      }
+      for (auto &dir : split(dirs == nullptr ? "." : dirs, ':')) {
+        if (parse(dir + "/" + table)) {
+          break;
+        }
+      }
+    }
+  }
+
+  static std::vector<std::string> split(const std::string &s, char sep) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    for (;;) {
+      size_t pos = s.find(sep, start);
+      parts.push_back(s.substr(start, pos - start));
+      if (pos == std::string::npos) {
+        return parts;
+      }
+      start = pos + 1;
+    }
+  }
+
+  // "*base N" lines, comments starting with # and "NAME NUMBER TYPE ..."
+  bool parse(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == nullptr) {
+      return false;
+    }
+    static const char *const types[] = {"short",  "long",   "char",
+                                        "float",  "double", "string",
+                                        "carray", nullptr,  nullptr,
+                                        nullptr,  "fml32"};
+    long base = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != nullptr) {
+      char name[256];
+      char type[64];
+      long number;
+      if (line[0] == '#' || line[0] == '$' || line[0] == '\n') {
+        continue;
+      }
+      if (sscanf(line, "*base %ld", &number) == 1) {
+        base = number;
+        continue;
+      }
+      if (sscanf(line, "%255s %ld %63s", name, &number, type) != 3) {
+        continue;
+      }
+      for (int t = 0; t < static_cast<int>(sizeof(types) / sizeof(types[0]));
+           t++) {
+        if (types[t] != nullptr && strcmp(types[t], type) == 0) {
+          add(name, Fmkfldid32(t, static_cast<FLDID32>(base + number)));
+          break;
+        }
+      }
+    }
+    fclose(f);
+    return true;
+  }
+};
+
+field_tables &fields() {
+  static field_tables *tables = new field_tables();
+  tables->load();
+  return *tables;
+}
+
+}  // namespace
+
+extern "C" {
+
+int *_Fget_Ferror_addr32(void) { return &ferror_; }
+
+char *Fstrerror32(int err) {
+  static const char *const messages[] = {
+      "No error",
+      "Alignment error",
+      "Not a fielded buffer",
+      "No space in fielded buffer",
+      "Field not present",
+      "Unknown field number or type",
+      "Illegal field type",
+      "UNIX system call error",
+      "Unknown field name",
+      "Malloc failed",
+      "Bad syntax in boolean expression",
+      "Cannot find or open field table",
+      "Syntax error in field table",
+      "Invalid argument to function",
+      "Destructive concurrent access to field table",
+      "Cannot find or get view",
+      "Syntax error in viewfile",
+      "Cannot find or open viewfile",
+      "Negative or zero ACM",
+      "Cname not found",
+      "Operation invalid for field type"};
+  if (err < 0 || err >= FMAXVAL) {
+    return const_cast<char *>("Unknown error");
+  }
+  return const_cast<char *>(messages[err]);
+}
+
+long Fneeded32(FLDOCC32 F, FLDLEN32 V) {
+  return static_cast<long>(sizeof(fbfr) + F * (sizeof(fentry) + 8) + V);
+}
+
+int Finit32(FBFR32 *p, FLDLEN32 buflen) {
+  if (p == nullptr) {
+    return ffail(FNOTFLD);
+  }
+  if (buflen < sizeof(fbfr)) {
+    return ffail(FNOSPACE);
+  }
+  fbfr *b = reinterpret_cast<fbfr *>(p);
+  b->magic = FML_MAGIC;
+  b->size = buflen;
+  b->used = sizeof(fbfr);
+  b->count = 0;
+  return 1;
+}
+
+FBFR32 *Falloc32(FLDOCC32 F, FLDLEN32 V) {
+  long size = Fneeded32(F, V);
+  FBFR32 *p = reinterpret_cast<FBFR32 *>(malloc(size));
+  if (p == nullptr) {
+    ffail(FMALLOC);
+    return nullptr;
+  }
+  Finit32(p, static_cast<FLDLEN32>(size));
+  return p;
+}
+
+int Ffree32(FBFR32 *p) {
+  if (fml(p) == nullptr) {
+    return -1;
+  }
+  free(p);
+  return 1;
+}
+
+long Fsizeof32(FBFR32 *p) {
+  fbfr *b = fml(p);
+  return b == nullptr ? -1 : b->size;
+}
+
+long Fused32(FBFR32 *p) {
+  fbfr *b = fml(p);
+  return b == nullptr ? -1 : b->used;
+}
+
+long Funused32(FBFR32 *p) {
+  fbfr *b = fml(p);
+  return b == nullptr ? -1 : b->size - b->used;
+}
+
+int Fcpy32(FBFR32 *dest, FBFR32 *src) {
+  fbfr *s = fml(src);
+  fbfr *d = fml(dest);
+  if (s == nullptr || d == nullptr) {
+    return -1;
+  }
+  if (d->size < s->used) {
+    return ffail(FNOSPACE);
+  }
+  uint32_t size = d->size;
+  memmove(d, s, s->used);
+  d->size = size;
+  return 1;
+}
+
+int Fadd32(FBFR32 *p, FLDID32 id, char *value, FLDLEN32 len) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  if (!valid_field(id)) {
+    return ffail(FBADFLD);
+  }
+  if (value == nullptr) {
+    return ffail(FEINVAL);
+  }
+  long n = value_len(id, value, len);
+  if (n < 0) {
+    return -1;
+  }
+  FLDOCC32 found;
+  fentry *at = locate(b, id, INT32_MAX, &found);
+  return insert(b, at, id, value, n);
+}
+
+int Fchg32(FBFR32 *p, FLDID32 id, FLDOCC32 oc, char *value, FLDLEN32 len) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  if (!valid_field(id)) {
+    return ffail(FBADFLD);
+  }
+  if (value == nullptr) {
+    fentry *e = find(b, id, oc);
+    if (e != nullptr) {
+      remove(b, e);
+    }
+    return 1;
+  }
+  if (oc < 0) {
+    return Fadd32(p, id, value, len);
+  }
+  long n = value_len(id, value, len);
+  if (n < 0) {
+    return -1;
+  }
+  FLDOCC32 found;
+  fentry *at = locate(b, id, oc, &found);
+  if (found == oc && at < end(b) && at->id == id) {
+    return replace(b, at, value, n);
+  }
+  // Occurrences up to the one being changed get null values
+  for (; found < oc; found++) {
+    long nlen;
+    const char *nv = null_value(id, &nlen);
+    if (insert(b, at, id, nv, nlen) == -1) {
+      return -1;
+    }
+    at = at->next();
+  }
+  return insert(b, at, id, value, n);
+}
+
+int Fget32(FBFR32 *p, FLDID32 id, FLDOCC32 oc, char *loc, FLDLEN32 *maxlen) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  fentry *e = find(b, id, oc);
+  if (e == nullptr) {
+    return ffail(FNOTPRES);
+  }
+  if (loc != nullptr) {
+    if (maxlen != nullptr && *maxlen < e->len) {
+      return ffail(FNOSPACE);
+    }
+    memcpy(loc, e->value(), e->len);
+  }
+  if (maxlen != nullptr) {
+    *maxlen = e->len;
+  }
+  return 1;
+}
+
+char *Ffind32(FBFR32 *p, FLDID32 id, FLDOCC32 oc, FLDLEN32 *len) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return nullptr;
+  }
+  fentry *e = find(b, id, oc);
+  if (e == nullptr) {
+    ffail(FNOTPRES);
+    return nullptr;
+  }
+  if (len != nullptr) {
+    *len = e->len;
+  }
+  return e->value();
+}
+
+int CFchg32(FBFR32 *p, FLDID32 id, FLDOCC32 oc, char *value, FLDLEN32 len,
+            int type) {
+  if (value == nullptr || !valid_type(type)) {
+    return ffail(type == FLD_FML32 || valid_type(type) ? FEINVAL : FTYPERR);
+  }
+  if (!valid_field(id)) {
+    return ffail(FBADFLD);
+  }
+  std::string v;
+  long n = convert(type, value, type == FLD_CARRAY ? len : value_len(
+                                                               Fmkfldid32(type, 1),
+                                                               value, len),
+                   Fldtype32(id), v);
+  if (n < 0) {
+    return -1;
+  }
+  return Fchg32(p, id, oc, &v[0], static_cast<FLDLEN32>(n));
+}
+
+int CFget32(FBFR32 *p, FLDID32 id, FLDOCC32 oc, char *buf, FLDLEN32 *len,
+            int type) {
+  FLDLEN32 flen;
+  char *v = Ffind32(p, id, oc, &flen);
+  if (v == nullptr) {
+    return -1;
+  }
+  std::string out;
+  long n = convert(Fldtype32(id), v, flen, type, out);
+  if (n < 0) {
+    return -1;
+  }
+  if (buf != nullptr) {
+    if (len != nullptr && *len < n) {
+      return ffail(FNOSPACE);
+    }
+    memcpy(buf, out.data(), n);
+  }
+  if (len != nullptr) {
+    *len = static_cast<FLDLEN32>(n);
+  }
+  return 1;
+}
+
+char *CFfind32(FBFR32 *p, FLDID32 id, FLDOCC32 oc, FLDLEN32 *len, int type) {
+  // Valid until the next call in the same thread
+  static thread_local std::string converted;
+  FLDLEN32 flen;
+  char *v = Ffind32(p, id, oc, &flen);
+  if (v == nullptr) {
+    return nullptr;
+  }
+  long n = convert(Fldtype32(id), v, flen, type, converted);
+  if (n < 0) {
+    return nullptr;
+  }
+  if (len != nullptr) {
+    *len = static_cast<FLDLEN32>(n);
+  }
+  converted.reserve(converted.size() + 8);
+  return &converted[0];
+}
+
+int Fdel32(FBFR32 *p, FLDID32 id, FLDOCC32 oc) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  fentry *e = find(b, id, oc);
+  if (e == nullptr) {
+    return ffail(FNOTPRES);
+  }
+  remove(b, e);
+  return 1;
+}
+
+int Fdelall32(FBFR32 *p, FLDID32 id) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  fentry *e = find(b, id, 0);
+  if (e == nullptr) {
+    return ffail(FNOTPRES);
+  }
+  while (e < end(b) && e->id == id) {
+    remove(b, e);
+  }
+  return 1;
+}
+
+int Fpres32(FBFR32 *p, FLDID32 id, FLDOCC32 oc) {
+  fbfr *b = fml(p);
+  return b != nullptr && find(b, id, oc) != nullptr ? 1 : 0;
+}
+
+FLDOCC32 Foccur32(FBFR32 *p, FLDID32 id) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  FLDOCC32 n;
+  locate(b, id, INT32_MAX, &n);
+  return n;
+}
+
+FLDOCC32 Fnum32(FBFR32 *p) {
+  fbfr *b = fml(p);
+  return b == nullptr ? -1 : static_cast<FLDOCC32>(b->count);
+}
+
+FLDLEN32 Flen32(FBFR32 *p, FLDID32 id, FLDOCC32 oc) {
+  FLDLEN32 len;
+  return Ffind32(p, id, oc, &len) == nullptr ? static_cast<FLDLEN32>(-1) : len;
+}
+
+int Fnext32(FBFR32 *p, FLDID32 *id, FLDOCC32 *oc, char *value,
+            FLDLEN32 *len) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  fentry *e = first(b);
+  fentry *last = end(b);
+  FLDOCC32 n = 0;
+  if (*id != FIRSTFLDID) {
+    FLDOCC32 found;
+    e = locate(b, *id, *oc, &found);
+    if (e < last && e->id == *id && found == *oc) {
+      n = found + 1;
+      e = e->next();
+    } else {
+      // The current field was deleted, continue after it
+      n = found;
+    }
+    if (e < last && e->id != *id) {
+      n = 0;
+    }
+  }
+  if (e >= last) {
+    return 0;
+  }
+  if (value != nullptr) {
+    if (len != nullptr && *len < e->len) {
+      return ffail(FNOSPACE);
+    }
+    memcpy(value, e->value(), e->len);
+  }
+  if (len != nullptr) {
+    *len = e->len;
+  }
+  *id = e->id;
+  *oc = n;
+  return 1;
+}
+
+FLDID32 Fldid32(char *name) {
+  if (name == nullptr) {
+    ffail(FEINVAL);
+    return BADFLDID;
+  }
+  auto &t = fields();
+  auto it = t.ids.find(name);
+  if (it == t.ids.end()) {
+    ffail(FBADNAME);
+    return BADFLDID;
+  }
+  return it->second;
+}
+
+char *Fname32(FLDID32 id) {
+  auto &t = fields();
+  auto it = t.names.find(id);
+  if (it == t.names.end()) {
+    ffail(FBADFLD);
+    return nullptr;
+  }
+  return const_cast<char *>(it->second.c_str());
+}
+
+int Fldtype32(FLDID32 id) { return static_cast<int>(id >> 25); }
+
+long Fldno32(FLDID32 id) { return static_cast<long>(id & 0x1ffffff); }
+
+FLDID32 Fmkfldid32(int type, FLDID32 num) {
+  if (!valid_type(type) || num == 0 || num > 0x1ffffff) {
+    ffail(type < 0 || type > FLD_FML32 ? FTYPERR : FBADFLD);
+    return BADFLDID;
+  }
+  return (static_cast<FLDID32>(type) << 25) | num;
+}
+
+}  // extern "C"
+
+// Fielded buffer text format, one "NAME<tab>value" line per occurrence,
+// embedded FML32 is indented with one more tab and a blank line ends a record
+
+namespace {
+
+void print_value(FILE *f, const char *v, long len) {
+  for (long i = 0; i < len; i++) {
+    unsigned char c = static_cast<unsigned char>(v[i]);
+    if (c == '\\') {
+      fputs("\\\\", f);
+    } else if (c < 0x20 || c >= 0x7f) {
+      fprintf(f, "\\%02x", c);
+    } else {
+      fputc(c, f);
+    }
+  }
+}
+
+int print_fields(fbfr *b, FILE *f, int depth) {
+  for (fentry *e = first(b); e < end(b); e = e->next()) {
+    for (int i = 0; i < depth; i++) {
+      fputc('\t', f);
+    }
+    const char *name = Fname32(e->id);
+    if (name != nullptr) {
+      fputs(name, f);
+    } else {
+      fprintf(f, "((FLDID32)%u)", e->id);
+    }
+    fputc('\t', f);
+    int type = Fldtype32(e->id);
+    if (type == FLD_FML32) {
+      fputc('\n', f);
+      print_fields(reinterpret_cast<fbfr *>(e->value()), f, depth + 1);
+      continue;
+    }
+    std::string s = to_string(type, e->value(), e->len);
+    if (type == FLD_STRING || type == FLD_CARRAY || type == FLD_CHAR) {
+      print_value(f, s.data(), static_cast<long>(s.size()));
+    } else {
+      fputs(s.c_str(), f);
+    }
+    fputc('\n', f);
+  }
+  return ferror(f) ? ffail(FEUNIX) : 1;
+}
+
+std::string unescape(const char *v) {
+  std::string s;
+  while (*v != '\0') {
+    if (v[0] == '\\' && v[1] == '\\') {
+      s += '\\';
+      v += 2;
+    } else if (v[0] == '\\' && isxdigit(static_cast<unsigned char>(v[1])) &&
+               isxdigit(static_cast<unsigned char>(v[2]))) {
+      char hex[3] = {v[1], v[2], '\0'};
+      s += static_cast<char>(strtol(hex, nullptr, 16));
+      v += 3;
+    } else {
+      s += *v++;
+    }
+  }
+  return s;
+}
+
+// Peeks at the indentation of the next line
+int next_depth(FILE *f) {
+  int depth = 0;
+  int c;
+  while ((c = getc(f)) == '\t') {
+    depth++;
+  }
+  if (c != EOF) {
+    ungetc(c, f);
+  }
+  return c == EOF || c == '\n' ? -1 : depth;
+}
+
+int read_fields(fbfr *b, FILE *f, int depth) {
+  std::string line;
+  for (;;) {
+    long pos = ftell(f);
+    int d = next_depth(f);
+    if (d < depth) {
+      // The line belongs to an outer buffer, read it again from there
+      if (d != -1 && (pos == -1 || fseek(f, pos, SEEK_SET) != 0)) {
+        return ffail(FEUNIX);
+      }
+      // The blank line ends the whole record
+      if (d == -1 && depth == 0 && getc(f) == EOF) {
+        clearerr(f);
+      }
+      return 1;
+    }
+    line.clear();
+    int c;
+    while ((c = getc(f)) != EOF && c != '\n') {
+      line += static_cast<char>(c);
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    char flag = '\0';
+    size_t start = 0;
+    if (line[0] == '+' || line[0] == '-' || line[0] == '=') {
+      flag = line[0];
+      start = line.find_first_not_of(" ", 1);
+      if (start == std::string::npos) {
+        return ffail(FSYNTAX);
+      }
+    }
+    size_t tab = line.find('\t', start);
+    std::string name = line.substr(start, tab - start);
+    std::string value =
+        tab == std::string::npos ? std::string() : line.substr(tab + 1);
+    FLDID32 id = Fldid32(const_cast<char *>(name.c_str()));
+    if (id == BADFLDID) {
+      return -1;
+    }
+    if (flag == '-') {
+      Fdelall32(reinterpret_cast<FBFR32 *>(b), id);
+      continue;
+    }
+    if (flag == '=') {
+      FLDID32 src = Fldid32(const_cast<char *>(value.c_str()));
+      FLDLEN32 len;
+      char *v = src == BADFLDID
+                    ? nullptr
+                    : Ffind32(reinterpret_cast<FBFR32 *>(b), src, 0, &len);
+      if (v == nullptr) {
+        return -1;
+      }
+      std::string copy(v, len);
+      if (CFchg32(reinterpret_cast<FBFR32 *>(b), id, 0, &copy[0], len,
+                  Fldtype32(src)) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    FLDOCC32 oc = flag == '+' ? 0 : -1;
+    int rc;
+    if (Fldtype32(id) == FLD_FML32) {
+      std::vector<char> sub(b->size);
+      Finit32(reinterpret_cast<FBFR32 *>(&sub[0]),
+              static_cast<FLDLEN32>(sub.size()));
+      if (read_fields(reinterpret_cast<fbfr *>(&sub[0]), f, depth + 1) == -1) {
+        return -1;
+      }
+      rc = Fchg32(reinterpret_cast<FBFR32 *>(b), id, oc, &sub[0], 0);
+    } else {
+      std::string v = unescape(value.c_str());
+      rc = CFchg32(reinterpret_cast<FBFR32 *>(b), id, oc, &v[0],
+                   static_cast<FLDLEN32>(v.size()), FLD_CARRAY);
+    }
+    if (rc == -1) {
+      return -1;
+    }
+  }
+}
+
+}  // namespace
+
+extern "C" {
+
+int Ffprint32(FBFR32 *p, FILE *iop) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  if (print_fields(b, iop, 0) == -1) {
+    return -1;
+  }
+  fputc('\n', iop);
+  return 1;
+}
+
+int Fprint32(FBFR32 *p) { return Ffprint32(p, stdout); }
+
+int Fextread32(FBFR32 *p, FILE *iop) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  return read_fields(b, iop, 0);
+}
+
+}  // extern "C"
+
+// Boolean expressions, Fboolco32 only checks the syntax and keeps the text,
+// evaluation parses it again
+
+namespace {
+
+struct value {
+  bool is_string = false;
+  bool present = true;
+  double number = 0;
+  std::string text;
+};
+
+struct evaluator {
+  evaluator(const char *expr, fbfr *buf) : p(expr), b(buf) {}
+
+  const char *p;
+  fbfr *b;
+  // Occurrence used for field[?] while a comparison is retried
+  FLDOCC32 any_oc = 0;
+  FLDOCC32 any_max = 0;
+
+  void skip() {
+    while (isspace(static_cast<unsigned char>(*p))) {
+      p++;
+    }
+  }
+
+  bool accept(const char *token) {
+    skip();
+    size_t n = strlen(token);
+    if (strncmp(p, token, n) == 0) {
+      p += n;
+      return true;
+    }
+    return false;
+  }
+
+  void expect(const char *token) {
+    if (!accept(token)) {
+      throw FSYNTAX;
+    }
+  }
+
+  value primary() {
+    skip();
+    value v;
+    if (accept("(")) {
+      v = logical_or();
+      expect(")");
+      return v;
+    }
+    if (*p == '\'') {
+      p++;
+      v.is_string = true;
+      while (*p != '\0' && *p != '\'') {
+        if (*p == '\\' && p[1] != '\0') {
+          p++;
+        }
+        v.text += *p++;
+      }
+      expect("'");
+      return v;
+    }
+    if (isdigit(static_cast<unsigned char>(*p)) || *p == '.') {
+      char *endp;
+      v.number = strtod(p, &endp);
+      p = endp;
+      return v;
+    }
+    if (isalpha(static_cast<unsigned char>(*p)) || *p == '_') {
+      const char *start = p;
+      while (isalnum(static_cast<unsigned char>(*p)) || *p == '_') {
+        p++;
+      }
+      std::string name(start, p);
+      FLDOCC32 oc = 0;
+      if (accept("[")) {
+        skip();
+        if (*p == '?') {
+          p++;
+          oc = -1;
+        } else {
+          char *endp;
+          oc = static_cast<FLDOCC32>(strtol(p, &endp, 10));
+          if (endp == p) {
+            throw FSYNTAX;
+          }
+          p = endp;
+        }
+        expect("]");
+      }
+      FLDID32 id = Fldid32(const_cast<char *>(name.c_str()));
+      if (id == BADFLDID) {
+        throw FBADNAME;
+      }
+      return field(id, oc);
+    }
+    throw FSYNTAX;
+  }
+
+  value field(FLDID32 id, FLDOCC32 oc) {
+    value v;
+    int type = Fldtype32(id);
+    v.is_string =
+        type == FLD_STRING || type == FLD_CARRAY || type == FLD_CHAR;
+    if (b == nullptr) {
+      return v;
+    }
+    if (oc == -1) {
+      any_max = std::max(any_max, Foccur32(reinterpret_cast<FBFR32 *>(b), id));
+      oc = any_oc;
+    }
+    FLDLEN32 len;
+    char *data = Ffind32(reinterpret_cast<FBFR32 *>(b), id, oc, &len);
+    if (data == nullptr) {
+      v.present = false;
+      return v;
+    }
+    if (v.is_string) {
+      v.text = to_string(type, data, len);
+    } else {
+      v.number = to_double(type, data, len);
+    }
+    return v;
+  }
+
+  static double number(const value &v) {
+    return v.is_string ? strtod(v.text.c_str(), nullptr) : v.number;
+  }
+
+  static bool truth(const value &v) {
+    if (!v.present) {
+      return false;
+    }
+    return v.is_string ? true : v.number != 0;
+  }
+
+  static value boolean(bool b) {
+    value v;
+    v.number = b ? 1 : 0;
+    return v;
+  }
+
+  value unary() {
+    if (accept("-")) {
+      value v = unary();
+      v.number = -number(v);
+      v.is_string = false;
+      return v;
+    }
+    if (accept("!")) {
+      if (*p == '=' || *p == '%') {
+        throw FSYNTAX;
+      }
+      return boolean(!truth(unary()));
+    }
+    return primary();
+  }
+
+  value multiplicative() {
+    value v = unary();
+    for (;;) {
+      skip();
+      char op = *p;
+      if ((op != '*' && op != '/' && op != '%') || p[1] == '%') {
+        return v;
+      }
+      p++;
+      value r = unary();
+      double a = number(v);
+      double c = number(r);
+      v = value();
+      if (op == '*') {
+        v.number = a * c;
+      } else if (op == '/') {
+        v.number = c == 0 ? 0 : a / c;
+      } else {
+        v.number = c == 0 ? 0 : static_cast<double>(static_cast<long>(a) %
+                                                    static_cast<long>(c));
+      }
+    }
+  }
+
+  value additive() {
+    value v = multiplicative();
+    for (;;) {
+      skip();
+      char op = *p;
+      if (op != '+' && op != '-') {
+        return v;
+      }
+      p++;
+      value r = multiplicative();
+      double a = number(v);
+      double c = number(r);
+      v = value();
+      v.number = op == '+' ? a + c : a - c;
+    }
+  }
+
+  value comparison() {
+    const char *start = p;
+    FLDOCC32 outer_oc = any_oc;
+    FLDOCC32 outer_max = any_max;
+    any_oc = 0;
+    for (;;) {
+      any_max = 0;
+      value r = compare_once();
+      // field[?] is true when any occurrence satisfies the comparison
+      if (truth(r) || any_oc + 1 >= any_max) {
+        any_oc = outer_oc;
+        any_max = outer_max;
+        return r;
+      }
+      any_oc++;
+      p = start;
+    }
+  }
+
+  value compare_once() {
+    value l = additive();
+    static const char *const ops[] = {"==", "!=", "<=", ">=", "%%", "!%",
+                                      "<",  ">"};
+    skip();
+    for (const char *op : ops) {
+      size_t n = strlen(op);
+      if (strncmp(p, op, n) != 0) {
+        continue;
+      }
+      p += n;
+      value r = additive();
+      if (!l.present || !r.present) {
+        return boolean(false);
+      }
+      if (op[1] == '%') {
+        try {
+          bool m = std::regex_match(l.text, std::regex(r.text));
+          return boolean(op[0] == '%' ? m : !m);
+        } catch (const std::regex_error &) {
+          throw FSYNTAX;
+        }
+      }
+      int c;
+      if (l.is_string && r.is_string) {
+        c = l.text.compare(r.text);
+      } else {
+        double a = number(l);
+        double d = number(r);
+        c = a < d ? -1 : (a > d ? 1 : 0);
+      }
+      switch (op[0]) {
+        case '=':
+          return boolean(c == 0);
+        case '!':
+          return boolean(c != 0);
+        case '<':
+          return boolean(n == 2 ? c <= 0 : c < 0);
+        default:
+          return boolean(n == 2 ? c >= 0 : c > 0);
+      }
+    }
+    return l;
+  }
+
+  value logical_and() {
+    value v = comparison();
+    while (accept("&&")) {
+      value r = comparison();
+      v = boolean(truth(v) && truth(r));
+    }
+    return v;
+  }
+
+  value logical_or() {
+    value v = logical_and();
+    while (accept("||")) {
+      value r = logical_and();
+      v = boolean(truth(v) || truth(r));
+    }
+    return v;
+  }
+
+  value run() {
+    value v = logical_or();
+    skip();
+    if (*p != '\0') {
+      throw FSYNTAX;
+    }
+    return v;
+  }
+};
+
+}  // namespace
+
+extern "C" {
+
+char *Fboolco32(char *expression) {
+  if (expression == nullptr) {
+    ffail(FEINVAL);
+    return nullptr;
+  }
+  try {
+    evaluator(expression, nullptr).run();
+  } catch (int err) {
+    ffail(err);
+    return nullptr;
+  }
+  return strdup(expression);
+}
+
+int Fboolev32(FBFR32 *p, char *tree) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  try {
+    return evaluator::truth(evaluator(tree, b).run()) ? 1 : 0;
+  } catch (int err) {
+    return ffail(err);
+  }
+}
+
+double Ffloatev32(FBFR32 *p, char *tree) {
+  fbfr *b = fml(p);
+  if (b == nullptr) {
+    return -1;
+  }
+  try {
+    return evaluator::number(evaluator(tree, b).run());
+  } catch (int err) {
+    return ffail(err);
+  }
+}
+
+void Fboolpr32(char *tree, FILE *iop) { fprintf(iop, "( %s )\n", tree); }
+
+}  // extern "C"
+
+// ATMI
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+thread_local TPCONTEXT_T current_context = TPNULLCONTEXT;
+std::atomic<TPCONTEXT_T> next_context(1);
+
+// Blocking timeout in milliseconds, 0 when not set
+thread_local long blktime_next = 0;
+thread_local long blktime_all = 0;
+
+long default_blktime() {
+  static long ms = env_long("TUXSTUB_BLOCKTIME", 60) * 1000;
+  return ms;
+}
+
+// Deadline of the next blocking call, consumes TPBLK_NEXT
+clock::time_point deadline(long flags) {
+  long ms = blktime_next != 0 ? blktime_next
+                              : (blktime_all != 0 ? blktime_all
+                                                  : default_blktime());
+  blktime_next = 0;
+  if (flags & TPNOTIME) {
+    return clock::time_point::max();
+  }
+  return clock::now() + std::chrono::milliseconds(ms);
+}
+
+bool wait_until(std::condition_variable &cv,
+                std::unique_lock<std::mutex> &lock,
+                clock::time_point until) {
+  if (until == clock::time_point::max()) {
+    cv.wait(lock);
+    return true;
+  }
+  return cv.wait_until(lock, until) == std::cv_status::no_timeout;
+}
+
+void delay(long us) {
+  if (us <= 0) {
+    return;
+  }
+  auto until = clock::now() + std::chrono::microseconds(us);
+  if (us < 200) {
+    while (clock::now() < until) {
+    }
+  } else {
+    std::this_thread::sleep_until(until);
+  }
+}
+
+// Transactions only decide whether queue operations become visible
+
+struct transaction {
+  std::mutex mutex;
+  std::vector<std::function<void()>> on_commit;
+  std::vector<std::function<void()>> on_abort;
+  clock::time_point expires = clock::time_point::max();
+
+  void finish(bool commit) {
+    std::vector<std::function<void()>> actions;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      actions.swap(commit ? on_commit : on_abort);
+      on_commit.clear();
+      on_abort.clear();
+    }
+    for (auto &action : actions) {
+      action();
+    }
+  }
+};
+
+thread_local std::shared_ptr<transaction> current_tx;
+
+std::mutex suspended_mutex;
+std::map<long, std::shared_ptr<transaction>> &suspended() {
+  static auto *m = new std::map<long, std::shared_ptr<transaction>>();
+  return *m;
+}
+std::atomic<long> next_tranid(1);
+
+// Replies of outstanding calls, one for tpacall() and one for tpcall() in
+// each thread so that TPGETANY does not pick up synchronous replies
+
+struct reply {
+  int err = 0;
+  long urcode = 0;
+  char *data = nullptr;
+  long len = 0;
+};
+
+struct mailbox {
+  std::mutex mutex;
+  std::condition_variable cv;
+  int next_cd = 0;
+  std::map<int, bool> pending;
+  std::map<int, reply> done;
+
+  int open() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pending.size() + done.size() >= 1024) {
+      return fail(TPELIMIT);
+    }
+    do {
+      next_cd = next_cd == INT32_MAX ? 1 : next_cd + 1;
+    } while (pending.count(next_cd) != 0 || done.count(next_cd) != 0);
+    pending[next_cd] = true;
+    return next_cd;
+  }
+
+  void deliver(int cd, reply &r) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (pending.erase(cd) != 0) {
+        done[cd] = r;
+        cv.notify_all();
+        return;
+      }
+    }
+    // Cancelled or timed out
+    tpfree(r.data);
+  }
+
+  void forget(int cd) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.erase(cd);
+    auto it = done.find(cd);
+    if (it != done.end()) {
+      tpfree(it->second.data);
+      done.erase(it);
+    }
+  }
+};
+
+thread_local std::shared_ptr<mailbox> async_box;
+thread_local std::shared_ptr<mailbox> sync_box;
+
+std::shared_ptr<mailbox> &box(std::shared_ptr<mailbox> &b) {
+  if (!b) {
+    b = std::make_shared<mailbox>();
+  }
+  return b;
+}
+
+// Moves the reply into the caller's buffer
+int receive(reply &r, char **data, long *len) {
+  tpurcode_ = r.urcode;
+  if (r.data != nullptr) {
+    if (data != nullptr) {
+      if (*data != nullptr && *data != r.data) {
+        tpfree(*data);
+      }
+      *data = r.data;
+      if (len != nullptr) {
+        bufhdr *h = header(r.data);
+        *len = strcmp(h->type, "FML32") == 0 ? h->size : r.len;
+      }
+    } else {
+      tpfree(r.data);
+    }
+  } else if (len != nullptr) {
+    *len = 0;
+  }
+  return r.err == 0 ? 0 : fail(r.err);
+}
+
+int await(mailbox &b, int *cd, char **data, long *len, long flags) {
+  auto until = deadline(flags);
+  std::unique_lock<std::mutex> lock(b.mutex);
+  for (;;) {
+    auto it = (flags & TPGETANY) ? b.done.begin() : b.done.find(*cd);
+    if (it != b.done.end()) {
+      reply r = it->second;
+      *cd = it->first;
+      b.done.erase(it);
+      lock.unlock();
+      return receive(r, data, len);
+    }
+    if ((flags & TPGETANY) ? b.pending.empty() : b.pending.count(*cd) == 0) {
+      return fail(TPEBADDESC);
+    }
+    if (flags & TPNOBLOCK) {
+      return fail(TPEBLOCK);
+    }
+    if (!wait_until(b.cv, lock, until)) {
+      return fail(TPETIME);
+    }
+  }
+}
+
+// Services
+
+enum service_kind { ADVERTISED, ECHO, SHUTDOWN, TMIB };
+
+struct service {
+  std::string name;
+  std::string fname;
+  void (*func)(TPSVCINFO *) = nullptr;
+  service_kind kind = ADVERTISED;
+  long latency_us = 0;
+  std::atomic<long> completed{0};
+};
+
+struct services {
+  std::mutex mutex;
+  std::map<std::string, std::shared_ptr<service>> table;
+  std::map<std::string, long> latency;
+
+  services() {
+    add(".TMIB", TMIB, 0);
+    add(".TUXSTUB_SHUTDOWN", SHUTDOWN, 0);
+    const char *spec = getenv("TUXSTUB_SERVICES");
+    if (spec == nullptr) {
+      return;
+    }
+    for (auto &entry : field_tables::split(spec, ',')) {
+      size_t eq = entry.find('=');
+      std::string name = entry.substr(0, eq);
+      if (name.empty()) {
+        continue;
+      }
+      long us = eq == std::string::npos
+                    ? 0
+                    : strtol(entry.c_str() + eq + 1, nullptr, 10);
+      latency[name] = us;
+      add(name, ECHO, us);
+    }
+  }
+
+  void add(const std::string &name, service_kind kind, long us) {
+    auto s = std::make_shared<service>();
+    s->name = name;
+    s->fname = name;
+    s->kind = kind;
+    s->latency_us = us;
+    table[name] = s;
+  }
+
+  std::shared_ptr<service> find(const char *name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = table.find(name);
+    return it == table.end() ? nullptr : it->second;
+  }
+};
+
+services &registry() {
+  static auto *s = new services();
+  return *s;
+}
+
+struct request {
+  std::shared_ptr<service> svc;
+  char *data = nullptr;
+  long len = 0;
+  long flags = 0;
+  std::shared_ptr<mailbox> box;
+  int cd = 0;
+  std::shared_ptr<transaction> tx;
+};
+
+// Server started with _tmstartserver()
+struct server_state {
+  std::mutex mutex;
+  std::condition_variable cv;
+  tmsvrargs_t *args = nullptr;
+  std::vector<std::string> argv;
+  std::vector<char *> cargv;
+  TPCONTEXT_T context = TPNULLCONTEXT;
+  std::atomic<bool> running{false};
+  bool shutdown = false;
+};
+
+server_state &server() {
+  static auto *s = new server_state();
+  return *s;
+}
+
+// Results of tpreturn() and tpforward() inside a service routine
+struct call_state {
+  bool done = false;
+  bool forward = false;
+  int rval = 0;
+  long rcode = 0;
+  char *data = nullptr;
+  long len = 0;
+  std::string svc;
+};
+
+thread_local call_state *current_call = nullptr;
+
+FBFR32 *mib(FBFR32 *in, int *err);
+
+void execute(request &req) {
+  for (int hops = 0;; hops++) {
+    auto svc = req.svc;
+    delay(svc->latency_us);
+    reply r;
+    switch (svc->kind) {
+      case ECHO:
+        r.data = req.data;
+        r.len = req.len;
+        req.data = nullptr;
+        break;
+      case SHUTDOWN: {
+        auto &s = server();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.shutdown = true;
+        s.cv.notify_all();
+        break;
+      }
+      case TMIB:
+        r.data = reinterpret_cast<char *>(
+            mib(reinterpret_cast<FBFR32 *>(req.data), &r.err));
+        if (r.data != nullptr) {
+          r.len = Fused32(reinterpret_cast<FBFR32 *>(r.data));
+        }
+        break;
+      case ADVERTISED: {
+        TPSVCINFO info;
+        memset(&info, 0, sizeof(info));
+        strncpy(info.name, svc->name.c_str(), sizeof(info.name) - 1);
+        strncpy(info.fname, svc->fname.c_str(), sizeof(info.fname) - 1);
+        info.data = req.data;
+        info.len = req.len;
+        info.flags = req.flags & (TPNOREPLY | TPTRAN);
+        info.cd = req.cd;
+        info.appkey = -1;
+        call_state state;
+        call_state *outer = current_call;
+        auto outer_tx = current_tx;
+        current_call = &state;
+        current_tx = req.tx;
+        svc->func(&info);
+        current_call = outer;
+        current_tx = outer_tx;
+
+        if (state.data != req.data) {
+          tpfree(req.data);
+        }
+        req.data = nullptr;
+        if (state.forward) {
+          auto next = registry().find(state.svc.c_str());
+          if (next && hops < 16) {
+            svc->completed++;
+            req.svc = next;
+            req.data = state.data;
+            req.len = state.len;
+            continue;
+          }
+          tpfree(state.data);
+          r.err = TPESVCERR;
+        } else if (!state.done) {
+          tpfree(state.data);
+          r.err = TPESVCERR;
+        } else {
+          r.data = state.data;
+          r.len = state.data == nullptr ? 0 : data_len(state.data, state.len);
+          r.urcode = state.rcode;
+          r.err = state.rval == TPSUCCESS
+                      ? 0
+                      : (state.rval == TPFAIL ? TPESVCFAIL : TPESVCERR);
+        }
+        break;
+      }
+    }
+    tpfree(req.data);
+    svc->completed++;
+    if (req.box) {
+      req.box->deliver(req.cd, r);
+    } else {
+      tpfree(r.data);
+    }
+    return;
+  }
+}
+
+// Dispatch threads are started on demand up to TUXSTUB_THREADS
+struct dispatcher {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::condition_variable stopped;
+  std::deque<request> queue;
+  int threads = 0;
+  int idle = 0;
+  int max_threads = static_cast<int>(env_long("TUXSTUB_THREADS", 16));
+  bool stopping = false;
+
+  void submit(request &&req) {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(std::move(req));
+    if (idle < static_cast<int>(queue.size()) && threads < max_threads) {
+      threads++;
+      std::thread(&dispatcher::run, this).detach();
+    }
+    cv.notify_one();
+  }
+
+  size_t queued() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+  }
+
+  void run() {
+    bool thread_init = false;
+    auto &s = server();
+    for (;;) {
+      request req;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle++;
+        cv.wait(lock, [&] { return stopping || !queue.empty(); });
+        idle--;
+        if (queue.empty()) {
+          break;
+        }
+        req = std::move(queue.front());
+        queue.pop_front();
+      }
+      if (!thread_init && s.running) {
+        current_context = s.context;
+        thread_init = true;
+        if (s.args->svrthrinit != nullptr &&
+            s.args->svrthrinit(static_cast<int>(s.argv.size()),
+                               &s.cargv[0]) == -1) {
+          userlog(const_cast<char *>("tpsvrthrinit() failed"));
+        }
+      }
+      execute(req);
+    }
+    if (thread_init && s.args->svrthrdone != nullptr) {
+      s.args->svrthrdone();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    threads--;
+    stopped.notify_all();
+  }
+
+  // Finishes queued requests and waits for all threads to exit
+  void stop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+    cv.notify_all();
+    stopped.wait(lock, [&] { return threads == 0; });
+    stopping = false;
+  }
+};
+
+dispatcher &pool() {
+  static auto *d = new dispatcher();
+  return *d;
+}
+
+int dispatch(char *svc, char *data, long len, long flags,
+             const std::shared_ptr<mailbox> &b) {
+  if (svc == nullptr || *svc == '\0') {
+    return fail(TPEINVAL);
+  }
+  auto s = registry().find(svc);
+  if (!s) {
+    return fail(TPENOENT);
+  }
+  if (data != nullptr && header(data) == nullptr) {
+    return fail(TPEINVAL);
+  }
+  request req;
+  req.svc = s;
+  req.flags = flags;
+  if (current_tx && !(flags & TPNOTRAN)) {
+    req.tx = current_tx;
+    req.flags |= TPTRAN;
+  }
+  if (b) {
+    req.cd = b->open();
+    if (req.cd == -1) {
+      return -1;
+    }
+    req.box = b;
+  }
+  if (data != nullptr) {
+    req.data = copy_buffer(data, len);
+    req.len = data_len(req.data, len);
+  }
+  int cd = req.cd;
+  pool().submit(std::move(req));
+  return cd;
+}
+
+// /Q kept in memory, ordered by priority
+
+struct qmessage {
+  char msgid[TMMSGIDLEN];
+  char corrid[TMCORRIDLEN];
+  long priority = 50;
+  char replyqueue[TMQNAMELEN + 1];
+  char failurequeue[TMQNAMELEN + 1];
+  long urcode = 0;
+  long appkey = 0;
+  char *data = nullptr;
+  long len = 0;
+};
+
+struct qspaces {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::map<std::string, std::deque<qmessage>> queues;
+  unsigned long long next_msgid = 0;
+
+  void put(const std::string &key, qmessage &&m, long flags,
+           const char *before) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &q = queues[key];
+    auto it = q.end();
+    if (flags & TPQTOP) {
+      it = q.begin();
+    } else if (flags & TPQBEFOREMSGID) {
+      it = std::find_if(q.begin(), q.end(), [&](const qmessage &x) {
+        return memcmp(x.msgid, before, TMMSGIDLEN) == 0;
+      });
+    } else {
+      it = std::find_if(q.begin(), q.end(), [&](const qmessage &x) {
+        return x.priority < m.priority;
+      });
+    }
+    q.insert(it, std::move(m));
+    cv.notify_all();
+  }
+};
+
+qspaces &queues() {
+  static auto *q = new qspaces();
+  return *q;
+}
+
+std::string queue_key(const char *qspace, const char *qname) {
+  return std::string(qspace) + '\0' + qname;
+}
+
+// Events
+
+struct subscription {
+  long id;
+  std::regex expr;
+  std::string filter;
+  bool has_ctl;
+  TPEVCTL ctl;
+};
+
+struct events {
+  std::mutex mutex;
+  std::vector<subscription> subscriptions;
+  long next_id = 0;
+  UNSOLFUNC *unsol = nullptr;
+};
+
+events &broker() {
+  static auto *e = new events();
+  return *e;
+}
+
+}  // namespace
+
+extern "C" {
+
+int *_tmget_tperrno_addr(void) { return &tperrno_; }
+long *_tmget_tpurcode_addr(void) { return &tpurcode_; }
+
+char *tpstrerror(int err) {
+  static const char *const messages[] = {
+      "TPMINVAL - no error",
+      "TPEABORT - transaction cannot commit",
+      "TPEBADDESC - bad communication descriptor",
+      "TPEBLOCK - blocking condition found",
+      "TPEINVAL - invalid arguments given",
+      "TPELIMIT - a system limit has been reached",
+      "TPENOENT - no entry found",
+      "TPEOS - operating system error",
+      "TPEPERM - bad permissions",
+      "TPEPROTO - protocol error",
+      "TPESVCERR - server error while handling request",
+      "TPESVCFAIL - application level service failure",
+      "TPESYSTEM - internal system error",
+      "TPETIME - timeout occured",
+      "TPETRAN - error starting transaction",
+      "TPGOTSIG - signal received and TPSIGRSTRT not specified",
+      "TPERMERR - resource manager error",
+      "TPEITYPE - type and/or subtype do not match service's",
+      "TPEOTYPE - type and/or subtype do not match buffer's or unknown",
+      "TPERELEASE - invalid release",
+      "TPEHAZARD - heuristic transaction error",
+      "TPEHEURISTIC - heuristic transaction error",
+      "TPEEVENT - event occurred",
+      "TPEMATCH - service name cannot be advertised due to matching conflict",
+      "TPEDIAGNOSTIC - function failed - check diagnostic value",
+      "TPEMIB - administrative request failed",
+      "TPENOSINGLETON - no singleton server",
+      "TPENOSECONDARYRQ - no secondary request queue"};
+  if (err < 0 || err > TPENOSECONDARYRQ) {
+    return const_cast<char *>("Unknown error");
+  }
+  return const_cast<char *>(messages[err]);
+}
+
+int userlog(char *fmt, ...) {
+  static std::mutex mutex;
+  time_t now = time(nullptr);
+  struct tm t;
+#if defined(_WIN32) || defined(_WIN64)
+  localtime_s(&t, &now);
+#else
+  localtime_r(&now, &t);
+#endif
+  char prefix[128];
+  snprintf(prefix, sizeof(prefix), "%02d%02d%02d.tuxstub!%d: ", t.tm_hour,
+           t.tm_min, t.tm_sec, static_cast<int>(getpid()));
+
+  std::lock_guard<std::mutex> lock(mutex);
+  FILE *f = stderr;
+  const char *pfx = getenv("ULOGPFX");
+  if (pfx != nullptr && *pfx != '\0') {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%02d%02d%02d", pfx, t.tm_mon + 1,
+             t.tm_mday, t.tm_year % 100);
+    FILE *log = fopen(path, "a");
+    if (log != nullptr) {
+      f = log;
+    }
+  }
+  fputs(prefix, f);
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vfprintf(f, fmt, ap);
+  va_end(ap);
+  fputc('\n', f);
+  if (f != stderr) {
+    fclose(f);
+  }
+  return n;
+}
+
+char *tpalloc(char *type, char *subtype, long size) {
+  if (type == nullptr) {
+    fail(TPEINVAL);
+    return nullptr;
+  }
+  bool fml32 = strcmp(type, "FML32") == 0;
+  if (fml32) {
+    size = std::max<long>(size, 1024);
+  } else if (strcmp(type, "STRING") == 0 || strcmp(type, "CARRAY") == 0 ||
+             strcmp(type, "X_OCTET") == 0) {
+    size = std::max<long>(size, 1);
+  } else if (strcmp(type, "TPINIT") == 0) {
+    size = std::max<long>(size, sizeof(TPINIT));
+  } else {
+    fail(TPENOENT);
+    return nullptr;
+  }
+  bufhdr *h = static_cast<bufhdr *>(calloc(1, sizeof(bufhdr) + size));
+  if (h == nullptr) {
+    fail(TPEOS);
+    return nullptr;
+  }
+  h->magic = BUF_MAGIC;
+  snprintf(h->type, sizeof(h->type), "%s", type);
+  if (subtype != nullptr) {
+    snprintf(h->subtype, sizeof(h->subtype), "%s", subtype);
+  }
+  h->size = size;
+  char *ptr = reinterpret_cast<char *>(h + 1);
+  if (fml32) {
+    Finit32(reinterpret_cast<FBFR32 *>(ptr), static_cast<FLDLEN32>(size));
+  }
+  return ptr;
+}
+
+char *tprealloc(char *ptr, long size) {
+  bufhdr *h = header(ptr);
+  if (h == nullptr) {
+    fail(TPEINVAL);
+    return nullptr;
+  }
+  bool fml32 = strcmp(h->type, "FML32") == 0;
+  if (fml32) {
+    size = std::max<long>(size, Fused32(reinterpret_cast<FBFR32 *>(ptr)));
+  }
+  size = std::max<long>(size, 1);
+  bufhdr *n = static_cast<bufhdr *>(realloc(h, sizeof(bufhdr) + size));
+  if (n == nullptr) {
+    fail(TPEOS);
+    return nullptr;
+  }
+  if (size > n->size) {
+    memset(reinterpret_cast<char *>(n + 1) + n->size, 0, size - n->size);
+  }
+  n->size = size;
+  ptr = reinterpret_cast<char *>(n + 1);
+  if (fml32) {
+    reinterpret_cast<fbfr *>(ptr)->size = static_cast<uint32_t>(size);
+  }
+  return ptr;
+}
+
+void tpfree(char *ptr) {
+  bufhdr *h = header(ptr);
+  if (h != nullptr) {
+    h->magic = 0;
+    free(h);
+  }
+}
+
+long tptypes(char *ptr, char *type, char *subtype) {
+  bufhdr *h = header(ptr);
+  if (h == nullptr) {
+    return fail(TPEINVAL);
+  }
+  if (type != nullptr) {
+    memcpy(type, h->type, sizeof(h->type));
+  }
+  if (subtype != nullptr) {
+    memcpy(subtype, h->subtype, sizeof(h->subtype));
+  }
+  return h->size;
+}
+
+int tpinit(TPINIT *tpinfo) {
+  if (tpinfo != nullptr && (tpinfo->flags & TPMULTICONTEXTS)) {
+    current_context = next_context++;
+  } else {
+    current_context = TPSINGLECONTEXT;
+  }
+  return 0;
+}
+
+int tpterm(void) {
+  current_context = TPNULLCONTEXT;
+  return 0;
+}
+
+int tpappthrinit(TPINIT *tpinfo) {
+  (void)tpinfo;
+  current_context = next_context++;
+  return 0;
+}
+
+int tpappthrterm(void) { return tpterm(); }
+
+int tpgetctxt(TPCONTEXT_T *context, long flags) {
+  if (context == nullptr || flags != 0) {
+    return fail(TPEINVAL);
+  }
+  *context = current_context;
+  return 0;
+}
+
+int tpsetctxt(TPCONTEXT_T context, long flags) {
+  if (flags != 0) {
+    return fail(TPEINVAL);
+  }
+  current_context = context;
+  return 0;
+}
+
+int tpsblktime(int blktime, long flags) {
+  if (blktime < 0) {
+    return fail(TPEINVAL);
+  }
+  long ms = (flags & TPBLK_SECOND) ? blktime * 1000L : blktime;
+  if (flags & TPBLK_NEXT) {
+    blktime_next = ms;
+  } else if (flags & TPBLK_ALL) {
+    blktime_all = ms;
+  } else {
+    return fail(TPEINVAL);
+  }
+  return 0;
+}
+
+int tpgblktime(long flags) {
+  long ms = (flags & TPBLK_NEXT) ? blktime_next
+                                 : (blktime_all != 0 ? blktime_all
+                                                     : default_blktime());
+  return static_cast<int>((flags & TPBLK_SECOND) ? ms / 1000 : ms);
+}
+
+int tpcall(char *svc, char *idata, long ilen, char **odata, long *olen,
+           long flags) {
+  if (flags & TPNOREPLY) {
+    return fail(TPEINVAL);
+  }
+  auto &b = box(sync_box);
+  int cd = dispatch(svc, idata, ilen, flags, b);
+  if (cd == -1) {
+    return -1;
+  }
+  int rc = await(*b, &cd, odata, olen, flags & TPNOTIME);
+  if (rc == -1 && tperrno_ == TPETIME) {
+    b->forget(cd);
+  }
+  return rc;
+}
+
+int tpacall(char *svc, char *data, long len, long flags) {
+  if ((flags & TPNOREPLY) && current_tx && !(flags & TPNOTRAN)) {
+    return fail(TPEINVAL);
+  }
+  std::shared_ptr<mailbox> none;
+  int cd = dispatch(svc, data, len, flags,
+                    (flags & TPNOREPLY) ? none : box(async_box));
+  return cd == -1 ? -1 : cd;
+}
+
+int tpgetrply(int *cd, char **data, long *len, long flags) {
+  if (cd == nullptr || data == nullptr || len == nullptr) {
+    return fail(TPEINVAL);
+  }
+  return await(*box(async_box), cd, data, len, flags);
+}
+
+int tpcancel(int cd) {
+  auto &b = box(async_box);
+  {
+    std::lock_guard<std::mutex> lock(b->mutex);
+    if (b->pending.count(cd) == 0 && b->done.count(cd) == 0) {
+      return fail(TPEBADDESC);
+    }
+  }
+  b->forget(cd);
+  return 0;
+}
+
+void tpreturn(int rval, long rcode, char *data, long len, long flags) {
+  (void)flags;
+  call_state *state = current_call;
+  // Only the first call counts, Tuxedo does not return from it
+  if (state == nullptr || state->done || state->forward) {
+    return;
+  }
+  state->done = true;
+  state->rval = rval;
+  state->rcode = rcode;
+  state->data = data;
+  state->len = len;
+}
+
+void tpforward(char *svc, char *data, long len, long flags) {
+  (void)flags;
+  call_state *state = current_call;
+  if (state == nullptr || state->done || state->forward) {
+    return;
+  }
+  state->forward = true;
+  state->svc = svc == nullptr ? "" : svc;
+  state->data = data;
+  state->len = len;
+}
+
+int tpbegin(unsigned long timeout, long flags) {
+  if (flags != 0) {
+    return fail(TPEINVAL);
+  }
+  if (current_tx) {
+    return fail(TPEPROTO);
+  }
+  current_tx = std::make_shared<transaction>();
+  if (timeout != 0) {
+    current_tx->expires = clock::now() + std::chrono::seconds(timeout);
+  }
+  return 0;
+}
+
+int tpcommit(long flags) {
+  if (flags != 0) {
+    return fail(TPEINVAL);
+  }
+  if (!current_tx) {
+    return fail(TPEPROTO);
+  }
+  auto tx = current_tx;
+  current_tx.reset();
+  if (clock::now() > tx->expires) {
+    tx->finish(false);
+    return fail(TPEABORT);
+  }
+  tx->finish(true);
+  return 0;
+}
+
+int tpabort(long flags) {
+  if (flags != 0) {
+    return fail(TPEINVAL);
+  }
+  if (!current_tx) {
+    return fail(TPEPROTO);
+  }
+  auto tx = current_tx;
+  current_tx.reset();
+  tx->finish(false);
+  return 0;
+}
+
+int tpsuspend(TPTRANID *tranid, long flags) {
+  if (tranid == nullptr || flags != 0) {
+    return fail(TPEINVAL);
+  }
+  if (!current_tx) {
+    return fail(TPEPROTO);
+  }
+  memset(tranid, 0, sizeof(*tranid));
+  tranid->info[0] = next_tranid++;
+  std::lock_guard<std::mutex> lock(suspended_mutex);
+  suspended()[tranid->info[0]] = current_tx;
+  current_tx.reset();
+  return 0;
+}
+
+int tpresume(TPTRANID *tranid, long flags) {
+  if (tranid == nullptr || flags != 0) {
+    return fail(TPEINVAL);
+  }
+  if (current_tx) {
+    return fail(TPEPROTO);
+  }
+  std::lock_guard<std::mutex> lock(suspended_mutex);
+  auto it = suspended().find(tranid->info[0]);
+  if (it == suspended().end()) {
+    return fail(TPEINVAL);
+  }
+  current_tx = it->second;
+  suspended().erase(it);
+  return 0;
+}
+
+int tpgetlev(void) { return current_tx ? 1 : 0; }
+
+int tpenqueue(char *qspace, char *qname, TPQCTL *ctl, char *data, long len,
+              long flags) {
+  if (qspace == nullptr || qname == nullptr || ctl == nullptr ||
+      data == nullptr || header(data) == nullptr) {
+    return fail(TPEINVAL);
+  }
+  auto &qs = queues();
+  qmessage m;
+  memset(m.msgid, 0, sizeof(m.msgid));
+  memset(m.corrid, 0, sizeof(m.corrid));
+  memset(m.replyqueue, 0, sizeof(m.replyqueue));
+  memset(m.failurequeue, 0, sizeof(m.failurequeue));
+  {
+    std::lock_guard<std::mutex> lock(qs.mutex);
+    snprintf(m.msgid, sizeof(m.msgid), "%llu", ++qs.next_msgid);
+  }
+  if (ctl->flags & TPQPRIORITY) {
+    if (ctl->priority < 1 || ctl->priority > 100) {
+      ctl->diagnostic = QMEINVAL;
+      return fail(TPEDIAGNOSTIC);
+    }
+    m.priority = ctl->priority;
+  }
+  if (ctl->flags & TPQCORRID) {
+    memcpy(m.corrid, ctl->corrid, sizeof(m.corrid));
+  }
+  if (ctl->flags & TPQREPLYQ) {
+    memcpy(m.replyqueue, ctl->replyqueue, sizeof(m.replyqueue));
+  }
+  if (ctl->flags & TPQFAILUREQ) {
+    memcpy(m.failurequeue, ctl->failurequeue, sizeof(m.failurequeue));
+  }
+  m.urcode = ctl->urcode;
+  m.appkey = -1;
+  m.data = copy_buffer(data, len);
+  m.len = data_len(m.data, len);
+
+  auto key = queue_key(qspace, qname);
+  long qflags = ctl->flags;
+  std::string before(ctl->msgid, sizeof(ctl->msgid));
+  memcpy(ctl->msgid, m.msgid, sizeof(ctl->msgid));
+  ctl->diagnostic = 0;
+  if (current_tx && !(flags & TPNOTRAN)) {
+    auto msg = std::make_shared<qmessage>(std::move(m));
+    std::lock_guard<std::mutex> lock(current_tx->mutex);
+    current_tx->on_commit.push_back([key, msg, qflags, before]() {
+      queues().put(key, std::move(*msg), qflags, before.data());
+    });
+    current_tx->on_abort.push_back([msg]() { tpfree(msg->data); });
+    return 0;
+  }
+  qs.put(key, std::move(m), qflags, before.data());
+  return 0;
+}
+
+int tpdequeue(char *qspace, char *qname, TPQCTL *ctl, char **data, long *len,
+              long flags) {
+  if (qspace == nullptr || qname == nullptr || ctl == nullptr ||
+      data == nullptr || len == nullptr) {
+    return fail(TPEINVAL);
+  }
+  auto &qs = queues();
+  auto key = queue_key(qspace, qname);
+  auto until = deadline(flags);
+  long qflags = ctl->flags;
+  std::unique_lock<std::mutex> lock(qs.mutex);
+  for (;;) {
+    auto &q = qs.queues[key];
+    auto it = q.begin();
+    if ((qflags & TPQGETBYMSGID) == TPQGETBYMSGID) {
+      it = std::find_if(q.begin(), q.end(), [&](const qmessage &x) {
+        return memcmp(x.msgid, ctl->msgid, TMMSGIDLEN) == 0;
+      });
+    } else if ((qflags & TPQGETBYCORRID) == TPQGETBYCORRID) {
+      it = std::find_if(q.begin(), q.end(), [&](const qmessage &x) {
+        return memcmp(x.corrid, ctl->corrid, TMCORRIDLEN) == 0;
+      });
+    }
+    if (it != q.end()) {
+      char *msg_data = it->data;
+      long msg_len = it->len;
+      long out = 0;
+      memcpy(ctl->msgid, it->msgid, sizeof(ctl->msgid));
+      memcpy(ctl->corrid, it->corrid, sizeof(ctl->corrid));
+      memcpy(ctl->replyqueue, it->replyqueue, sizeof(ctl->replyqueue));
+      memcpy(ctl->failurequeue, it->failurequeue, sizeof(ctl->failurequeue));
+      ctl->priority = it->priority;
+      ctl->urcode = it->urcode;
+      ctl->appkey = it->appkey;
+      ctl->diagnostic = 0;
+      out |= TPQMSGID | TPQPRIORITY;
+      if (it->corrid[0] != '\0') {
+        out |= TPQCORRID;
+      }
+      if (it->replyqueue[0] != '\0') {
+        out |= TPQREPLYQ;
+      }
+      if (it->failurequeue[0] != '\0') {
+        out |= TPQFAILUREQ;
+      }
+      ctl->flags = out;
+      if (qflags & TPQPEEK) {
+        msg_data = copy_buffer(msg_data, msg_len);
+      } else {
+        qmessage m = std::move(*it);
+        q.erase(it);
+        if (current_tx && !(flags & TPNOTRAN)) {
+          // Put back on abort, the caller gets a copy meanwhile
+          auto saved = std::make_shared<qmessage>(m);
+          saved->data = copy_buffer(m.data, m.len);
+          std::lock_guard<std::mutex> txlock(current_tx->mutex);
+          current_tx->on_abort.push_back([key, saved]() {
+            queues().put(key, std::move(*saved), TPQTOP, nullptr);
+          });
+          current_tx->on_commit.push_back([saved]() { tpfree(saved->data); });
+        }
+      }
+      lock.unlock();
+      reply r;
+      r.data = msg_data;
+      r.len = msg_len;
+      receive(r, data, len);
+      tpurcode_ = ctl->urcode;
+      return 0;
+    }
+    if (!(qflags & TPQWAIT) || (flags & TPNOBLOCK)) {
+      ctl->diagnostic = QMENOMSG;
+      return fail(TPEDIAGNOSTIC);
+    }
+    if (!wait_until(qs.cv, lock, until)) {
+      return fail(TPETIME);
+    }
+  }
+}
+
+int tppost(char *eventname, char *data, long len, long flags) {
+  (void)flags;
+  if (eventname == nullptr || *eventname == '\0') {
+    return fail(TPEINVAL);
+  }
+  auto &e = broker();
+  std::vector<subscription> matched;
+  UNSOLFUNC *unsol;
+  {
+    std::lock_guard<std::mutex> lock(e.mutex);
+    unsol = e.unsol;
+    for (auto &s : e.subscriptions) {
+      if (std::regex_match(eventname, s.expr)) {
+        matched.push_back(s);
+      }
+    }
+  }
+  long posted = 0;
+  for (auto &s : matched) {
+    if (!s.filter.empty() && data != nullptr) {
+      char type[8] = {0};
+      tptypes(data, type, nullptr);
+      if (strcmp(type, "FML32") == 0 &&
+          Fboolev32(reinterpret_cast<FBFR32 *>(data),
+                    const_cast<char *>(s.filter.c_str())) != 1) {
+        continue;
+      }
+    }
+    if (s.has_ctl && (s.ctl.flags & TPEVSERVICE)) {
+      if (tpacall(s.ctl.name1, data, len, TPNOREPLY | TPNOTRAN) == -1) {
+        continue;
+      }
+    } else if (s.has_ctl && (s.ctl.flags & TPEVQUEUE)) {
+      TPQCTL qctl = s.ctl.qctl;
+      if (tpenqueue(s.ctl.name1, s.ctl.name2, &qctl, data, len, TPNOTRAN) ==
+          -1) {
+        continue;
+      }
+    } else if (unsol != nullptr) {
+      char *copy = data == nullptr ? nullptr : copy_buffer(data, len);
+      unsol(copy, copy == nullptr ? 0 : data_len(copy, len), 0);
+      tpfree(copy);
+    } else {
+      continue;
+    }
+    posted++;
+  }
+  tpurcode_ = posted;
+  return 0;
+}
+
+long tpsubscribe(char *eventexpr, char *filter, TPEVCTL *ctl, long flags) {
+  (void)flags;
+  if (eventexpr == nullptr || *eventexpr == '\0') {
+    return fail(TPEINVAL);
+  }
+  subscription s;
+  try {
+    s.expr = std::regex(eventexpr, std::regex::extended);
+  } catch (const std::regex_error &) {
+    return fail(TPEINVAL);
+  }
+  s.filter = filter == nullptr ? "" : filter;
+  s.has_ctl = ctl != nullptr;
+  if (ctl != nullptr) {
+    s.ctl = *ctl;
+  } else {
+    memset(&s.ctl, 0, sizeof(s.ctl));
+  }
+  auto &e = broker();
+  std::lock_guard<std::mutex> lock(e.mutex);
+  s.id = ++e.next_id;
+  e.subscriptions.push_back(s);
+  return s.id;
+}
+
+int tpunsubscribe(long subscription, long flags) {
+  (void)flags;
+  auto &e = broker();
+  std::lock_guard<std::mutex> lock(e.mutex);
+  auto &subs = e.subscriptions;
+  auto it = subs.end();
+  if (subscription == -1) {
+    subs.clear();
+    tpurcode_ = 0;
+    return 0;
+  }
+  it = std::find_if(subs.begin(), subs.end(), [&](const struct subscription &s) {
+    return s.id == subscription;
+  });
+  if (it == subs.end()) {
+    return fail(TPENOENT);
+  }
+  subs.erase(it);
+  tpurcode_ = 1;
+  return 0;
+}
+
+UNSOLFUNC *tpsetunsol(UNSOLFUNC *disp) {
+  auto &e = broker();
+  std::lock_guard<std::mutex> lock(e.mutex);
+  UNSOLFUNC *old = e.unsol;
+  e.unsol = disp;
+  return old;
+}
+
+int tpchkunsol(void) { return 0; }
+
+}  // extern "C"
+
+// tpexport() format, the buffer type and data behind a fixed header
+
+namespace {
+
+const char EXPORT_MAGIC[8] = {'T', 'U', 'X', 'S', 'T', 'U', 'B', '1'};
+
+struct export_header {
+  char magic[8];
+  char type[8];
+  char subtype[16];
+  uint32_t len;
+};
+
+const char BASE64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string base64_encode(const std::string &in) {
+  std::string out;
+  size_t i = 0;
+  for (; i + 2 < in.size(); i += 3) {
+    uint32_t n = (static_cast<unsigned char>(in[i]) << 16) |
+                 (static_cast<unsigned char>(in[i + 1]) << 8) |
+                 static_cast<unsigned char>(in[i + 2]);
+    out += BASE64[(n >> 18) & 63];
+    out += BASE64[(n >> 12) & 63];
+    out += BASE64[(n >> 6) & 63];
+    out += BASE64[n & 63];
+  }
+  if (i < in.size()) {
+    uint32_t n = static_cast<unsigned char>(in[i]) << 16;
+    if (i + 1 < in.size()) {
+      n |= static_cast<unsigned char>(in[i + 1]) << 8;
+    }
+    out += BASE64[(n >> 18) & 63];
+    out += BASE64[(n >> 12) & 63];
+    out += i + 1 < in.size() ? BASE64[(n >> 6) & 63] : '=';
+    out += '=';
+  }
+  return out;
+}
+
+bool base64_decode(const char *in, long len, std::string &out) {
+  uint32_t n = 0;
+  int bits = 0;
+  for (long i = 0; i < len && in[i] != '='; i++) {
+    const char *c = strchr(BASE64, in[i]);
+    if (c == nullptr || in[i] == '\0') {
+      return false;
+    }
+    n = (n << 6) | static_cast<uint32_t>(c - BASE64);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out += static_cast<char>((n >> bits) & 0xff);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+extern "C" {
+
+int tpexport(char *ibuf, long ilen, char *ostr, long *olen, long flags) {
+  bufhdr *h = header(ibuf);
+  if (h == nullptr || ostr == nullptr || olen == nullptr ||
+      (flags & ~TPEX_STRING) != 0) {
+    return fail(TPEINVAL);
+  }
+  export_header eh;
+  memcpy(eh.magic, EXPORT_MAGIC, sizeof(eh.magic));
+  memcpy(eh.type, h->type, sizeof(eh.type));
+  memcpy(eh.subtype, h->subtype, sizeof(eh.subtype));
+  eh.len = static_cast<uint32_t>(data_len(ibuf, ilen));
+  std::string out(reinterpret_cast<char *>(&eh), sizeof(eh));
+  out.append(ibuf, eh.len);
+  if (flags & TPEX_STRING) {
+    out = base64_encode(out);
+    out += '\0';
+  }
+  if (static_cast<long>(out.size()) > *olen) {
+    *olen = static_cast<long>(out.size());
+    return fail(TPELIMIT);
+  }
+  memcpy(ostr, out.data(), out.size());
+  *olen = static_cast<long>(out.size());
+  return 0;
+}
+
+int tpimport(char *istr, long ilen, char **obuf, long *olen, long flags) {
+  if (istr == nullptr || obuf == nullptr || (flags & ~TPEX_STRING) != 0) {
+    return fail(TPEINVAL);
+  }
+  std::string in;
+  if (flags & TPEX_STRING) {
+    if (!base64_decode(istr, ilen > 0 ? ilen : static_cast<long>(strlen(istr)),
+                       in)) {
+      return fail(TPEINVAL);
+    }
+  } else {
+    in.assign(istr, ilen);
+  }
+  export_header eh;
+  if (in.size() < sizeof(eh)) {
+    return fail(TPEINVAL);
+  }
+  memcpy(&eh, in.data(), sizeof(eh));
+  if (memcmp(eh.magic, EXPORT_MAGIC, sizeof(eh.magic)) != 0 ||
+      in.size() < sizeof(eh) + eh.len) {
+    return fail(TPEINVAL);
+  }
+  char type[sizeof(eh.type) + 1] = {0};
+  char subtype[sizeof(eh.subtype) + 1] = {0};
+  memcpy(type, eh.type, sizeof(eh.type));
+  memcpy(subtype, eh.subtype, sizeof(eh.subtype));
+  char *buf = tpalloc(type, subtype, eh.len);
+  if (buf == nullptr) {
+    return -1;
+  }
+  if (strcmp(type, "FML32") == 0) {
+    std::vector<char> data(in.begin() + sizeof(eh), in.end());
+    if (Fcpy32(reinterpret_cast<FBFR32 *>(buf),
+               reinterpret_cast<FBFR32 *>(&data[0])) == -1) {
+      tpfree(buf);
+      return fail(TPEINVAL);
+    }
+  } else {
+    memcpy(buf, in.data() + sizeof(eh), eh.len);
+  }
+  if (*obuf != nullptr) {
+    tpfree(*obuf);
+  }
+  *obuf = buf;
+  if (olen != nullptr) {
+    *olen = header(buf)->size;
+  }
+  return 0;
+}
+
+}  // extern "C"
+
+// MIB, a single server with everything advertised in this process
+
+namespace {
+
+const long TA_ERROR_INVAL = -1;
+
+bool mib_add(FBFR32 *out, FLDID32 id, FLDOCC32 oc, const char *s) {
+  return CFchg32(out, id, oc, const_cast<char *>(s), 0, FLD_STRING) != -1;
+}
+
+bool mib_add(FBFR32 *out, FLDID32 id, FLDOCC32 oc, long l) {
+  return CFchg32(out, id, oc, reinterpret_cast<char *>(&l), 0, FLD_LONG) !=
+         -1;
+}
+
+FBFR32 *mib(FBFR32 *in, int *err) {
+  std::string cls;
+  std::string op = "GET";
+  FLDLEN32 len;
+  char *v = in == nullptr ? nullptr : CFfind32(in, TA_CLASS, 0, &len, FLD_STRING);
+  if (v != nullptr) {
+    cls = v;
+  }
+  v = in == nullptr ? nullptr
+                    : CFfind32(in, TA_OPERATION, 0, &len, FLD_STRING);
+  if (v != nullptr) {
+    op = v;
+  }
+
+  std::vector<std::shared_ptr<service>> svcs;
+  {
+    auto &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (auto &entry : r.table) {
+      if (entry.first[0] != '.') {
+        svcs.push_back(entry.second);
+      }
+    }
+  }
+  auto &s = server();
+  std::string name = s.argv.empty() ? "tuxstub" : s.argv[0];
+  const char *state = s.running ? "ACT" : "INA";
+
+  FBFR32 *out = reinterpret_cast<FBFR32 *>(tpalloc(
+      const_cast<char *>("FML32"), nullptr,
+      Fneeded32(static_cast<FLDOCC32>(svcs.size() * 8 + 16),
+                static_cast<FLDLEN32>(svcs.size() * 256 + 1024))));
+  if (out == nullptr) {
+    *err = TPESYSTEM;
+    return nullptr;
+  }
+  mib_add(out, TA_CLASS, 0, cls.c_str());
+
+  FLDOCC32 n = 0;
+  // A single page, GETNEXT finds nothing more
+  if (op == "GETNEXT") {
+  } else if (op != "GET") {
+    *err = TPESVCFAIL;
+    mib_add(out, TA_ERROR, 0, TA_ERROR_INVAL);
+    mib_add(out, TA_STATUS, 0, "TA_OPERATION not supported");
+    return out;
+  } else if (cls == "T_SERVICE" || cls == "T_SVCGRP") {
+    for (auto &svc : svcs) {
+      mib_add(out, TA_SERVICENAME, n, svc->name.c_str());
+      mib_add(out, TA_STATE, n, "ACT");
+      mib_add(out, TA_LMID, n, "SITE1");
+      mib_add(out, TA_SRVGRP, n, "STUBGRP");
+      mib_add(out, TA_SRVID, n, 1L);
+      mib_add(out, TA_NCOMPLETED, n, svc->completed.load());
+      n++;
+    }
+  } else if (cls == "T_SERVER") {
+    long completed = 0;
+    for (auto &svc : svcs) {
+      completed += svc->completed.load();
+    }
+    mib_add(out, TA_SERVERNAME, 0, name.c_str());
+    mib_add(out, TA_STATE, 0, state);
+    mib_add(out, TA_LMID, 0, "SITE1");
+    mib_add(out, TA_SRVGRP, 0, "STUBGRP");
+    mib_add(out, TA_SRVID, 0, 1L);
+    mib_add(out, TA_RQADDR, 0, "tuxstub");
+    mib_add(out, TA_NCOMPLETED, 0, completed);
+    mib_add(out, TA_NQUEUED, 0, static_cast<long>(pool().queued()));
+    mib_add(out, TA_CURRSERVICE, 0, "");
+    n = 1;
+  } else {
+    *err = TPESVCFAIL;
+    mib_add(out, TA_ERROR, 0, TA_ERROR_INVAL);
+    mib_add(out, TA_STATUS, 0, "TA_CLASS not supported");
+    return out;
+  }
+  mib_add(out, TA_OCCURS, 0, static_cast<long>(n));
+  mib_add(out, TA_MORE, 0, 0L);
+  mib_add(out, TA_ERROR, 0, static_cast<long>(TAOK));
+  return out;
+}
+
+}  // namespace
+
+extern "C" {
+
+int tpadmcall(FBFR32 *inbuf, FBFR32 **outbuf, long flags) {
+  (void)flags;
+  if (inbuf == nullptr || outbuf == nullptr) {
+    return fail(TPEINVAL);
+  }
+  int err = 0;
+  FBFR32 *out = mib(inbuf, &err);
+  if (out == nullptr) {
+    return fail(err);
+  }
+  char *data = reinterpret_cast<char *>(*outbuf);
+  reply r;
+  r.err = err;
+  r.data = reinterpret_cast<char *>(out);
+  r.len = Fused32(out);
+  int rc = receive(r, &data, nullptr);
+  *outbuf = reinterpret_cast<FBFR32 *>(data);
+  return rc;
+}
+
+int tpopen(void) { return 0; }
+
+int tpclose(void) { return 0; }
+
+int tpadvertisex(char *svcname, void (*func)(TPSVCINFO *), long flags) {
+  (void)flags;
+  if (svcname == nullptr || *svcname == '\0' || func == nullptr) {
+    return fail(TPEINVAL);
+  }
+  auto &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  auto it = r.table.find(svcname);
+  if (it != r.table.end() && it->second->kind == ADVERTISED) {
+    return it->second->func == func ? 0 : fail(TPEMATCH);
+  }
+  auto s = std::make_shared<service>();
+  s->name = svcname;
+  s->fname = svcname;
+  s->func = func;
+  auto lat = r.latency.find(svcname);
+  if (lat != r.latency.end()) {
+    s->latency_us = lat->second;
+  }
+  r.table[svcname] = s;
+  return 0;
+}
+
+int tpadvertise(char *svcname, void (*func)(TPSVCINFO *)) {
+  return tpadvertisex(svcname, func, 0);
+}
+
+int tpunadvertise(char *svcname) {
+  if (svcname == nullptr) {
+    return fail(TPEINVAL);
+  }
+  auto &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  auto it = r.table.find(svcname);
+  if (it == r.table.end() || it->second->kind != ADVERTISED) {
+    return fail(TPENOENT);
+  }
+  r.table.erase(it);
+  return 0;
+}
+
+// Server side, what buildserver links from the Tuxedo libraries
+
+int _tmbuilt_with_thread_option = 0;
+
+struct xa_switch_t tmnull_switch = {"TMSNULL", 0, 0, nullptr, nullptr};
+
+int tprminit(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  return 0;
+}
+
+// Services run on the dispatch threads until .TUXSTUB_SHUTDOWN is called
+int _tmrunserver(int argc) {
+  (void)argc;
+  auto &s = server();
+  std::unique_lock<std::mutex> lock(s.mutex);
+  s.cv.wait(lock, [&] { return s.shutdown; });
+  return 0;
+}
+
+int _tmstartserver(int argc, char **argv, struct tmsvrargs_t *tmsvrargs) {
+  auto &s = server();
+  if (tmsvrargs == nullptr || s.running) {
+    return fail(TPEPROTO);
+  }
+  s.args = tmsvrargs;
+  s.argv.assign(argv, argv + argc);
+  s.cargv.clear();
+  for (auto &arg : s.argv) {
+    s.cargv.push_back(&arg[0]);
+  }
+  s.cargv.push_back(nullptr);
+  s.context = next_context++;
+  s.shutdown = false;
+  current_context = s.context;
+
+  if (tmsvrargs->rminit != nullptr && tmsvrargs->rminit(argc, argv) == -1) {
+    return -1;
+  }
+  if (tmsvrargs->svrinit != nullptr &&
+      tmsvrargs->svrinit(argc, &s.cargv[0]) == -1) {
+    userlog(const_cast<char *>("tpsvrinit() failed"));
+    return -1;
+  }
+  s.running = true;
+  int rc = tmsvrargs->mainloop != nullptr ? tmsvrargs->mainloop(argc) : 0;
+  pool().stop();
+  s.running = false;
+  if (tmsvrargs->svrdone != nullptr) {
+    tmsvrargs->svrdone();
+  }
+  current_context = TPNULLCONTEXT;
+  return rc;
+}
+
+}  // extern "C"
@@ -0,0 +1,86 @@
+# A server running in the test process against the module built with
+# TUXEDO_STUB=1, shared by the test modules:
+#
+#   TUXEDO_STUB=1 pip install . && python3 -m unittest discover tests
+
+import atexit
+import os
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+os.environ['FLDTBLDIR32'] = HERE
+os.environ['FIELDTBLS32'] = 'fields'
+# Built-in ECHO, latency in microseconds added to the Python services
+os.environ['TUXSTUB_SERVICES'] = 'ECHO=0,SLOWPY=300000,COALESCED=200000'
+
+import tuxedo as t
+
+
+class Server:
+    def __init__(self):
+        self.ready = threading.Event()
+        self.release = threading.Event()
+        self.calls = {}
+
+    def tpsvrinit(self, args):
+        for name in ('ECHOPY', 'FAILPY', 'SLOWPY', 'COALESCED', 'BLOCKING',
+                     'RELAYJSON'):
+            t.tpadvertise(name)
+        self.ready.set()
+        return 0
+
+    def count(self, name):
+        self.calls[name] = self.calls.get(name, 0) + 1
+
+    def ECHOPY(self, data):
+        self.count('ECHOPY')
+        return t.tpreturn(t.TPSUCCESS, 0, data)
+
+    def FAILPY(self, data):
+        return t.tpreturn(t.TPFAIL, 7, {'NAME': 'failed'})
+
+    def SLOWPY(self, data):
+        self.count('SLOWPY')
+        return t.tpreturn(t.TPSUCCESS, 0, data)
+
+    def COALESCED(self, data):
+        self.count('COALESCED')
+        return t.tpreturn(t.TPSUCCESS, 0, data)
+
+    def RELAYJSON(self, data):
+        _, _, reply = t.tpcall_json('ECHOPY', b'{"NAME": "relayed"}')
+        return t.tpreturn(t.TPSUCCESS, 0, {'NAME': reply.decode()})
+
+    def BLOCKING(self, data):
+        self.release.wait(5)
+        return t.tpreturn(t.TPSUCCESS, 0, data)
+
+
+server = Server()
+_thread = None
+
+
+def start():
+    """Starts the server once per process, it stops at exit"""
+    global _thread
+    if _thread is not None:
+        return
+    _thread = threading.Thread(target=t.run, args=(server, ['stub_server']))
+    _thread.daemon = True
+    _thread.start()
+    if not server.ready.wait(5):
+        raise RuntimeError('Server did not start')
+    atexit.register(stop)
+
+
+def stop():
+    t.tpcall('.TUXSTUB_SHUTDOWN', {})
+    _thread.join(5)
+
+
+def wait_for(condition, timeout=2.0):
+    end = time.time() + timeout
+    while not condition() and time.time() < end:
+        time.sleep(0.01)
+    return condition()
@@ -0,0 +1,36 @@
+import time
+import unittest
+
+import stub_server
+from stub_server import server, t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+class AdmissionTest(unittest.TestCase):
+    def tearDown(self):
+        t.admission('BLOCKING', 0)
+        server.release.clear()
+
+    def test_rejected(self):
+        t.admission('BLOCKING', 1, rcode=42)
+        first = t.tpacall('BLOCKING', {'NAME': 'first'})
+        time.sleep(0.2)
+        rval, rcode, _ = t.tpcall('BLOCKING', {'NAME': 'second'})
+        self.assertEqual(rval, t.TPESVCFAIL)
+        self.assertEqual(rcode, 42)
+        server.release.set()
+        rval, rcode, data = t.tpgetrply(first)
+        self.assertEqual(rval, 0)
+        self.assertEqual(data, {'NAME': ['first']})
+        self.assertEqual(t.admission_stats()['BLOCKING']['rejected'], 1)
+
+    def test_invalid_limit(self):
+        with self.assertRaises(ValueError):
+            t.admission('BLOCKING', -1)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,58 @@
+import threading
+import unittest
+
+import stub_server
+from stub_server import server, t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+class CoalesceTest(unittest.TestCase):
+    def setUp(self):
+        t.coalesce('COALESCED')
+
+    def tearDown(self):
+        t.coalesce('COALESCED', False)
+
+    def test_shared(self):
+        calls = server.calls.get('COALESCED', 0)
+        replies = []
+        go = threading.Barrier(4)
+
+        def call():
+            go.wait()
+            replies.append(t.tpcall('COALESCED', {'NAME': 'same'}).data)
+
+        threads = [threading.Thread(target=call) for _ in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(replies, [{'NAME': ['same']}] * 4)
+        stats = t.coalesce_stats()['COALESCED']
+        self.assertEqual(stats['calls'], 4)
+        self.assertGreater(stats['shared'], 0)
+        self.assertEqual(server.calls['COALESCED'] - calls,
+                         4 - stats['shared'])
+
+    def test_replies_not_shared(self):
+        go = threading.Barrier(2)
+        replies = []
+
+        def call():
+            go.wait()
+            replies.append(t.tpcall('COALESCED', {'NAME': 'mine'}).data)
+
+        threads = [threading.Thread(target=call) for _ in range(2)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        replies[0]['NAME'].append('changed')
+        self.assertEqual(replies[1], {'NAME': ['mine']})
+
+
+if __name__ == '__main__':
+    unittest.main()
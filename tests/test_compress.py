@@ -0,0 +1,57 @@
+import unittest
+
+import stub_server
+from stub_server import t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+class CompressTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        try:
+            t.compress('ECHOPY', threshold=1024)
+        except RuntimeError:
+            raise unittest.SkipTest('Built without zlib')
+
+    def tearDown(self):
+        t.compress('ECHOPY', threshold=0)
+
+    def test_on(self):
+        t.compress('ECHOPY', threshold=1024)
+        before = t.compress_stats()
+        _, _, data = t.tpcall('ECHOPY', {'NAME': 'x' * 100000})
+        self.assertEqual(data, {'NAME': ['x' * 100000]})
+        after = t.compress_stats()
+        # The request and the reply
+        self.assertEqual(after['packed'] - before['packed'], 2)
+        self.assertEqual(after['unpacked'] - before['unpacked'], 2)
+
+    def test_below_threshold(self):
+        t.compress('ECHOPY', threshold=1024)
+        before = t.compress_stats()
+        _, _, data = t.tpcall('ECHOPY', {'NAME': 'small'})
+        self.assertEqual(data, {'NAME': ['small']})
+        self.assertEqual(t.compress_stats()['packed'], before['packed'])
+
+    def test_off(self):
+        before = t.compress_stats()
+        _, _, data = t.tpcall('ECHOPY', {'NAME': 'x' * 100000})
+        self.assertEqual(data, {'NAME': ['x' * 100000]})
+        self.assertEqual(t.compress_stats()['packed'], before['packed'])
+
+    def test_flag(self):
+        before = t.compress_stats()
+        _, _, data = t.tpcall('ECHOPY', {'NAME': 'x' * 1000}, t.TPCOMPRESS)
+        self.assertEqual(data, {'NAME': ['x' * 1000]})
+        self.assertEqual(t.compress_stats()['packed'] - before['packed'], 1)
+
+    def test_max_size(self):
+        with self.assertRaises(ValueError):
+            t.compress('ECHOPY', max_size=0)
+
+
+if __name__ == '__main__':
+    unittest.main()
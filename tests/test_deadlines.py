@@ -0,0 +1,46 @@
+import json
+import unittest
+
+import stub_server
+from stub_server import server, t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+class DeadlineTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        t.deadlines('PYDEADLINE', rcode=99)
+
+    def test_drop(self):
+        before = t.deadline_stats()['dropped']
+        calls = server.calls.get('SLOWPY', 0)
+        with self.assertRaises(t.XatmiException) as cm:
+            t.tpcall('SLOWPY', {'NAME': 'late'}, deadline_ms=50)
+        self.assertEqual(cm.exception.code, t.TPETIME)
+        self.assertTrue(stub_server.wait_for(
+            lambda: t.deadline_stats()['dropped'] > before))
+        self.assertEqual(server.calls.get('SLOWPY', 0), calls)
+
+    def test_field_not_kept(self):
+        buf = t.Buffer({'NAME': 'in time'})
+        _, _, data = t.tpcall('ECHOPY', buf, deadline_ms=5000)
+        self.assertEqual(data, {'NAME': ['in time']})
+        self.assertNotIn('PYDEADLINE', buf)
+
+    def test_without_deadline(self):
+        before = t.deadline_stats()['stamped']
+        t.tpcall('ECHOPY', {'NAME': 'no deadline'})
+        self.assertEqual(t.deadline_stats()['stamped'], before)
+
+    def test_passed_on_by_json(self):
+        before = t.deadline_stats()['stamped']
+        _, _, data = t.tpcall('RELAYJSON', {}, deadline_ms=5000)
+        self.assertEqual(json.loads(data['NAME'][0]), {'NAME': ['relayed']})
+        self.assertEqual(t.deadline_stats()['stamped'] - before, 2)
+
+
+if __name__ == '__main__':
+    unittest.main()
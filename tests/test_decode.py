@@ -0,0 +1,48 @@
+import unittest
+
+import stub_server
+from stub_server import t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+class DecodeTest(unittest.TestCase):
+    request = {'NAME': 'rate', 'COUNT': [1, 2], 'AMOUNT': 1.5}
+
+    def test_default(self):
+        rval, rcode, data = t.tpcall('ECHOPY', self.request)
+        self.assertEqual(rval, 0)
+        self.assertEqual(data, {'NAME': ['rate'], 'COUNT': [1, 2],
+                                'AMOUNT': [1.5]})
+
+    def test_flat(self):
+        _, _, data = t.tpcall('ECHOPY', self.request, decode=t.FLAT)
+        self.assertEqual(data, {'NAME': 'rate', 'COUNT': (1, 2),
+                                'AMOUNT': 1.5})
+
+    def test_flat_round_trip(self):
+        _, _, data = t.tpcall('ECHOPY', self.request, decode=t.FLAT)
+        _, _, again = t.tpcall('ECHOPY', data, decode=t.FLAT)
+        self.assertEqual(again, data)
+
+    def test_field_ids(self):
+        _, _, data = t.tpcall('ECHOPY', self.request, decode=t.FIELD_IDS)
+        self.assertEqual(data[t.Fldid32('NAME')], ['rate'])
+        self.assertEqual(data[t.Fldid32('COUNT')], [1, 2])
+
+    def test_flat_field_ids(self):
+        _, _, data = t.tpcall('ECHOPY', self.request,
+                              decode=t.FLAT | t.FIELD_IDS)
+        self.assertEqual(data[t.Fldid32('NAME')], 'rate')
+        self.assertEqual(data[t.Fldid32('COUNT')], (1, 2))
+
+    def test_callable(self):
+        _, _, names = t.tpcall('ECHOPY', self.request,
+                               decode=lambda buf: buf['NAME'])
+        self.assertEqual(names, ['rate'])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,102 @@
+import http.client
+import json
+import socket
+import time
+import unittest
+
+import stub_server
+from stub_server import t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+def post(port, path, body):
+    conn = http.client.HTTPConnection('127.0.0.1', port, timeout=5)
+    try:
+        conn.request('POST', path, body)
+        response = conn.getresponse()
+        return response.status, json.loads(response.read() or b'null')
+    finally:
+        conn.close()
+
+
+def request(path, body):
+    return (b'POST ' + path + b' HTTP/1.1\r\nHost: localhost\r\n'
+            b'Content-Length: ' + str(len(body)).encode() + b'\r\n\r\n' + body)
+
+
+def read_response(sock):
+    data = b''
+    while True:
+        chunk = sock.recv(65536)
+        if not chunk:
+            return data
+        data += chunk
+
+
+class HttpTest(unittest.TestCase):
+    def test_service(self):
+        with t.serve_http(18181, {'/echo': 'ECHO'}, threads=1) as server:
+            status, data = post(18181, '/echo', b'{"NAME": "http"}')
+            self.assertEqual(status, 200)
+            self.assertEqual(data, {'NAME': ['http']})
+            self.assertEqual(server.stats()['requests'], 1)
+
+    def test_errors(self):
+        with t.serve_http(18182, {'/none': 'NOSUCHSVC',
+                                  '/fail': 'FAILPY'}, threads=1):
+            self.assertEqual(post(18182, '/none', b'{}')[0], 404)
+            self.assertEqual(post(18182, '/missing', b'{}')[0], 404)
+            self.assertEqual(post(18182, '/fail', b'{}'),
+                             (500, {'NAME': ['failed']}))
+
+    def test_slow_service_does_not_block(self):
+        with t.serve_http(18183, {'/slow': 'SLOWPY', '/echo': 'ECHO'},
+                          threads=1):
+            slow = socket.create_connection(('127.0.0.1', 18183))
+            try:
+                slow.sendall(request(b'/slow', b'{"NAME": "slow"}'))
+                time.sleep(0.05)
+                started = time.time()
+                self.assertEqual(post(18183, '/echo', b'{}')[0], 200)
+                self.assertLess(time.time() - started, 0.2)
+                slow.shutdown(socket.SHUT_WR)
+                response = read_response(slow)
+            finally:
+                slow.close()
+            self.assertTrue(response.startswith(b'HTTP/1.1 200 OK\r\n'))
+            self.assertTrue(response.endswith(b'{"NAME":["slow"]}'))
+
+    def test_pipelined_responses_in_order(self):
+        with t.serve_http(18184, {'/slow': 'SLOWPY', '/echo': 'ECHO'},
+                          threads=1):
+            sock = socket.create_connection(('127.0.0.1', 18184))
+            try:
+                sock.sendall(request(b'/slow', b'{"NAME": "first"}') +
+                             request(b'/echo', b'{"NAME": "second"}'))
+                sock.shutdown(socket.SHUT_WR)
+                response = read_response(sock)
+            finally:
+                sock.close()
+            self.assertLess(response.index(b'first'),
+                            response.index(b'second'))
+
+    def test_stop_from_hook(self):
+        servers = []
+
+        def hook(path, body):
+            servers[0].stop()
+            return b'{}'
+
+        servers.append(t.serve_http(18185, {'/stop': hook}, threads=2))
+        self.assertEqual(post(18185, '/stop', b'')[0], 200)
+        started = time.time()
+        servers[0].stop()
+        self.assertLess(time.time() - started, 1)
+        del servers[:]
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,56 @@
+import json
+import locale
+import unittest
+
+import stub_server
+from stub_server import t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+class JsonTest(unittest.TestCase):
+    def test_round_trip(self):
+        buf = t.json_to_fml(b'{"NAME": "x", "COUNT": [1, -2], "AMOUNT": 1.5}')
+        self.assertEqual(buf.decode(), {'NAME': ['x'], 'COUNT': [1, -2],
+                                        'AMOUNT': [1.5]})
+        self.assertEqual(json.loads(t.fml_to_json(buf, flat=True)),
+                         {'NAME': 'x', 'COUNT': [1, -2], 'AMOUNT': 1.5})
+
+    def test_tpcall_json(self):
+        rval, _, reply = t.tpcall_json('ECHOPY', b'{"NAME": "json"}')
+        self.assertEqual(rval, 0)
+        self.assertEqual(json.loads(reply), {'NAME': ['json']})
+
+    def test_long_range(self):
+        big = 2 ** 63 - 1
+        buf = t.json_to_fml(('{"COUNT": [%d, %d]}' % (big, -big - 1))
+                            .encode())
+        self.assertEqual(buf['COUNT'], [big, -big - 1])
+
+    def test_too_large_for_long(self):
+        buf = t.json_to_fml(b'{"AMOUNT": 9223372036854775808}')
+        self.assertEqual(buf['AMOUNT'], [9223372036854775808.0])
+
+    def test_locale(self):
+        previous = locale.setlocale(locale.LC_NUMERIC)
+        for name in ('de_DE.UTF-8', 'de_DE.utf8', 'fr_FR.UTF-8', 'ru_RU.UTF-8'):
+            try:
+                locale.setlocale(locale.LC_NUMERIC, name)
+                break
+            except locale.Error:
+                pass
+        else:
+            self.skipTest('No locale with a decimal comma')
+        try:
+            buf = t.json_to_fml(b'{"AMOUNT": 1.5}')
+            self.assertEqual(buf['AMOUNT'], [1.5])
+            self.assertEqual(t.fml_to_json({'AMOUNT': 0.25}, flat=True),
+                             b'{"AMOUNT":0.25}')
+        finally:
+            locale.setlocale(locale.LC_NUMERIC, previous)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,110 @@
+import threading
+import time
+import unittest
+
+import stub_server
+from stub_server import t, wait_for
+
+
+def setUpModule():
+    stub_server.start()
+
+
+def enqueue(qname, n):
+    for i in range(n):
+        t.tpenqueue('QSPACE', qname, t.TPQCTL(), {'COUNT': i})
+
+
+class QueueConsumerTest(unittest.TestCase):
+    def test_context_manager(self):
+        received = []
+        done = threading.Event()
+
+        def handler(data):
+            received.append(data['COUNT'][0])
+            if len(received) == 5:
+                done.set()
+
+        with t.QueueConsumer('QSPACE', 'Q1', handler, threads=2) as consumer:
+            enqueue('Q1', 5)
+            self.assertTrue(done.wait(5))
+        self.assertEqual(sorted(received), list(range(5)))
+        self.assertEqual(consumer.stats()['succeeded'], 5)
+
+    def test_stop_from_handler(self):
+        stopped = threading.Event()
+        consumers = []
+
+        def handler(data):
+            consumers[0].stop()
+            stopped.set()
+
+        consumers.append(t.QueueConsumer('QSPACE', 'Q2', handler, threads=2))
+        enqueue('Q2', 1)
+        self.assertTrue(stopped.wait(5))
+        self.assertTrue(wait_for(
+            lambda: consumers[0].stats()['succeeded'] == 1))
+        # Stopping again from another thread returns at once
+        consumers[0].stop()
+
+    def test_failed_to_failure_queue(self):
+        def handler(data):
+            return False
+
+        with t.QueueConsumer('QSPACE', 'Q3', handler,
+                             failurequeue='Q3ERR') as consumer:
+            enqueue('Q3', 1)
+            self.assertTrue(wait_for(
+                lambda: consumer.stats()['rerouted'] == 1, 5))
+        _, data = t.tpdequeue('QSPACE', 'Q3ERR', t.TPQCTL())
+        self.assertEqual(data, {'COUNT': [0]})
+
+    def test_prefetch(self):
+        release = threading.Event()
+        received = []
+
+        def handler(data):
+            received.append(data['COUNT'][0])
+            release.wait(5)
+
+        consumer = t.QueueConsumer('QSPACE', 'Q4', handler, threads=1,
+                                   max_in_flight=3, transactional=False)
+        enqueue('Q4', 5)
+        # One being handled and two more dequeued ahead of it
+        self.assertTrue(wait_for(lambda: consumer.stats()['dequeued'] == 3))
+        self.assertEqual(consumer.stats()['in_flight'], 3)
+        release.set()
+        self.assertTrue(wait_for(
+            lambda: consumer.stats()['succeeded'] == 5, 5))
+        consumer.stop()
+        self.assertEqual(received, list(range(5)))
+
+    def test_prefetched_enqueued_again(self):
+        started = threading.Event()
+        release = threading.Event()
+
+        def handler(data):
+            started.set()
+            release.wait(5)
+
+        consumer = t.QueueConsumer('QSPACE', 'Q5', handler, threads=1,
+                                   max_in_flight=3, transactional=False)
+        enqueue('Q5', 3)
+        self.assertTrue(started.wait(5))
+        self.assertTrue(wait_for(lambda: consumer.stats()['dequeued'] == 3))
+        stopping = threading.Thread(target=consumer.stop)
+        stopping.start()
+        time.sleep(0.2)
+        release.set()
+        stopping.join(5)
+        left = sorted(t.tpdequeue('QSPACE', 'Q5', t.TPQCTL())[1]['COUNT'][0]
+                      for _ in range(2))
+        self.assertEqual(left, [1, 2])
+
+    def test_prefetch_needs_no_transactions(self):
+        with self.assertRaises(ValueError):
+            t.QueueConsumer('QSPACE', 'Q6', print, threads=1, max_in_flight=2)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,68 @@
+import dataclasses
+import sys
+import typing
+import unittest
+
+import stub_server
+from stub_server import t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+@dataclasses.dataclass
+class Rate:
+    NAME: str
+    COUNT: typing.List[int]
+    AMOUNT: typing.Optional[float] = None
+
+
+class SchemaTest(unittest.TestCase):
+    request = {'NAME': 'rate', 'COUNT': [1, 2], 'AMOUNT': 1.5}
+
+    def test_dict(self):
+        Rec = t.Schema({'NAME': str, 'COUNT': (int, '*'), 'AMOUNT': float},
+                       name='Rec')
+        _, _, rec = t.tpcall('ECHOPY', self.request, decode=Rec)
+        self.assertEqual(rec.NAME, 'rate')
+        self.assertEqual(rec.COUNT, [1, 2])
+        self.assertEqual(rec.AMOUNT, 1.5)
+
+    def test_dataclass(self):
+        Rec = t.Schema(Rate)
+        _, _, rec = t.tpcall('ECHOPY', Rec.encode(Rate('rate', [3])),
+                             decode=Rec)
+        self.assertEqual(rec, Rate('rate', [3]))
+
+    def test_required(self):
+        Rec = t.Schema(Rate)
+        with self.assertRaises(ValueError):
+            Rec.encode({'COUNT': [1]})
+
+    def test_optional_none_first(self):
+        @dataclasses.dataclass
+        class Rec:
+            NAME: typing.Union[None, str] = None
+
+        schema = t.Schema(Rec)
+        self.assertEqual(schema.decode(schema.encode(Rec())), Rec())
+        self.assertEqual(schema.decode(schema.encode(Rec('x'))), Rec('x'))
+
+    @unittest.skipIf(sys.version_info < (3, 10), 'X | Y needs Python 3.10')
+    def test_optional_union_type(self):
+        Rec = dataclasses.make_dataclass(
+            'Rec', [('NAME', eval('str | None'), None)])
+        schema = t.Schema(Rec)
+        self.assertEqual(schema.decode(schema.encode(Rec())), Rec())
+
+    def test_failed_reply(self):
+        Rec = t.Schema({'NAME': str, 'COUNT': int}, name='Rec')
+        rval, rcode, data = t.tpcall('FAILPY', self.request, decode=Rec)
+        self.assertEqual(rval, t.TPESVCFAIL)
+        self.assertEqual(rcode, 7)
+        self.assertEqual(data, {'NAME': ['failed']})
+
+
+if __name__ == '__main__':
+    unittest.main()
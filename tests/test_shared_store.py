@@ -0,0 +1,57 @@
+import os
+import tempfile
+import unittest
+
+from stub_server import t
+
+
+class SharedStoreTest(unittest.TestCase):
+    def setUp(self):
+        self.store = t.SharedStore('tuxedo_test_%d' % os.getpid(),
+                                   size=64 * 1024)
+
+    def tearDown(self):
+        self.store.unlink()
+        self.store.close()
+
+    def test_put_get(self):
+        self.store['rate'] = {'NAME': 'USD', 'AMOUNT': 1.5}
+        self.assertEqual(self.store['rate'].decode(),
+                         {'NAME': ['USD'], 'AMOUNT': [1.5]})
+        self.assertIn('rate', self.store)
+        del self.store['rate']
+        self.assertNotIn('rate', self.store)
+        with self.assertRaises(KeyError):
+            self.store['rate']
+
+    def test_replace(self):
+        self.store['rate'] = {'COUNT': 1}
+        self.store['rate'] = {'COUNT': 2}
+        self.assertEqual(self.store['rate'].decode(), {'COUNT': [2]})
+        self.assertEqual(len(self.store), 1)
+
+    def test_full_keeps_old_value(self):
+        self.store['rate'] = {'COUNT': 1}
+        with self.assertRaises(MemoryError):
+            self.store['rate'] = {'BLOB': b'x' * 128 * 1024}
+        self.assertEqual(self.store['rate'].decode(), {'COUNT': [1]})
+
+    def test_snapshot(self):
+        fd, path = tempfile.mkstemp()
+        os.close(fd)
+        try:
+            self.store['rate'] = {'NAME': 'EUR'}
+            self.store.save(path)
+            name = 'tuxedo_test_snapshot_%d' % os.getpid()
+            copy = t.SharedStore(name, size=64 * 1024, snapshot=path)
+            try:
+                self.assertEqual(copy['rate'].decode(), {'NAME': ['EUR']})
+            finally:
+                copy.unlink()
+                copy.close()
+        finally:
+            os.remove(path)
+
+
+if __name__ == '__main__':
+    unittest.main()
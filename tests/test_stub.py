@@ -0,0 +1,42 @@
+import time
+import unittest
+
+import stub_server
+from stub_server import t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+class StubTest(unittest.TestCase):
+    def test_builtin_echo(self):
+        rval, rcode, data = t.tpcall('ECHO', {'NAME': 'echo', 'COUNT': 1})
+        self.assertEqual((rval, rcode), (0, 0))
+        self.assertEqual(data, {'NAME': ['echo'], 'COUNT': [1]})
+
+    def test_python_service(self):
+        _, _, data = t.tpcall('ECHOPY', {'AMOUNT': [1.5, 2.5]})
+        self.assertEqual(data, {'AMOUNT': [1.5, 2.5]})
+
+    def test_latency(self):
+        started = time.time()
+        t.tpcall('SLOWPY', {'NAME': 'slow'})
+        self.assertGreaterEqual(time.time() - started, 0.3)
+
+    def test_unknown_service(self):
+        with self.assertRaises(t.XatmiException) as cm:
+            t.tpcall('NOSUCHSVC', {})
+        self.assertEqual(cm.exception.code, t.TPENOENT)
+
+    def test_field_table(self):
+        self.assertEqual(t.Fname32(t.Fldid32('BLOB')), 'BLOB')
+
+    def test_queue(self):
+        t.tpenqueue('QSPACE', 'STUBQ', t.TPQCTL(), {'NAME': 'queued'})
+        _, data = t.tpdequeue('QSPACE', 'STUBQ', t.TPQCTL())
+        self.assertEqual(data, {'NAME': ['queued']})
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,31 @@
+import unittest
+
+import stub_server
+from stub_server import t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+class TpReplyTest(unittest.TestCase):
+    def test_fields(self):
+        reply = t.tpcall('ECHOPY', {'NAME': 'fast'})
+        self.assertEqual(len(reply), 3)
+        self.assertEqual(reply.rval, 0)
+        self.assertEqual(reply.rcode, 0)
+        self.assertEqual(reply.data, {'NAME': ['fast']})
+
+    def test_unpack(self):
+        rval, rcode, data = t.tpcall('FAILPY', {})
+        self.assertEqual((rval, rcode), (t.TPESVCFAIL, 7))
+        self.assertEqual(data, {'NAME': ['failed']})
+
+    def test_keywords(self):
+        cd = t.tpacall(svc='ECHOPY', idata={'COUNT': 3})
+        _, _, data = t.tpgetrply(cd=cd)
+        self.assertEqual(data, {'COUNT': [3]})
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,41 @@
+import os
+import tempfile
+import unittest
+
+import stub_server
+from stub_server import t
+
+
+def setUpModule():
+    stub_server.start()
+
+
+class TracingTest(unittest.TestCase):
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp()
+        os.close(fd)
+        t.tracing(self.path, sample=1.0, flush_ms=10)
+
+    def tearDown(self):
+        t.tracing(None)
+        os.remove(self.path)
+
+    def test_context_not_in_request(self):
+        buf = t.Buffer({'NAME': 'traced'})
+        _, _, data = t.tpcall('ECHOPY', buf)
+        self.assertEqual(data, {'NAME': ['traced']})
+        self.assertNotIn('TRACEPARENT', buf)
+
+    def test_spans_exported(self):
+        t.tpcall('ECHOPY', {'NAME': 'traced'})
+        t.tracing(None)
+        with open(self.path) as f:
+            self.assertIn('ECHOPY', f.read())
+
+    def test_bad_field(self):
+        with self.assertRaises(ValueError):
+            t.tracing(self.path, field='COUNT')
+
+
+if __name__ == '__main__':
+    unittest.main()